@@ -0,0 +1,472 @@
+/*
+ * Microbenchmarks for the overhead of the intercepted functions. Every benchmark runs natively and, if the library
+ * is given, with the library preloaded: once with all locks redirected to lock files (preload), once with all locks
+ * passed through to the kernel by the policy (passthrough), once with all locks redirected to the shared memory
+ * backend (shm), and with lock files and the shm backend in the fair mode of LOCALFLOCK_FAIR (fair, shm_fair).
+ * Results are written as one JSON object (or CSV row) per benchmark and variant, so that they can be compared
+ * between builds.
+ *
+ * Usage: localflock_bench [-l liblocalflock.so] [-d scratch directory] [-n iterations] [-t max workers]
+ *                         [-f json|csv] [-o output file]
+ *
+ * Benchmarks:
+ *  - flock, fcntl(F_SETLK) and close on tracked and untracked fds without contention
+ *  - the first lock on a file, which creates the lock information and the lock file
+ *  - loading and initializing the library, measured as the time to start a process that does nothing
+ *  - one exclusive lock used by 1 to N threads and 1 to N processes
+ *  - one lock used by N processes, a quarter of them writers taking exclusive locks now and then, the others
+ *    readers taking shared locks back to back. The latencies of the writers show whether they starve.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ctime>
+
+using namespace std;
+
+// number of processes started to measure the load time
+#define LOAD_RUNS 200
+// maximal number of new files for the first lock benchmark
+#define FIRST_LOCK_FILES 10000
+// time the workers of the mixed benchmark hold their lock, the pause of the writers between their locks, and the
+// time after which the readers stop even if the writers did not get all their locks
+#define MIXED_HOLD_NS 20000
+#define MIXED_PAUSE_US 1000
+#define MIXED_MAX_SECONDS 2
+
+// options, the same in the parent and in the workload processes
+struct options_t {
+    const char* library = nullptr;
+    string directory = "/tmp";
+    long iterations = 100000;
+    int max_workers = 0;
+    bool csv = false;
+    FILE* output = stdout;
+};
+static options_t options;
+// native, preload, passthrough, shm, fair or shm_fair, part of each result
+static const char* variant = "native";
+// the variants run by the parent process, with the library preloaded from the second on
+static const char* variants[] = {"native", "preload", "passthrough", "shm", "fair", "shm_fair"};
+
+/*
+ * current time in nanoseconds
+ */
+static inline int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * write one result with percentiles of the latencies of single operations and the throughput of all workers.
+ */
+static void report(const char* benchmark, int threads, int processes, vector<int64_t>& latencies, int64_t elapsed_ns) {
+    if (latencies.empty()) return;
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) { return latencies[(size_t) (p * (latencies.size() - 1))]; };
+    double ops_per_sec = elapsed_ns > 0 ? latencies.size() * 1e9 / elapsed_ns : 0;
+    if (options.csv) {
+        fprintf(options.output, "%s,%s,%d,%d,%zu,%.0f,%ld,%ld,%ld,%ld,%ld\n", benchmark, variant, threads, processes,
+                latencies.size(), ops_per_sec, percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999),
+                latencies.back());
+    } else {
+        fprintf(options.output, "{\"benchmark\": \"%s\", \"variant\": \"%s\", \"threads\": %d, \"processes\": %d, "
+                "\"ops\": %zu, \"ops_per_sec\": %.0f, \"p50_ns\": %ld, \"p90_ns\": %ld, \"p99_ns\": %ld, "
+                "\"p999_ns\": %ld, \"max_ns\": %ld}\n", benchmark, variant, threads, processes, latencies.size(),
+                ops_per_sec, percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), latencies.back());
+    }
+    fflush(options.output);
+}
+
+/*
+ * run an operation repeatedly on one thread and report the latency of each call.
+ */
+static void run_single(const char* benchmark, long iterations, const function<void(long)>& setup,
+                       const function<void(long)>& operation, const function<void(long)>& teardown) {
+    vector<int64_t> latencies(iterations);
+    int64_t total = 0;
+    for (long i = 0; i < iterations; i++) {
+        setup(i);
+        int64_t start = now_ns();
+        operation(i);
+        latencies[i] = now_ns() - start;
+        total += latencies[i];
+        teardown(i);
+    }
+    report(benchmark, 1, 1, latencies, total);
+}
+
+/*
+ * flock, fcntl and close without any other process or thread using the files.
+ */
+static void bench_uncontended(const string& data) {
+    string path = data + "/uncontended";
+    int fd = open(path.c_str(), O_CREAT | O_RDWR, 0644);
+    auto nothing = [](long) {};
+
+    // the first call is not measured, it creates the lock information
+    flock(fd, LOCK_UN);
+    run_single("flock_ex_un", options.iterations, nothing, [&](long) {
+        flock(fd, LOCK_EX);
+        flock(fd, LOCK_UN);
+    }, nothing);
+    run_single("flock_sh_un", options.iterations, nothing, [&](long) {
+        flock(fd, LOCK_SH);
+        flock(fd, LOCK_UN);
+    }, nothing);
+
+    struct flock lock = {};
+    lock.l_whence = SEEK_SET;
+    run_single("fcntl_setlk_un", options.iterations, nothing, [&](long) {
+        lock.l_type = F_WRLCK;
+        fcntl(fd, F_SETLK, &lock);
+        lock.l_type = F_UNLCK;
+        fcntl(fd, F_SETLK, &lock);
+    }, nothing);
+    close(fd);
+
+    // close is measured alone, the open is part of the setup
+    int current = -1;
+    run_single("close_untracked", options.iterations, [&](long) {
+        current = open(path.c_str(), O_RDWR);
+    }, [&](long) {
+        close(current);
+    }, nothing);
+    run_single("close_tracked", options.iterations, [&](long) {
+        current = open(path.c_str(), O_RDWR);
+        flock(current, LOCK_EX);
+        flock(current, LOCK_UN);
+    }, [&](long) {
+        close(current);
+    }, nothing);
+}
+
+/*
+ * the first lock on files that were never locked before, including the creation of the lock file.
+ */
+static void bench_first_lock(const string& data) {
+    string directory = data + "/first_lock";
+    filesystem::create_directory(directory);
+    long files = min(options.iterations, (long) FIRST_LOCK_FILES);
+    int fd = -1;
+    run_single("first_lock", files, [&](long i) {
+        fd = open((directory + "/" + to_string(i)).c_str(), O_CREAT | O_RDWR, 0644);
+    }, [&](long) {
+        flock(fd, LOCK_EX);
+    }, [&](long) {
+        flock(fd, LOCK_UN);
+        close(fd);
+    });
+}
+
+/*
+ * one exclusive lock used by several workers. Each worker has its own fd and measures how long it takes to get the
+ * lock. Results of worker processes are collected in shared memory.
+ */
+static void bench_contended(const string& data, int workers, bool processes) {
+    string path = data + "/contended";
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    long per_worker = max(options.iterations / workers, 1L);
+    size_t size = sizeof(int64_t) * per_worker * workers;
+    auto* latencies = (int64_t*) mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (latencies == MAP_FAILED) return;
+
+    auto worker = [&](int index) {
+        int fd = open(path.c_str(), O_RDWR);
+        int64_t* own = latencies + index * per_worker;
+        for (long i = 0; i < per_worker; i++) {
+            int64_t start = now_ns();
+            flock(fd, LOCK_EX);
+            own[i] = now_ns() - start;
+            flock(fd, LOCK_UN);
+        }
+        close(fd);
+    };
+
+    int64_t start = now_ns();
+    if (processes) {
+        vector<pid_t> children;
+        for (int i = 0; i < workers; i++) {
+            pid_t child = fork();
+            if (child == 0) {
+                worker(i);
+                _exit(0);
+            }
+            children.push_back(child);
+        }
+        for (pid_t child: children) waitpid(child, nullptr, 0);
+    } else {
+        vector<thread> threads;
+        for (int i = 0; i < workers; i++) threads.emplace_back(worker, i);
+        for (auto& t: threads) t.join();
+    }
+    int64_t elapsed = now_ns() - start;
+
+    vector<int64_t> result(latencies, latencies + per_worker * workers);
+    munmap(latencies, size);
+    report(processes ? "flock_contended_processes" : "flock_contended_threads", processes ? 1 : workers,
+           processes ? workers : 1, result, elapsed);
+}
+
+static void spin(int64_t ns) {
+    int64_t end = now_ns() + ns;
+    while (now_ns() < end) {}
+}
+
+/*
+ * readers and writers of one lock in separate processes. Each worker has its own fd and measures how long it takes
+ * to get the lock. The readers keep the lock shared almost all the time, writers only get it if waiting writers
+ * hold back new readers.
+ */
+static void bench_mixed(const string& data, int workers) {
+    if (workers < 2) return;
+    string path = data + "/mixed";
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    int writers = max(workers / 4, 1);
+    int readers = workers - writers;
+    long per_writer = max(options.iterations / 1000, 10L);
+    long per_reader = max(options.iterations / readers, 1L);
+    // the latencies of all workers, the number recorded by each reader and the number of writers still running
+    size_t count = per_writer * writers + per_reader * readers;
+    size_t size = sizeof(int64_t) * (count + readers + 1);
+    auto* shared = (int64_t*) mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) return;
+    int64_t* latencies = shared;
+    int64_t* recorded = shared + count;
+    auto* writers_left = (atomic<int64_t>*) (shared + count + readers);
+    writers_left->store(writers);
+
+    auto reader = [&](int index) {
+        int fd = open(path.c_str(), O_RDWR);
+        int64_t* own = latencies + per_writer * writers + per_reader * index;
+        int64_t deadline = now_ns() + MIXED_MAX_SECONDS * 1000000000L;
+        long n = 0;
+        while (writers_left->load() > 0 && now_ns() < deadline) {
+            int64_t start = now_ns();
+            flock(fd, LOCK_SH);
+            if (n < per_reader) own[n++] = now_ns() - start;
+            spin(MIXED_HOLD_NS);
+            flock(fd, LOCK_UN);
+        }
+        recorded[index] = n;
+        close(fd);
+    };
+    auto writer = [&](int index) {
+        int fd = open(path.c_str(), O_RDWR);
+        int64_t* own = latencies + per_writer * index;
+        for (long i = 0; i < per_writer; i++) {
+            usleep(MIXED_PAUSE_US);
+            int64_t start = now_ns();
+            flock(fd, LOCK_EX);
+            own[i] = now_ns() - start;
+            spin(MIXED_HOLD_NS);
+            flock(fd, LOCK_UN);
+        }
+        writers_left->fetch_sub(1);
+        close(fd);
+    };
+
+    int64_t start = now_ns();
+    vector<pid_t> children;
+    for (int i = 0; i < workers; i++) {
+        pid_t child = fork();
+        if (child == 0) {
+            if (i < readers) reader(i);
+            else writer(i - readers);
+            _exit(0);
+        }
+        children.push_back(child);
+    }
+    for (pid_t child: children) waitpid(child, nullptr, 0);
+    int64_t elapsed = now_ns() - start;
+
+    vector<int64_t> write_latencies(latencies, latencies + per_writer * writers);
+    vector<int64_t> read_latencies;
+    for (int i = 0; i < readers; i++) {
+        int64_t* own = latencies + per_writer * writers + per_reader * i;
+        read_latencies.insert(read_latencies.end(), own, own + recorded[i]);
+    }
+    munmap(shared, size);
+    report("flock_mixed_write", 1, workers, write_latencies, elapsed);
+    report("flock_mixed_read", 1, workers, read_latencies, elapsed);
+}
+
+/*
+ * all benchmarks measured within one process. The parent starts this once without and once with the library.
+ */
+static int workload(const string& data) {
+    filesystem::create_directories(data);
+    bench_uncontended(data);
+    bench_first_lock(data);
+    // powers of two and the number of workers itself, also if it is not a power of two
+    vector<int> worker_counts;
+    for (int workers = 1; workers < options.max_workers; workers *= 2) worker_counts.push_back(workers);
+    worker_counts.push_back(options.max_workers);
+    for (int workers: worker_counts) {
+        bench_contended(data, workers, false);
+        bench_contended(data, workers, true);
+    }
+    bench_mixed(data, options.max_workers);
+    return 0;
+}
+
+/*
+ * start this program again with the given arguments. Except for the native variant, the library is preloaded and
+ * uses the lock directory of the variant. Returns the time until the process exited.
+ */
+static int64_t run_self(const vector<string>& arguments, int variant_index, const string& lockdir) {
+    int64_t start = now_ns();
+    pid_t child = fork();
+    if (child == 0) {
+        if (variant_index > 0) {
+            string name = variants[variant_index];
+            setenv("LD_PRELOAD", options.library, 1);
+            setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+            // an empty list of filesystems passes all locks through
+            setenv("LOCALFLOCK_FILESYSTEMS", name == "passthrough" ? "" : "all", 1);
+            setenv("LOCALFLOCK_BACKEND", name == "shm" || name == "shm_fair" ? "shm" : "file", 1);
+            setenv("LOCALFLOCK_FAIR", name == "fair" || name == "shm_fair" ? "1" : "0", 1);
+        } else {
+            unsetenv("LD_PRELOAD");
+        }
+        vector<char*> argv;
+        argv.push_back((char*) "localflock_bench");
+        for (auto& argument: arguments) argv.push_back((char*) argument.c_str());
+        argv.push_back(nullptr);
+        execv("/proc/self/exe", argv.data());
+        _exit(127);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return now_ns() - start;
+}
+
+/*
+ * time to start a process that exits immediately, which includes loading and initializing the library.
+ */
+static void bench_load(int variant_index, const string& lockdir) {
+    vector<int64_t> latencies(LOAD_RUNS);
+    int64_t total = 0;
+    for (auto& latency: latencies) {
+        latency = run_self({"--noop"}, variant_index, lockdir);
+        total += latency;
+    }
+    report("process_start", 1, 1, latencies, total);
+}
+
+int main(int argc, char** argv) {
+    // modes used by the parent process
+    if (argc == 2 && strcmp(argv[1], "--noop") == 0) return 0;
+    bool is_workload = false;
+    string data;
+    if (argc >= 4 && strcmp(argv[1], "--workload") == 0) {
+        is_workload = true;
+        variant = argv[2];
+        data = argv[3];
+        argc -= 3;
+        argv += 3;
+    }
+
+    int option;
+    string output;
+    while ((option = getopt(argc, argv, "l:d:n:t:f:o:h")) != -1) {
+        switch (option) {
+            case 'l':
+                options.library = optarg;
+                break;
+            case 'd':
+                options.directory = optarg;
+                break;
+            case 'n':
+                options.iterations = max(atol(optarg), 1L);
+                break;
+            case 't':
+                options.max_workers = atoi(optarg);
+                break;
+            case 'f':
+                options.csv = strcmp(optarg, "csv") == 0;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-l liblocalflock.so] [-d scratch directory] [-n iterations] "
+                                "[-t max workers] [-f json|csv] [-o output file]\n", argv[0]);
+                return option == 'h' ? 0 : 2;
+        }
+    }
+    if (options.max_workers <= 0) options.max_workers = max((int) thread::hardware_concurrency(), 1);
+    if (!output.empty()) {
+        options.output = fopen(output.c_str(), is_workload ? "a" : "w");
+        if (options.output == nullptr) {
+            perror(output.c_str());
+            return 2;
+        }
+    }
+    if (is_workload) return workload(data);
+
+    if (options.csv) fprintf(options.output, "benchmark,variant,threads,processes,ops,ops_per_sec,p50_ns,p90_ns,"
+                                             "p99_ns,p999_ns,max_ns\n");
+    fflush(options.output);
+
+    // everything happens in a new directory, the lock files should not exist before
+    filesystem::create_directories(options.directory);
+    string directory = options.directory + "/localflock_bench.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    // the backend is recorded in the lock directory when it is used first, each variant needs its own
+    auto lockdir = [&](int variant_index) { return directory + "/locks-" + variants[variant_index]; };
+
+    vector<string> common = {"-n", to_string(options.iterations), "-t", to_string(options.max_workers),
+                             "-f", options.csv ? "csv" : "json"};
+    if (!output.empty()) {
+        common.push_back("-o");
+        common.push_back(output);
+    }
+    if (options.output != stdout) fclose(options.output);
+    int variant_count = options.library != nullptr ? sizeof(variants) / sizeof(variants[0]) : 1;
+    for (int i = 0; i < variant_count; i++) {
+        vector<string> arguments = {"--workload", variants[i], directory + "/" + variants[i]};
+        arguments.insert(arguments.end(), common.begin(), common.end());
+        run_self(arguments, i, lockdir(i));
+    }
+
+    // the load time is measured last, the lock directory exists already then
+    if (!output.empty()) options.output = fopen(output.c_str(), "a");
+    for (int i = 0; i < variant_count; i++) {
+        variant = variants[i];
+        bench_load(i, lockdir(i));
+    }
+    if (options.output != stdout) fclose(options.output);
+
+    // the segments of the shared memory backend and of the fair queues are named after their lock directory
+    for (int i = 1; i < variant_count; i++) {
+        struct stat st;
+        if (stat(lockdir(i).c_str(), &st) != 0) continue;
+        char name[64];
+        snprintf(name, sizeof(name), "/localflock-%lx-%lx", (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+        shm_unlink(name);
+        snprintf(name, sizeof(name), "/localflock-fair-%lx-%lx", (unsigned long) st.st_dev,
+                 (unsigned long) st.st_ino);
+        shm_unlink(name);
+    }
+    filesystem::remove_all(directory);
+    return 0;
+}
@@ -0,0 +1,578 @@
+/*
+ * Torture and throughput test for the lock semantics. Many processes with several threads each run a randomized mix
+ * of flock, POSIX and OFD byte range locks, locks on duplicated fds and closes of locked fds against a few files,
+ * while the parent kills random processes and starts new ones. Every lock that is acquired is checked against a
+ * shared memory oracle, which knows the locks held by all threads: two threads holding conflicting locks at the same
+ * time are a violation. The test runs natively, which checks the oracle, and with the library preloaded with lock
+ * files (preload) and with the shared memory backend (shm). It reports the operations per second and the latency of
+ * acquiring a lock, one JSON object (or CSV row) per variant like localflock_bench.
+ *
+ * The oracle: each thread publishes the lock it holds in one 64 bit word after acquiring it, and clears the word
+ * before releasing it. After publishing, it reads the words of all other threads. As both steps are sequentially
+ * consistent, of two threads holding conflicting locks at least one sees the other. POSIX locks belong to the
+ * process, so only the first thread of each process uses them and only this thread closes fds, which releases the
+ * POSIX locks of the process. Locks of a process that is being killed are not checked, the kernel releases them
+ * before the parent can clear its words.
+ *
+ * Usage: localflock_stress [-l liblocalflock.so] [-d scratch directory] [-p processes] [-t threads per process]
+ *                          [-F files] [-s seconds per variant] [-k kill interval ms] [-H max hold us]
+ *                          [-f json|csv] [-o output file]
+ *
+ * The exit status is 1 if a variant had a violation, an unexpected error or stopped making progress.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <filesystem>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ctime>
+
+using namespace std;
+
+// byte range locks cover whole regions of this size, the oracle knows them as a bit mask
+#define REGION_SIZE 16
+#define REGIONS 32
+#define MAX_REGIONS_PER_LOCK 4
+#define MAX_FILES 256
+// latencies are counted in buckets with 8 steps per power of two, i.e., with an error of at most 12.5%
+#define HISTOGRAM_BUCKETS 496
+// the run fails if no operation finished for this long
+#define STALL_SECONDS 10
+// violations printed by each thread, further ones are only counted
+#define MAX_REPORTED_VIOLATIONS 5
+
+// the operations and their weights. Operations marked with "first thread" are done by other threads as OP_FLOCK_EX.
+enum op_t {
+    OP_FLOCK_EX,
+    OP_FLOCK_SH,
+    // exclusive flock with LOCK_NB
+    OP_FLOCK_NB,
+    // F_SETLKW write lock, first thread
+    OP_POSIX_WR,
+    // F_SETLK read lock, first thread
+    OP_POSIX_RD,
+    // F_OFD_SETLKW write lock
+    OP_OFD_WR,
+    // F_OFD_SETLK read lock
+    OP_OFD_RD,
+    // exclusive flock on a duplicate of the fd, released through the fd, first thread
+    OP_DUP,
+    // exclusive flock or POSIX write lock released by closing the fd, first thread
+    OP_CLOSE,
+    OP_COUNT
+};
+static const int op_weights[OP_COUNT] = {25, 15, 10, 10, 5, 15, 10, 5, 5};
+
+// a held lock as published in the oracle
+#define HOLDING_VALID (1ULL << 63)
+#define HOLDING_WRITE (1ULL << 62)
+#define HOLDING_RANGE (1ULL << 61)
+#define HOLDING_FILE_SHIFT 40
+
+struct oracle_header_t {
+    atomic<uint32_t> stop;
+    atomic<uint32_t> violations;
+    // unexpected errors of lock functions
+    atomic<uint32_t> errors;
+    uint32_t processes;
+    uint32_t threads;
+    uint32_t files;
+};
+
+// one per process slot
+struct process_slot_t {
+    // incremented by the parent before it kills the process and after it cleared its words: odd while the locks of
+    // the process are not checked. A word read while the counter changed may be stale.
+    atomic<uint32_t> killed;
+};
+
+// one per thread of each process slot
+struct thread_slot_t {
+    atomic<uint64_t> holding;
+    atomic<uint64_t> ops;
+    atomic<uint64_t> histogram[HISTOGRAM_BUCKETS];
+};
+
+// options, the same in the parent and in the worker processes
+struct options_t {
+    const char* library = nullptr;
+    string directory = "/tmp";
+    int processes = 0;
+    int threads = 4;
+    int files = 8;
+    int seconds = 10;
+    int kill_ms = 500;
+    int hold_us = 20;
+    bool csv = false;
+    FILE* output = stdout;
+};
+static options_t options;
+static const char* variants[] = {"native", "preload", "shm"};
+
+// the oracle shared by the parent and all workers
+static oracle_header_t* oracle;
+static process_slot_t* process_slots;
+static thread_slot_t* thread_slots;
+
+/*
+ * current time in nanoseconds
+ */
+static inline int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t oracle_size(int processes, int threads) {
+    return sizeof(oracle_header_t) + sizeof(process_slot_t) * processes +
+           sizeof(thread_slot_t) * processes * threads;
+}
+
+/*
+ * map the oracle file. The parent creates it with the given geometry, workers read the geometry from it.
+ */
+static bool map_oracle(const string& path, bool create) {
+    int fd = open(path.c_str(), O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    if (fd < 0) return false;
+    size_t size = oracle_size(options.processes, options.threads);
+    if (create && ftruncate(fd, (off_t) size) != 0) return false;
+    if (!create) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+        size = st.st_size;
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) return false;
+    oracle = (oracle_header_t*) memory;
+    if (create) {
+        oracle->processes = options.processes;
+        oracle->threads = options.threads;
+        oracle->files = options.files;
+    }
+    process_slots = (process_slot_t*) (oracle + 1);
+    thread_slots = (thread_slot_t*) (process_slots + oracle->processes);
+    return true;
+}
+
+static int histogram_bucket(uint64_t ns) {
+    if (ns < 16) return (int) ns;
+    int power = 63 - __builtin_clzll(ns);
+    return 16 + (power - 4) * 8 + (int) ((ns >> (power - 3)) & 7);
+}
+
+static uint64_t bucket_value(int bucket) {
+    if (bucket < 16) return bucket;
+    int power = (bucket - 16) / 8 + 4;
+    return (uint64_t) (8 + (bucket - 16) % 8) << (power - 3);
+}
+
+/*
+ * small and fast random numbers for the workers
+ */
+static inline uint64_t next_random(uint64_t& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/*
+ * whether two published locks can not be held at the same time
+ */
+static bool conflicts(uint64_t a, uint64_t b) {
+    if ((a & HOLDING_VALID) == 0 || (b & HOLDING_VALID) == 0) return false;
+    if ((a ^ b) & (HOLDING_RANGE | (0xffULL << HOLDING_FILE_SHIFT))) return false;
+    if ((a & HOLDING_WRITE) == 0 && (b & HOLDING_WRITE) == 0) return false;
+    return (a & b & 0xffffffffULL) != 0;
+}
+
+/*
+ * publish a lock that was just acquired and check it against the locks of all other threads.
+ */
+static void publish(int process, int thread, uint64_t holding, op_t op, int& reported) {
+    int own = process * oracle->threads + thread;
+    thread_slots[own].holding.store(holding);
+    int total = oracle->processes * oracle->threads;
+    for (int other = 0; other < total; other++) {
+        if (other == own) continue;
+        int other_process = other / oracle->threads;
+        uint32_t generation = process_slots[other_process].killed.load();
+        uint64_t theirs = thread_slots[other].holding.load();
+        if (!conflicts(holding, theirs)) continue;
+        if ((generation & 1) || process_slots[other_process].killed.load() != generation) continue;
+        oracle->violations.fetch_add(1);
+        if (reported++ < MAX_REPORTED_VIOLATIONS) {
+            fprintf(stderr, "violation: operation %d of process %d thread %d holds %016lx, process %d thread %d "
+                            "holds %016lx\n", op, process, thread, (unsigned long) holding, other_process,
+                    other % oracle->threads, (unsigned long) theirs);
+        }
+    }
+}
+
+/*
+ * one worker thread. The first thread of each process (thread 0) also uses POSIX locks and closes fds.
+ */
+static void worker_thread(int process, int thread, const vector<string>& paths) {
+    thread_slot_t& slot = thread_slots[process * oracle->threads + thread];
+    uint64_t random = (uint64_t) now_ns() ^ ((uint64_t) getpid() << 20) ^ ((uint64_t) thread << 48) | 1;
+    int weight_sum = 0;
+    for (int weight: op_weights) weight_sum += weight;
+    vector<int> fds;
+    for (auto& path: paths) fds.push_back(open(path.c_str(), O_RDWR));
+    int reported = 0;
+
+    while (!oracle->stop.load(memory_order_relaxed)) {
+        // choose the operation, the file and the regions of byte range locks
+        int choice = (int) (next_random(random) % weight_sum);
+        int op = 0;
+        while (choice >= op_weights[op]) choice -= op_weights[op++];
+        if (thread != 0 && (op == OP_POSIX_WR || op == OP_POSIX_RD || op == OP_DUP || op == OP_CLOSE)) {
+            op = OP_FLOCK_EX;
+        }
+        int file = (int) (next_random(random) % paths.size());
+        int fd = fds[file];
+        int first_region = (int) (next_random(random) % REGIONS);
+        int regions = min((int) (next_random(random) % MAX_REGIONS_PER_LOCK) + 1, REGIONS - first_region);
+        bool close_posix = op == OP_CLOSE && next_random(random) % 2 == 0;
+        struct flock range = {};
+        range.l_whence = SEEK_SET;
+        range.l_start = first_region * REGION_SIZE;
+        range.l_len = regions * REGION_SIZE;
+        uint64_t mask = (((1ULL << regions) - 1) << first_region) & 0xffffffffULL;
+
+        int64_t start = now_ns();
+        int result = 0;
+        int duplicate = -1;
+        uint64_t holding = HOLDING_VALID | ((uint64_t) file << HOLDING_FILE_SHIFT);
+        switch (op) {
+            case OP_FLOCK_EX:
+                result = flock(fd, LOCK_EX);
+                holding |= HOLDING_WRITE | 0xffffffffULL;
+                break;
+            case OP_FLOCK_SH:
+                result = flock(fd, LOCK_SH);
+                holding |= 0xffffffffULL;
+                break;
+            case OP_FLOCK_NB:
+                result = flock(fd, LOCK_EX | LOCK_NB);
+                holding |= HOLDING_WRITE | 0xffffffffULL;
+                break;
+            case OP_DUP:
+                duplicate = dup(fd);
+                result = flock(duplicate, LOCK_EX);
+                holding |= HOLDING_WRITE | 0xffffffffULL;
+                break;
+            case OP_CLOSE:
+                if (close_posix) {
+                    range.l_type = F_WRLCK;
+                    result = fcntl(fd, F_SETLKW, &range);
+                    holding |= HOLDING_RANGE | HOLDING_WRITE | mask;
+                } else {
+                    result = flock(fd, LOCK_EX);
+                    holding |= HOLDING_WRITE | 0xffffffffULL;
+                }
+                break;
+            case OP_POSIX_WR:
+            case OP_OFD_WR:
+                range.l_type = F_WRLCK;
+                result = fcntl(fd, op == OP_POSIX_WR ? F_SETLKW : F_OFD_SETLKW, &range);
+                holding |= HOLDING_RANGE | HOLDING_WRITE | mask;
+                break;
+            default:
+                range.l_type = F_RDLCK;
+                result = fcntl(fd, op == OP_POSIX_RD ? F_SETLK : F_OFD_SETLK, &range);
+                holding |= HOLDING_RANGE | mask;
+                break;
+        }
+        uint64_t latency = now_ns() - start;
+        slot.histogram[histogram_bucket(latency)].fetch_add(1, memory_order_relaxed);
+        slot.ops.fetch_add(1, memory_order_relaxed);
+        if (result != 0) {
+            // only the nonblocking operations may find the lock taken
+            if ((errno != EAGAIN && errno != EACCES && errno != EWOULDBLOCK) ||
+                op == OP_FLOCK_EX || op == OP_FLOCK_SH || op == OP_DUP || op == OP_CLOSE || op == OP_POSIX_WR ||
+                op == OP_OFD_WR) {
+                oracle->errors.fetch_add(1);
+                fprintf(stderr, "error: operation %d of process %d thread %d failed: %s\n", op, process, thread,
+                        strerror(errno));
+            }
+            if (duplicate >= 0) close(duplicate);
+            continue;
+        }
+
+        publish(process, thread, holding, (op_t) op, reported);
+        if (options.hold_us > 0) {
+            int64_t until = now_ns() + (int64_t) (next_random(random) % options.hold_us) * 1000;
+            while (now_ns() < until) {}
+        }
+        slot.holding.store(0);
+
+        switch (op) {
+            case OP_FLOCK_EX:
+            case OP_FLOCK_SH:
+            case OP_FLOCK_NB:
+                flock(fd, LOCK_UN);
+                break;
+            case OP_DUP:
+                flock(fd, LOCK_UN);
+                close(duplicate);
+                break;
+            case OP_CLOSE:
+                close(fd);
+                fds[file] = open(paths[file].c_str(), O_RDWR);
+                break;
+            default:
+                range.l_type = F_UNLCK;
+                fcntl(fd, op == OP_POSIX_WR || op == OP_POSIX_RD ? F_SETLK : F_OFD_SETLK, &range);
+                break;
+        }
+    }
+    // the fds stay open until the process exits. Closing them here would release the POSIX locks that thread 0 may
+    // still hold.
+}
+
+/*
+ * one worker process running under LD_PRELOAD, it runs until the parent sets stop.
+ */
+static int worker(const string& oracle_path, int process, const string& data) {
+    if (!map_oracle(oracle_path, false)) {
+        perror(oracle_path.c_str());
+        return 2;
+    }
+    vector<string> paths;
+    for (uint32_t i = 0; i < oracle->files; i++) paths.push_back(data + "/file" + to_string(i));
+    vector<thread> threads;
+    for (uint32_t i = 0; i < oracle->threads; i++) threads.emplace_back(worker_thread, process, i, cref(paths));
+    for (auto& t: threads) t.join();
+    return 0;
+}
+
+/*
+ * start a worker for a process slot. Except for the native variant, the library is preloaded and uses the lock
+ * directory of the variant.
+ */
+static pid_t start_worker(int variant_index, const string& oracle_path, int process, const string& data,
+                          const string& lockdir) {
+    pid_t child = fork();
+    if (child == 0) {
+        if (variant_index > 0) {
+            setenv("LD_PRELOAD", options.library, 1);
+            setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+            setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+            setenv("LOCALFLOCK_BACKEND", variant_index == 2 ? "shm" : "file", 1);
+        } else {
+            unsetenv("LD_PRELOAD");
+        }
+        string index = to_string(process);
+        execl("/proc/self/exe", "localflock_stress", "--worker", oracle_path.c_str(), index.c_str(), data.c_str(),
+              (char*) nullptr);
+        _exit(127);
+    }
+    return child;
+}
+
+static uint64_t total_ops() {
+    uint64_t result = 0;
+    for (uint32_t i = 0; i < oracle->processes * oracle->threads; i++) result += thread_slots[i].ops.load();
+    return result;
+}
+
+/*
+ * run one variant for the given time, killing a random worker every kill interval. Returns false if the variant
+ * failed.
+ */
+static bool run_variant(int variant_index, const string& directory) {
+    const char* variant = variants[variant_index];
+    string data = directory + "/" + variant;
+    string lockdir = directory + "/locks-" + variant;
+    string oracle_path = directory + "/oracle-" + variant;
+    filesystem::create_directories(data);
+    for (int i = 0; i < options.files; i++) {
+        close(open((data + "/file" + to_string(i)).c_str(), O_CREAT | O_RDWR, 0644));
+    }
+    if (!map_oracle(oracle_path, true)) {
+        perror(oracle_path.c_str());
+        return false;
+    }
+
+    vector<pid_t> workers;
+    for (int i = 0; i < options.processes; i++) {
+        workers.push_back(start_worker(variant_index, oracle_path, i, data, lockdir));
+    }
+    int64_t start = now_ns();
+    int64_t end = start + (int64_t) options.seconds * 1000000000;
+    int64_t next_kill = options.kill_ms > 0 ? start + (int64_t) options.kill_ms * 1000000 : INT64_MAX;
+    int64_t last_progress = start;
+    uint64_t last_ops = 0;
+    uint64_t random = (uint64_t) start | 1;
+    int kills = 0;
+    bool stalled = false;
+    while (now_ns() < end) {
+        usleep(10000);
+        int64_t now = now_ns();
+        uint64_t ops = total_ops();
+        if (ops != last_ops) {
+            last_ops = ops;
+            last_progress = now;
+        } else if (now - last_progress > (int64_t) STALL_SECONDS * 1000000000) {
+            stalled = true;
+            break;
+        }
+        if (now < next_kill || options.processes < 2) continue;
+        next_kill = now + (int64_t) options.kill_ms * 1000000;
+        // the locks of the killed process are released by the kernel before the process is reaped, they are not
+        // checked anymore. The words of its threads are cleared before a new process uses the slot.
+        int victim = (int) (next_random(random) % options.processes);
+        process_slots[victim].killed.fetch_add(1);
+        kill(workers[victim], SIGKILL);
+        waitpid(workers[victim], nullptr, 0);
+        for (int i = 0; i < options.threads; i++) thread_slots[victim * options.threads + i].holding.store(0);
+        process_slots[victim].killed.fetch_add(1);
+        workers[victim] = start_worker(variant_index, oracle_path, victim, data, lockdir);
+        kills++;
+    }
+
+    // blocked threads finish when the current holders release their locks
+    oracle->stop.store(1);
+    int64_t deadline = now_ns() + (int64_t) STALL_SECONDS * 1000000000;
+    for (pid_t worker: workers) {
+        int status;
+        while (waitpid(worker, &status, WNOHANG) == 0) {
+            if (now_ns() > deadline) {
+                stalled = true;
+                kill(worker, SIGKILL);
+            }
+            usleep(1000);
+        }
+    }
+    int64_t elapsed = now_ns() - start;
+
+    // percentiles from the histograms of all threads
+    vector<uint64_t> histogram(HISTOGRAM_BUCKETS);
+    uint64_t ops = 0;
+    for (uint32_t i = 0; i < oracle->processes * oracle->threads; i++) {
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) histogram[b] += thread_slots[i].histogram[b].load();
+        ops += thread_slots[i].ops.load();
+    }
+    auto percentile = [&](double p) -> uint64_t {
+        uint64_t rank = (uint64_t) (p * (ops > 0 ? ops - 1 : 0)), seen = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            seen += histogram[b];
+            if (seen > rank) return bucket_value(b);
+        }
+        return 0;
+    };
+    uint64_t max_ns = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) if (histogram[b] > 0) max_ns = bucket_value(b);
+    double ops_per_sec = elapsed > 0 ? ops * 1e9 / elapsed : 0;
+    uint32_t violations = oracle->violations.load(), errors = oracle->errors.load();
+    if (options.csv) {
+        fprintf(options.output, "stress,%s,%d,%d,%d,%lu,%.0f,%lu,%lu,%lu,%lu,%lu,%d,%u,%u,%d\n", variant,
+                options.threads, options.processes, options.files, (unsigned long) ops, ops_per_sec,
+                (unsigned long) percentile(0.5), (unsigned long) percentile(0.9), (unsigned long) percentile(0.99),
+                (unsigned long) percentile(0.999), (unsigned long) max_ns, kills, violations, errors, stalled);
+    } else {
+        fprintf(options.output, "{\"benchmark\": \"stress\", \"variant\": \"%s\", \"threads\": %d, \"processes\": %d, "
+                "\"files\": %d, \"ops\": %lu, \"ops_per_sec\": %.0f, \"p50_ns\": %lu, \"p90_ns\": %lu, "
+                "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu, \"kills\": %d, \"violations\": %u, "
+                "\"errors\": %u, \"stalled\": %s}\n", variant, options.threads, options.processes, options.files,
+                (unsigned long) ops, ops_per_sec, (unsigned long) percentile(0.5), (unsigned long) percentile(0.9),
+                (unsigned long) percentile(0.99), (unsigned long) percentile(0.999), (unsigned long) max_ns, kills,
+                violations, errors, stalled ? "true" : "false");
+    }
+    fflush(options.output);
+    munmap(oracle, oracle_size(options.processes, options.threads));
+
+    // the segment of the shared memory backend is named after its lock directory
+    struct stat st;
+    if (variant_index == 2 && stat(lockdir.c_str(), &st) == 0) {
+        char name[64];
+        snprintf(name, sizeof(name), "/localflock-%lx-%lx", (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+        shm_unlink(name);
+    }
+    return violations == 0 && errors == 0 && !stalled;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 5 && strcmp(argv[1], "--worker") == 0) return worker(argv[2], atoi(argv[3]), argv[4]);
+
+    int option;
+    string output;
+    while ((option = getopt(argc, argv, "l:d:p:t:F:s:k:H:f:o:h")) != -1) {
+        switch (option) {
+            case 'l':
+                options.library = optarg;
+                break;
+            case 'd':
+                options.directory = optarg;
+                break;
+            case 'p':
+                options.processes = atoi(optarg);
+                break;
+            case 't':
+                options.threads = max(atoi(optarg), 1);
+                break;
+            case 'F':
+                options.files = min(max(atoi(optarg), 1), MAX_FILES);
+                break;
+            case 's':
+                options.seconds = max(atoi(optarg), 1);
+                break;
+            case 'k':
+                options.kill_ms = max(atoi(optarg), 0);
+                break;
+            case 'H':
+                options.hold_us = max(atoi(optarg), 0);
+                break;
+            case 'f':
+                options.csv = strcmp(optarg, "csv") == 0;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-l liblocalflock.so] [-d scratch directory] [-p processes] "
+                                "[-t threads per process] [-F files] [-s seconds per variant] [-k kill interval ms] "
+                                "[-H max hold us] [-f json|csv] [-o output file]\n", argv[0]);
+                return option == 'h' ? 0 : 2;
+        }
+    }
+    if (options.processes <= 0) options.processes = max((int) thread::hardware_concurrency(), 2);
+    if (!output.empty()) {
+        options.output = fopen(output.c_str(), "w");
+        if (options.output == nullptr) {
+            perror(output.c_str());
+            return 2;
+        }
+    }
+    if (options.csv) fprintf(options.output, "benchmark,variant,threads,processes,files,ops,ops_per_sec,p50_ns,"
+                                             "p90_ns,p99_ns,p999_ns,max_ns,kills,violations,errors,stalled\n");
+
+    // everything happens in a new directory, the lock files should not exist before
+    filesystem::create_directories(options.directory);
+    string directory = options.directory + "/localflock_stress.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    bool ok = true;
+    int variant_count = options.library != nullptr ? sizeof(variants) / sizeof(variants[0]) : 1;
+    for (int i = 0; i < variant_count; i++) ok = run_variant(i, directory) && ok;
+    if (options.output != stdout) fclose(options.output);
+    filesystem::remove_all(directory);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+/*
+ * Public API of liblocalflock for programs that know about the library. Everything else works without changes of
+ * the program, these functions only make some things cheaper or safer, or possible without blocking a thread.
+ *
+ * The functions are declared weak: a program that is not linked with liblocalflock can check whether they are
+ * available, i.e., whether the library is preloaded, and fall back to plain flock otherwise:
+ *
+ *     if (localflock_lock_many != NULL) localflock_lock_many(fds, n, LOCK_EX, 0);
+ *     else for (int i = 0; i < n; i++) flock(fds[i], LOCK_EX);
+ */
+
+#ifndef LOCALFLOCK_H
+#define LOCALFLOCK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * lock the files of fds with flock semantics. mode is LOCK_SH or LOCK_EX, flags is 0 or LOCK_NB. The files are
+ * locked in an order that is the same in all processes, so processes locking overlapping sets of files do not
+ * deadlock, and the lock files of files that were not locked before are created together. Returns 0 if all files
+ * are locked. Otherwise, the locks acquired by this call are released again and -1 is returned with errno set:
+ * EWOULDBLOCK if LOCK_NB was given and a file is locked by someone else, EDEADLK if fds contains different open file
+ * descriptions of the same file and mode is LOCK_EX, or the error of flock.
+ */
+int localflock_lock_many(const int* fds, int count, int mode, int flags) __attribute__ ((weak));
+
+/*
+ * release the flock locks of fds. Returns 0, or -1 with the errno of the first fd that could not be unlocked.
+ */
+int localflock_unlock_many(const int* fds, int count) __attribute__ ((weak));
+
+/*
+ * start acquiring the flock lock of fd without blocking the caller. mode is LOCK_SH or LOCK_EX. The request fails
+ * with ETIMEDOUT if the lock is not granted within timeout_ms milliseconds, a negative timeout waits forever and 0
+ * tries once. Returns the handle of the request, a file descriptor that becomes readable (POLLIN) when the request
+ * is finished, or -1 with errno set. Converting a held lock releases it when the request starts, as flock does.
+ * The handle must be closed with localflock_async_close, not with close.
+ */
+int localflock_lock_async(int fd, int mode, int timeout_ms) __attribute__ ((weak));
+
+/*
+ * result of a request: 0 if the lock is held, otherwise -1 with errno set. errno is EINPROGRESS while the request is
+ * pending, ETIMEDOUT or ECANCELED if it ended without the lock, or the error of flock.
+ */
+int localflock_async_result(int handle) __attribute__ ((weak));
+
+/*
+ * cancel a pending request, it finishes with ECANCELED. Returns -1 with EALREADY if the request was finished before,
+ * the lock may then be held and has to be released with flock.
+ */
+int localflock_async_cancel(int handle) __attribute__ ((weak));
+
+/*
+ * cancel the request if it is pending and close its handle. A granted lock stays held.
+ */
+int localflock_async_close(int handle) __attribute__ ((weak));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //LOCALFLOCK_H
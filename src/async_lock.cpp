@@ -0,0 +1,300 @@
+/*
+ * Asynchronous flock requests, retried by one background thread per process.
+ */
+
+#include "async_lock.h"
+#include "support.h"
+#include "stats.h"
+#include "trace.h"
+#include <unordered_map>
+#include <algorithm>
+#include <climits>
+#include <csignal>
+#include <new>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+
+// one request started by localflock_lock_async
+struct async_request_t {
+    // the eventfd of the caller
+    int handle;
+    // fd used for the attempts. Locks passed through are tried on an own duplicate of the original fd, the caller
+    // may close the original fd while the request is pending.
+    int fd;
+    bool own_fd;
+    int original_fd;
+    LockInfo* info;
+    int mode;
+    // monotonic times in nanoseconds. The deadline is UINT64_MAX if the request has no timeout.
+    uint64_t start;
+    uint64_t deadline;
+    uint64_t next_try;
+    uint32_t interval_ms;
+    // EINPROGRESS while the request is pending, 0 if the lock was granted, otherwise the errno of the request.
+    int error;
+};
+
+// all requests of this process by handle, protected by requests_mtx
+static unordered_map<int, async_request_t*> requests;
+static mutex requests_mtx;
+// number of pending requests, checked without the mutex whenever a lock is released
+static atomic<int> pending(0);
+// set when a lock was released, all pending requests are retried at once
+static atomic<bool> released(false);
+// wakes the background thread. Both belong to the process waiter_pid, protected by requests_mtx.
+static int wake_fd = -1;
+static pid_t waiter_pid = 0;
+
+/*
+ * try to acquire the lock of a request without waiting. Returns 0 or the errno of the attempt.
+ */
+static int attempt(async_request_t* request) {
+    int result = request->info->native ? originalFlock(request->fd, request->mode | LOCK_NB)
+                                       : request->info->flock(request->mode | LOCK_NB);
+    return result == 0 ? 0 : errno;
+}
+
+/*
+ * record the result of a request and make its handle readable.
+ */
+static void complete(async_request_t* request, int error) {
+    LOG_DEBUG("async lock request {} finished: {}", request->handle, error);
+    request->error = error;
+    if (error == 0) stats_add_wait(request->start);
+    else if (error == ETIMEDOUT) stats_add(STAT_WOULD_BLOCK);
+    else if (error != ECANCELED) stats_add(STAT_ERRORS);
+    // a granted request is traced as blocking flock, a request that timed out as failed LOCK_NB
+    if (trace_active && (error == 0 || error == ETIMEDOUT)) {
+        errno = EWOULDBLOCK;
+        trace_flock(request->original_fd, request->info, request->mode | (error == 0 ? 0 : LOCK_NB), request->start,
+                    error == 0 ? 0 : -1);
+    }
+    uint64_t one = 1;
+    if (write(request->handle, &one, sizeof(one)) < 0) {
+        logger->error("unable to signal the end of async lock request {}", request->handle);
+    }
+}
+
+/*
+ * finish a pending request. requests_mtx has to be held by the caller.
+ */
+static void finish_pending(async_request_t* request, int error) {
+    pending.fetch_sub(1, memory_order_relaxed);
+    complete(request, error);
+}
+
+static void wake_waiter() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) logger->error("unable to wake the async lock thread");
+}
+
+/*
+ * main function of the background thread. All pending requests are tried when they are due, in between the thread
+ * sleeps until the next retry, the next deadline or a wakeup.
+ */
+static void* waiter_main(void*) {
+    struct pollfd wake = {wake_fd, POLLIN, 0};
+    while (true) {
+        int timeout = -1;
+        {
+            lock_guard<mutex> guard(requests_mtx);
+            if (released.exchange(false, memory_order_acq_rel)) {
+                for (auto& entry: requests) entry.second->next_try = 0;
+            }
+            uint64_t now = stats_clock();
+            uint64_t next = UINT64_MAX;
+            for (auto& entry: requests) {
+                async_request_t* request = entry.second;
+                if (request->error != EINPROGRESS) continue;
+                if (now >= request->next_try) {
+                    int error = attempt(request);
+                    if (error != EWOULDBLOCK) {
+                        finish_pending(request, error);
+                        continue;
+                    }
+                    request->interval_ms = min(request->interval_ms * 2, (uint32_t) ASYNC_RETRY_MAX_MS);
+                    request->next_try = now + request->interval_ms * 1000000ULL;
+                }
+                if (now >= request->deadline) {
+                    finish_pending(request, ETIMEDOUT);
+                    continue;
+                }
+                next = min(next, min(request->next_try, request->deadline));
+            }
+            if (next != UINT64_MAX) timeout = (int) ((next - now + 999999) / 1000000);
+        }
+        if (poll(&wake, 1, timeout) > 0) {
+            uint64_t count;
+            if (read(wake.fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                logger->error("unable to read the wakeups of the async lock thread");
+            }
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * start the background thread if it is not running in this process. Signals are blocked in the thread, they are
+ * meant for the application. requests_mtx has to be held by the caller.
+ */
+static bool ensure_waiter() {
+    if (waiter_pid == get_own_pid()) return true;
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) return false;
+    internal_fd_add(wake_fd);
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    pthread_t thread;
+    int error = pthread_create(&thread, nullptr, waiter_main, nullptr);
+    pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+    if (error != 0) {
+        internal_fd_close(wake_fd);
+        wake_fd = -1;
+        errno = error;
+        return false;
+    }
+    pthread_detach(thread);
+    waiter_pid = get_own_pid();
+    return true;
+}
+
+/*
+ * start a request for the flock lock mode of fd, which has the lock information info. The lock is tried at once,
+ * only if it is held by someone else, the request is left to the background thread. timeout_ms < 0 waits without a
+ * deadline. Returns the handle or -1 with errno set.
+ */
+int async_lock_start(int fd, LockInfo* info, int mode, int timeout_ms) {
+    int handle = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (handle < 0) return -1;
+    auto* request = new async_request_t();
+    request->handle = handle;
+    request->fd = fd;
+    request->own_fd = false;
+    request->original_fd = fd;
+    info->retain();
+    request->info = info;
+    request->mode = mode;
+    request->start = stats_clock();
+    request->deadline = timeout_ms < 0 ? UINT64_MAX : request->start + timeout_ms * 1000000ULL;
+    request->interval_ms = ASYNC_RETRY_MIN_MS;
+    request->next_try = request->start + request->interval_ms * 1000000ULL;
+    stats_add(mode == LOCK_EX ? STAT_FLOCK_EX : STAT_FLOCK_SH);
+    if (info->native) stats_add(STAT_PASSTHROUGH);
+    int error = attempt(request);
+
+    lock_guard<mutex> guard(requests_mtx);
+    requests[handle] = request;
+    if (error == EWOULDBLOCK && timeout_ms != 0) {
+        if (info->native) {
+            request->fd = originalFcntl(fd, F_DUPFD_CLOEXEC, 0);
+            request->own_fd = request->fd >= 0;
+            if (request->own_fd) internal_fd_add(request->fd);
+        }
+        if (request->fd >= 0 && ensure_waiter()) {
+            LOG_DEBUG("async lock request {} is pending", handle);
+            request->error = EINPROGRESS;
+            pending.fetch_add(1, memory_order_relaxed);
+            wake_waiter();
+            return handle;
+        }
+        error = errno;
+    }
+    complete(request, error == EWOULDBLOCK ? ETIMEDOUT : error);
+    return handle;
+}
+
+/*
+ * the result of a request: 0 if the lock was granted, otherwise -1 with the errno of the request, which is
+ * EINPROGRESS while it is pending.
+ */
+int async_lock_result(int handle) {
+    lock_guard<mutex> guard(requests_mtx);
+    auto existing = requests.find(handle);
+    if (existing == requests.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    if (existing->second->error == 0) return 0;
+    errno = existing->second->error;
+    return -1;
+}
+
+/*
+ * cancel a pending request, it fails with ECANCELED. A finished request is not changed, EALREADY is returned.
+ */
+int async_lock_cancel(int handle) {
+    lock_guard<mutex> guard(requests_mtx);
+    auto existing = requests.find(handle);
+    if (existing == requests.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    if (existing->second->error != EINPROGRESS) {
+        errno = EALREADY;
+        return -1;
+    }
+    finish_pending(existing->second, ECANCELED);
+    return 0;
+}
+
+/*
+ * forget a request and close its handle. A pending request is cancelled, a granted lock stays locked.
+ */
+int async_lock_close(int handle) {
+    async_request_t* request;
+    {
+        lock_guard<mutex> guard(requests_mtx);
+        auto existing = requests.find(handle);
+        if (existing == requests.end()) {
+            errno = EBADF;
+            return -1;
+        }
+        request = existing->second;
+        requests.erase(existing);
+        if (request->error == EINPROGRESS) pending.fetch_sub(1, memory_order_relaxed);
+    }
+    originalClose(request->handle);
+    if (request->own_fd) internal_fd_close(request->fd);
+    request->info->release();
+    delete request;
+    return 0;
+}
+
+/*
+ * called whenever this process released a flock lock. Pending requests may wait for it, they are retried at once.
+ */
+void async_lock_notify() {
+    if (pending.load(memory_order_relaxed) == 0) return;
+    released.store(true, memory_order_release);
+    wake_waiter();
+}
+
+/*
+ * keep the requests consistent while fork copies them.
+ */
+void async_lock_prepare_fork() {
+    requests_mtx.lock();
+}
+
+void async_lock_parent_after_fork() {
+    requests_mtx.unlock();
+}
+
+/*
+ * in a new child process, the background thread does not exist. The pending requests of the parent are cancelled
+ * without signaling their handles, which the child shares with the parent.
+ */
+void async_lock_child_after_fork() {
+    new (&requests_mtx) mutex();
+    for (auto& entry: requests) {
+        if (entry.second->error == EINPROGRESS) entry.second->error = ECANCELED;
+    }
+    pending.store(0, memory_order_relaxed);
+    if (wake_fd >= 0) internal_fd_close(wake_fd);
+    wake_fd = -1;
+    waiter_pid = 0;
+}
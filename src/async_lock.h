@@ -0,0 +1,34 @@
+/*
+ * Asynchronous flock requests for programs with event loops, started with localflock_lock_async. Each request has
+ * an eventfd, the handle, that becomes readable when the request is finished: the lock was granted, the deadline
+ * passed, the request was cancelled or an error occurred.
+ *
+ * Neither the kernel nor the lock backends can report that a lock was released. One background thread per process
+ * retries all pending requests with LOCK_NB instead: at once when a lock is released by this process, otherwise
+ * in intervals that grow from ASYNC_RETRY_MIN_MS to ASYNC_RETRY_MAX_MS. Pending requests need no thread of their
+ * own and no system call while they wait, except the retries.
+ *
+ * Requests belong to the process that started them. A child process inherits the handles, but not the requests.
+ */
+
+#ifndef LOCALFLOCK_ASYNC_LOCK_H
+#define LOCALFLOCK_ASYNC_LOCK_H
+
+#include "lock_info.h"
+
+using namespace std;
+
+// intervals between the retries of a pending request
+#define ASYNC_RETRY_MIN_MS 1
+#define ASYNC_RETRY_MAX_MS 32
+
+int async_lock_start(int fd, LockInfo* info, int mode, int timeout_ms);
+int async_lock_result(int handle);
+int async_lock_cancel(int handle);
+int async_lock_close(int handle);
+void async_lock_notify();
+void async_lock_prepare_fork();
+void async_lock_parent_after_fork();
+void async_lock_child_after_fork();
+
+#endif //LOCALFLOCK_ASYNC_LOCK_H
@@ -0,0 +1,185 @@
+/*
+ * Asynchronous logging into a file.
+ */
+
+#include "async_log.h"
+#include "support.h"
+#include <pthread.h>
+#include <csignal>
+#include <ctime>
+
+// all rings ever created, new rings are pushed to the front
+static atomic<async_log_ring_t*> rings(nullptr);
+// the file written by the background thread
+static int log_fd = -1;
+// the background thread and the process it was started in. A child process starts its own thread.
+static pthread_t drainer;
+static atomic<pid_t> drainer_pid(0);
+static atomic<bool> drainer_stop(false);
+
+// marks the ring of a thread as abandoned when the thread exits
+struct ring_owner_t {
+    async_log_ring_t* ring = nullptr;
+    ~ring_owner_t() {
+        if (this->ring != nullptr) this->ring->abandoned.store(true, memory_order_release);
+    }
+};
+static thread_local ring_owner_t ring_owner;
+
+/*
+ * get the ring of the calling thread. Rings of threads that exited are reused before a new one is allocated.
+ */
+static async_log_ring_t* get_ring() {
+    if (ring_owner.ring != nullptr) return ring_owner.ring;
+    for (async_log_ring_t* ring = rings.load(memory_order_acquire); ring != nullptr; ring = ring->next) {
+        bool abandoned = true;
+        if (ring->abandoned.load(memory_order_relaxed)
+            && ring->abandoned.compare_exchange_strong(abandoned, false, memory_order_acquire)) {
+            ring_owner.ring = ring;
+            return ring;
+        }
+    }
+    // calloc instead of new: all-zero memory is a valid empty ring
+    auto* ring = (async_log_ring_t*) calloc(1, sizeof(async_log_ring_t));
+    if (ring == nullptr) return nullptr;
+    ring->next = rings.load(memory_order_relaxed);
+    while (!rings.compare_exchange_weak(ring->next, ring, memory_order_release)) {}
+    ring_owner.ring = ring;
+    return ring;
+}
+
+/*
+ * format all records of all rings and write them to the file. Returns the number of records written.
+ */
+static size_t drain_rings() {
+    static char buffer[65536];
+    size_t used = 0;
+    size_t count = 0;
+    pid_t pid = get_own_pid();
+    auto write_buffer = [&]() {
+        size_t written = 0;
+        while (written < used) {
+            ssize_t result = write(log_fd, buffer + written, used - written);
+            if (result <= 0) break;
+            written += result;
+        }
+        used = 0;
+    };
+
+    for (async_log_ring_t* ring = rings.load(memory_order_acquire); ring != nullptr; ring = ring->next) {
+        uint64_t tail = ring->tail.load(memory_order_relaxed);
+        uint64_t head = ring->head.load(memory_order_acquire);
+        for (; tail < head; tail++) {
+            async_log_record_t& record = ring->records[tail & (ASYNC_LOG_RING_SIZE - 1)];
+            if (sizeof(buffer) - used < ASYNC_LOG_PAYLOAD_LEN + 128) write_buffer();
+            time_t seconds = record.time_ns / 1000000000;
+            struct tm local_time;
+            localtime_r(&seconds, &local_time);
+            used += strftime(buffer + used, sizeof(buffer) - used, "[%Y-%m-%d %H:%M:%S", &local_time);
+            auto level = spdlog::level::to_string_view((spdlog::level::level_enum) record.level);
+            used += snprintf(buffer + used, sizeof(buffer) - used, ".%06ld] [%d] [%d] [%.*s] %.*s\n",
+                             (long) (record.time_ns % 1000000000) / 1000, pid, record.thread_id,
+                             (int) level.size(), level.data(), (int) record.length, record.payload);
+            count++;
+        }
+        ring->tail.store(tail, memory_order_release);
+        uint64_t dropped = ring->dropped.exchange(0, memory_order_relaxed);
+        if (dropped > 0) {
+            if (sizeof(buffer) - used < 128) write_buffer();
+            used += snprintf(buffer + used, sizeof(buffer) - used, "[%d] %lu messages dropped\n", pid,
+                             (unsigned long) dropped);
+        }
+    }
+    if (used > 0) write_buffer();
+    return count;
+}
+
+/*
+ * main function of the background thread. It sleeps while there is nothing to do.
+ */
+static void* drainer_main(void*) {
+    struct timespec idle = {0, 10000000};
+    while (!drainer_stop.load(memory_order_acquire)) {
+        if (drain_rings() == 0) nanosleep(&idle, nullptr);
+    }
+    return nullptr;
+}
+
+/*
+ * start the background thread if it is not running in this process. Signals are blocked in the thread, they are
+ * meant for the application.
+ */
+static void ensure_drainer() {
+    pid_t pid = get_own_pid();
+    pid_t running = drainer_pid.load(memory_order_acquire);
+    if (running == pid) return;
+    if (!drainer_pid.compare_exchange_strong(running, pid, memory_order_acq_rel)) return;
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    drainer_stop.store(false, memory_order_release);
+    if (pthread_create(&drainer, nullptr, drainer_main, nullptr) != 0) drainer_pid.store(0);
+    pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+}
+
+/*
+ * in a new child process, records of the parent are still in the rings. They are written by the parent, the child
+ * skips them. Only the forking thread exists in the child, all other rings can be reused.
+ */
+static void reset_rings_in_child() {
+    for (async_log_ring_t* ring = rings.load(memory_order_acquire); ring != nullptr; ring = ring->next) {
+        ring->tail.store(ring->head.load(memory_order_relaxed), memory_order_relaxed);
+        ring->dropped.store(0, memory_order_relaxed);
+        if (ring != ring_owner.ring) ring->abandoned.store(true, memory_order_relaxed);
+    }
+}
+
+/*
+ * open the file, records are appended.
+ */
+async_log_sink::async_log_sink(const string& filename) {
+    log_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd >= 0) internal_fd_add(log_fd);
+    if (log_fd < 0) fprintf(stderr, "localflock: unable to open log file %s\n", filename.c_str());
+    pthread_atfork(nullptr, nullptr, reset_rings_in_child);
+}
+
+/*
+ * copy the message into the ring of the calling thread. This never blocks.
+ */
+void async_log_sink::log(const spdlog::details::log_msg& msg) {
+    if (log_fd < 0) return;
+    async_log_ring_t* ring = get_ring();
+    if (ring == nullptr) return;
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    if (head - ring->tail.load(memory_order_acquire) >= ASYNC_LOG_RING_SIZE) {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    async_log_record_t& record = ring->records[head & (ASYNC_LOG_RING_SIZE - 1)];
+    record.time_ns = chrono::duration_cast<chrono::nanoseconds>(msg.time.time_since_epoch()).count();
+    record.thread_id = (int32_t) msg.thread_id;
+    record.level = msg.level;
+    record.length = (uint16_t) min(msg.payload.size(), (size_t) ASYNC_LOG_PAYLOAD_LEN);
+    memcpy(record.payload, msg.payload.data(), record.length);
+    ring->head.store(head + 1, memory_order_release);
+    ensure_drainer();
+}
+
+/*
+ * records are written by the background thread only, there is nothing to do here.
+ */
+void async_log_sink::flush() {}
+
+/*
+ * stop the background thread and write all remaining records. Called when the library is unloaded.
+ */
+void async_log_shutdown() {
+    if (log_fd < 0) return;
+    if (drainer_pid.load(memory_order_acquire) == get_own_pid()) {
+        drainer_stop.store(true, memory_order_release);
+        pthread_join(drainer, nullptr);
+        drainer_pid.store(0, memory_order_release);
+    }
+    drain_rings();
+}
@@ -0,0 +1,55 @@
+/*
+ * Asynchronous logging into a file, enabled with LOCALFLOCK_LOG_FILE. Each thread writes fixed-size binary records
+ * into its own lock-free ring buffer. A background thread drains all rings and writes formatted lines to the file,
+ * so that logging neither blocks the calling thread nor interleaves with the output of the application. Records
+ * are dropped (and counted) when a ring is full, the timing of the locks is never affected.
+ */
+
+#ifndef LOCALFLOCK_ASYNC_LOG_H
+#define LOCALFLOCK_ASYNC_LOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "spdlog/sinks/sink.h"
+
+using namespace std;
+
+// number of records per thread, has to be a power of two
+#define ASYNC_LOG_RING_SIZE 1024
+// maximal length of the message of a record, longer messages are truncated
+#define ASYNC_LOG_PAYLOAD_LEN 232
+
+// one message as stored in the ring buffer
+struct async_log_record_t {
+    int64_t time_ns;
+    int32_t thread_id;
+    uint16_t level;
+    uint16_t length;
+    char payload[ASYNC_LOG_PAYLOAD_LEN];
+};
+
+// ring buffer of one thread. Only the owning thread writes records, only the background thread reads them.
+struct async_log_ring_t {
+    atomic<uint64_t> head;
+    atomic<uint64_t> tail;
+    atomic<uint64_t> dropped;
+    // set when the owning thread exits, the ring can then be taken over by a new thread.
+    atomic<bool> abandoned;
+    async_log_ring_t* next;
+    async_log_record_t records[ASYNC_LOG_RING_SIZE];
+};
+
+// spdlog sink that writes into the ring buffer of the calling thread.
+class async_log_sink : public spdlog::sinks::sink {
+public:
+    explicit async_log_sink(const string& filename);
+    void log(const spdlog::details::log_msg& msg) override;
+    void flush() override;
+    void set_pattern(const string& pattern) override {}
+    void set_formatter(unique_ptr<spdlog::formatter> sink_formatter) override {}
+};
+
+void async_log_shutdown();
+
+#endif //LOCALFLOCK_ASYNC_LOG_H
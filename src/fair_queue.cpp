@@ -0,0 +1,315 @@
+/*
+ * Fair order of blocking flock requests.
+ */
+
+#include "fair_queue.h"
+#include "shm_table.h"
+#include "support.h"
+#include "stats.h"
+#include <mutex>
+#include <climits>
+#include <cstring>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+static bool has_key(fair_queue_t* queue, const uint64_t key[2]) {
+    return queue->key[0].load(memory_order_relaxed) == key[0] && queue->key[1].load(memory_order_relaxed) == key[1];
+}
+
+/*
+ * whether the request of an entry still waits, i.e., its process and thread are still running.
+ */
+static bool entry_alive(const fair_entry_t& entry) {
+    if (syscall(SYS_tgkill, entry.pid, entry.tid, 0) != 0 && errno == ESRCH) return false;
+    return entry.pid == get_own_pid() || process_is_running(entry.pid, entry.start_time);
+}
+
+/*
+ * remove the entry at index, the later entries move up.
+ */
+static void remove_entry(fair_queue_t* queue, uint32_t index) {
+    uint32_t length = queue->length.load(memory_order_relaxed);
+    if (queue->entries[index].exclusive) queue->writers.fetch_sub(1, memory_order_relaxed);
+    memmove(&queue->entries[index], &queue->entries[index + 1], (length - index - 1) * sizeof(fair_entry_t));
+    queue->length.store(length - 1, memory_order_release);
+}
+
+/*
+ * remove the entries of requests that ended. Returns whether any was removed.
+ */
+static bool remove_dead(fair_queue_t* queue) {
+    bool removed = false;
+    for (uint32_t i = 0; i < queue->length.load(memory_order_relaxed);) {
+        if (entry_alive(queue->entries[i])) {
+            i++;
+            continue;
+        }
+        LOG_DEBUG("removing the queued request of pid {}, which is not running anymore", queue->entries[i].pid);
+        remove_entry(queue, i);
+        removed = true;
+    }
+    return removed;
+}
+
+/*
+ * lock the mutex of a queue. If its last owner died, the queue may have been changed halfway: the counters are
+ * recalculated and the entries of requests that ended are removed.
+ */
+static int lock_mutex(fair_queue_t* queue) {
+    int err = pthread_mutex_lock(&queue->mtx);
+    if (err == EOWNERDEAD) {
+        logger->warn("a process died while changing a fair queue, removing the requests of dead processes");
+        if (queue->length.load(memory_order_relaxed) > FAIR_QUEUE_MAX) queue->length.store(FAIR_QUEUE_MAX);
+        uint32_t length = queue->length.load(memory_order_relaxed), writers = 0;
+        for (uint32_t i = 0; i < length; i++) writers += queue->entries[i].exclusive;
+        queue->writers.store(writers, memory_order_relaxed);
+        remove_dead(queue);
+        pthread_mutex_consistent(&queue->mtx);
+        err = 0;
+    }
+    if (err != 0) logger->error("unable to lock a fair queue: {}", strerror(err));
+    return err;
+}
+
+/*
+ * release the mutex of a queue and wake all waiting requests if entries were removed.
+ */
+static void unlock_mutex(fair_queue_t* queue, bool changed) {
+    bool wake = changed && queue->length.load(memory_order_relaxed) > 0;
+    if (wake) queue->wakeups.fetch_add(1, memory_order_release);
+    pthread_mutex_unlock(&queue->mtx);
+    if (wake) syscall(SYS_futex, (uint32_t*) &queue->wakeups, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/*
+ * whether the request with ticket may wait for its lock: an exclusive request if it is the first one, a shared
+ * request if no exclusive request is before it. A request without entry is not held back.
+ */
+static bool may_proceed(fair_queue_t* queue, uint64_t ticket) {
+    bool writer_before = false;
+    uint32_t length = queue->length.load(memory_order_relaxed);
+    for (uint32_t i = 0; i < length; i++) {
+        const fair_entry_t& entry = queue->entries[i];
+        if (entry.ticket == ticket) return entry.exclusive ? i == 0 : !writer_before;
+        writer_before = writer_before || entry.exclusive;
+    }
+    return true;
+}
+
+/*
+ * open and if necessary create the segment of the lock directory, named like the one of the ShmTable.
+ */
+FairQueue::FairQueue() : header(nullptr), queues(nullptr) {
+    struct stat st;
+    if (fstat(settings->LOCKDIR_FD, &st) != 0) {
+        logger->error("unable to get the identity of {}", settings->LOCKDIR);
+        return;
+    }
+    string name = fmt::format("/localflock-fair-{:x}-{:x}", (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        logger->error("unable to open shared memory {}", name);
+        return;
+    }
+    // the mode given to shm_open is reduced by the umask. Only the creator is allowed to change it.
+    fchmod(fd, 0666);
+
+    // a new segment is initialized by the one process that gets the exclusive lock while it is still empty.
+    size_t size = sizeof(fair_header_t) + sizeof(fair_queue_t) * FAIR_QUEUES;
+    originalFlock(fd, LOCK_EX);
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (st.st_size > 0 || ftruncate(fd, size) == 0)) {
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapping != MAP_FAILED) {
+        auto* new_header = (fair_header_t*) mapping;
+        if (st.st_size == 0) {
+            LOG_DEBUG("creating shared memory {} with {} queues", name, FAIR_QUEUES);
+            shm_init_mutex(&new_header->insert_mtx);
+            new_header->queues = FAIR_QUEUES;
+            new_header->version = FAIR_VERSION;
+            new_header->magic = FAIR_MAGIC;
+        }
+        if (st.st_size != 0 && (st.st_size != (off_t) size || new_header->magic != FAIR_MAGIC ||
+                                new_header->version != FAIR_VERSION || new_header->queues != FAIR_QUEUES)) {
+            logger->error("shared memory {} is not a fair queue of this version", name);
+            munmap(mapping, size);
+        } else {
+            this->header = new_header;
+            this->queues = (fair_queue_t*) ((char*) mapping + sizeof(fair_header_t));
+        }
+    }
+    originalFlock(fd, LOCK_UN);
+    // the mapping stays valid without the fd
+    originalClose(fd);
+}
+
+/*
+ * get the queues of this process. They are opened once and kept open.
+ */
+FairQueue* FairQueue::get() {
+    static FairQueue* instance = nullptr;
+    static mutex instance_mtx;
+    lock_guard<mutex> guard(instance_mtx);
+    if (instance == nullptr) instance = new FairQueue();
+    return instance;
+}
+
+bool FairQueue::is_open() const {
+    return this->header != nullptr;
+}
+
+/*
+ * find the queue of a file, as ShmTable::find finds its record. New queues take over a queue without entries in
+ * the probe sequence or a queue that was never used. The probe sequence is short, queues are only needed while
+ * requests wait and requests that find the queue empty should not search for long. Returns nullptr if the file
+ * has no queue and none can be assigned.
+ */
+fair_queue_t* FairQueue::find(const uint64_t key[2], bool create) {
+    if (this->header == nullptr) return nullptr;
+    uint32_t count = this->header->queues;
+    uint32_t home = (uint32_t) (key[0] % count);
+    for (uint32_t i = 0; i < FAIR_PROBE_MAX && i < count; i++) {
+        fair_queue_t* queue = &this->queues[(home + i) % count];
+        if (queue->used.load(memory_order_acquire) == 0) break;
+        if (has_key(queue, key)) return queue;
+    }
+    if (!create) return nullptr;
+
+    if (pthread_mutex_lock(&this->header->insert_mtx) == EOWNERDEAD) {
+        pthread_mutex_consistent(&this->header->insert_mtx);
+    }
+    fair_queue_t* result = nullptr;
+    // an empty queue, its mutex is held until the whole probe sequence was checked for the key
+    fair_queue_t* unused = nullptr;
+    for (uint32_t i = 0; i < FAIR_PROBE_MAX && i < count; i++) {
+        fair_queue_t* queue = &this->queues[(home + i) % count];
+        if (queue->used.load(memory_order_acquire) == 0) {
+            if (unused == nullptr) {
+                shm_init_mutex(&queue->mtx);
+                queue->key[0].store(key[0], memory_order_relaxed);
+                queue->key[1].store(key[1], memory_order_relaxed);
+                queue->used.store(1, memory_order_release);
+                result = queue;
+            }
+            break;
+        }
+        if (has_key(queue, key)) {
+            result = queue;
+            break;
+        }
+        if (unused == nullptr && lock_mutex(queue) == 0) {
+            if (queue->length.load(memory_order_relaxed) == 0) unused = queue;
+            else pthread_mutex_unlock(&queue->mtx);
+        }
+    }
+    if (unused != nullptr) {
+        if (result == nullptr) {
+            unused->key[0].store(key[0], memory_order_relaxed);
+            unused->key[1].store(key[1], memory_order_relaxed);
+            result = unused;
+        }
+        pthread_mutex_unlock(&unused->mtx);
+    }
+    pthread_mutex_unlock(&this->header->insert_mtx);
+    if (result == nullptr) LOG_DEBUG("    -> no free fair queue, the request is not queued");
+    return result;
+}
+
+/*
+ * find and lock the queue of a file. Returns nullptr if there is none.
+ */
+fair_queue_t* FairQueue::lock_queue(const uint64_t key[2], bool create) {
+    while (true) {
+        fair_queue_t* queue = this->find(key, create);
+        if (queue == nullptr || lock_mutex(queue) != 0) return nullptr;
+        // the queue may have been taken over by another file in the meantime
+        if (has_key(queue, key)) return queue;
+        pthread_mutex_unlock(&queue->mtx);
+    }
+}
+
+/*
+ * remove the entry of a request from the queue of its file.
+ */
+void FairQueue::leave(const uint64_t key[2], uint64_t ticket) {
+    fair_queue_t* queue = this->lock_queue(key, false);
+    if (queue == nullptr) return;
+    bool removed = false;
+    for (uint32_t i = 0; i < queue->length.load(memory_order_relaxed); i++) {
+        if (queue->entries[i].ticket == ticket) {
+            remove_entry(queue, i);
+            removed = true;
+            break;
+        }
+    }
+    unlock_mutex(queue, removed);
+}
+
+/*
+ * acquire a flock lock in the order of the queue of the file. lock acquires the lock itself, without blocking if
+ * its argument is set. Requests that get their lock at once while the queue is empty do not change the queue.
+ * A signal interrupts the wait in the queue with EINTR, like a blocking request.
+ */
+int FairQueue::acquire(const uint64_t key[2], bool exclusive, bool nonblocking, const function<int(bool)>& lock) {
+    fair_queue_t* queue = this->find(key, false);
+    uint32_t length = queue != nullptr ? queue->length.load(memory_order_acquire) : 0;
+    // the queue may belong to another file by now
+    if (length > 0 && !has_key(queue, key)) length = 0;
+    if (nonblocking) {
+        if (length > 0 && (exclusive || queue->writers.load(memory_order_relaxed) > 0)) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+        return lock(true);
+    }
+    if (length == 0) {
+        if (lock(true) == 0) return 0;
+        if (errno != EWOULDBLOCK) return -1;
+    }
+
+    // take a ticket, a full queue leaves the order to the lock
+    queue = this->lock_queue(key, true);
+    if (queue == nullptr) return lock(false);
+    length = queue->length.load(memory_order_relaxed);
+    if (length >= FAIR_QUEUE_MAX) {
+        unlock_mutex(queue, false);
+        LOG_DEBUG("    -> fair queue is full, waiting without a place in it");
+        return lock(false);
+    }
+    uint64_t ticket = ++queue->next_ticket;
+    queue->entries[length] = {get_own_pid(), (int32_t) syscall(SYS_gettid), get_own_start_time(), ticket,
+                              exclusive, 0};
+    if (exclusive) queue->writers.fetch_add(1, memory_order_relaxed);
+    queue->length.store(length + 1, memory_order_release);
+    stats_add(STAT_FAIR_QUEUED);
+
+    // wait for the requests before this one, but check from time to time whether they are still running
+    bool changed = false;
+    while (!may_proceed(queue, ticket)) {
+        uint32_t seen = queue->wakeups.load(memory_order_acquire);
+        unlock_mutex(queue, changed);
+        struct timespec timeout = {FAIR_LIVENESS_CHECK_MS / 1000, (FAIR_LIVENESS_CHECK_MS % 1000) * 1000000L};
+        long waited = syscall(SYS_futex, (uint32_t*) &queue->wakeups, FUTEX_WAIT, seen, &timeout, nullptr, 0);
+        int error = waited == 0 ? 0 : errno;
+        if (error == EINTR) {
+            this->leave(key, ticket);
+            errno = EINTR;
+            return -1;
+        }
+        queue = this->lock_queue(key, true);
+        if (queue == nullptr) return lock(false);
+        changed = error == ETIMEDOUT && remove_dead(queue);
+    }
+    unlock_mutex(queue, changed);
+
+    // later requests wait until this one got its lock
+    int result = lock(false);
+    int saved_errno = errno;
+    this->leave(key, ticket);
+    errno = saved_errno;
+    return result;
+}
@@ -0,0 +1,90 @@
+/*
+ * Fair order of blocking flock requests, enabled with LOCALFLOCK_FAIR. Kernel locks and the lock backends grant a
+ * released lock to whichever request comes first, so a steady stream of shared locks can keep an exclusive request
+ * waiting forever. With the fair mode, a blocking request that does not get its lock at once takes a ticket in the
+ * queue of the file and waits until all requests before it are done: an exclusive request until it is the first,
+ * a shared request until no exclusive request is before it. Only then it waits for the lock itself. A waiting
+ * exclusive request therefore holds back all later requests, and new requests only pass the queue while it is
+ * empty. Non-blocking requests fail while a request in the queue would conflict with them.
+ *
+ * The queues of all files of a lock directory are kept in a POSIX shared memory segment next to the one of the
+ * ShmTable, a queue per file identified by the key of its lock. Queues are protected by robust, process-shared
+ * mutexes and waiting requests sleep on a futex of their queue. Requests of processes or threads that ended while
+ * they were queued are removed by the requests waiting behind them.
+ */
+
+#ifndef LOCALFLOCK_FAIR_QUEUE_H
+#define LOCALFLOCK_FAIR_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <pthread.h>
+
+using namespace std;
+
+// identification of the segment, it starts with "lclffair".
+#define FAIR_MAGIC 0x72696166666c636cULL
+#define FAIR_VERSION 1
+// number of files with waiting requests at the same time, queues without requests are reused by other files
+#define FAIR_QUEUES 4096
+// queues checked for the one of a file, starting at the hash of its key
+#define FAIR_PROBE_MAX 16
+// waiting requests check this often whether the requests before them are still running. Shorter than for the
+// ShmTable, a request that ended holds back all requests behind it.
+#define FAIR_LIVENESS_CHECK_MS 50
+// requests per queue, further requests wait for the lock without a place in the queue
+#define FAIR_QUEUE_MAX 32
+
+// one waiting request
+struct fair_entry_t {
+    int32_t pid;
+    int32_t tid;
+    uint64_t start_time;
+    uint64_t ticket;
+    uint32_t exclusive;
+    uint32_t reserved;
+};
+
+// the waiting requests of one file, in the order of their tickets
+struct fair_queue_t {
+    pthread_mutex_t mtx;
+    // 0 for queues that were never used
+    atomic<uint32_t> used;
+    // futex word, incremented whenever a request leaves the queue
+    atomic<uint32_t> wakeups;
+    // number of entries and of exclusive entries. Changed with mtx held, read without it by new requests.
+    atomic<uint32_t> length;
+    atomic<uint32_t> writers;
+    // key of the lock of the file, see LocalLock::key
+    atomic<uint64_t> key[2];
+    // protected by mtx
+    uint64_t next_ticket;
+    fair_entry_t entries[FAIR_QUEUE_MAX];
+};
+
+// start of the segment
+struct fair_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t queues;
+    // serializes the assignment of queues to files, never taken while a queue mutex is held.
+    pthread_mutex_t insert_mtx;
+    char reserved[80];
+};
+
+class FairQueue {
+public:
+    static FairQueue* get();
+    bool is_open() const;
+    int acquire(const uint64_t key[2], bool exclusive, bool nonblocking, const function<int(bool)>& lock);
+private:
+    FairQueue();
+    fair_queue_t* find(const uint64_t key[2], bool create);
+    fair_queue_t* lock_queue(const uint64_t key[2], bool create);
+    void leave(const uint64_t key[2], uint64_t ticket);
+    fair_header_t* header;
+    fair_queue_t* queues;
+};
+
+#endif //LOCALFLOCK_FAIR_QUEUE_H
@@ -0,0 +1,79 @@
+/*
+ * Identity of an original file for lock directories with identity naming.
+ */
+
+#include "file_identity.h"
+#include "support.h"
+#include <mutex>
+#include <cstring>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+// devices whose filesystem has no inode generations. A plain array with a mutex like the decisions of the policy,
+// so that a filesystem refusing FS_IOC_GETVERSION is asked only once.
+static dev_t no_generation[IDENTITY_CACHED_DEVICES];
+static int no_generation_used = 0;
+static mutex no_generation_mtx;
+
+/*
+ * parse a comma separated list of mount points and their names, e.g., "/data=data,/scratch=scratch". The device of
+ * each mount point is taken when the settings are read. Returns false if an entry is malformed or its mount point
+ * does not exist, the other entries are used anyway.
+ */
+bool identity_parse_devices(const char* value, vector<device_name_t>& devices) {
+    devices.clear();
+    bool ok = true;
+    string list(value);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos) end = list.size();
+        string entry = list.substr(start, end - start);
+        start = end + 1;
+        if (entry.empty()) continue;
+        size_t pos = entry.find('=');
+        struct stat st;
+        if (pos == string::npos || pos + 1 == entry.size() || stat(entry.substr(0, pos).c_str(), &st) != 0) {
+            ok = false;
+            continue;
+        }
+        uint8_t digest[16];
+        murmur3_128(entry.data() + pos + 1, entry.size() - pos - 1, digest);
+        device_name_t device = {st.st_dev, 0};
+        memcpy(&device.id, digest, sizeof(device.id));
+        devices.push_back(device);
+    }
+    return ok;
+}
+
+/*
+ * the generation of the inode of fd, 0 if its filesystem does not support it.
+ */
+static uint64_t get_generation(int fd, dev_t dev) {
+    {
+        lock_guard<mutex> guard(no_generation_mtx);
+        for (int i = 0; i < no_generation_used; i++) {
+            if (no_generation[i] == dev) return 0;
+        }
+    }
+    // the kernel writes an int, although the ioctl is declared with a long
+    int generation = 0;
+    if (ioctl(fd, FS_IOC_GETVERSION, &generation) == 0) return (uint32_t) generation;
+    if (errno != ENOTTY && errno != EINVAL && errno != EOPNOTSUPP) return 0;
+    LOG_DEBUG("    -> device {:x} has no inode generations", (unsigned long) dev);
+    lock_guard<mutex> guard(no_generation_mtx);
+    if (no_generation_used < IDENTITY_CACHED_DEVICES) no_generation[no_generation_used++] = dev;
+    return 0;
+}
+
+/*
+ * the identity of the original file fd with the result of fstat.
+ */
+file_identity_t get_file_identity(int fd, const struct stat& st) {
+    file_identity_t identity = {st.st_dev, st.st_ino, 0};
+    for (auto& device: settings->DEVICES) {
+        if (device.dev == st.st_dev) identity.device = device.id;
+    }
+    identity.generation = get_generation(fd, st.st_dev);
+    return identity;
+}
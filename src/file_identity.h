@@ -0,0 +1,43 @@
+/*
+ * Identity of an original file for lock directories with identity naming (LOCALFLOCK_NAMING=identity). Locks are
+ * named after the device, the inode and the generation of the file instead of its path, which is taken from the
+ * fstat done anyway for every new fd. Hardlinks and bind mounts of a file share its locks, renaming or deleting a
+ * locked file keeps them, and the path is not resolved at all unless LOCALFLOCK_SHOW_NAMES asks for it.
+ *
+ * Device numbers are assigned by the kernel when a filesystem is mounted and differ between hosts and remounts.
+ * LOCALFLOCK_DEVICES maps the devices of mount points to stable names, e.g., /data=data,/scratch=scratch, so that
+ * all hosts using localflock-server and all mounts of a filesystem agree on the names.
+ */
+
+#ifndef LOCALFLOCK_FILE_IDENTITY_H
+#define LOCALFLOCK_FILE_IDENTITY_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/stat.h>
+
+using namespace std;
+
+// number of devices whose support of generations is cached, further devices are asked for each new file.
+#define IDENTITY_CACHED_DEVICES 64
+
+// device of a mount point and the id derived from its stable name
+struct device_name_t {
+    dev_t dev;
+    uint64_t id;
+};
+
+// the data hashed for the name of the locks of a file
+struct file_identity_t {
+    // the mapped name of the device or its number
+    uint64_t device;
+    uint64_t inode;
+    // generation of the inode, 0 if the filesystem has none. Distinguishes files reusing the inode of deleted ones.
+    uint64_t generation;
+};
+
+bool identity_parse_devices(const char* value, vector<device_name_t>& devices);
+file_identity_t get_file_identity(int fd, const struct stat& st);
+
+#endif //LOCALFLOCK_FILE_IDENTITY_H
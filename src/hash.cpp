@@ -0,0 +1,212 @@
+/*
+ * Hash functions used to construct the names of lock files.
+ */
+
+#include "hash.h"
+#include <cstring>
+
+/*
+ * rotate left
+ */
+static inline uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * process one block of 64 bytes
+ */
+static void sha1_block(uint32_t state[5], const uint8_t* block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16
+               | (uint32_t) block[i * 4 + 2] << 8 | (uint32_t) block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t temp = rotl32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl32(b, 30);
+        b = a;
+        a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/*
+ * SHA1 as defined in FIPS 180-4. Used to name lock files in lock directories of older versions.
+ */
+void sha1(const void* data, size_t len, uint8_t digest[20]) {
+    uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    auto* bytes = (const uint8_t*) data;
+    size_t remaining = len;
+    while (remaining >= 64) {
+        sha1_block(state, bytes);
+        bytes += 64;
+        remaining -= 64;
+    }
+
+    // padding: a single one bit, zeros and the length in bits as big endian 64 bit number
+    uint8_t last[128] = {};
+    memcpy(last, bytes, remaining);
+    last[remaining] = 0x80;
+    size_t last_len = remaining < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t) len * 8;
+    for (int i = 0; i < 8; i++) last[last_len - 1 - i] = (uint8_t) (bits >> (i * 8));
+    sha1_block(state, last);
+    if (last_len == 128) sha1_block(state, last + 64);
+
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4] = (uint8_t) (state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t) (state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t) (state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t) state[i];
+    }
+}
+
+/*
+ * final mix of MurmurHash3
+ */
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/*
+ * MurmurHash3_x64_128 by Austin Appleby (public domain) with seed 0. Not cryptographic, but good enough to avoid
+ * collisions of file names and many times faster than SHA1.
+ */
+void murmur3_128(const void* data, size_t len, uint8_t digest[16]) {
+    auto* bytes = (const uint8_t*) data;
+    size_t blocks = len / 16;
+    uint64_t h1 = 0, h2 = 0;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, bytes + i * 16, 8);
+        memcpy(&k2, bytes + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const uint8_t* tail = bytes + blocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    switch (len & 15) {
+        case 15: k2 ^= (uint64_t) tail[14] << 48; [[fallthrough]];
+        case 14: k2 ^= (uint64_t) tail[13] << 40; [[fallthrough]];
+        case 13: k2 ^= (uint64_t) tail[12] << 32; [[fallthrough]];
+        case 12: k2 ^= (uint64_t) tail[11] << 24; [[fallthrough]];
+        case 11: k2 ^= (uint64_t) tail[10] << 16; [[fallthrough]];
+        case 10: k2 ^= (uint64_t) tail[9] << 8; [[fallthrough]];
+        case 9: k2 ^= (uint64_t) tail[8];
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+            [[fallthrough]];
+        case 8: k1 ^= (uint64_t) tail[7] << 56; [[fallthrough]];
+        case 7: k1 ^= (uint64_t) tail[6] << 48; [[fallthrough]];
+        case 6: k1 ^= (uint64_t) tail[5] << 40; [[fallthrough]];
+        case 5: k1 ^= (uint64_t) tail[4] << 32; [[fallthrough]];
+        case 4: k1 ^= (uint64_t) tail[3] << 24; [[fallthrough]];
+        case 3: k1 ^= (uint64_t) tail[2] << 16; [[fallthrough]];
+        case 2: k1 ^= (uint64_t) tail[1] << 8; [[fallthrough]];
+        case 1: k1 ^= (uint64_t) tail[0];
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    for (int i = 0; i < 8; i++) {
+        digest[i] = (uint8_t) (h1 >> (i * 8));
+        digest[i + 8] = (uint8_t) (h2 >> (i * 8));
+    }
+}
+
+// two hex characters for every possible byte
+struct hex_table_t {
+    char pairs[256][2];
+    constexpr hex_table_t() : pairs() {
+        const char* digits = "0123456789abcdef";
+        for (int i = 0; i < 256; i++) {
+            pairs[i][0] = digits[i >> 4];
+            pairs[i][1] = digits[i & 15];
+        }
+    }
+};
+static constexpr hex_table_t hex_table;
+
+/*
+ * calculate the hash of data and write its hex encoding to result, which needs space for HASH_MAX_HEX_LEN
+ * characters. Returns the number of characters written, without the terminating zero.
+ */
+size_t hash_hex(hash_algorithm_t algorithm, const void* data, size_t len, char* result) {
+    uint8_t digest[HASH_MAX_DIGEST_LEN];
+    size_t digest_len;
+    if (algorithm == HASH_SHA1) {
+        sha1(data, len, digest);
+        digest_len = 20;
+    } else {
+        murmur3_128(data, len, digest);
+        digest_len = 16;
+    }
+    for (size_t i = 0; i < digest_len; i++) memcpy(result + i * 2, hex_table.pairs[digest[i]], 2);
+    result[digest_len * 2] = 0;
+    return digest_len * 2;
+}
+
+/*
+ * name of an algorithm as used in the settings and in the format file of the lock directory.
+ */
+const char* hash_name(hash_algorithm_t algorithm) {
+    return algorithm == HASH_SHA1 ? "sha1" : "murmur3";
+}
+
+/*
+ * find an algorithm by its name. Returns false for unknown names.
+ */
+bool hash_from_name(const char* name, hash_algorithm_t& algorithm) {
+    if (strcmp(name, "sha1") == 0) {
+        algorithm = HASH_SHA1;
+    } else if (strcmp(name, "murmur3") == 0) {
+        algorithm = HASH_MURMUR3;
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,28 @@
+/*
+ * Hash functions used to construct the names of lock files. SHA1 is used for compatibility with lock directories
+ * created by older versions, MurmurHash3 (x64, 128 bit) is much faster and used for new lock directories. Both are
+ * computed without any memory allocation.
+ */
+
+#ifndef LOCALFLOCK_HASH_H
+#define LOCALFLOCK_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+enum hash_algorithm_t {
+    HASH_SHA1,
+    HASH_MURMUR3
+};
+
+// size of the largest digest in bytes and of its hex encoding including the terminating zero.
+#define HASH_MAX_DIGEST_LEN 20
+#define HASH_MAX_HEX_LEN (HASH_MAX_DIGEST_LEN * 2 + 1)
+
+void sha1(const void* data, size_t len, uint8_t digest[20]);
+void murmur3_128(const void* data, size_t len, uint8_t digest[16]);
+size_t hash_hex(hash_algorithm_t algorithm, const void* data, size_t len, char* result);
+const char* hash_name(hash_algorithm_t algorithm);
+bool hash_from_name(const char* name, hash_algorithm_t& algorithm);
+
+#endif //LOCALFLOCK_HASH_H
@@ -0,0 +1,338 @@
+/*
+ * Handle for one local lock file within this process.
+ */
+
+#include "local_lock.h"
+#include "support.h"
+#include "protocol.h"
+#include "lock_dir.h"
+#include "shm_table.h"
+#include "lock_client.h"
+#include "fair_queue.h"
+#include <unordered_map>
+#include <cstring>
+#include <sys/file.h>
+#include <new>
+
+// hash function for the registry
+struct file_id_hash {
+    size_t operator()(const file_id_t& id) const {
+        return hash<dev_t>()(id.dev) * 31 + hash<ino_t>()(id.ino);
+    }
+};
+
+// all LocalLocks of this process. Only used when a fd is seen for the first time and when the last fd of a
+// file is closed. The mutex is recursive, a batch holds it while it creates the lock information of many fds.
+static unordered_map<file_id_t, LocalLock*, file_id_hash> registry;
+static recursive_mutex registry_mtx;
+// whether this thread is in a batch and holds the shared lock of the protocol for it
+static thread_local bool batch_active = false;
+static thread_local bool batch_protocol_locked = false;
+// whether this process opened the protocol and checked it for old files, protected by the registry mutex.
+static bool protocol_used = false;
+
+/*
+ * the backend keeping the locks of new LocalLocks, nullptr for lock files. The lock directory is the fallback if
+ * localflock-server cannot be reached.
+ */
+static LockBackend* get_table() {
+    if (!settings->SERVER.empty()) {
+        LockClient* client = LockClient::get();
+        if (client != nullptr) return client;
+    }
+    return settings->BACKEND == BACKEND_SHM ? ShmTable::get() : nullptr;
+}
+
+/*
+ * the queue of flock requests of the lock directory, nullptr if it cannot be used.
+ */
+static FairQueue* get_fair_queue() {
+    FairQueue* queue = FairQueue::get();
+    return queue->is_open() ? queue : nullptr;
+}
+
+/*
+ * get the LocalLock for an original file. If this process has no handle for this file yet, the local lock file is
+ * created. The path of the original file is resolved if it is not given. The returned handle has a reference for the
+ * caller.
+ */
+LocalLock* LocalLock::get(int original_fd, const struct stat& st, const string& path) {
+    file_id_t id = {st.st_dev, st.st_ino};
+    lock_guard<recursive_mutex> guard(registry_mtx);
+    auto existing = registry.find(id);
+    if (existing != registry.end()) {
+        existing->second->refs++;
+        LOG_DEBUG("    -> reusing local lock file {}", existing->second->local_path);
+        return existing->second;
+    }
+    // cleanup old files from the lock directory when the first file is redirected. Only a few entries are checked
+    // here, the cost of starting a process should not depend on the history of the host. Full sweeps are done by
+    // localflock-gc.
+    LockBackend* table = get_table();
+    if (!protocol_used && table == nullptr) {
+        protocol_used = true;
+        Protocol::get()->cleanup(settings->CLEANUP_SLOTS, false);
+    }
+    auto* result = new LocalLock(original_fd, st, path, table);
+    registry[id] = result;
+    return result;
+}
+
+/*
+ * resolve the name of the original file and create the local file.
+ */
+LocalLock::LocalLock(int original_fd, const struct stat& st, const string& path, LockBackend* table)
+        : table(table), fair_queue(nullptr), refs(1), shared_count(0), inherited_fd(-1) {
+    this->id = {st.st_dev, st.st_ino};
+    this->posix_used = false;
+    this->pid = get_own_pid();
+
+    // find the original absolute path to the given file. Identity names need it only to show it.
+    bool identity = settings->NAMING == NAMING_IDENTITY;
+    this->original_path = path.empty() && (!identity || settings->SHOW_NAMES) ? get_path_for_fd(original_fd) : path;
+    file_identity_t file_identity = {};
+    if (identity) file_identity = get_file_identity(original_fd, st);
+
+    // other backends need only the key of the file
+    if (this->table != nullptr) {
+        uint8_t digest[16];
+        if (identity) murmur3_128(&file_identity, sizeof(file_identity), digest);
+        else murmur3_128(this->original_path.data(), this->original_path.size(), digest);
+        memcpy(this->key, digest, sizeof(this->key));
+        this->local_name = fmt::format("{:016x}{:016x}", this->key[0], this->key[1]);
+        this->local_path = (settings->SERVER.empty() ? "shm:" : "server:") + this->local_name;
+        this->fd = -1;
+        this->protocol_slot = -1;
+        // the queue is kept per host, localflock-server would have to keep it for all hosts
+        if (settings->FAIR && settings->SERVER.empty()) this->fair_queue = get_fair_queue();
+        return;
+    }
+
+    // make a protocol of writing this file. This is used to cleanup later. The shared lock on the protocol makes
+    // sure that no cleanup removes the file between adding it and opening it, and that no migration changes the
+    // layout of the lock directory in the meantime.
+    string name = identity ? get_local_lock_name(file_identity) : get_local_lock_name(this->original_path);
+    Protocol* proto = Protocol::get();
+    bool locked;
+    if (batch_active) {
+        // the lock is kept until the end of the batch
+        if (!batch_protocol_locked) batch_protocol_locked = proto->lock(LOCK_SH);
+        locked = false;
+    } else {
+        locked = proto->lock(LOCK_SH);
+    }
+    this->local_name = lockdir_shard_path(name, proto->levels());
+    // the queue of the file is found under the hash of the name of its lock file
+    if (settings->FAIR) {
+        uint8_t digest[16];
+        murmur3_128(name.data(), name.size(), digest);
+        memcpy(this->key, digest, sizeof(this->key));
+        this->fair_queue = get_fair_queue();
+    }
+    this->local_path = fmt::format("{}/{}", settings->LOCKDIR, this->local_name);
+    this->protocol_slot = proto->add(this->local_name);
+
+    // actually create and open the local file. If names may be shown, the original path is recorded in the file
+    // for localflock-top.
+    bool created = false;
+    this->fd = open_and_set_perm(this->local_name, true, &created);
+    if (created && settings->SHOW_NAMES && !this->original_path.empty()) {
+        if (pwrite(this->fd, this->original_path.data(), this->original_path.size(), 0) < 0) {
+            logger->warn("unable to record the original path in {}", this->local_path);
+        }
+    }
+    if (locked) proto->unlock();
+}
+
+/*
+ * close the local file. This releases all locks still held on it by this process.
+ */
+LocalLock::~LocalLock() {
+    if (this->fd >= 0) internal_fd_close(this->fd);
+    if (this->inherited_fd >= 0) internal_fd_close(this->inherited_fd);
+    if (this->protocol_slot >= 0) Protocol::get()->remove(this->protocol_slot);
+}
+
+/*
+ * start creating the LocalLocks of many files in one transaction. Until end_batch, this thread holds the registry
+ * and, once the first lock file is created, the shared lock of the protocol, which are otherwise taken for each
+ * file.
+ */
+void LocalLock::begin_batch() {
+    registry_mtx.lock();
+    batch_active = true;
+}
+
+void LocalLock::end_batch() {
+    if (batch_protocol_locked) Protocol::get()->unlock();
+    batch_protocol_locked = false;
+    batch_active = false;
+    registry_mtx.unlock();
+}
+
+/*
+ * take an additional reference
+ */
+void LocalLock::retain() {
+    lock_guard<recursive_mutex> guard(registry_mtx);
+    this->refs++;
+}
+
+/*
+ * give up a reference. The last one removes the handle from the registry and closes the local file.
+ */
+void LocalLock::release() {
+    {
+        lock_guard<recursive_mutex> guard(registry_mtx);
+        if (--this->refs > 0) return;
+        registry.erase(this->id);
+    }
+    delete this;
+}
+
+/*
+ * open a new, independent open file description of the local file, as needed for flock and OFD locks. The file is
+ * reopened through the fd of this process, a migration of the lock directory may have moved it to another name.
+ */
+int LocalLock::open_local() {
+    if (this->fd < 0) return open_and_set_perm(this->local_name, false);
+    char link[32];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", this->fd);
+    int result = open(link, O_RDWR | O_CLOEXEC);
+    // files created by older versions or other users may not be writable for us. flock works with read-only fds.
+    if (result < 0 && errno == EACCES) result = open(link, O_RDONLY | O_CLOEXEC);
+    if (result < 0) logger->error("unable to open {} again", this->local_path);
+    else internal_fd_add(result);
+    return result;
+}
+
+/*
+ * acquire the coalesced shared flock lock. Only the first holder in this process calls into the kernel and waits in
+ * the fair queue.
+ */
+int LocalLock::lock_shared(bool nonblocking) {
+    lock_guard<mutex> guard(this->mtx);
+    if (this->pid != get_own_pid()) this->separate_from_parent();
+    if (this->shared_count == 0) {
+        auto lock = [this](bool nonblocking) {
+            return this->table != nullptr ? this->table->set(this->key, {this->pid, 0, KIND_FLOCK}, F_RDLCK, 0,
+                                                             LOCK_RANGE_MAX, !nonblocking)
+                                          : originalFlock(this->fd, LOCK_SH | (nonblocking ? LOCK_NB : 0));
+        };
+        int result = this->fair_queue != nullptr ? this->fair_queue->acquire(this->key, false, nonblocking, lock)
+                                                 : lock(nonblocking);
+        if (result != 0) return result;
+    }
+    this->shared_count++;
+    return 0;
+}
+
+/*
+ * give up one coalesced shared flock lock. The kernel lock is released together with the last holder.
+ */
+int LocalLock::unlock_shared() {
+    lock_guard<mutex> guard(this->mtx);
+    if (this->shared_count == 0) return 0;
+    if (this->pid != get_own_pid()) this->separate_from_parent();
+    this->shared_count--;
+    if (this->shared_count > 0) return 0;
+    if (this->table != nullptr) {
+        return this->table->set(this->key, {this->pid, 0, KIND_FLOCK}, F_UNLCK, 0, LOCK_RANGE_MAX, false);
+    }
+    return originalFlock(this->fd, LOCK_UN);
+}
+
+/*
+ * open an own fd of the local file in a child process. The inherited fd shares the coalesced shared lock with the
+ * parent: the parent would release it for the child and the other way round. The shared locks inherited from the
+ * parent are taken again on the new fd, the inherited fd stays open like the inherited original fds. mtx has to be
+ * held by the caller. With other backends, the child takes the shared lock under its own pid.
+ */
+void LocalLock::separate_from_parent() {
+    if (this->table != nullptr) {
+        this->pid = get_own_pid();
+        if (this->shared_count > 0 &&
+            this->table->set(this->key, {this->pid, 0, KIND_FLOCK}, F_RDLCK, 0, LOCK_RANGE_MAX, false) != 0) {
+            logger->warn("unable to take the shared lock of the parent process on {}", this->local_path);
+        }
+        return;
+    }
+    int new_fd = this->open_local();
+    if (new_fd < 0) return;
+    if (this->shared_count > 0 && originalFlock(new_fd, LOCK_SH | LOCK_NB) != 0) {
+        logger->warn("unable to take the shared lock of the parent process on {}", this->local_path);
+    }
+    if (this->inherited_fd >= 0) internal_fd_close(this->inherited_fd);
+    this->inherited_fd = this->fd;
+    this->fd = new_fd;
+    this->pid = get_own_pid();
+    LOG_DEBUG("    -> child process uses fd {} for {}", new_fd, this->local_path);
+}
+
+/*
+ * keep the registry consistent while fork copies it. The registry mutex is taken before the mutex of the protocol,
+ * as in the constructor.
+ */
+void LocalLock::prepare_fork() {
+    registry_mtx.lock();
+    if (protocol_used) Protocol::get()->prepare_fork();
+}
+
+/*
+ * continue in the parent after fork.
+ */
+void LocalLock::parent_after_fork() {
+    if (protocol_used) Protocol::get()->after_fork();
+    registry_mtx.unlock();
+}
+
+/*
+ * continue in a new child process. Only the forking thread exists, mutexes held by other threads of the parent are
+ * reset. The entries of the parent in the protocol end with the parent, the child registers all its lock files
+ * again. No lock on the protocol is needed for that, the entries of the parent keep the files in the meantime.
+ */
+void LocalLock::child_after_fork() {
+    // the recursive mutex records the thread id of its owner, which is different in the child. It cannot be
+    // unlocked here and is reset instead.
+    new (&registry_mtx) recursive_mutex();
+    if (!protocol_used && settings->BACKEND == BACKEND_FILE) return;
+    Protocol* proto = Protocol::get();
+    proto->after_fork();
+    for (auto& entry: registry) {
+        LocalLock* local = entry.second;
+        new (&local->mtx) mutex();
+        // the files may have been moved by a migration since they were created
+        local->local_name = lockdir_shard_path(lockdir_flat_name(local->local_name), proto->levels());
+        local->protocol_slot = proto->add(local->local_name);
+    }
+}
+
+/*
+ * release all POSIX locks of this process on the file. The kernel does that whenever any fd of the original file
+ * is closed, but as the local fd stays open while other fds use it, we have to do it ourselves.
+ */
+void LocalLock::unlock_posix() {
+    if (!this->posix_used) return;
+    if (this->table != nullptr) {
+        this->set_posix(F_UNLCK, 0, LOCK_RANGE_MAX, false);
+        return;
+    }
+    struct flock unlock = {};
+    unlock.l_type = F_UNLCK;
+    unlock.l_whence = SEEK_SET;
+    originalFcntl(this->fd, F_SETLK, &unlock);
+}
+
+/*
+ * set or remove a POSIX lock of this process in the backend.
+ */
+int LocalLock::set_posix(short type, int64_t start, int64_t end, bool wait) {
+    return this->table->set(this->key, {get_own_pid(), 0, KIND_POSIX}, type, start, end, wait);
+}
+
+/*
+ * get a string representation for logging and debugging.
+ */
+string LocalLock::str() {
+    return fmt::format("path: {0}, local FD: {1}, local path: {2}", this->original_path, this->fd, this->local_path);
+}
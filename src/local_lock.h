@@ -0,0 +1,94 @@
+/*
+ * Handle for one local lock file within this process. All fds of the process that refer to the same original
+ * file (same device and inode) share one LocalLock, so that the lock file is resolved, registered in the protocol
+ * and opened only once per process.
+ *
+ * The kernel attaches POSIX locks (F_SETLK, ...) to the process and the inode and flock locks to the open file
+ * description. POSIX locks are therefore done on the single fd of the LocalLock. flock locks need a separate open
+ * file description for each original fd (see LockInfo). Only shared flock locks can be coalesced: as long as any
+ * fd of this process holds LOCK_SH, a single shared kernel lock on the fd of the LocalLock represents all of them.
+ *
+ * A child process inherits all handles with fork. The inherited fd of a LocalLock shares its open file description
+ * with the parent, so the child opens its own before it changes the coalesced shared lock, and registers the lock
+ * files in the protocol under its own pid.
+ *
+ * With the shared memory backend and with localflock-server, there is no local file. The locks are kept by the
+ * LockBackend under the hash of the original path or identity. The coalesced shared lock belongs to the pid of the
+ * process.
+ *
+ * With LOCALFLOCK_FAIR, flock requests that would block go through the FairQueue of the lock directory. Requests
+ * for the coalesced shared lock only do so if no other fd of the process holds it already: a thread of a process
+ * that holds the shared lock cannot wait for a queued exclusive request, which in turn waits for that process.
+ */
+
+#ifndef LOCALFLOCK_LOCAL_LOCK_H
+#define LOCALFLOCK_LOCAL_LOCK_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <sys/stat.h>
+#include "lock_backend.h"
+
+using namespace std;
+
+class FairQueue;
+
+// identity of an original file.
+struct file_id_t {
+    dev_t dev;
+    ino_t ino;
+    bool operator==(const file_id_t& other) const { return dev == other.dev && ino == other.ino; }
+};
+
+class LocalLock {
+public:
+    static LocalLock* get(int original_fd, const struct stat& st, const string& path);
+    static void begin_batch();
+    static void end_batch();
+    void retain();
+    void release();
+    int open_local();
+    int lock_shared(bool nonblocking);
+    int unlock_shared();
+    void unlock_posix();
+    int set_posix(short type, int64_t start, int64_t end, bool wait);
+    string str();
+    static void prepare_fork();
+    static void parent_after_fork();
+    static void child_after_fork();
+    file_id_t id;
+    // empty with identity naming unless names are shown or the policy resolved it
+    string original_path;
+    // name of the local file relative to LOCKDIR and the full path for messages.
+    string local_name;
+    string local_path;
+    // fd used for all POSIX locks and the coalesced shared flock lock of this process.
+    int fd;
+    // whether POSIX locks were ever requested, only then close has to release them.
+    atomic<bool> posix_used;
+    // the locks are kept by this backend under key instead of a local file, nullptr for lock files.
+    LockBackend* table;
+    // key of the locks in the backend and of the fair queue, see FairQueue. Unused for lock files without it.
+    uint64_t key[2];
+    // the queue of flock requests with LOCALFLOCK_FAIR, nullptr without it
+    FairQueue* fair_queue;
+private:
+    LocalLock(int original_fd, const struct stat& st, const string& path, LockBackend* table);
+    ~LocalLock();
+    void separate_from_parent();
+    // number of users, protected by the registry mutex.
+    int refs;
+    // protects shared_count and the transitions of the coalesced shared lock.
+    mutex mtx;
+    // number of open file descriptions currently holding a coalesced LOCK_SH.
+    int shared_count;
+    // the entry of this file in the protocol, -1 for the shared memory backend.
+    int protocol_slot;
+    // the process that opened fd. In a child process, fd is shared with the parent.
+    pid_t pid;
+    // the fd inherited from the parent, kept open as it may still hold locks of inherited fds.
+    int inherited_fd;
+};
+
+#endif //LOCALFLOCK_LOCAL_LOCK_H
@@ -3,7 +3,7 @@
  *
  * Author: Robert Redl
  *
- * Build Dependencies on Ubuntu: libspdlog-dev, libgcrypt20-dev
+ * Build Dependencies on Ubuntu: libspdlog-dev
  */
 
 // We want to find the original implementation of a function, which is not our implementation.
@@ -24,148 +24,536 @@ using namespace std;
 
 // class for lock information and other support functions
 #include "lock_info.h"
+#include "lock_table.h"
+#include "lock_client.h"
+#include "async_lock.h"
 #include "support.h"
 #include "protocol.h"
-shared_ptr<spdlog::logger> logger;
-original_flock_type originalFlock;
-original_fcntl_type originalFcntl;
-original_close_type originalClose;
-bool init_called = false;
-mutex mtx;
-
-// a dictionary to keep track of locks and one for settings. The init priority makes sure that they are
-// initialized before calling the init method.
-map<int, shared_ptr<LockInfo>> lock_map __attribute__ ((init_priority (101)));
-shared_ptr<settings_t> settings __attribute__ ((init_priority (101)));
+#include "async_log.h"
+#include "stats.h"
+#include "trace.h"
+#include "lock_wait.h"
+#include "profile.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/stat.h>
+
+// flag of close_range, only defined by glibc 2.34 and newer
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+// the pointers to the original functions are needed by every intercepted call, everything else only once a file is
+// locked. Processes that never lock a file do not read settings, create a logger or touch LOCKDIR.
+static pthread_once_t functions_once = PTHREAD_ONCE_INIT;
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+static atomic<bool> setup_done(false);
 
 /*
  * Cleanup function called when the program loading this library is closed. This is unfortunately not
  * always ensured.
  */
 void __attribute__ ((destructor)) localflock_cleanup() {
-    logger->debug("cleanup");
+    if (!setup_done.load(memory_order_acquire)) return;
+    LOG_DEBUG("cleanup");
 
     // loop over all remaining locks and remove them
-    if (lock_map.size() > 0) logger->debug("cleaning up {} locks...", lock_map.size());
-    for (const auto& one_lock: lock_map) {
-        logger->debug("removing lock for fd={0}, path={1}", one_lock.first, one_lock.second->orignal_path);
-        one_lock.second->cleanup();
-    }
+    lock_table.for_each([](int fd, LockInfo* info) {
+        LOG_DEBUG("removing lock for fd={0}, path={1}", fd, info->orignal_path);
+        info->cleanup();
+    });
+
+    // locks still held by samples count until now
+    profile_retire();
+
+    // keep the statistics of this process in the sum of all exited processes
+    stats_retire();
+
+    // write messages still waiting in the buffers of the async logger
+    async_log_shutdown();
 }
 
 /*
- * initialize internal structures and pointers to original functions
+ * fork handlers. The registry of local lock files must not change while fork copies the process. The child
+ * inherits all fds and keeps using their lock information, but only the forking thread exists in the child: pins
+ * and mutexes held by other threads of the parent are released.
  */
-void __attribute__ ((constructor (102))) localflock_init() {
-    if (init_called) return;
-    mtx.lock();
-
-    // get pointers to the original system functions.
-    originalFlock = (original_flock_type)dlsym(RTLD_NEXT, "flock");
-    originalFcntl = (original_fcntl_type)dlsym(RTLD_NEXT, "fcntl");
-    originalClose = (original_close_type)dlsym(RTLD_NEXT, "close");
-
-    // register a logger
-    logger = spdlog::stderr_logger_st("localflock");
-
-    // read settings from environment variables
-    settings = make_shared<settings_t>();
-    const char* value = getenv("LOCALFLOCK_DEBUG");
-    if (value == nullptr) {
-        settings->DEBUG = false;
-    } else {
-        settings->DEBUG = true;
-        logger->set_level(spdlog::level::debug);
+static void prepare_fork() {
+    async_lock_prepare_fork();
+    LocalLock::prepare_fork();
+    LockClient::prepare_fork();
+}
+
+static void parent_after_fork() {
+    LockClient::parent_after_fork();
+    LocalLock::parent_after_fork();
+    async_lock_parent_after_fork();
+}
+
+static void child_after_fork() {
+    lock_table.reset_in_child();
+    lock_table.for_each([](int fd, LockInfo* info) { info->reset_in_child(); });
+    LockClient::child_after_fork();
+    LocalLock::child_after_fork();
+    async_lock_child_after_fork();
+}
+
+/*
+ * initialize the logger, settings and the lock directory. Called once, on the first lock operation.
+ */
+static void localflock_setup() {
+    pthread_once(&functions_once, init_original_functions);
+
+    // register a logger and read settings from environment variables
+    create_logger("localflock");
+    read_settings();
+    stats_enable();
+    trace_enable();
+    profile_enable();
+
+    pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
+    setup_done.store(true, memory_order_release);
+}
+
+/*
+ * make sure that the original functions are known. Threads calling this concurrently wait in pthread_once, there
+ * is no polling.
+ */
+static inline void ensure_functions() {
+    pthread_once(&functions_once, init_original_functions);
+}
+
+/*
+ * make sure that the library is set up for locking.
+ */
+static inline void ensure_setup() {
+    if (__builtin_expect(setup_done.load(memory_order_acquire), 1)) return;
+    pthread_once(&setup_once, localflock_setup);
+}
+
+/*
+ * get the lock information for a fd. If this file is not already in our lock_table, it is created. The caller has
+ * to release the returned reference.
+ */
+LockInfo* get_lock_info(int fd) {
+    LockInfo* info = lock_table.acquire(fd);
+    if (info != nullptr) return info;
+
+    // store information about this files. We also create the local lock file here
+    auto* new_info = new LockInfo(fd);
+    if (new_info->local == nullptr && !new_info->native) {
+        new_info->release();
+        errno = EBADF;
+        return nullptr;
     }
-    logger->debug("LOCALFLOCK_DEBUG={}", settings->DEBUG);
-    value = getenv("LOCALFLOCK_LOCKDIR");
-    if (value == nullptr) {
-        settings->LOCKDIR = "/var/lock/localflock";
+    info = lock_table.insert(fd, new_info);
+    if (info == nullptr) {
+        logger->error("unable to track fd={}, no lock will be created!", fd);
+        new_info->release();
+        errno = ENOLCK;
+    } else if (info == new_info) {
+        LOG_DEBUG(info->str());
     } else {
-        settings->LOCKDIR = string(value);
+        // another thread was faster, only its object remains.
+        new_info->release();
     }
-    settings->PROTOCOL_FILE = fmt::format("{}/protocol", settings->LOCKDIR);
-    logger->debug("LOCALFLOCK_LOCKDIR={}", settings->LOCKDIR);
-    value = getenv("LOCALFLOCK_SHOW_NAMES");
-    if (value == nullptr) {
-        settings->SHOW_NAMES = false;
-        // init hashing library here
-        gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
-        gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+    return info;
+}
+
+/*
+ * give up a reference to lock information without changing errno of the operation before.
+ */
+void release_lock_info(LockInfo* info) {
+    int saved_errno = errno;
+    info->release();
+    errno = saved_errno;
+}
+
+/*
+ * forget the lock information of a fd that is closed. The information itself stays alive as long as duplicates of
+ * the fd use it, just like the flock lock of the open file description in the kernel.
+ */
+static void forget_fd(int fd) {
+    LockInfo* info = lock_table.acquire(fd);
+    if (info == nullptr) return;
+    LOG_DEBUG("    -> {} is known!", info->orignal_path);
+    LOG_DEBUG("    -> {} is also closed!", info->local_path);
+    if (trace_active) trace_close(fd, info);
+    if (profile_active) profile_closing(info);
+    // like the kernel, release all POSIX locks of this process on the file when any of its fds is closed.
+    if (info->local != nullptr) info->local->unlock_posix();
+    lock_table.remove(fd);
+    stats_add(STAT_CLOSE_TRACKED);
+    release_lock_info(info);
+    async_lock_notify();
+}
+
+/*
+ * let a new fd created by dup share the lock information of the old fd. Both refer to the same open file
+ * description, locks done through either of them are the same lock. A tracked new_fd was closed by dup2 or dup3.
+ */
+static void track_duplicate(int old_fd, int new_fd) {
+    if (lock_table.is_tracked(new_fd)) {
+        LOG_DEBUG("dup({0}, {1}) closes {1}", old_fd, new_fd);
+        forget_fd(new_fd);
+    }
+    if (!lock_table.is_tracked(old_fd)) return;
+    LockInfo* info = lock_table.acquire(old_fd);
+    if (info == nullptr) return;
+    LOG_DEBUG("dup({0}) -> {1}, sharing the lock of {2}", old_fd, new_fd, info->orignal_path);
+    if (trace_active) trace_dup(old_fd, info, new_fd);
+    LockInfo* inserted = lock_table.insert(new_fd, info);
+    if (inserted != nullptr && inserted != info) release_lock_info(inserted);
+    release_lock_info(info);
+}
+
+/*
+ * perform a flock operation on the local file, or on the original file if the policy passes it through.
+ */
+static int flock_with_info(int fd, LockInfo* info, int operation) {
+    bool blocking = (operation & LOCK_NB) == 0 && (operation & (LOCK_SH | LOCK_EX)) != 0;
+    uint64_t start = blocking || trace_active ? stats_clock() : 0;
+    if (profile_active) profile_flock_releasing(info, operation);
+    int waiting = blocking && profile_active ? profile_wait_begin(info, PROFILE_FLOCK, start) : -1;
+    int result;
+    if (info->native) {
+        LOG_DEBUG("    -> passing flock through");
+        result = originalFlock(fd, operation);
+        stats_add(STAT_PASSTHROUGH);
+    } else if (blocking && lock_wait_bounded(info)) {
+        LOG_DEBUG("    -> calling flock for local file {} with a deadline", info->local_path);
+        result = lock_wait_flock(info, operation);
     } else {
-        settings->SHOW_NAMES = true;
+        LOG_DEBUG("    -> calling flock for local file {}", info->local_path);
+        result = info->flock(operation);
     }
-    logger->debug("LOCALFLOCK_SHOW_NAMES={}", settings->SHOW_NAMES);
+    if (waiting >= 0) profile_wait_end(waiting);
+    if (profile_active && result == 0 && (operation & (LOCK_SH | LOCK_EX))) profile_flock_acquired(info, operation);
+    if (blocking) stats_add_wait(start);
+    if (trace_active) trace_flock(fd, info, operation, start, result);
+    stats_add(operation & LOCK_EX ? STAT_FLOCK_EX : operation & LOCK_SH ? STAT_FLOCK_SH : STAT_FLOCK_UN);
+    if (result != 0) stats_add(errno == EWOULDBLOCK ? STAT_WOULD_BLOCK : STAT_ERRORS);
+    else if (operation & LOCK_UN) async_lock_notify();
+    return result;
+}
+
+/*
+ * Replacement for the flock function.
+ */
+extern "C" LOCALFLOCK_EXPORT int flock(int fd, int operation) {
+    ensure_setup();
+    LOG_DEBUG("flock({0}, {1})", fd, operation);
+    LockInfo* info = get_lock_info(fd);
+    if (info == nullptr) return -1;
+    int result = flock_with_info(fd, info, operation);
+    release_lock_info(info);
+    return result;
+}
+
+// one fd of localflock_lock_many and the position of its file in the canonical order
+struct many_entry_t {
+    int fd;
+    LockInfo* info;
+    // redirected files are ordered by the name of their lock file, passed through ones after them by device and
+    // inode
+    string name;
+    dev_t dev;
+    ino_t ino;
+};
 
-    // create the local folder for locks.
-    if (!filesystem::is_directory(settings->LOCKDIR)) {
-        filesystem::create_directory(settings->LOCKDIR);
-        filesystem::permissions(settings->LOCKDIR, filesystem::perms::all);
+/*
+ * Lock many files at once with flock semantics. The lock information of all fds is created in one transaction, the
+ * files are locked in the order of their lock files, which is the same in all processes, so that processes
+ * locking overlapping sets of files cannot deadlock. If a lock cannot be acquired, the locks acquired by this call
+ * are released again. Several fds of the same open file description are locked once, exclusive locks on different
+ * open file descriptions of the same file would wait for each other and fail with EDEADLK.
+ */
+extern "C" LOCALFLOCK_EXPORT int localflock_lock_many(const int* fds, int count, int mode, int flags) {
+    ensure_setup();
+    LOG_DEBUG("localflock_lock_many({0} fds, {1}, {2})", count, mode, flags);
+    if (count < 0 || (count > 0 && fds == nullptr) || (mode != LOCK_SH && mode != LOCK_EX) || (flags & ~LOCK_NB)) {
+        errno = EINVAL;
+        return -1;
+    }
+    vector<many_entry_t> entries(count);
+    bool complete = true;
+    LocalLock::begin_batch();
+    for (int i = 0; i < count; i++) {
+        entries[i].fd = fds[i];
+        entries[i].info = get_lock_info(fds[i]);
+        if (entries[i].info == nullptr) {
+            complete = false;
+            break;
+        }
+    }
+    LocalLock::end_batch();
+    int saved_errno = errno;
+    auto release_all = [&]() {
+        for (auto& entry: entries) {
+            if (entry.info != nullptr) release_lock_info(entry.info);
+        }
+    };
+    if (!complete) {
+        release_all();
+        errno = saved_errno;
+        return -1;
     }
 
-    // cleanup old files from the lock directory.
-    Protocol* proto = new Protocol();
-    proto->cleanup();
-    proto->close();
-    delete proto;
+    for (auto& entry: entries) {
+        LockInfo* info = entry.info;
+        struct stat st = {};
+        if (info->native) fstat(entry.fd, &st);
+        entry.name = info->local != nullptr ? lockdir_flat_name(info->local->local_name) : "";
+        entry.dev = info->local != nullptr ? info->local->id.dev : st.st_dev;
+        entry.ino = info->local != nullptr ? info->local->id.ino : st.st_ino;
+    }
+    sort(entries.begin(), entries.end(), [](const many_entry_t& a, const many_entry_t& b) {
+        if (a.info->native != b.info->native) return b.info->native;
+        if (a.name != b.name) return a.name < b.name;
+        if (a.dev != b.dev) return a.dev < b.dev;
+        if (a.ino != b.ino) return a.ino < b.ino;
+        return a.info < b.info;
+    });
+    for (size_t i = 1; i < entries.size(); i++) {
+        many_entry_t& previous = entries[i - 1];
+        bool same_file = previous.dev == entries[i].dev && previous.ino == entries[i].ino &&
+                         previous.info->native == entries[i].info->native;
+        if (mode == LOCK_EX && same_file && previous.info != entries[i].info) {
+            release_all();
+            errno = EDEADLK;
+            return -1;
+        }
+    }
 
-    // now we are done with initialisation
-    init_called = true;
-    mtx.unlock();
+    // lock in order, each open file description once
+    size_t locked = 0;
+    for (; locked < entries.size(); locked++) {
+        if (locked > 0 && entries[locked].info == entries[locked - 1].info) continue;
+        if (flock_with_info(entries[locked].fd, entries[locked].info, mode | flags) != 0) break;
+    }
+    if (locked < entries.size()) {
+        saved_errno = errno;
+        LOG_DEBUG("    -> lock {} of {} failed, releasing the others", locked + 1, entries.size());
+        for (size_t i = locked; i-- > 0;) {
+            if (i > 0 && entries[i].info == entries[i - 1].info) continue;
+            flock_with_info(entries[i].fd, entries[i].info, LOCK_UN);
+        }
+        release_all();
+        errno = saved_errno;
+        return -1;
+    }
+    release_all();
+    return 0;
 }
 
 /*
- * make sure that the init function has already been called.
+ * release the flock locks of many fds. All fds are unlocked even if one of them fails, the error of the first
+ * failing one is returned.
  */
-void wait_for_init() {
-    int waited = 0;
-    while (!init_called && waited < 1000) {
-        this_thread::sleep_for(chrono::milliseconds(1));
-        waited++;
+extern "C" LOCALFLOCK_EXPORT int localflock_unlock_many(const int* fds, int count) {
+    ensure_setup();
+    LOG_DEBUG("localflock_unlock_many({0} fds)", count);
+    if (count < 0 || (count > 0 && fds == nullptr)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int result = 0;
+    int first_errno = 0;
+    for (int i = count; i-- > 0;) {
+        LockInfo* info = get_lock_info(fds[i]);
+        int error = info != nullptr ? flock_with_info(fds[i], info, LOCK_UN) : -1;
+        if (error != 0 && result == 0) {
+            result = -1;
+            first_errno = errno;
+        }
+        if (info != nullptr) release_lock_info(info);
     }
-    if (!init_called) localflock_init();
+    if (result != 0) errno = first_errno;
+    return result;
 }
 
 /*
- * Replacement for the flock function.
+ * Start acquiring the flock lock of fd without blocking. Returns the handle of the request, an eventfd that becomes
+ * readable when the request is finished, see async_lock.h.
  */
-extern "C" int flock(int fd, int operation) {
-    wait_for_init();
-    logger->debug("flock({0}, {1})", fd, operation);
-
-    // if this file is not already in our lock_map, create
-    if (lock_map.count(fd) == 0) {
-        // store information about this files. We also create the local lock file here
-        lock_map[fd] = std::make_shared<LockInfo>(fd);
-        logger->debug(lock_map[fd]->str());
+extern "C" LOCALFLOCK_EXPORT int localflock_lock_async(int fd, int mode, int timeout_ms) {
+    ensure_setup();
+    LOG_DEBUG("localflock_lock_async({0}, {1}, {2})", fd, mode, timeout_ms);
+    if (mode != LOCK_SH && mode != LOCK_EX) {
+        errno = EINVAL;
+        return -1;
     }
+    LockInfo* info = get_lock_info(fd);
+    if (info == nullptr) return -1;
+    int result = async_lock_start(fd, info, mode, timeout_ms);
+    release_lock_info(info);
+    return result;
+}
 
-    // perform the operation on the local file
-    logger->debug("    -> calling flock for local file {}", lock_map[fd]->local_path);
-    return originalFlock(lock_map[fd]->local_fd, operation);
+extern "C" LOCALFLOCK_EXPORT int localflock_async_result(int handle) {
+    ensure_setup();
+    return async_lock_result(handle);
+}
+
+extern "C" LOCALFLOCK_EXPORT int localflock_async_cancel(int handle) {
+    ensure_setup();
+    LOG_DEBUG("localflock_async_cancel({0})", handle);
+    return async_lock_cancel(handle);
+}
+
+extern "C" LOCALFLOCK_EXPORT int localflock_async_close(int handle) {
+    ensure_setup();
+    return async_lock_close(handle);
+}
+
+/*
+ * count a fcntl lock operation and its result.
+ */
+static void count_fcntl(int operation, int result) {
+    switch (operation) {
+        case F_SETLK: stats_add(STAT_FCNTL_SETLK); break;
+        case F_SETLKW: stats_add(STAT_FCNTL_SETLKW); break;
+        case F_GETLK: stats_add(STAT_FCNTL_GETLK); break;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+        case F_OFD_SETLK: stats_add(STAT_OFD_SETLK); break;
+        case F_OFD_SETLKW: stats_add(STAT_OFD_SETLKW); break;
+        case F_OFD_GETLK: stats_add(STAT_OFD_GETLK); break;
+#endif
+        default: break;
+    }
+    // F_SETLK reports conflicting locks with EACCES or EAGAIN
+    if (result != 0) stats_add(errno == EAGAIN || errno == EACCES ? STAT_WOULD_BLOCK : STAT_ERRORS);
+}
+
+
+/*
+ * positions relative to the current offset or the end of the original file mean nothing for the empty local file.
+ * They are converted to absolute positions. Returns false if the position of the original file is unknown.
+ */
+static bool make_absolute(int fd, struct flock* arg) {
+    if (arg->l_whence == SEEK_CUR) {
+        off_t position = lseek(fd, 0, SEEK_CUR);
+        if (position < 0) return false;
+        arg->l_start += position;
+    } else if (arg->l_whence == SEEK_END) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+        arg->l_start += st.st_size;
+    } else {
+        return true;
+    }
+    arg->l_whence = SEEK_SET;
+    return true;
+}
+
+/*
+ * whether a fcntl operation sets or clears a lock
+ */
+static bool is_set_operation(int operation) {
+    bool set = operation == F_SETLK || operation == F_SETLKW;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+    set = set || operation == F_OFD_SETLK || operation == F_OFD_SETLKW;
+#endif
+    return set;
+}
+
+/*
+ * pass a fcntl lock operation through to the original file with samples of its hold time.
+ */
+static int profiled_fcntl(int fd, LockInfo* info, int operation, struct flock* arg) {
+    if (!is_set_operation(operation)) return originalFcntl(fd, operation, arg);
+    bool blocking = operation == F_SETLKW;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+    blocking = blocking || operation == F_OFD_SETLKW;
+#endif
+    // samples compare absolute ranges, the caller's structure stays untouched
+    struct flock absolute = *arg;
+    if (!make_absolute(fd, &absolute)) return originalFcntl(fd, operation, arg);
+    profile_fcntl_releasing(info, operation, &absolute);
+    int waiting = blocking ? profile_wait_begin(info, PROFILE_RANGE, stats_clock()) : -1;
+    int result = originalFcntl(fd, operation, arg);
+    if (waiting >= 0) profile_wait_end(waiting);
+    if (result == 0) profile_fcntl_acquired(info, operation, &absolute);
+    return result;
 }
 
+/*
+ * perform a fcntl lock operation on the local file of fd.
+ */
+static int fcntl_lock(int fd, int operation, struct flock* arg) {
+    ensure_setup();
+    LockInfo* info = get_lock_info(fd);
+    if (info == nullptr) return -1;
+    if (info->native) {
+        LOG_DEBUG("    -> passing fcntl through");
+        uint64_t start = trace_active ? stats_clock() : 0;
+        int result = profile_active ? profiled_fcntl(fd, info, operation, arg)
+                                    : originalFcntl(fd, operation, arg);
+        if (trace_active) trace_fcntl(fd, info, operation, arg, start, result);
+        stats_add(STAT_PASSTHROUGH);
+        count_fcntl(operation, result);
+        release_lock_info(info);
+        return result;
+    }
+
+    // the caller's structure is only changed by the GETLK operations, as by the kernel
+    struct flock absolute = *arg;
+    if (!make_absolute(fd, &absolute)) {
+        release_lock_info(info);
+        return -1;
+    }
+
+    // perform the operation on the local file
+    LOG_DEBUG("    -> forwarding flock* arg for local file {}", info->local_path);
+    bool blocking = operation == F_SETLKW;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+    blocking = blocking || operation == F_OFD_SETLKW;
+#endif
+    uint64_t start = blocking || trace_active ? stats_clock() : 0;
+    if (profile_active) profile_fcntl_releasing(info, operation, &absolute);
+    int waiting = blocking && profile_active ? profile_wait_begin(info, PROFILE_RANGE, start) : -1;
+    int result = blocking && lock_wait_bounded(info) ? lock_wait_fcntl(info, operation, &absolute)
+                                                     : info->fcntl(operation, &absolute);
+    if (waiting >= 0) profile_wait_end(waiting);
+    if (profile_active && result == 0 && is_set_operation(operation)) {
+        profile_fcntl_acquired(info, operation, &absolute);
+    }
+    if (blocking) stats_add_wait(start);
+    if (trace_active) trace_fcntl(fd, info, operation, &absolute, start, result);
+    count_fcntl(operation, result);
+    bool get = operation == F_GETLK;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+    get = get || operation == F_OFD_GETLK;
+#endif
+    if (get && result == 0) *arg = absolute;
+    release_lock_info(info);
+    return result;
+}
 
 /*
  * Replacement for the fcntl function. This function is used for different things. We decide based
  * on the second argument whether to call the original fcntl on the original or the lock file.
  */
-extern "C" int fcntl(int fd, int operation, ...) {
-    wait_for_init();
-    logger->debug("fcntl({0}, {1}, ...)", fd, operation);
+static int fcntl_with_list(int fd, int operation, va_list vl) {
+    ensure_functions();
+    LOG_DEBUG("fcntl({0}, {1}, ...)", fd, operation);
     // we have to deal with a variable list of arguments. The third argument is optional.
     // and can have different types.
-    struct flock* arg_flock;
     struct f_owner_ex* arg_f_owner_ex;
     int arg_int;
     uint64_t* arg_uint64_t;
     int result = -1;
-    va_list vl;
-    va_start(vl, operation);
     switch (operation) {
-        // cases with integer argument
+        // the new fd shares the open file description and the lock information
         case F_DUPFD:
         case F_DUPFD_CLOEXEC:
+            LOG_DEBUG("    -> duplicating original file");
+            arg_int = va_arg(vl, int);
+            result = originalFcntl(fd, operation, arg_int);
+            if (result >= 0) track_duplicate(fd, result);
+            break;
+        // cases with integer argument
         case F_SETFD:
         case F_SETFL:
         case F_SETOWN:
@@ -176,7 +564,7 @@ extern "C" int fcntl(int fd, int operation, ...) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
         case F_ADD_SEALS:
 #endif
-            logger->debug("    -> forwarding integer arg for original file");
+            LOG_DEBUG("    -> forwarding integer arg for original file");
             arg_int = va_arg(vl, int);
             result = originalFcntl(fd, operation, arg_int);
             break;
@@ -186,7 +574,7 @@ extern "C" int fcntl(int fd, int operation, ...) {
         case F_SET_RW_HINT:
         case F_GET_FILE_RW_HINT:
         case F_SET_FILE_RW_HINT:
-            logger->debug("    -> forwarding uint64_t* arg for original file");
+            LOG_DEBUG("    -> forwarding uint64_t* arg for original file");
             arg_uint64_t = va_arg(vl, uint64_t*);
             result = originalFcntl(fd, operation, arg_uint64_t);
             break;
@@ -201,13 +589,13 @@ extern "C" int fcntl(int fd, int operation, ...) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
         case F_GET_SEALS:
 #endif
-            logger->debug("    -> forwarding no arg for original file");
+            LOG_DEBUG("    -> forwarding no arg for original file");
             result = originalFcntl(fd, operation, NULL);
             break;
         // cases with f_owner_ex
         case F_GETOWN_EX:
         case F_SETOWN_EX:
-            logger->debug("    -> forwarding f_owner_ex* arg for original file");
+            LOG_DEBUG("    -> forwarding f_owner_ex* arg for original file");
             arg_f_owner_ex = va_arg(vl, f_owner_ex*);
             result = originalFcntl(fd, operation, arg_f_owner_ex);
             break;
@@ -220,44 +608,200 @@ extern "C" int fcntl(int fd, int operation, ...) {
         case F_OFD_SETLKW:
         case F_OFD_GETLK:
 #endif
-            arg_flock = va_arg(vl, struct flock*);
-
-            // if this file is not already in our lock_map, create
-            if (lock_map.count(fd) == 0) {
-                // store information about this files. We also create the local lock file here
-                lock_map[fd] = std::make_shared<LockInfo>(fd);
-                logger->debug(lock_map[fd]->str());
-            }
-
-            // perform the operation on the local file
-            logger->debug("    -> forwarding flock* arg for local file {}", lock_map[fd]->local_path);
-            result = originalFcntl(lock_map[fd]->local_fd, operation, arg_flock);
+            result = fcntl_lock(fd, operation, va_arg(vl, struct flock*));
             break;
         // for the default case, we assume no argument
         default:
+            ensure_setup();
             logger->warn("    -> unknown command called on original file");
             result = originalFcntl(fd, operation);
             break;
     }
+    LOG_DEBUG("    -> result: {}", result);
+    return result;
+}
+
+extern "C" LOCALFLOCK_EXPORT int fcntl(int fd, int operation, ...) {
+    va_list vl;
+    va_start(vl, operation);
+    int result = fcntl_with_list(fd, operation, vl);
+    va_end(vl);
+    return result;
+}
+
+/*
+ * programs built with 64 bit file offsets call fcntl64, which is the same function as fcntl on 64 bit systems.
+ * __fcntl is an old alias still used by some libraries.
+ */
+extern "C" LOCALFLOCK_EXPORT int fcntl64(int fd, int operation, ...) {
+    va_list vl;
+    va_start(vl, operation);
+    int result = fcntl_with_list(fd, operation, vl);
+    va_end(vl);
+    return result;
+}
+
+extern "C" LOCALFLOCK_EXPORT int __fcntl(int fd, int operation, ...) {
+    va_list vl;
+    va_start(vl, operation);
+    int result = fcntl_with_list(fd, operation, vl);
     va_end(vl);
-    logger->debug("    -> result: {}", result);
     return result;
 }
 
+/*
+ * replacement for lockf. The C library implements it with its internal fcntl, which is not intercepted. The
+ * commands are translated to POSIX locks as done by the C library.
+ */
+static int lockf_impl(int fd, int command, off_t length) {
+    ensure_functions();
+    LOG_DEBUG("lockf({0}, {1}, {2})", fd, command, length);
+    struct flock arg = {};
+    arg.l_whence = SEEK_CUR;
+    arg.l_start = 0;
+    arg.l_len = length;
+    switch (command) {
+        case F_TEST:
+            arg.l_type = F_RDLCK;
+            if (fcntl_lock(fd, F_GETLK, &arg) != 0) return -1;
+            if (arg.l_type == F_UNLCK || arg.l_pid == getpid()) return 0;
+            errno = EACCES;
+            return -1;
+        case F_ULOCK:
+            arg.l_type = F_UNLCK;
+            return fcntl_lock(fd, F_SETLK, &arg);
+        case F_LOCK:
+            arg.l_type = F_WRLCK;
+            return fcntl_lock(fd, F_SETLKW, &arg);
+        case F_TLOCK:
+            arg.l_type = F_WRLCK;
+            return fcntl_lock(fd, F_SETLK, &arg);
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+extern "C" LOCALFLOCK_EXPORT int lockf(int fd, int command, off_t length) {
+    return lockf_impl(fd, command, length);
+}
+
+extern "C" LOCALFLOCK_EXPORT int lockf64(int fd, int command, off64_t length) {
+    return lockf_impl(fd, command, length);
+}
+
 /*
  * replacement for the close function.
  */
-extern "C" int close(int fd) {
-    wait_for_init();
-    // close the file and free the lock information if this is a known locked file.
-    if (lock_map.count(fd) > 0) {
-        logger->debug("close({0})", fd);
-        logger->debug("    -> {} is known!", lock_map[fd]->orignal_path);
-        logger->debug("    -> {} is also closed!", lock_map[fd]->local_path);
-        lock_map[fd]->cleanup();
-        lock_map.erase(fd);
+extern "C" LOCALFLOCK_EXPORT int close(int fd) {
+    ensure_functions();
+    // close the file and free the lock information if this is a known locked file. For all other fds, this is
+    // a single load from the bitmap of the lock_table.
+    if (lock_table.is_tracked(fd)) {
+        LOG_DEBUG("close({0})", fd);
+        forget_fd(fd);
     }
 
     // perform the actual close operation on the original file
     return originalClose(fd);
 }
+
+/*
+ * forget the lock information of all tracked fds in a range, in one pass over the bitmap of the lock_table.
+ */
+static void forget_range(unsigned int first, unsigned int last) {
+    bool vfork_child = false;
+    bool checked = false;
+    LocalLock* unlocked = nullptr;
+    lock_table.for_each_in_range(first, last, [&](int fd, LockInfo* info) {
+        // a child created by vfork runs in the memory of its parent, but has its own fds. Bulk closes are common
+        // between vfork and exec, they must not change the lock information of the parent.
+        if (!checked) {
+            vfork_child = getpid() != get_own_pid();
+            checked = true;
+        }
+        if (vfork_child) return;
+        LOG_DEBUG("    -> closing {} in a range", info->orignal_path);
+        if (trace_active) trace_close(fd, info);
+        if (profile_active) profile_closing(info);
+        // fds of the same file are usually next to each other, their POSIX locks are released only once
+        if (info->local != nullptr && info->local != unlocked) info->local->unlock_posix();
+        unlocked = info->local;
+        lock_table.remove(fd);
+        stats_add(STAT_CLOSE_TRACKED);
+    });
+}
+
+/*
+ * close the fds from first to last, including both, with one system call. Falls back to closing them one by one
+ * if the kernel does not support close_range.
+ */
+static int close_gap(unsigned int first, unsigned int last, int flags) {
+    if (originalCloseRange != nullptr) {
+        if (originalCloseRange(first, last, flags) == 0) return 0;
+        if (errno != ENOSYS) return -1;
+    }
+    for (unsigned int fd = first; fd <= last; fd++) {
+        if (flags & CLOSE_RANGE_CLOEXEC) originalFcntl((int) fd, F_SETFD, FD_CLOEXEC);
+        else originalClose((int) fd);
+    }
+    return 0;
+}
+
+/*
+ * replacements for the bulk close functions of glibc 2.34. The fds of the library itself are left open, the range
+ * is closed in the gaps between them. With CLOSE_RANGE_CLOEXEC, the fds are only marked to be closed by exec.
+ */
+extern "C" LOCALFLOCK_EXPORT int close_range(unsigned int first, unsigned int last, int flags) {
+    ensure_functions();
+    if (originalCloseRange == nullptr) {
+        errno = ENOSYS;
+        return -1;
+    }
+    LOG_DEBUG("close_range({0}, {1}, {2})", first, last, flags);
+    if ((flags & CLOSE_RANGE_CLOEXEC) == 0) forget_range(first, last);
+    int internal;
+    while (first <= last && (internal = next_internal_fd(first, last)) >= 0) {
+        if ((unsigned int) internal > first && close_gap(first, internal - 1, flags) != 0) return -1;
+        if ((unsigned int) internal == last) return 0;
+        first = internal + 1;
+    }
+    return first <= last ? originalCloseRange(first, last, flags) : 0;
+}
+
+extern "C" LOCALFLOCK_EXPORT void closefrom(int first) {
+    ensure_functions();
+    if (first < 0) first = 0;
+    LOG_DEBUG("closefrom({0})", first);
+    forget_range(first, ~0U);
+    int internal;
+    while ((internal = next_internal_fd(first, ~0U)) >= 0) {
+        if (internal > first) close_gap(first, internal - 1, 0);
+        first = internal + 1;
+    }
+    if (originalClosefrom != nullptr) originalClosefrom(first);
+}
+
+/*
+ * replacements for the dup functions. For untracked fds, only the bitmap of the lock_table is checked.
+ */
+extern "C" LOCALFLOCK_EXPORT int dup(int fd) {
+    ensure_functions();
+    int result = originalDup(fd);
+    if (result >= 0) track_duplicate(fd, result);
+    return result;
+}
+
+extern "C" LOCALFLOCK_EXPORT int dup2(int fd, int new_fd) {
+    ensure_functions();
+    int result = originalDup2(fd, new_fd);
+    if (result >= 0 && result != fd) track_duplicate(fd, result);
+    return result;
+}
+
+extern "C" LOCALFLOCK_EXPORT int dup3(int fd, int new_fd, int flags) {
+    ensure_functions();
+    int result = originalDup3(fd, new_fd, flags);
+    if (result >= 0) track_duplicate(fd, result);
+    return result;
+}
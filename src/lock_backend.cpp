@@ -0,0 +1,148 @@
+/*
+ * Locks kept by the library itself.
+ */
+
+#include "lock_backend.h"
+#include "support.h"
+
+/*
+ * whether a holder belongs to the owner of a request
+ */
+static bool is_own(const lock_holder_t& holder, const lock_owner_t& owner) {
+    return holder.kind == owner.kind && holder.pid == owner.pid && holder.id == owner.id &&
+           holder.session == owner.session;
+}
+
+void holders_remove(lock_holder_t* holders, uint32_t& count, uint32_t index) {
+    holders[index] = holders[--count];
+}
+
+/*
+ * index of a holder of another owner that conflicts with the request, -1 if there is none.
+ */
+int holders_conflict(const lock_holder_t* holders, uint32_t count, const lock_owner_t& owner, bool write,
+                     int64_t start, int64_t end) {
+    for (uint32_t i = 0; i < count; i++) {
+        const lock_holder_t& holder = holders[i];
+        if ((holder.kind == KIND_FLOCK) != (owner.kind == KIND_FLOCK) || is_own(holder, owner)) continue;
+        if (holder.start <= end && start <= holder.end && (write || holder.write)) return (int) i;
+    }
+    return -1;
+}
+
+/*
+ * number of additional holders needed to set the lock: the new one and own holders of another type that are split
+ * into two by it.
+ */
+uint32_t holders_needed(const lock_holder_t* holders, uint32_t count, const lock_owner_t& owner, short type,
+                        int64_t start, int64_t end) {
+    bool unlock = type == F_UNLCK;
+    uint32_t needed = unlock ? 0 : 1;
+    for (uint32_t i = 0; i < count; i++) {
+        const lock_holder_t& holder = holders[i];
+        if (!is_own(holder, owner) || (!unlock && holder.write == (type == F_WRLCK))) continue;
+        if (holder.start < start && holder.end > end) needed++;
+    }
+    return needed;
+}
+
+/*
+ * remove the range from the own holders. Returns whether anything changed. The caller made sure that there is
+ * space for split holders.
+ */
+static bool cut_range(lock_holder_t* holders, uint32_t& count, const lock_owner_t& owner, int64_t start,
+                      int64_t end) {
+    bool changed = false;
+    for (uint32_t i = 0; i < count;) {
+        lock_holder_t& holder = holders[i];
+        if (!is_own(holder, owner) || holder.end < start || holder.start > end) {
+            i++;
+            continue;
+        }
+        changed = true;
+        if (holder.start < start && holder.end > end) {
+            lock_holder_t tail = holder;
+            tail.start = end + 1;
+            holder.end = start - 1;
+            holders[count++] = tail;
+        } else if (holder.start < start) {
+            holder.end = start - 1;
+        } else if (holder.end > end) {
+            holder.start = end + 1;
+        } else {
+            holders_remove(holders, count, i);
+            continue;
+        }
+        i++;
+    }
+    return changed;
+}
+
+/*
+ * set or remove a lock of the owner without checking for conflicts. Own ranges of the same type that overlap or
+ * touch a new range are merged into it, own ranges of the other type are replaced in the range. The caller made
+ * sure that holders_needed entries are free. Returns whether anything changed.
+ */
+bool holders_set(lock_holder_t* holders, uint32_t& count, const lock_owner_t& owner, short type, int64_t start,
+                 int64_t end) {
+    if (type == F_UNLCK) return cut_range(holders, count, owner, start, end);
+    bool write = type == F_WRLCK;
+    for (uint32_t i = 0; i < count;) {
+        lock_holder_t& holder = holders[i];
+        if (is_own(holder, owner) && holder.write == write && holder.start - 1 <= end && start - 1 <= holder.end) {
+            start = min(start, holder.start);
+            end = max(end, holder.end);
+            holders_remove(holders, count, i);
+            continue;
+        }
+        i++;
+    }
+    cut_range(holders, count, owner, start, end);
+    lock_holder_t& holder = holders[count++];
+    holder = {};
+    holder.pid = owner.pid;
+    holder.kind = owner.kind;
+    holder.write = write ? 1 : 0;
+    holder.id = owner.id;
+    holder.start_time = owner.pid == get_own_pid() ? get_own_start_time() : 0;
+    holder.start = start;
+    holder.end = end;
+    holder.session = owner.session;
+    return true;
+}
+
+/*
+ * describe a conflicting lock in the result of F_GETLK
+ */
+void holders_describe(const lock_holder_t& holder, struct flock* arg) {
+    arg->l_type = holder.write ? F_WRLCK : F_RDLCK;
+    arg->l_whence = SEEK_SET;
+    arg->l_start = holder.start;
+    arg->l_len = holder.end == LOCK_RANGE_MAX ? 0 : holder.end - holder.start + 1;
+    // the kernel reports -1 for OFD locks, they do not belong to a process
+    arg->l_pid = holder.kind == KIND_OFD ? -1 : holder.pid;
+}
+
+/*
+ * convert the absolute range of a struct flock into the first and the last byte. Returns false with EINVAL if the
+ * range starts before the beginning of the file.
+ */
+bool lock_range(const struct flock* arg, int64_t& start, int64_t& end) {
+    int64_t position = arg->l_start;
+    int64_t length = arg->l_len;
+    if (length > 0) {
+        start = position;
+        end = position > LOCK_RANGE_MAX - (length - 1) ? LOCK_RANGE_MAX : position + length - 1;
+    } else if (length == 0) {
+        start = position;
+        end = LOCK_RANGE_MAX;
+    } else {
+        start = position + length;
+        end = position - 1;
+    }
+    if (start < 0) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,75 @@
+/*
+ * Lock backends that keep the locks themselves instead of using kernel locks on lock files: the ShmTable for the
+ * processes of one host and the LockClient of localflock-server for the processes of many hosts. Both implement
+ * flock and byte range locks with the same list of holders per file.
+ */
+
+#ifndef LOCALFLOCK_LOCK_BACKEND_H
+#define LOCALFLOCK_LOCK_BACKEND_H
+
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/types.h>
+
+using namespace std;
+
+// locks per file. Shared flock locks of a process are coalesced into one entry.
+#define LOCK_HOLDERS_MAX 64
+// end of a range that extends to the end of the file
+#define LOCK_RANGE_MAX INT64_MAX
+
+// lock spaces of the kernel: flock locks only conflict with flock locks, POSIX and OFD locks with each other.
+enum lock_kind_t : uint8_t {
+    KIND_FLOCK = 1,
+    KIND_POSIX = 2,
+    KIND_OFD = 3
+};
+
+// owner of a lock: the process for POSIX locks and shared flock locks, an open file description of the process
+// for OFD locks and exclusive flock locks.
+struct lock_owner_t {
+    pid_t pid;
+    uint64_t id;
+    lock_kind_t kind;
+    // the client of localflock-server, pids and ids of different hosts are independent. 0 for the ShmTable.
+    uint32_t session;
+};
+
+// one lock of a range of a file
+struct lock_holder_t {
+    int32_t pid;
+    lock_kind_t kind;
+    uint8_t write;
+    uint16_t reserved;
+    uint64_t id;
+    // start time of the process, to detect reused pids.
+    uint64_t start_time;
+    // first and last byte, both included.
+    int64_t start;
+    int64_t end;
+    uint32_t session;
+};
+
+class LockBackend {
+public:
+    virtual ~LockBackend() = default;
+    // set or remove a lock of the owner on a range, type is one of F_RDLCK, F_WRLCK and F_UNLCK. If wait is set,
+    // the caller sleeps until conflicting locks are released, otherwise EAGAIN is returned.
+    virtual int set(const uint64_t key[2], const lock_owner_t& owner, short type, int64_t start, int64_t end,
+                    bool wait) = 0;
+    // F_GETLK with the absolute range in arg
+    virtual int test(const uint64_t key[2], const lock_owner_t& owner, struct flock* arg) = 0;
+};
+
+// operations on the holders of one file
+int holders_conflict(const lock_holder_t* holders, uint32_t count, const lock_owner_t& owner, bool write,
+                     int64_t start, int64_t end);
+uint32_t holders_needed(const lock_holder_t* holders, uint32_t count, const lock_owner_t& owner, short type,
+                        int64_t start, int64_t end);
+bool holders_set(lock_holder_t* holders, uint32_t& count, const lock_owner_t& owner, short type, int64_t start,
+                 int64_t end);
+void holders_remove(lock_holder_t* holders, uint32_t& count, uint32_t index);
+void holders_describe(const lock_holder_t& holder, struct flock* arg);
+bool lock_range(const struct flock* arg, int64_t& start, int64_t& end);
+
+#endif //LOCALFLOCK_LOCK_BACKEND_H
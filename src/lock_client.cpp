@@ -0,0 +1,370 @@
+/*
+ * Client of localflock-server.
+ */
+
+#include "lock_client.h"
+#include "support.h"
+#include <new>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// the client of this process, nullptr if the server was not reachable when the first file was locked.
+static LockClient* instance = nullptr;
+static mutex instance_mtx;
+
+/*
+ * split an address into the path of a Unix socket or a host and a port. Unix sockets are given as unix:<path> or
+ * as an absolute path, IPv6 addresses in brackets, e.g., [::1]:7890.
+ */
+static bool parse_address(const string& address, string& path, string& host, string& port) {
+    if (address.compare(0, 5, "unix:") == 0 || address.compare(0, 1, "/") == 0) {
+        path = address[0] == '/' ? address : address.substr(5);
+        return !path.empty();
+    }
+    size_t colon = address.rfind(':');
+    if (colon == string::npos || colon == 0 || colon + 1 == address.size()) return false;
+    host = address.substr(0, colon);
+    if (host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    port = address.substr(colon + 1);
+    return true;
+}
+
+static bool unix_address(const string& path, struct sockaddr_un& result) {
+    if (path.size() >= sizeof(result.sun_path)) return false;
+    memset(&result, 0, sizeof(result));
+    result.sun_family = AF_UNIX;
+    memcpy(result.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+/*
+ * connect to the server. Returns the fd of the connection or -1.
+ */
+int server_connect(const string& address) {
+    string path, host, port;
+    if (!parse_address(address, path, host, port)) {
+        logger->error("invalid server address {}", address);
+        return -1;
+    }
+    if (!path.empty()) {
+        struct sockaddr_un target;
+        if (!unix_address(path, target)) return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*) &target, sizeof(target)) != 0) {
+            originalClose(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo* entry = addresses; entry != nullptr && fd < 0; entry = entry->ai_next) {
+        fd = socket(entry->ai_family, entry->ai_socktype | SOCK_CLOEXEC, entry->ai_protocol);
+        if (fd >= 0 && connect(fd, entry->ai_addr, entry->ai_addrlen) != 0) {
+            originalClose(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    // requests are small and answered one by one
+    int enabled = 1;
+    if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+    return fd;
+}
+
+/*
+ * create a listening socket for the server. bound is set to the address that clients can use, with the port that
+ * was chosen by the kernel if the port was 0. Returns the fd or -1.
+ */
+int server_listen(const string& address, string& bound) {
+    string path, host, port;
+    if (!parse_address(address, path, host, port)) {
+        logger->error("invalid server address {}", address);
+        return -1;
+    }
+    if (!path.empty()) {
+        struct sockaddr_un local;
+        if (!unix_address(path, local)) return -1;
+        // a socket left behind by a server that was killed
+        unlink(path.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*) &local, sizeof(local)) != 0 || listen(fd, SOMAXCONN) != 0) {
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        // processes of all users lock through the same server
+        chmod(path.c_str(), 0666);
+        bound = "unix:" + path;
+        return fd;
+    }
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo* addresses;
+    if (getaddrinfo(host == "*" ? nullptr : host.c_str(), port.c_str(), &hints, &addresses) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo* entry = addresses; entry != nullptr && fd < 0; entry = entry->ai_next) {
+        fd = socket(entry->ai_family, entry->ai_socktype | SOCK_CLOEXEC, entry->ai_protocol);
+        int enabled = 1;
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+        if (fd >= 0 && (bind(fd, entry->ai_addr, entry->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) return -1;
+    struct sockaddr_storage local;
+    socklen_t length = sizeof(local);
+    getsockname(fd, (struct sockaddr*) &local, &length);
+    uint16_t bound_port = local.ss_family == AF_INET6 ? ((struct sockaddr_in6*) &local)->sin6_port
+                                                      : ((struct sockaddr_in*) &local)->sin_port;
+    bound = fmt::format("{}:{}", host.find(':') == string::npos ? host : "[" + host + "]", ntohs(bound_port));
+    return fd;
+}
+
+static bool send_all(int fd, const void* data, size_t size) {
+    const char* position = (const char*) data;
+    while (size > 0) {
+        ssize_t length = send(fd, position, size, MSG_NOSIGNAL);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) return false;
+        position += length;
+        size -= length;
+    }
+    return true;
+}
+
+static bool receive_all(int fd, void* data, size_t size) {
+    char* position = (char*) data;
+    while (size > 0) {
+        ssize_t length = recv(fd, position, size, 0);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) return false;
+        position += length;
+        size -= length;
+    }
+    return true;
+}
+
+/*
+ * get the client of this process. The server is contacted when the first file is locked. If it is not reachable
+ * then, the process uses the lock directory and nullptr is returned.
+ */
+LockClient* LockClient::get() {
+    static bool tried = false;
+    lock_guard<mutex> guard(instance_mtx);
+    if (!tried) {
+        tried = true;
+        auto* client = new LockClient();
+        if (client->fd >= 0) {
+            instance = client;
+        } else {
+            logger->warn("unable to reach localflock-server at {}, using the lock directory", settings->SERVER);
+            delete client;
+        }
+    }
+    return instance;
+}
+
+LockClient::LockClient() : fd(-1), reading(false), generation(0), serial(0), session(0), partial_size(0) {
+    lock_guard<mutex> guard(this->mtx);
+    this->connect_locked(false);
+}
+
+/*
+ * connect to the server and start or resume the session. If retry is set, the server is tried again until
+ * SERVER_RECONNECT_MS have passed, e.g., while it is restarted. mtx has to be held by the caller.
+ */
+bool LockClient::connect_locked(bool retry) {
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(SERVER_RECONNECT_MS);
+    int delay_ms = 10;
+    while (true) {
+        int new_fd = server_connect(settings->SERVER);
+        server_message_t hello = {};
+        hello.type = REQUEST_HELLO;
+        hello.version = SERVER_PROTOCOL_VERSION;
+        hello.pid = get_own_pid();
+        hello.id = this->session;
+        if (new_fd >= 0 && send_all(new_fd, &hello, sizeof(hello)) && receive_all(new_fd, &hello, sizeof(hello)) &&
+            (hello.result == 0 || hello.result == ESTALE)) {
+            if (hello.result == ESTALE) {
+                logger->error("the session at localflock-server expired, the locks of this process are lost");
+            }
+            LOG_DEBUG("connected to localflock-server at {}, session {:x}", settings->SERVER, hello.id);
+            internal_fd_add(new_fd);
+            this->fd = new_fd;
+            this->session = hello.id;
+            this->partial_size = 0;
+            return true;
+        }
+        if (new_fd >= 0) originalClose(new_fd);
+        if (!retry || chrono::steady_clock::now() >= deadline) return false;
+        this_thread::sleep_for(chrono::milliseconds(delay_ms));
+        delay_ms = min(delay_ms * 2, 1000);
+    }
+}
+
+/*
+ * read the replies that are available, waiting for at least one. mtx has to be held by the caller, it is released
+ * while reading. If the connection is lost, all waiting threads send their requests again.
+ */
+void LockClient::read_replies(unique_lock<mutex>& guard) {
+    this->reading = true;
+    int connection = this->fd;
+    char buffer[sizeof(server_message_t) * 64];
+    size_t size = this->partial_size;
+    memcpy(buffer, this->partial, size);
+    guard.unlock();
+    ssize_t length;
+    do {
+        length = recv(connection, buffer + size, sizeof(buffer) - size, 0);
+    } while (length < 0 && errno == EINTR);
+    guard.lock();
+    this->reading = false;
+    if (length <= 0) {
+        logger->warn("lost the connection to localflock-server at {}", settings->SERVER);
+        internal_fd_close(connection);
+        this->fd = -1;
+        this->generation++;
+        this->partial_size = 0;
+    } else {
+        size += length;
+        size_t offset = 0;
+        for (; offset + sizeof(server_message_t) <= size; offset += sizeof(server_message_t)) {
+            server_message_t reply;
+            memcpy(&reply, buffer + offset, sizeof(reply));
+            this->replies[reply.serial] = reply;
+        }
+        this->partial_size = size - offset;
+        memcpy(this->partial, buffer + offset, this->partial_size);
+    }
+    this->replied.notify_all();
+}
+
+/*
+ * send a request and wait for its reply, which replaces the request. Returns -1 with ENOLCK if the server cannot
+ * be reached.
+ */
+int LockClient::call(server_message_t& message) {
+    unique_lock<mutex> guard(this->mtx);
+    message.serial = ++this->serial;
+    while (true) {
+        if (this->fd < 0 && !this->connect_locked(true)) {
+            errno = ENOLCK;
+            return -1;
+        }
+        uint64_t generation = this->generation;
+        if (!send_all(this->fd, &message, sizeof(message))) {
+            // a reading thread notices it as well and has to close the fd, it could be reused otherwise
+            if (this->reading) {
+                shutdown(this->fd, SHUT_RDWR);
+            } else {
+                internal_fd_close(this->fd);
+                this->fd = -1;
+                this->generation++;
+            }
+        }
+        while (this->generation == generation) {
+            auto reply = this->replies.find(message.serial);
+            if (reply != this->replies.end()) {
+                message = reply->second;
+                this->replies.erase(reply);
+                return 0;
+            }
+            if (this->reading) this->replied.wait(guard);
+            else this->read_replies(guard);
+        }
+        LOG_DEBUG("sending request {} to localflock-server again", message.serial);
+    }
+}
+
+int LockClient::set(const uint64_t key[2], const lock_owner_t& owner, short type, int64_t start, int64_t end,
+                    bool wait) {
+    server_message_t message = {};
+    message.type = REQUEST_SET;
+    message.wait = wait ? 1 : 0;
+    message.kind = owner.kind;
+    message.lock_type = type;
+    message.pid = owner.pid;
+    message.id = owner.id;
+    message.key[0] = key[0];
+    message.key[1] = key[1];
+    message.start = start;
+    message.end = end;
+    if (this->call(message) != 0) return -1;
+    if (message.result != 0) {
+        errno = message.result;
+        return -1;
+    }
+    return 0;
+}
+
+int LockClient::test(const uint64_t key[2], const lock_owner_t& owner, struct flock* arg) {
+    server_message_t message = {};
+    if (!lock_range(arg, message.start, message.end)) return -1;
+    message.type = REQUEST_TEST;
+    message.kind = owner.kind;
+    message.lock_type = arg->l_type;
+    message.pid = owner.pid;
+    message.id = owner.id;
+    message.key[0] = key[0];
+    message.key[1] = key[1];
+    if (this->call(message) != 0) return -1;
+    if (message.result != 0) {
+        errno = message.result;
+        return -1;
+    }
+    if (message.lock_type == F_UNLCK) {
+        arg->l_type = F_UNLCK;
+        return 0;
+    }
+    lock_holder_t holder = {};
+    holder.pid = message.pid;
+    holder.kind = message.kind;
+    holder.write = message.lock_type == F_WRLCK ? 1 : 0;
+    holder.start = message.start;
+    holder.end = message.end;
+    holders_describe(holder, arg);
+    return 0;
+}
+
+/*
+ * the connection must not change while fork copies the process.
+ */
+void LockClient::prepare_fork() {
+    instance_mtx.lock();
+    if (instance != nullptr) instance->mtx.lock();
+}
+
+void LockClient::parent_after_fork() {
+    if (instance != nullptr) instance->mtx.unlock();
+    instance_mtx.unlock();
+}
+
+/*
+ * a child process starts its own session. It must not read the replies of its parent, its locks belong to itself.
+ */
+void LockClient::child_after_fork() {
+    new (&instance_mtx) mutex();
+    if (instance == nullptr) return;
+    new (&instance->mtx) mutex();
+    new (&instance->replied) condition_variable();
+    if (instance->fd >= 0) internal_fd_close(instance->fd);
+    instance->fd = -1;
+    instance->reading = false;
+    instance->generation++;
+    instance->session = 0;
+    instance->replies.clear();
+    instance->partial_size = 0;
+}
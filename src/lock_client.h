@@ -0,0 +1,97 @@
+/*
+ * Lock backend for processes on many hosts: the locks are kept by localflock-server, which is reached over a Unix
+ * or TCP socket given by LOCALFLOCK_SERVER, e.g., unix:/run/localflock.sock or lockhost:7890.
+ *
+ * Each process has one connection, which is shared by its threads: requests of several threads are sent without
+ * waiting for the replies of the others, whichever thread waits reads the replies of all of them. Blocking
+ * requests are queued at the server and answered when the lock is granted. The connection belongs to a session of
+ * the server, whose locks are kept for a lease time when the connection is lost. The client connects again and
+ * resumes its session, the requests that were not answered are sent again.
+ *
+ * The client only knows the locks requested by this process. Shared flock locks are coalesced per process by the
+ * LocalLock, so further shared locks of a process need no request at all.
+ */
+
+#ifndef LOCALFLOCK_LOCK_CLIENT_H
+#define LOCALFLOCK_LOCK_CLIENT_H
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include "lock_backend.h"
+
+using namespace std;
+
+#define SERVER_PROTOCOL_VERSION 1
+// time in seconds for which the server keeps the locks of a lost connection. Default of localflock-server -L.
+#define SERVER_DEFAULT_LEASE 30
+// the client tries to connect again for this long before a request fails
+#define SERVER_RECONNECT_MS 5000
+
+enum server_request_t : uint16_t {
+    // start or resume a session. id is the session to resume or 0, the reply contains the session in id and
+    // ESTALE in result if the session to resume was gone.
+    REQUEST_HELLO = 1,
+    // set or remove a lock, answered when it is granted if wait is set
+    REQUEST_SET = 2,
+    // F_GETLK, the reply describes the conflicting lock
+    REQUEST_TEST = 3
+};
+
+// request and reply, both have the same fixed size, so that many of them can be sent and read at once.
+struct server_message_t {
+    uint16_t type;
+    uint8_t wait;
+    lock_kind_t kind;
+    // number of the request, repeated in the reply
+    uint32_t serial;
+    // F_RDLCK, F_WRLCK or F_UNLCK
+    int16_t lock_type;
+    uint16_t version;
+    // reply: 0 or an errno value
+    int32_t result;
+    int32_t pid;
+    uint32_t reserved;
+    uint64_t id;
+    uint64_t key[2];
+    int64_t start;
+    int64_t end;
+};
+static_assert(sizeof(server_message_t) == 64, "the size of server messages is part of the protocol");
+
+int server_connect(const string& address);
+int server_listen(const string& address, string& bound);
+
+class LockClient : public LockBackend {
+public:
+    static LockClient* get();
+    int set(const uint64_t key[2], const lock_owner_t& owner, short type, int64_t start, int64_t end,
+            bool wait) override;
+    int test(const uint64_t key[2], const lock_owner_t& owner, struct flock* arg) override;
+    static void prepare_fork();
+    static void parent_after_fork();
+    static void child_after_fork();
+private:
+    LockClient();
+    int call(server_message_t& message);
+    bool connect_locked(bool retry);
+    void read_replies(unique_lock<mutex>& guard);
+    // protects all members. Not held while a thread reads replies.
+    mutex mtx;
+    condition_variable replied;
+    int fd;
+    // whether a thread is reading replies
+    bool reading;
+    // incremented whenever the connection is lost, requests sent before are sent again.
+    uint64_t generation;
+    uint32_t serial;
+    // the session at the server, 0 before the first connection.
+    uint64_t session;
+    unordered_map<uint32_t, server_message_t> replies;
+    // the beginning of a reply that was not read completely
+    char partial[sizeof(server_message_t)];
+    size_t partial_size;
+};
+
+#endif //LOCALFLOCK_LOCK_CLIENT_H
@@ -0,0 +1,301 @@
+/*
+ * Format of the lock directory.
+ */
+
+#include "lock_dir.h"
+#include "support.h"
+#include "protocol.h"
+#include <dirent.h>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <sys/file.h>
+
+/*
+ * parse the content of a format file. Unknown keys are ignored.
+ */
+static bool parse_format(const char* content, lockdir_format_t& format) {
+    bool hash_found = false;
+    // version 1 has no levels, versions 1 and 2 have no backend, versions before 4 have no naming
+    format.levels = 0;
+    format.backend = BACKEND_FILE;
+    format.naming = NAMING_PATH;
+    const char* line = content;
+    while (line != nullptr && *line != 0) {
+        const char* end = strchr(line, '\n');
+        string entry = end == nullptr ? string(line) : string(line, end - line);
+        size_t pos = entry.find('=');
+        if (pos != string::npos) {
+            string key = entry.substr(0, pos);
+            string value = entry.substr(pos + 1);
+            if (key == "hash") {
+                if (!hash_from_name(value.c_str(), format.hash)) {
+                    logger->error("unknown hash algorithm {} in lock directory format", value);
+                    return false;
+                }
+                hash_found = true;
+            } else if (key == "levels") {
+                format.levels = min((uint32_t) strtoul(value.c_str(), nullptr, 10), (uint32_t) LOCKDIR_MAX_LEVELS);
+            } else if (key == "backend") {
+                if (!backend_from_name(value.c_str(), format.backend)) {
+                    logger->error("unknown backend {} in lock directory format", value);
+                    return false;
+                }
+            } else if (key == "naming") {
+                if (!naming_from_name(value.c_str(), format.naming)) {
+                    logger->error("unknown naming {} in lock directory format", value);
+                    return false;
+                }
+            }
+        }
+        line = end == nullptr ? nullptr : end + 1;
+    }
+    return hash_found;
+}
+
+/*
+ * read an existing format file. Returns false if it does not exist or is not readable.
+ */
+static bool read_format(const string& path, lockdir_format_t& format) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    char content[1024];
+    ssize_t length = read(fd, content, sizeof(content) - 1);
+    originalClose(fd);
+    if (length <= 0) return false;
+    content[length] = 0;
+    return parse_format(content, format);
+}
+
+/*
+ * write a format file under a temporary name, which is returned. The caller moves it to its final name.
+ */
+static string write_format(const string& lockdir, const lockdir_format_t& format) {
+    string temp_path = fmt::format("{}/format.{}", lockdir, getpid());
+    int fd = open(temp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        logger->error("unable to create format file in {}", lockdir);
+        return "";
+    }
+    dprintf(fd, "version=%d\nhash=%s\nlevels=%u\nbackend=%s\nnaming=%s\n", LOCKDIR_FORMAT_VERSION,
+            hash_name(format.hash), format.levels, backend_name(format.backend), naming_name(format.naming));
+    fchmod(fd, 0644);
+    originalClose(fd);
+    return temp_path;
+}
+
+/*
+ * check whether the directory was used before without a format file, i.e., by an older version.
+ */
+static bool is_used_without_format(const string& lockdir) {
+    DIR* dir = opendir(lockdir.c_str());
+    if (dir == nullptr) return false;
+    bool used = false;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_name[0] == '.' || strncmp(entry->d_name, "format", 6) == 0) continue;
+        used = true;
+        break;
+    }
+    closedir(dir);
+    return used;
+}
+
+/*
+ * name of a backend as used in the format file and in LOCALFLOCK_BACKEND
+ */
+const char* backend_name(lock_backend_t backend) {
+    return backend == BACKEND_SHM ? "shm" : "file";
+}
+
+bool backend_from_name(const char* name, lock_backend_t& backend) {
+    if (strcmp(name, "file") == 0) backend = BACKEND_FILE;
+    else if (strcmp(name, "shm") == 0) backend = BACKEND_SHM;
+    else return false;
+    return true;
+}
+
+/*
+ * name of a naming as used in the format file and in LOCALFLOCK_NAMING
+ */
+const char* naming_name(lock_naming_t naming) {
+    return naming == NAMING_IDENTITY ? "identity" : "path";
+}
+
+bool naming_from_name(const char* name, lock_naming_t& naming) {
+    if (strcmp(name, "path") == 0) naming = NAMING_PATH;
+    else if (strcmp(name, "identity") == 0) naming = NAMING_IDENTITY;
+    else return false;
+    return true;
+}
+
+/*
+ * get the format of the lock directory. If the directory has no format yet, the requested format is recorded,
+ * unless the directory was already used by an older version, which always used SHA1 and a flat directory.
+ */
+lockdir_format_t get_lockdir_format(const string& lockdir, const lockdir_format_t& requested) {
+    string path = fmt::format("{}/format", lockdir);
+    lockdir_format_t result = requested;
+    if (read_format(path, result)) return result;
+
+    result = requested;
+    if (is_used_without_format(lockdir)) {
+        LOG_DEBUG("{} was used by an older version, keeping flat SHA1 names", lockdir);
+        result.hash = HASH_SHA1;
+        result.levels = 0;
+        result.backend = BACKEND_FILE;
+        result.naming = NAMING_PATH;
+    }
+
+    // write the new file under a temporary name and link it. Only one process can succeed, all others read the
+    // format of the winner.
+    string temp_path = write_format(lockdir, result);
+    if (temp_path.empty()) return result;
+    if (link(temp_path.c_str(), path.c_str()) == 0) {
+        LOG_DEBUG("created lock directory format with {} names in {} levels, backend {}, naming {}",
+                  hash_name(result.hash), result.levels, backend_name(result.backend), naming_name(result.naming));
+    } else if (!read_format(path, result)) {
+        logger->error("unable to read format file {}", path);
+    }
+    unlink(temp_path.c_str());
+    return result;
+}
+
+/*
+ * path of a lock file relative to LOCKDIR. Each level is named after two hex digits of the MurmurHash3 of the name,
+ * which is independent of the hash used for the name itself and works for names shown with LOCALFLOCK_SHOW_NAMES.
+ */
+string lockdir_shard_path(const string& name, uint32_t levels) {
+    if (levels == 0) return name;
+    char digest[HASH_MAX_HEX_LEN];
+    hash_hex(HASH_MURMUR3, name.data(), name.size(), digest);
+    string result;
+    result.reserve(levels * 3 + name.size());
+    for (uint32_t level = 0; level < levels; level++) {
+        result.append(digest + level * 2, 2);
+        result += '/';
+    }
+    return result + name;
+}
+
+/*
+ * create the subdirectories of a lock file relative to LOCKDIR. They are writable for everyone, like LOCKDIR.
+ */
+int lockdir_create_parents(const string& path) {
+    for (size_t end = path.find('/'); end != string::npos; end = path.find('/', end + 1)) {
+        string directory = path.substr(0, end);
+        if (mkdirat(settings->LOCKDIR_FD, directory.c_str(), 0777) == 0) {
+            // the mode given to mkdirat is reduced by the umask
+            fchmodat(settings->LOCKDIR_FD, directory.c_str(), 0777, 0);
+        } else if (errno != EEXIST) {
+            logger->error("unable to create {}/{}", settings->LOCKDIR, directory);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * whether a name directly in LOCKDIR belongs to the library itself and is not a lock file or lock subdirectory
+ */
+static bool is_internal_name(const string& name) {
+    return name == PROTOCOL_NAME || name == "stats" || name.compare(0, 6, "format") == 0;
+}
+
+/*
+ * call file for all lock files in LOCKDIR and directory for all subdirectories, with names relative to LOCKDIR.
+ * Subdirectories are reported after their content. The inode is taken from the directory entry.
+ */
+static void for_each_entry(const string& directory, uint32_t depth, const function<void(const string&, ino_t)>& file,
+                           const function<void(const string&)>& subdirectory) {
+    string path = directory.empty() ? settings->LOCKDIR : settings->LOCKDIR + "/" + directory;
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (depth == 0 && is_internal_name(entry->d_name)) continue;
+        string name = directory.empty() ? string(entry->d_name) : directory + "/" + entry->d_name;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(settings->LOCKDIR_FD, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_REG) {
+            file(name, entry->d_ino);
+        } else if (type == DT_DIR && depth < LOCKDIR_MAX_LEVELS) {
+            for_each_entry(name, depth + 1, file, subdirectory);
+            subdirectory(name);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * call file for each lock file in LOCKDIR, in any layout. Files are reported with their name relative to LOCKDIR and
+ * their inode.
+ */
+void lockdir_for_each_file(const function<void(const string&, ino_t)>& file) {
+    for_each_entry("", 0, file, [](const string&) {});
+}
+
+/*
+ * the name of a lock file without its subdirectories
+ */
+string lockdir_flat_name(const string& path) {
+    size_t slash = path.rfind('/');
+    return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+/*
+ * move all lock files into a layout with the given number of levels. No process can create or remove a lock file
+ * while the exclusive lock of the protocol is held, processes holding locks keep them, as the inodes stay the same.
+ * The format file is replaced and the protocol header tells running processes about the new layout.
+ */
+lockdir_migration_t lockdir_migrate(uint32_t levels) {
+    lockdir_migration_t result = {0, 0, 0};
+    Protocol* proto = Protocol::get();
+    if (!proto->is_open() || !proto->lock(LOCK_EX)) {
+        logger->error("unable to lock the protocol, the lock directory is not migrated");
+        result.failed = 1;
+        return result;
+    }
+    result.old_levels = proto->levels();
+    if (result.old_levels == levels) {
+        proto->unlock();
+        return result;
+    }
+
+    vector<string> files, directories;
+    for_each_entry("", 0, [&](const string& name, ino_t) { files.push_back(name); },
+                   [&](const string& name) { directories.push_back(name); });
+    for (auto& file: files) {
+        string target = lockdir_shard_path(lockdir_flat_name(file), levels);
+        if (target == file) continue;
+        if (lockdir_create_parents(target) != 0 ||
+            renameat2(settings->LOCKDIR_FD, file.c_str(), settings->LOCKDIR_FD, target.c_str(), RENAME_NOREPLACE) != 0) {
+            logger->error("unable to move {}/{} to {}", settings->LOCKDIR, file, target);
+            result.failed++;
+            continue;
+        }
+        LOG_DEBUG("moved {} to {}", file, target);
+        result.moved++;
+    }
+    proto->rename_entries([levels](const char* name) { return lockdir_shard_path(lockdir_flat_name(name), levels); });
+
+    // the format file is replaced atomically, processes starting now read the new layout
+    lockdir_format_t format = {settings->HASH, levels, settings->BACKEND, settings->NAMING};
+    string temp_path = write_format(settings->LOCKDIR, format);
+    string path = fmt::format("{}/format", settings->LOCKDIR);
+    if (temp_path.empty() || rename(temp_path.c_str(), path.c_str()) != 0) {
+        logger->error("unable to replace {}", path);
+    }
+    proto->set_levels(levels);
+    settings->LEVELS = levels;
+
+    // subdirectories not used by the new layout are empty now
+    for (auto& directory: directories) unlinkat(settings->LOCKDIR_FD, directory.c_str(), AT_REMOVEDIR);
+    proto->unlock();
+    return result;
+}
@@ -0,0 +1,76 @@
+/*
+ * The lock directory records the format of its lock files in $LOCKDIR/format. The format is fixed when the first
+ * process uses a new directory, all later processes follow it independent of their own settings. Otherwise, two
+ * processes could use different lock files for the same original file.
+ *
+ * Lock files of new directories are spread over subdirectories named after a hash of the lock file name, e.g.,
+ * $LOCKDIR/3f/a0/<name> with two levels, so that no directory holds more than a few entries even with millions of
+ * lock files. Directories of older versions stay flat until they are migrated with localflock-gc -m, which renames
+ * all lock files while holding the exclusive lock of the protocol. Renaming keeps the inodes, running processes keep
+ * their locks, and the new layout is announced in the protocol header to processes that read the format before.
+ *
+ * The format also records the backend: lock files or a table in shared memory (see ShmTable), and whether locks are
+ * named after the path or the identity of the original file (see file_identity.h). Processes using different
+ * backends or names would not see each other's locks.
+ */
+
+#ifndef LOCALFLOCK_LOCK_DIR_H
+#define LOCALFLOCK_LOCK_DIR_H
+
+#include <string>
+#include <functional>
+#include <sys/types.h>
+#include "hash.h"
+using namespace std;
+
+// version of the format file. Version 1 has no levels, the lock files are directly in LOCKDIR. Version 2 has no
+// backend, it always uses lock files. Version 3 has no naming, it always names locks after the path.
+#define LOCKDIR_FORMAT_VERSION 4
+// levels of subdirectories of new lock directories, can be changed with LOCALFLOCK_SHARD_LEVELS.
+#define LOCKDIR_DEFAULT_LEVELS 2
+// each level has 256 subdirectories
+#define LOCKDIR_MAX_LEVELS 4
+
+// where the locks of a lock directory are kept
+enum lock_backend_t {
+    BACKEND_FILE,
+    BACKEND_SHM
+};
+
+// what the names of locks are derived from
+enum lock_naming_t {
+    NAMING_PATH,
+    NAMING_IDENTITY
+};
+
+struct lockdir_format_t {
+    // algorithm used for the names of lock files
+    hash_algorithm_t hash;
+    // number of subdirectory levels, 0 for a flat directory
+    uint32_t levels;
+    lock_backend_t backend;
+    lock_naming_t naming;
+};
+
+// result of a migration
+struct lockdir_migration_t {
+    // levels before the migration
+    uint32_t old_levels;
+    // number of lock files moved
+    uint32_t moved;
+    // number of lock files that could not be moved
+    uint32_t failed;
+};
+
+const char* backend_name(lock_backend_t backend);
+bool backend_from_name(const char* name, lock_backend_t& backend);
+const char* naming_name(lock_naming_t naming);
+bool naming_from_name(const char* name, lock_naming_t& naming);
+lockdir_format_t get_lockdir_format(const string& lockdir, const lockdir_format_t& requested);
+string lockdir_shard_path(const string& name, uint32_t levels);
+string lockdir_flat_name(const string& path);
+int lockdir_create_parents(const string& path);
+void lockdir_for_each_file(const function<void(const string&, ino_t)>& file);
+lockdir_migration_t lockdir_migrate(uint32_t levels);
+
+#endif //LOCALFLOCK_LOCK_DIR_H
@@ -4,27 +4,40 @@
 
 #include "lock_info.h"
 #include "support.h"
-#include "protocol.h"
+#include "policy.h"
+#include "proc_locks.h"
+#include "lock_dir.h"
+#include "hash.h"
+#include "profile.h"
+#include "fair_queue.h"
+#include <cstring>
+#include <sys/file.h>
+#include <new>
 
-LockInfo::LockInfo(int original_fd) {
+LockInfo::LockInfo(int original_fd) : local_fd(-1), local(nullptr), native(false), wait_deadline_ms(0), dev(0),
+                                      ino(0), id(0), ofd_used(false), refs(1), state(FLOCK_UNLOCKED) {
     this->original_fd = original_fd;
+    this->pid = get_own_pid();
 
-    // find the original absolute path to the given file
-    this->orignal_path = get_path_for_fd(original_fd);
-
-    // construct the name used for the local lock file
-    this->local_path = get_local_lock_path(this->orignal_path);
-
-    // make a protocol of writing this file. This is used to cleanup later
-    Protocol* proto = new Protocol();
-    proto->add(this->local_path);
-
-    // actually create and open the local file
-    this->local_fd = open_and_set_perm(this->local_path);
-
-    // close the protocol and release the lock
-    proto->close();
-    delete proto;
+    // the identity of the original file decides which local lock file is used. All fds of this process referring
+    // to the same file share the local lock file.
+    struct stat st;
+    if (fstat(original_fd, &st) != 0) {
+        logger->warn("LockInfo: unable to stat fd {}, no lock will be created!", original_fd);
+        return;
+    }
+    this->dev = st.st_dev;
+    this->ino = st.st_ino;
+    // filesystems with working locks are not redirected
+    string path;
+    if (!policy_redirect(original_fd, st, path)) {
+        this->native = true;
+        return;
+    }
+    this->local = LocalLock::get(original_fd, st, path);
+    this->orignal_path = this->local->original_path;
+    this->local_path = this->local->local_path;
+    this->wait_deadline_ms = policy_wait_deadline(original_fd, path.empty() ? this->orignal_path : path);
 }
 
 /*
@@ -32,12 +45,14 @@ LockInfo::LockInfo(int original_fd) {
  */
 LockInfo::~LockInfo() {
     this->cleanup();
+    if (this->local != nullptr) this->local->release();
 }
 
 /*
  * get a string representation of the lock information for logging and debugging.
  */
 string LockInfo::str() {
+    if (this->native) return fmt::format("Lock-Information:\n    -> orig. FD: {0}, passed through", this->original_fd);
     return fmt::format("Lock-Information:\n    -> orig. FD: {0}, path: {1}\n    -> local FD: {2}, path: {3}",
             this->original_fd,
             this->orignal_path,
@@ -46,11 +61,236 @@ string LockInfo::str() {
 }
 
 /*
- * if open, close the local file
+ * if open, close the local file and give up a coalesced shared lock. Exclusive flock and OFD locks in a LockBackend
+ * are released only by the process that created them, a child process closing an inherited fd keeps them like the
+ * kernel keeps the lock of an open file description that is still open elsewhere.
  */
 void LockInfo::cleanup() {
-    if (this->local_fd > 0) {
-        originalClose(this->local_fd);
+    // the flock and OFD locks of the open file description end with it
+    if (profile_active && profile_holding.load(memory_order_relaxed) != 0) profile_end_owner(this);
+    lock_guard<mutex> guard(this->mtx);
+    if (this->state == FLOCK_SHARED) this->local->unlock_shared();
+    LockBackend* table = this->local != nullptr ? this->local->table : nullptr;
+    if (table != nullptr && this->pid == get_own_pid()) {
+        if (this->state == FLOCK_EXCLUSIVE) this->unlock_exclusive();
+        if (this->ofd_used) {
+            table->set(this->local->key, this->table_owner(KIND_OFD), F_UNLCK, 0, LOCK_RANGE_MAX, false);
+        }
+    }
+    this->state = FLOCK_UNLOCKED;
+    if (this->local_fd >= 0) {
+        internal_fd_close(this->local_fd);
         this->local_fd = -1;
     }
-}
\ No newline at end of file
+}
+
+/*
+ * take an additional reference
+ */
+void LockInfo::retain() {
+    this->refs.fetch_add(1, memory_order_relaxed);
+}
+
+/*
+ * give up a reference, the last one deletes the object and closes the local file.
+ */
+void LockInfo::release() {
+    if (this->refs.fetch_sub(1, memory_order_acq_rel) == 1) delete this;
+}
+
+/*
+ * forget the state of the mutex after fork. A thread of the parent may have held it, e.g., while waiting for a lock,
+ * but only the forking thread exists in the child.
+ */
+void LockInfo::reset_in_child() {
+    new (&this->mtx) mutex();
+}
+
+/*
+ * open the own open file description of the local file if not yet done. mtx has to be held by the caller.
+ */
+int LockInfo::get_local_fd() {
+    if (this->local_fd < 0) this->local_fd = this->local->open_local();
+    return this->local_fd;
+}
+
+/*
+ * owner of exclusive flock and OFD locks in a LockBackend: this open file description of the creating process.
+ */
+lock_owner_t LockInfo::table_owner(lock_kind_t kind) {
+    return {this->pid, (uint64_t) (uintptr_t) this, kind};
+}
+
+/*
+ * acquire the exclusive flock lock of this open file description. mtx has to be held by the caller.
+ */
+int LockInfo::lock_exclusive(int operation) {
+    LockBackend* table = this->local->table;
+    auto lock = [&](bool nonblocking) {
+        if (table != nullptr) {
+            return table->set(this->local->key, this->table_owner(KIND_FLOCK), F_WRLCK, 0, LOCK_RANGE_MAX,
+                              !nonblocking);
+        }
+        return originalFlock(this->local_fd, LOCK_EX | (nonblocking ? LOCK_NB : 0));
+    };
+    bool nonblocking = (operation & LOCK_NB) != 0;
+    FairQueue* queue = this->local->fair_queue;
+    return queue != nullptr ? queue->acquire(this->local->key, true, nonblocking, lock) : lock(nonblocking);
+}
+
+/*
+ * release the exclusive flock lock of this open file description. mtx has to be held by the caller.
+ */
+int LockInfo::unlock_exclusive() {
+    LockBackend* table = this->local->table;
+    if (table != nullptr) {
+        return table->set(this->local->key, this->table_owner(KIND_FLOCK), F_UNLCK, 0, LOCK_RANGE_MAX, false);
+    }
+    return originalFlock(this->local_fd, LOCK_UN);
+}
+
+/*
+ * perform a flock operation. Shared locks are coalesced with all other fds of this process holding a shared lock
+ * on the same file, exclusive locks are done on the own open file description. As for the kernel, converting a
+ * lock is not atomic: the existing lock is removed before the new one is acquired.
+ */
+int LockInfo::flock(int operation) {
+    lock_guard<mutex> guard(this->mtx);
+    bool nonblocking = (operation & LOCK_NB) != 0;
+    int result = 0;
+    switch (operation & ~LOCK_NB) {
+        case LOCK_SH:
+            if (this->state == FLOCK_SHARED) return 0;
+            if (this->state == FLOCK_EXCLUSIVE) {
+                this->unlock_exclusive();
+                this->state = FLOCK_UNLOCKED;
+            }
+            result = this->local->lock_shared(nonblocking);
+            if (result == 0) this->state = FLOCK_SHARED;
+            break;
+        case LOCK_EX:
+            if (this->state == FLOCK_EXCLUSIVE) return 0;
+            if (this->local->table == nullptr && this->get_local_fd() < 0) return -1;
+            if (this->state == FLOCK_SHARED) {
+                this->local->unlock_shared();
+                this->state = FLOCK_UNLOCKED;
+            }
+            result = this->lock_exclusive(operation);
+            if (result == 0) this->state = FLOCK_EXCLUSIVE;
+            break;
+        case LOCK_UN:
+            if (this->state == FLOCK_SHARED) result = this->local->unlock_shared();
+            else if (this->state == FLOCK_EXCLUSIVE) result = this->unlock_exclusive();
+            this->state = FLOCK_UNLOCKED;
+            break;
+        default:
+            errno = EINVAL;
+            result = -1;
+            break;
+    }
+    return result;
+}
+
+/*
+ * perform a fcntl lock operation. POSIX locks belong to the process and are done on the fd of the LocalLock, OFD
+ * locks belong to the open file description and are done on the own local fd.
+ */
+int LockInfo::fcntl(int operation, struct flock* arg) {
+    if (this->local->table != nullptr) return this->table_fcntl(operation, arg);
+    switch (operation) {
+        case F_SETLK:
+        case F_SETLKW:
+            this->local->posix_used = true;
+            [[fallthrough]];
+        case F_GETLK:
+            return originalFcntl(this->local->fd, operation, arg);
+        default: {
+            lock_guard<mutex> guard(this->mtx);
+            if (this->get_local_fd() < 0) return -1;
+        }
+            return originalFcntl(this->local_fd, operation, arg);
+    }
+}
+
+/*
+ * perform a fcntl lock operation in the LockBackend. POSIX locks belong to the process, OFD locks to this open file
+ * description. arg contains an absolute range.
+ */
+int LockInfo::table_fcntl(int operation, struct flock* arg) {
+    bool ofd = operation != F_SETLK && operation != F_SETLKW && operation != F_GETLK;
+    lock_owner_t owner = ofd ? this->table_owner(KIND_OFD) : lock_owner_t{get_own_pid(), 0, KIND_POSIX};
+    LockBackend* table = this->local->table;
+    if (operation == F_GETLK || operation == F_OFD_GETLK) return table->test(this->local->key, owner, arg);
+    if (arg->l_type != F_RDLCK && arg->l_type != F_WRLCK && arg->l_type != F_UNLCK) {
+        errno = EINVAL;
+        return -1;
+    }
+    int64_t start, end;
+    if (!lock_range(arg, start, end)) return -1;
+    if (ofd) {
+        lock_guard<mutex> guard(this->mtx);
+        this->ofd_used = true;
+    } else {
+        this->local->posix_used = true;
+    }
+    bool wait = operation == F_SETLKW || operation == F_OFD_SETLKW;
+    return table->set(this->local->key, owner, arg->l_type, start, end, wait);
+}
+
+/*
+ * name of the lock in messages, traces and profiles: the name of the lock file without subdirectories, or device and
+ * inode of the original file for locks passed through. The same in all processes using the same lock directory.
+ */
+string LockInfo::lock_name() {
+    if (this->local != nullptr) return lockdir_flat_name(this->local->local_name);
+    return fmt::format("{:x}:{}", this->dev, this->ino);
+}
+
+/*
+ * 64 bit hash of the lock name, computed once.
+ */
+uint64_t LockInfo::file_id() {
+    uint64_t result = this->id.load(memory_order_relaxed);
+    if (result != 0) return result;
+    string name = this->lock_name();
+    uint8_t digest[16];
+    murmur3_128(name.data(), name.size(), digest);
+    memcpy(&result, digest, sizeof(result));
+    result |= 1;
+    this->id.store(result, memory_order_relaxed);
+    return result;
+}
+
+/*
+ * a process holding a flock lock that conflicts with LOCK_EX on this file, for messages about long waits. 0 if
+ * there is none anymore.
+ */
+pid_t LockInfo::flock_holder() {
+    struct flock arg = {};
+    arg.l_type = F_WRLCK;
+    arg.l_whence = SEEK_SET;
+    LockBackend* table = this->local->table;
+    if (table != nullptr) {
+        if (table->test(this->local->key, this->table_owner(KIND_FLOCK), &arg) != 0) return 0;
+        return arg.l_type == F_UNLCK ? 0 : arg.l_pid;
+    }
+    // the kernel does not report flock locks with F_GETLK, only in /proc/locks
+    struct stat st;
+    vector<proc_lock_t> locks;
+    if (fstat(this->local->fd, &st) != 0 || !read_proc_locks(locks, st.st_dev, true)) return 0;
+    for (auto& lock: locks) {
+        if (lock.ino == st.st_ino && lock.kind == PROC_LOCK_FLOCK && !lock.waiting) return lock.pid;
+    }
+    return 0;
+}
+
+/*
+ * a process holding a lock that conflicts with the fcntl lock request in arg, -1 for OFD locks and 0 if there is
+ * none anymore.
+ */
+pid_t LockInfo::range_holder(int operation, const struct flock* arg) {
+    struct flock test = *arg;
+    bool posix = operation == F_SETLK || operation == F_SETLKW;
+    if (this->fcntl(posix ? F_GETLK : F_OFD_GETLK, &test) != 0) return 0;
+    return test.l_type == F_UNLCK ? 0 : test.l_pid;
+}
@@ -6,21 +6,73 @@
 #define LOCALFLOCK_LOCK_INFO_H
 
 #include <string>
+#include <atomic>
+#include <mutex>
 #include <fcntl.h>
-#include <fcntl.h>
+#include "local_lock.h"
+#include "lock_backend.h"
 
 using namespace std;
 
+// state of the flock lock of one original fd.
+enum flock_state_t {
+    FLOCK_UNLOCKED,
+    // LOCK_SH is held as part of the coalesced shared lock of the LocalLock.
+    FLOCK_SHARED,
+    // LOCK_EX is held on the own local_fd or in the LockBackend.
+    FLOCK_EXCLUSIVE
+};
+
 class LockInfo {
 public:
     LockInfo(int original_fd);
     ~LockInfo();
     string str();
     void cleanup();
+    void retain();
+    void release();
+    void reset_in_child();
+    int flock(int operation);
+    int fcntl(int operation, struct flock* arg);
+    uint64_t file_id();
+    string lock_name();
+    pid_t flock_holder();
+    pid_t range_holder(int operation, const struct flock* arg);
+    // the fd this object was created for. Duplicates of it share the object, as they share the open file
+    // description and with it the flock lock.
     int original_fd;
     string orignal_path;
+    // own open file description of the local file, only opened when needed for LOCK_EX or OFD locks.
     int local_fd;
     string local_path;
+    // the shared handle for the local lock file, nullptr if the original fd could not be resolved or if the locks
+    // are passed through.
+    LocalLock* local;
+    // the policy passes the locks of this fd through to the original file.
+    bool native;
+    // deadline of blocking requests in milliseconds, 0 waits forever.
+    uint32_t wait_deadline_ms;
+private:
+    int get_local_fd();
+    int lock_exclusive(int operation);
+    int unlock_exclusive();
+    int table_fcntl(int operation, struct flock* arg);
+    lock_owner_t table_owner(lock_kind_t kind);
+    // the process that created this object. With a LockBackend, exclusive flock and OFD locks belong to it, also
+    // when a child process inherited the fd.
+    pid_t pid;
+    // identity of the original file, for locks passed through
+    dev_t dev;
+    ino_t ino;
+    // hash of lock_name, 0 until it is needed.
+    atomic<uint64_t> id;
+    // whether OFD locks were ever set in a LockBackend, they are released by cleanup.
+    bool ofd_used;
+    // number of references, the object is deleted when the last one is released.
+    atomic<int> refs;
+    // protects the flock state of this fd.
+    mutex mtx;
+    flock_state_t state;
 };
 
 #endif //LOCALFLOCK_LOCK_INFO_H
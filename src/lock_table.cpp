@@ -0,0 +1,116 @@
+/*
+ * Table of all file descriptors we have created lock information for.
+ */
+
+#include "lock_table.h"
+#include <cstdlib>
+#include <sched.h>
+
+// the table is zero-initialized static storage and does not depend on any constructor.
+LockTable lock_table;
+
+/*
+ * find the slot for a fd. If create is set, the chunk containing the slot is allocated if necessary.
+ */
+atomic<uintptr_t>* LockTable::get_slot(int fd, bool create) {
+    if ((unsigned int) fd >= LOCK_TABLE_MAX_FDS) return nullptr;
+    atomic<atomic<uintptr_t>*>& chunk_ptr = this->chunks[fd / LOCK_TABLE_CHUNK_SIZE];
+    atomic<uintptr_t>* chunk = chunk_ptr.load(memory_order_acquire);
+    if (chunk == nullptr) {
+        if (!create) return nullptr;
+        // calloc instead of new: all-zero memory is a valid array of empty atomic slots
+        auto* new_chunk = (atomic<uintptr_t>*) calloc(LOCK_TABLE_CHUNK_SIZE, sizeof(atomic<uintptr_t>));
+        if (new_chunk == nullptr) return nullptr;
+        if (chunk_ptr.compare_exchange_strong(chunk, new_chunk, memory_order_acq_rel)) {
+            chunk = new_chunk;
+        } else {
+            // another thread was faster, chunk now contains its allocation
+            free(new_chunk);
+        }
+    }
+    return &chunk[fd % LOCK_TABLE_CHUNK_SIZE];
+}
+
+/*
+ * set the pin bit of a slot and return the value it had before. Only the content of this single slot is protected,
+ * the pin is held just long enough to take a reference.
+ */
+uintptr_t LockTable::pin(atomic<uintptr_t>* slot) {
+    uintptr_t value = slot->load(memory_order_relaxed);
+    while (true) {
+        if (value & 1) {
+            sched_yield();
+            value = slot->load(memory_order_relaxed);
+            continue;
+        }
+        if (slot->compare_exchange_weak(value, value | 1, memory_order_acquire, memory_order_relaxed)) {
+            return value;
+        }
+    }
+}
+
+/*
+ * get the lock information for a fd. The returned object has an additional reference that has to be released by
+ * the caller. Returns nullptr if the fd is not tracked.
+ */
+LockInfo* LockTable::acquire(int fd) {
+    if (!this->is_tracked(fd)) return nullptr;
+    atomic<uintptr_t>* slot = this->get_slot(fd, false);
+    if (slot == nullptr) return nullptr;
+    uintptr_t value = pin(slot);
+    auto* info = (LockInfo*) value;
+    if (info != nullptr) info->retain();
+    slot->store(value, memory_order_release);
+    return info;
+}
+
+/*
+ * store new lock information for a fd. If another thread was faster, the existing information is returned instead
+ * and the caller has to release its own object. In both cases the returned object has a reference for the caller.
+ * Returns nullptr if the fd can not be tracked.
+ */
+LockInfo* LockTable::insert(int fd, LockInfo* info) {
+    atomic<uintptr_t>* slot = this->get_slot(fd, true);
+    if (slot == nullptr) return nullptr;
+    uintptr_t value = pin(slot);
+    if (value != 0) {
+        auto* existing = (LockInfo*) value;
+        existing->retain();
+        slot->store(value, memory_order_release);
+        return existing;
+    }
+    // one reference is owned by the table from now on
+    info->retain();
+    int highest = this->highest_fd.load(memory_order_relaxed);
+    while (fd > highest && !this->highest_fd.compare_exchange_weak(highest, fd, memory_order_release)) {}
+    this->tracked[fd / 64].fetch_or(uint64_t(1) << (fd % 64), memory_order_relaxed);
+    slot->store((uintptr_t) info, memory_order_release);
+    return info;
+}
+
+/*
+ * forget about a fd. The reference of the table is released, the lock information is destroyed as soon as no other
+ * thread is using it anymore.
+ */
+void LockTable::remove(int fd) {
+    if (!this->is_tracked(fd)) return;
+    atomic<uintptr_t>* slot = this->get_slot(fd, false);
+    if (slot == nullptr) return;
+    uintptr_t value = pin(slot);
+    this->tracked[fd / 64].fetch_and(~(uint64_t(1) << (fd % 64)), memory_order_relaxed);
+    slot->store(0, memory_order_release);
+    if (value != 0) ((LockInfo*) value)->release();
+}
+
+/*
+ * release the pins of threads that do not exist in a new child process. Called after fork, when only the forking
+ * thread is running.
+ */
+void LockTable::reset_in_child() {
+    int chunk_count = this->highest_fd.load(memory_order_relaxed) / LOCK_TABLE_CHUNK_SIZE + 1;
+    for (int i = 0; i < chunk_count; i++) {
+        atomic<uintptr_t>* chunk = this->chunks[i].load(memory_order_relaxed);
+        if (chunk == nullptr) continue;
+        for (int slot = 0; slot < LOCK_TABLE_CHUNK_SIZE; slot++) chunk[slot].fetch_and(~(uintptr_t) 1);
+    }
+}
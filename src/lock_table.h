@@ -0,0 +1,75 @@
+/*
+ * Table of all file descriptors we have created lock information for. The table is indexed directly by the fd
+ * number. Slots are atomic pointers and a bitmap marks the fds that are tracked at all, so that closing an
+ * untracked fd costs a single load. Lookups pin only the slot they read, there is no global mutex.
+ */
+
+#ifndef LOCALFLOCK_LOCK_TABLE_H
+#define LOCALFLOCK_LOCK_TABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include "lock_info.h"
+
+using namespace std;
+
+// fds larger than this can not be tracked. Memory is only touched for the parts of the table in use.
+#define LOCK_TABLE_MAX_FDS (1 << 24)
+// number of slots allocated at once when a new range of fds is used for the first time.
+#define LOCK_TABLE_CHUNK_SIZE 1024
+
+class LockTable {
+public:
+    /*
+     * check whether we have lock information for this fd. This is a single relaxed load.
+     */
+    inline bool is_tracked(int fd) const {
+        if ((unsigned int) fd >= LOCK_TABLE_MAX_FDS) return false;
+        return (tracked[fd / 64].load(memory_order_relaxed) >> (fd % 64)) & 1;
+    }
+    LockInfo* acquire(int fd);
+    LockInfo* insert(int fd, LockInfo* info);
+    void remove(int fd);
+    void reset_in_child();
+    /*
+     * call f(fd, info) for all tracked fds. The info object is kept alive during the call.
+     */
+    template <typename F> void for_each(F f) {
+        this->for_each_in_range(0, LOCK_TABLE_MAX_FDS - 1, f);
+    }
+    /*
+     * call f(fd, info) for all tracked fds from first to last, including both. Only the words of the bitmap
+     * covering the range are read, f may remove the fd it is called for.
+     */
+    template <typename F> void for_each_in_range(unsigned int first, unsigned int last, F f) {
+        unsigned int highest = (unsigned int) highest_fd.load(memory_order_acquire);
+        if (last > highest) last = highest;
+        if (first > last) return;
+        for (unsigned int word = first / 64; word <= last / 64; word++) {
+            uint64_t bits = tracked[word].load(memory_order_relaxed);
+            // mask the fds outside of the range in the first and last word
+            if (word == first / 64) bits &= ~uint64_t(0) << (first % 64);
+            if (word == last / 64 && last % 64 != 63) bits &= (uint64_t(1) << (last % 64 + 1)) - 1;
+            while (bits != 0) {
+                int fd = (int) (word * 64 + __builtin_ctzll(bits));
+                bits &= bits - 1;
+                LockInfo* info = this->acquire(fd);
+                if (info == nullptr) continue;
+                f(fd, info);
+                info->release();
+            }
+        }
+    }
+private:
+    atomic<uintptr_t>* get_slot(int fd, bool create);
+    static uintptr_t pin(atomic<uintptr_t>* slot);
+    // one bit per fd, set if the slot of the fd contains lock information.
+    atomic<uint64_t> tracked[LOCK_TABLE_MAX_FDS / 64];
+    // the slots are allocated in chunks. Each slot holds a LockInfo pointer, the lowest bit is used to pin the slot.
+    atomic<atomic<uintptr_t>*> chunks[LOCK_TABLE_MAX_FDS / LOCK_TABLE_CHUNK_SIZE];
+    // the highest fd ever inserted, limits the part of the bitmap to scan in for_each.
+    atomic<int> highest_fd;
+};
+extern LockTable lock_table;
+
+#endif //LOCALFLOCK_LOCK_TABLE_H
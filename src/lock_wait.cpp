@@ -0,0 +1,98 @@
+/*
+ * Blocking requests for redirected locks with a deadline.
+ */
+
+#include "lock_wait.h"
+#include "lock_info.h"
+#include "support.h"
+#include "stats.h"
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <sys/file.h>
+
+/*
+ * whether blocking requests on a fd are bounded by a deadline or reported while they wait
+ */
+bool lock_wait_bounded(LockInfo* info) {
+    return !info->native && (info->wait_deadline_ms > 0 || settings->WAIT_REPORT_MS > 0);
+}
+
+/*
+ * a holder of a lock for messages, e.g., "pid 1234 (rsync)". The pids of localflock-server belong to other hosts.
+ */
+static string describe_holder(pid_t pid) {
+    if (pid == 0) return "nobody anymore";
+    if (pid < 0) return "an open file description";
+    string name;
+    if (settings->SERVER.empty()) {
+        FILE* comm = fopen(fmt::format("/proc/{}/comm", pid).c_str(), "re");
+        char line[64];
+        if (comm != nullptr && fgets(line, sizeof(line), comm) != nullptr) {
+            line[strcspn(line, "\n")] = 0;
+            name = line;
+        }
+        if (comm != nullptr) fclose(comm);
+    }
+    return name.empty() ? fmt::format("pid {}", pid) : fmt::format("pid {} ({})", pid, name);
+}
+
+/*
+ * retry a request without blocking until it succeeds, fails for another reason than a conflicting lock or reaches
+ * the deadline of the fd. A signal interrupts the wait like a blocking request, with EINTR.
+ */
+static int bounded_wait(LockInfo* info, const char* request, const function<int()>& attempt,
+                        const function<pid_t()>& holder) {
+    uint64_t start = stats_clock();
+    uint64_t deadline = info->wait_deadline_ms > 0 ? start + info->wait_deadline_ms * 1000000ULL : UINT64_MAX;
+    uint64_t report = settings->WAIT_REPORT_MS * 1000000ULL;
+    uint64_t next_report = report > 0 ? start + report : UINT64_MAX;
+    const string& path = info->orignal_path.empty() ? info->local_path : info->orignal_path;
+    uint32_t interval_ms = WAIT_RETRY_MIN_MS;
+    while (true) {
+        if (attempt() == 0) return 0;
+        if (errno != EWOULDBLOCK && errno != EACCES) return -1;
+        uint64_t now = stats_clock();
+        if (now >= deadline) {
+            logger->warn("{} on {} failed after {:.1f} s, the lock is held by {}", request, path, (now - start) / 1e9,
+                         describe_holder(holder()));
+            stats_add(STAT_WAIT_DEADLINES);
+            errno = settings->WAIT_ERROR;
+            return -1;
+        }
+        if (now >= next_report) {
+            logger->warn("{} on {} is waiting for {:.1f} s, the lock is held by {}", request, path,
+                         (now - start) / 1e9, describe_holder(holder()));
+            stats_add(STAT_WAIT_REPORTS);
+            next_report += report;
+        }
+        uint64_t until = min(now + interval_ms * (uint64_t) 1000000, min(deadline, next_report));
+        struct timespec ts = {(time_t) (until / 1000000000), (long) (until % 1000000000)};
+        int error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+        if (error != 0) {
+            errno = error;
+            return -1;
+        }
+        interval_ms = min(interval_ms * 2, (uint32_t) WAIT_RETRY_MAX_MS);
+    }
+}
+
+/*
+ * acquire a flock lock without LOCK_NB within the deadline of the fd.
+ */
+int lock_wait_flock(LockInfo* info, int operation) {
+    return bounded_wait(info, operation & LOCK_EX ? "LOCK_EX" : "LOCK_SH",
+                        [&]() { return info->flock(operation | LOCK_NB); }, [&]() { return info->flock_holder(); });
+}
+
+/*
+ * acquire a lock with F_SETLKW or F_OFD_SETLKW within the deadline of the fd. arg contains an absolute range.
+ */
+int lock_wait_fcntl(LockInfo* info, int operation, struct flock* arg) {
+    bool posix = operation == F_SETLKW;
+    int nonblocking = posix ? F_SETLK : F_OFD_SETLK;
+    return bounded_wait(info, posix ? "F_SETLKW" : "F_OFD_SETLKW",
+                        [&]() { return info->fcntl(nonblocking, arg); },
+                        [&]() { return info->range_holder(nonblocking, arg); });
+}
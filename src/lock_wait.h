@@ -0,0 +1,27 @@
+/*
+ * Blocking requests for redirected locks with a deadline and messages about long waits, configured with
+ * LOCALFLOCK_WAIT_DEADLINE, LOCALFLOCK_WAIT_DEADLINES and LOCALFLOCK_WAIT_REPORT. Neither the kernel nor the backends
+ * can wait for all kinds of locks with a timeout, such requests try the lock without blocking in intervals growing
+ * from WAIT_RETRY_MIN_MS to WAIT_RETRY_MAX_MS instead. When the deadline expires, the request fails with
+ * LOCALFLOCK_WAIT_ERROR and the process holding the lock is logged. Requests without a deadline and without reports
+ * block as before.
+ */
+
+#ifndef LOCALFLOCK_LOCK_WAIT_H
+#define LOCALFLOCK_LOCK_WAIT_H
+
+#include <fcntl.h>
+
+using namespace std;
+
+// intervals between the attempts of a bounded wait
+#define WAIT_RETRY_MIN_MS 1
+#define WAIT_RETRY_MAX_MS 32
+
+class LockInfo;
+
+bool lock_wait_bounded(LockInfo* info);
+int lock_wait_flock(LockInfo* info, int operation);
+int lock_wait_fcntl(LockInfo* info, int operation, struct flock* arg);
+
+#endif //LOCALFLOCK_LOCK_WAIT_H
@@ -0,0 +1,221 @@
+/*
+ * Policy deciding which locks are redirected to LOCKDIR.
+ */
+
+#include "policy.h"
+#include "support.h"
+#include <mutex>
+#include <cstring>
+#include <climits>
+#include <sys/vfs.h>
+
+// names of filesystem types as used in LOCALFLOCK_FILESYSTEMS and their f_type in statfs
+struct filesystem_name_t {
+    const char* name;
+    long type;
+};
+static const filesystem_name_t filesystem_names[] = {
+    {"nfs", 0x6969},
+    {"cifs", 0xFF534D42},
+    {"smb2", 0xFE534D42},
+    {"smb", 0x517B},
+    {"lustre", 0x0BD00BD0},
+    {"gpfs", 0x47504653},
+    {"beegfs", 0x19830326},
+    {"ceph", 0x00C36400},
+    {"fuse", 0x65735546},
+    {"9p", 0x01021997},
+    {"afs", 0x5346414F},
+    {"ocfs2", 0x7461636F},
+    {"gfs2", 0x01161970},
+    {"ext4", 0xEF53},
+    {"xfs", 0x58465342},
+    {"btrfs", 0x9123683E},
+    {"tmpfs", 0x01021994},
+    {"overlay", 0x794C7630},
+    {"zfs", 0x2FC12FC1},
+};
+
+// decisions of devices seen before. A plain array with a mutex, it is only used for new fds and must not depend on
+// any constructor, as the first lock may happen before the static initializers of the library ran.
+struct device_decision_t {
+    dev_t dev;
+    bool redirect;
+};
+static device_decision_t device_cache[POLICY_CACHED_DEVICES];
+static int device_cache_used = 0;
+static mutex device_cache_mtx;
+
+/*
+ * parse a comma separated list of filesystem names or f_type numbers, e.g., "nfs,lustre,0x2fc12fc1". "all"
+ * redirects the locks on all filesystems. Returns false if a name is unknown, the known names are used anyway.
+ */
+bool policy_parse_filesystems(const char* value, vector<long>& types, bool& all) {
+    types.clear();
+    all = false;
+    bool ok = true;
+    string list(value);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos) end = list.size();
+        string name = list.substr(start, end - start);
+        start = end + 1;
+        if (name.empty()) continue;
+        if (name == "all") {
+            all = true;
+            continue;
+        }
+        char* number_end;
+        long type = strtol(name.c_str(), &number_end, 0);
+        if (*number_end == 0) {
+            types.push_back(type);
+            continue;
+        }
+        bool found = false;
+        for (auto& known: filesystem_names) {
+            if (name == known.name) {
+                types.push_back(known.type);
+                found = true;
+            }
+        }
+        ok = ok && found;
+    }
+    return ok;
+}
+
+/*
+ * an absolute path prefix as it is compared with the paths of fds. Existing directories are resolved like the paths
+ * of the fds, which do not contain symbolic links.
+ */
+static string normalize_prefix(string prefix) {
+    char resolved[PATH_MAX];
+    if (realpath(prefix.c_str(), resolved) != nullptr) prefix = resolved;
+    while (prefix.size() > 1 && prefix.back() == '/') prefix.pop_back();
+    return prefix;
+}
+
+/*
+ * parse a colon separated list of absolute path prefixes. Returns false if a prefix is not absolute, it is ignored.
+ */
+bool policy_parse_prefixes(const char* value, vector<string>& prefixes) {
+    prefixes.clear();
+    bool ok = true;
+    string list(value);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(':', start);
+        if (end == string::npos) end = list.size();
+        string prefix = list.substr(start, end - start);
+        start = end + 1;
+        if (prefix.empty()) continue;
+        if (prefix[0] != '/') {
+            ok = false;
+            continue;
+        }
+        prefixes.push_back(normalize_prefix(prefix));
+    }
+    return ok;
+}
+
+/*
+ * parse a colon separated list of absolute path prefixes with a deadline in seconds, e.g., "/data=30:/scratch=0".
+ * Returns false if an entry is malformed, it is ignored.
+ */
+bool policy_parse_deadlines(const char* value, vector<pair<string, uint32_t>>& deadlines) {
+    deadlines.clear();
+    bool ok = true;
+    string list(value);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(':', start);
+        if (end == string::npos) end = list.size();
+        string entry = list.substr(start, end - start);
+        start = end + 1;
+        if (entry.empty()) continue;
+        size_t separator = entry.rfind('=');
+        uint32_t milliseconds;
+        if (entry[0] != '/' || separator == string::npos ||
+            !parse_seconds(entry.c_str() + separator + 1, milliseconds)) {
+            ok = false;
+            continue;
+        }
+        deadlines.emplace_back(normalize_prefix(entry.substr(0, separator)), milliseconds);
+    }
+    return ok;
+}
+
+/*
+ * length of a prefix if it contains the path, -1 otherwise. "/data" contains "/data" and "/data/x", but not
+ * "/database".
+ */
+static long prefix_match(const string& prefix, const string& path) {
+    if (path.compare(0, prefix.size(), prefix) != 0) return -1;
+    if (path.size() == prefix.size() || prefix == "/" || path[prefix.size()] == '/') return (long) prefix.size();
+    return -1;
+}
+
+/*
+ * decision for a filesystem type
+ */
+static bool filesystem_redirected(long type) {
+    if (settings->ALL_FILESYSTEMS) return true;
+    for (long redirected: settings->FILESYSTEMS) {
+        if ((uint32_t) redirected == (uint32_t) type) return true;
+    }
+    return false;
+}
+
+/*
+ * decide whether the locks of a file are redirected to LOCKDIR. If the path had to be resolved for the decision, it
+ * is returned in path, so that it is not resolved again.
+ */
+bool policy_redirect(int fd, const struct stat& st, string& path) {
+    // the most specific prefix wins, exclude wins over include with the same prefix
+    if (!settings->INCLUDE.empty() || !settings->EXCLUDE.empty()) {
+        path = get_path_for_fd(fd);
+        long include = -1, exclude = -1;
+        for (auto& prefix: settings->INCLUDE) include = max(include, prefix_match(prefix, path));
+        for (auto& prefix: settings->EXCLUDE) exclude = max(exclude, prefix_match(prefix, path));
+        if (include >= 0 || exclude >= 0) {
+            LOG_DEBUG("    -> {} is {} by prefix", path, include > exclude ? "included" : "excluded");
+            return include > exclude;
+        }
+    }
+    if (settings->ALL_FILESYSTEMS) return true;
+
+    lock_guard<mutex> guard(device_cache_mtx);
+    for (int i = 0; i < device_cache_used; i++) {
+        if (device_cache[i].dev == st.st_dev) return device_cache[i].redirect;
+    }
+    struct statfs fs;
+    if (fstatfs(fd, &fs) != 0) {
+        // better redirected than not locked at all
+        logger->warn("unable to get the filesystem type of fd {}, locks are redirected", fd);
+        return true;
+    }
+    bool redirect = filesystem_redirected(fs.f_type);
+    LOG_DEBUG("    -> device {:x} has filesystem type {:x}, locks are {}", st.st_dev, (unsigned long) fs.f_type,
+              redirect ? "redirected" : "passed through");
+    if (device_cache_used < POLICY_CACHED_DEVICES) device_cache[device_cache_used++] = {st.st_dev, redirect};
+    return redirect;
+}
+
+/*
+ * deadline of blocking waits for the redirected locks of a file in milliseconds, 0 for none. The path is resolved
+ * if deadlines depend on it and it is not known yet.
+ */
+uint32_t policy_wait_deadline(int fd, const string& known_path) {
+    if (settings->WAIT_DEADLINES.empty()) return settings->WAIT_DEADLINE_MS;
+    string path = known_path.empty() ? get_path_for_fd(fd) : known_path;
+    long longest = -1;
+    uint32_t result = settings->WAIT_DEADLINE_MS;
+    for (auto& entry: settings->WAIT_DEADLINES) {
+        long length = prefix_match(entry.first, path);
+        if (length > longest) {
+            longest = length;
+            result = entry.second;
+        }
+    }
+    return result;
+}
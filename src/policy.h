@@ -0,0 +1,31 @@
+/*
+ * Policy deciding which locks are redirected to LOCKDIR. Locks on filesystems with working kernel locks, e.g., a
+ * local ext4, xfs or tmpfs, are passed through to the original functions. By default, only locks on network and
+ * parallel filesystems are redirected. The filesystem type is taken from fstatfs and cached per device, so that
+ * the decision costs no system call for files on known devices. Path prefixes can be included or excluded
+ * explicitly, which requires resolving the path of each new fd. The same prefixes can bound the time blocking
+ * requests wait for redirected locks.
+ */
+
+#ifndef LOCALFLOCK_POLICY_H
+#define LOCALFLOCK_POLICY_H
+
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <sys/stat.h>
+
+using namespace std;
+
+// filesystems redirected if LOCALFLOCK_FILESYSTEMS is not set
+#define POLICY_DEFAULT_FILESYSTEMS "nfs,cifs,smb2,lustre,gpfs,beegfs"
+// number of devices whose decision is cached, further devices are checked with fstatfs for each new fd.
+#define POLICY_CACHED_DEVICES 64
+
+bool policy_parse_filesystems(const char* value, vector<long>& types, bool& all);
+bool policy_parse_prefixes(const char* value, vector<string>& prefixes);
+bool policy_parse_deadlines(const char* value, vector<pair<string, uint32_t>>& deadlines);
+bool policy_redirect(int fd, const struct stat& st, string& path);
+uint32_t policy_wait_deadline(int fd, const string& known_path);
+
+#endif //LOCALFLOCK_POLICY_H
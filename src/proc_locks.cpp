@@ -0,0 +1,113 @@
+/*
+ * Parser for /proc/locks.
+ */
+
+#include "proc_locks.h"
+#include "support.h"
+#include <cstring>
+#include <mutex>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sysmacros.h>
+
+/*
+ * skip spaces and return the next token, which ends at the next space. end points to the character after it.
+ */
+static const char* next_token(const char* pos, const char* line_end, const char*& end) {
+    while (pos < line_end && *pos == ' ') pos++;
+    end = pos;
+    while (end < line_end && *end != ' ') end++;
+    return pos;
+}
+
+/*
+ * compare a token with a keyword
+ */
+static bool token_is(const char* token, const char* end, const char* keyword) {
+    size_t len = strlen(keyword);
+    return (size_t) (end - token) == len && memcmp(token, keyword, len) == 0;
+}
+
+/*
+ * parse one line, e.g., "12: -> POSIX  ADVISORY  WRITE 1234 fe:01:131090 0 EOF". Returns false for lines that
+ * could not be parsed.
+ */
+static bool parse_line(const char* pos, const char* line_end, proc_lock_t& lock) {
+    const char* end;
+    const char* token = next_token(pos, line_end, end);
+    lock.id = (uint32_t) strtoul(token, nullptr, 10);
+    token = next_token(end, line_end, end);
+    lock.waiting = token_is(token, end, "->");
+    if (lock.waiting) token = next_token(end, line_end, end);
+    if (token_is(token, end, "FLOCK")) lock.kind = PROC_LOCK_FLOCK;
+    else if (token_is(token, end, "POSIX")) lock.kind = PROC_LOCK_POSIX;
+    else if (token_is(token, end, "OFDLCK")) lock.kind = PROC_LOCK_OFD;
+    else lock.kind = PROC_LOCK_OTHER;
+    // ADVISORY or MANDATORY
+    next_token(end, line_end, end);
+    token = next_token(end, line_end, end);
+    lock.write = token_is(token, end, "WRITE");
+    token = next_token(end, line_end, end);
+    lock.pid = (pid_t) strtol(token, nullptr, 10);
+
+    // major:minor:inode, major and minor are hexadecimal
+    token = next_token(end, line_end, end);
+    char* number_end;
+    unsigned long major_number = strtoul(token, &number_end, 16);
+    if (*number_end != ':') return false;
+    unsigned long minor_number = strtoul(number_end + 1, &number_end, 16);
+    if (*number_end != ':') return false;
+    lock.dev = makedev(major_number, minor_number);
+    lock.ino = (ino_t) strtoull(number_end + 1, nullptr, 10);
+
+    token = next_token(end, line_end, end);
+    lock.start = strtoull(token, nullptr, 10);
+    token = next_token(end, line_end, end);
+    lock.end = token_is(token, end, "EOF") ? UINT64_MAX : strtoull(token, nullptr, 10);
+    return true;
+}
+
+/*
+ * read all locks, or only the locks on one device if filter_device is set. The file is read with a few large reads
+ * and parsed without allocations per line, so that hosts with many locks can be checked every second.
+ */
+bool read_proc_locks(vector<proc_lock_t>& result, dev_t device, bool filter_device) {
+    static vector<char> buffer(1 << 16);
+    static mutex buffer_mtx;
+    lock_guard<mutex> guard(buffer_mtx);
+    result.clear();
+    int fd = open("/proc/locks", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    size_t used = 0;
+    while (true) {
+        if (buffer.size() - used < 4096) buffer.resize(buffer.size() * 2);
+        ssize_t length = read(fd, buffer.data() + used, buffer.size() - used);
+        if (length <= 0) break;
+        used += length;
+    }
+    originalClose(fd);
+
+    const char* pos = buffer.data();
+    const char* buffer_end = pos + used;
+    while (pos < buffer_end) {
+        auto* line_end = (const char*) memchr(pos, '\n', buffer_end - pos);
+        if (line_end == nullptr) line_end = buffer_end;
+        proc_lock_t lock;
+        if (parse_line(pos, line_end, lock) && (!filter_device || lock.dev == device)) result.push_back(lock);
+        pos = line_end + 1;
+    }
+    return true;
+}
+
+/*
+ * name of a kind as shown in /proc/locks
+ */
+const char* proc_lock_kind_name(proc_lock_kind_t kind) {
+    switch (kind) {
+        case PROC_LOCK_FLOCK: return "FLOCK";
+        case PROC_LOCK_POSIX: return "POSIX";
+        case PROC_LOCK_OFD: return "OFDLCK";
+        default: return "OTHER";
+    }
+}
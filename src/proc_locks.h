@@ -0,0 +1,44 @@
+/*
+ * Parser for /proc/locks, which lists all locks of the host with the inode of the locked file. Used by the tools to
+ * find the processes holding and waiting for the locks on the local lock files, and by the library to name the
+ * holder of a lock a request has been waiting for.
+ */
+
+#ifndef LOCALFLOCK_PROC_LOCKS_H
+#define LOCALFLOCK_PROC_LOCKS_H
+
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+using namespace std;
+
+// kind of a lock as shown in /proc/locks
+enum proc_lock_kind_t {
+    PROC_LOCK_FLOCK,
+    PROC_LOCK_POSIX,
+    PROC_LOCK_OFD,
+    PROC_LOCK_OTHER
+};
+
+// one line of /proc/locks
+struct proc_lock_t {
+    // number of the lock, waiting requests have the number of the lock they wait for.
+    uint32_t id;
+    proc_lock_kind_t kind;
+    bool write;
+    // the process waits for the lock with the same id
+    bool waiting;
+    // -1 for OFD locks on older kernels
+    pid_t pid;
+    dev_t dev;
+    ino_t ino;
+    // locked range, end is UINT64_MAX for EOF
+    uint64_t start;
+    uint64_t end;
+};
+
+bool read_proc_locks(vector<proc_lock_t>& result, dev_t device, bool filter_device);
+const char* proc_lock_kind_name(proc_lock_kind_t kind);
+
+#endif //LOCALFLOCK_PROC_LOCKS_H
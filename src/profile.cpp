@@ -0,0 +1,419 @@
+/*
+ * Sampling profiler of lock hold times.
+ */
+
+#include "profile.h"
+#include "lock_info.h"
+#include "support.h"
+#include "stats.h"
+#include "hash.h"
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <new>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <unwind.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool profile_active = false;
+uint64_t profile_threshold = 0;
+atomic<int> profile_holding(0);
+
+// a sampled lock that is still held
+struct profile_sample_t {
+    // the LockInfo of flock and OFD locks, nullptr for POSIX locks, which belong to the process
+    LockInfo* owner;
+    uint64_t file;
+    profile_space_t space;
+    // LOCK_SH or LOCK_EX for flock locks
+    int mode;
+    // first and last byte of range locks
+    int64_t start;
+    int64_t end;
+    uint64_t acquired_ns;
+    profile_entry_t* entry;
+};
+
+// everything below is protected by profile_mtx, only sampled locks and their release take it
+static mutex profile_mtx;
+static vector<profile_sample_t> samples;
+// the file of this process, created with the first sample, and its entries by key
+static int profile_fd = -1;
+static profile_header_t* profile_header = nullptr;
+static unordered_map<uint64_t, profile_entry_t*> entries;
+// the shared file of the waiting requests, kept by child processes
+static profile_wait_slot_t* wait_slots = nullptr;
+static bool wait_slots_failed = false;
+// code of this library, its frames are not part of the stacks
+static uintptr_t own_text_start = 0;
+static uintptr_t own_text_end = 0;
+
+/*
+ * a child process gets its own file with the first sample. The samples of the parent are held by the parent.
+ */
+static void profile_reset_in_child() {
+    new (&profile_mtx) mutex();
+    samples.clear();
+    profile_holding.store(0, memory_order_relaxed);
+    entries.clear();
+    if (profile_header != nullptr) {
+        munmap(profile_header, PROFILE_HEADER_SIZE + PROFILE_ENTRIES * sizeof(profile_entry_t));
+    }
+    profile_header = nullptr;
+    if (profile_fd >= 0) internal_fd_close(profile_fd);
+    profile_fd = -1;
+}
+
+/*
+ * find the executable segment of this library
+ */
+static int find_own_text(struct dl_phdr_info* info, size_t, void*) {
+    auto own = (uintptr_t) &profile_enable;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)& segment = info->dlpi_phdr[i];
+        if (segment.p_type != PT_LOAD || (segment.p_flags & PF_X) == 0) continue;
+        uintptr_t start = info->dlpi_addr + segment.p_vaddr;
+        if (own >= start && own < start + segment.p_memsz) {
+            own_text_start = start;
+            own_text_end = start + segment.p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * sample lock hold times in this process if LOCALFLOCK_PROFILE is set. Only the library does this, not the tools.
+ */
+void profile_enable() {
+    if (settings->PROFILE.empty() || settings->PROFILE_RATE <= 0) return;
+    profile_threshold = settings->PROFILE_RATE >= 1 ? UINT64_MAX
+                                                    : (uint64_t) (settings->PROFILE_RATE * 18446744073709551616.0);
+    dl_iterate_phdr(find_own_text, nullptr);
+    profile_active = true;
+    pthread_atfork(nullptr, nullptr, profile_reset_in_child);
+}
+
+/*
+ * map a file of the profile directory, which is created with size bytes if needed. nullptr on errors.
+ */
+static void* map_file(const string& path, size_t size, bool truncate, int& fd) {
+    mkdir(settings->PROFILE.c_str(), 0755);
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if (fd < 0) return nullptr;
+    // the shared file may be used by other users
+    if (!truncate) fchmod(fd, 0666);
+    struct stat st;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (st.st_size >= (off_t) size || ftruncate(fd, size) == 0)) {
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        originalClose(fd);
+        fd = -1;
+        return nullptr;
+    }
+    internal_fd_add(fd);
+    return mapping;
+}
+
+/*
+ * the header of the file of this process, which is created if needed. profile_mtx has to be held by the caller.
+ */
+static profile_header_t* get_header() {
+    if (profile_header != nullptr || profile_fd == -2) return profile_header;
+    string path = fmt::format("{}/{}-{}.profile", settings->PROFILE, get_own_pid(), get_own_start_time());
+    auto* header = (profile_header_t*) map_file(path, PROFILE_HEADER_SIZE + PROFILE_ENTRIES * sizeof(profile_entry_t),
+                                                true, profile_fd);
+    if (header == nullptr) {
+        logger->error("unable to create the profile {}, lock hold times are not recorded", path);
+        profile_fd = -2;
+        return nullptr;
+    }
+    header->pid = get_own_pid();
+    header->entries = PROFILE_ENTRIES;
+    header->rate = settings->PROFILE_RATE;
+    header->entry_size = sizeof(profile_entry_t);
+    header->version = PROFILE_VERSION;
+    header->magic = PROFILE_MAGIC;
+    profile_header = header;
+    return header;
+}
+
+/*
+ * the slots of the waiting requests, the shared file is mapped if needed. nullptr if it cannot be used.
+ */
+static profile_wait_slot_t* get_wait_slots() {
+    if (wait_slots != nullptr || wait_slots_failed) return wait_slots;
+    lock_guard<mutex> guard(profile_mtx);
+    if (wait_slots == nullptr && !wait_slots_failed) {
+        int fd;
+        string path = settings->PROFILE + "/" + PROFILE_WAITING;
+        wait_slots = (profile_wait_slot_t*) map_file(path, PROFILE_WAIT_SLOTS * sizeof(profile_wait_slot_t), false, fd);
+        if (wait_slots == nullptr) {
+            logger->error("unable to map {}, the waits caused by locks are not recorded", path);
+            wait_slots_failed = true;
+        } else {
+            internal_fd_close(fd);
+        }
+    }
+    return wait_slots;
+}
+
+/*
+ * register a blocking request for the lock of info, which started at start. Returns the slot or -1.
+ */
+int profile_wait_begin(LockInfo* info, profile_space_t space, uint64_t start) {
+    profile_wait_slot_t* slots = get_wait_slots();
+    if (slots == nullptr) return -1;
+    uint64_t file = info->file_id();
+    for (uint32_t i = 0; i < PROFILE_WAIT_WINDOW; i++) {
+        int index = (int) ((file + i) % PROFILE_WAIT_SLOTS);
+        int32_t free_slot = 0;
+        if (!slots[index].pid.compare_exchange_strong(free_slot, get_own_pid(), memory_order_acquire)) continue;
+        slots[index].space = space;
+        slots[index].start_ns = start;
+        slots[index].file.store(file, memory_order_release);
+        return index;
+    }
+    return -1;
+}
+
+void profile_wait_end(int slot) {
+    wait_slots[slot].file.store(0, memory_order_relaxed);
+    wait_slots[slot].pid.store(0, memory_order_release);
+}
+
+/*
+ * time requests waited for the lock of a sample while it was held, until now. Slots of processes that died while
+ * they waited are freed.
+ */
+static uint64_t caused_wait(const profile_sample_t& sample, uint64_t now) {
+    profile_wait_slot_t* slots = get_wait_slots();
+    if (slots == nullptr) return 0;
+    uint64_t result = 0;
+    for (uint32_t i = 0; i < PROFILE_WAIT_WINDOW; i++) {
+        profile_wait_slot_t& slot = slots[(sample.file + i) % PROFILE_WAIT_SLOTS];
+        if (slot.file.load(memory_order_acquire) != sample.file || slot.space != sample.space) continue;
+        int32_t pid = slot.pid.load(memory_order_relaxed);
+        if (kill(pid, 0) != 0 && errno == ESRCH) {
+            slot.file.store(0, memory_order_relaxed);
+            slot.pid.compare_exchange_strong(pid, 0);
+            continue;
+        }
+        uint64_t since = max(slot.start_ns, sample.acquired_ns);
+        if (now > since) result += now - since;
+    }
+    return result;
+}
+
+// frames collected by the unwinder
+struct profile_stack_t {
+    uintptr_t frames[PROFILE_MAX_FRAMES];
+    int depth;
+};
+
+static _Unwind_Reason_Code collect_frame(struct _Unwind_Context* context, void* argument) {
+    auto* stack = (profile_stack_t*) argument;
+    uintptr_t ip = _Unwind_GetIP(context);
+    if (ip == 0) return _URC_END_OF_STACK;
+    // the frames of the library come first, they are the same for all stacks
+    if (stack->depth == 0 && ip >= own_text_start && ip < own_text_end) return _URC_NO_REASON;
+    stack->frames[stack->depth++] = ip;
+    return stack->depth < PROFILE_MAX_FRAMES ? _URC_NO_REASON : _URC_END_OF_STACK;
+}
+
+/*
+ * name of a frame for folded stacks: the function without its parameters if the symbol is exported, otherwise the
+ * file name of the module and the offset.
+ */
+static string frame_name(uintptr_t ip) {
+    Dl_info symbol;
+    // the return address may already belong to the next function
+    if (dladdr((void*) (ip - 1), &symbol) == 0 || symbol.dli_fname == nullptr) return fmt::format("{:#x}", ip);
+    if (symbol.dli_sname != nullptr) {
+        int status;
+        char* demangled = abi::__cxa_demangle(symbol.dli_sname, nullptr, nullptr, &status);
+        string name = demangled != nullptr ? demangled : symbol.dli_sname;
+        free(demangled);
+        // remove the parameter list, the parenthesis matching the one at the end
+        if (!name.empty() && name.back() == ')') {
+            int depth = 0;
+            for (size_t i = name.size(); i-- > 0;) {
+                depth += name[i] == ')' ? 1 : name[i] == '(' ? -1 : 0;
+                if (depth == 0) {
+                    if (i > 0) name.resize(i);
+                    break;
+                }
+            }
+        }
+        return name;
+    }
+    const char* module = strrchr(symbol.dli_fname, '/');
+    return fmt::format("{}+{:#x}", module != nullptr ? module + 1 : symbol.dli_fname,
+                       ip - (uintptr_t) symbol.dli_fbase);
+}
+
+/*
+ * the entry of a stack and a lock, a new entry gets their names. nullptr if all entries are used. profile_mtx has to
+ * be held by the caller.
+ */
+static profile_entry_t* get_entry(const profile_stack_t& stack, LockInfo* info, profile_space_t space) {
+    uint64_t file = info->file_id();
+    uint8_t digest[16];
+    murmur3_128(stack.frames, stack.depth * sizeof(uintptr_t), digest);
+    uint64_t key;
+    memcpy(&key, digest, sizeof(key));
+    key = (key ^ file ^ space) | 1;
+    auto existing = entries.find(key);
+    if (existing != entries.end()) return existing->second;
+    profile_header_t* header = get_header();
+    if (header == nullptr || entries.size() >= PROFILE_ENTRIES) return nullptr;
+
+    auto* entry = (profile_entry_t*) ((char*) header + PROFILE_HEADER_SIZE) + entries.size();
+    string folded;
+    for (int i = stack.depth - 1; i >= 0; i--) {
+        string frame = frame_name(stack.frames[i]);
+        if (folded.size() + frame.size() + 1 >= PROFILE_STACK_LEN) break;
+        if (!folded.empty()) folded += ';';
+        folded += frame;
+    }
+    strncpy(entry->stack, folded.c_str(), PROFILE_STACK_LEN - 1);
+    strncpy(entry->lock, info->lock_name().c_str(), PROFILE_LOCK_LEN - 1);
+    entry->space = space;
+    entry->key.store(key, memory_order_release);
+    entries[key] = entry;
+    return entry;
+}
+
+/*
+ * sample a lock that was just acquired. mode is the flock operation or the fcntl command, range the absolute range
+ * of fcntl locks. A lock of the same owner that is already sampled is not sampled again.
+ */
+void profile_start(LockInfo* info, profile_space_t space, int mode, const struct flock* range) {
+    int saved_errno = errno;
+    profile_sample_t sample = {};
+    sample.space = space;
+    sample.file = info->file_id();
+    sample.mode = mode & (LOCK_SH | LOCK_EX);
+    bool posix = space == PROFILE_RANGE && (mode == F_SETLK || mode == F_SETLKW);
+    sample.owner = posix ? nullptr : info;
+    if (range != nullptr) {
+        sample.start = range->l_start;
+        sample.end = range->l_len == 0 ? INT64_MAX : range->l_start + range->l_len - 1;
+    }
+    profile_stack_t stack;
+    stack.depth = 0;
+    _Unwind_Backtrace(collect_frame, &stack);
+
+    lock_guard<mutex> guard(profile_mtx);
+    for (auto& other: samples) {
+        if (other.owner == sample.owner && other.file == sample.file && other.space == space &&
+            other.start <= sample.end && sample.start <= other.end) {
+            errno = saved_errno;
+            return;
+        }
+    }
+    sample.entry = get_entry(stack, info, space);
+    profile_header_t* header = get_header();
+    if (header != nullptr) header->samples.fetch_add(1, memory_order_relaxed);
+    if (sample.entry == nullptr) {
+        if (header != nullptr) header->dropped.fetch_add(1, memory_order_relaxed);
+        errno = saved_errno;
+        return;
+    }
+    sample.acquired_ns = stats_clock();
+    samples.push_back(sample);
+    profile_holding.fetch_add(1, memory_order_relaxed);
+    errno = saved_errno;
+}
+
+/*
+ * end all samples the predicate selects. profile_mtx has to be held by the caller.
+ */
+template<typename predicate_t>
+static void end_samples(const predicate_t& selected) {
+    uint64_t now = stats_clock();
+    for (size_t i = 0; i < samples.size();) {
+        profile_sample_t& sample = samples[i];
+        if (!selected(sample)) {
+            i++;
+            continue;
+        }
+        sample.entry->samples.fetch_add(1, memory_order_relaxed);
+        sample.entry->hold_ns.fetch_add(now - sample.acquired_ns, memory_order_relaxed);
+        sample.entry->caused_ns.fetch_add(caused_wait(sample, now), memory_order_relaxed);
+        samples[i] = samples.back();
+        samples.pop_back();
+        profile_holding.fetch_sub(1, memory_order_relaxed);
+    }
+}
+
+/*
+ * a flock operation on info is about to release or convert its lock. Repeating the mode of the lock keeps it.
+ */
+void profile_end_flock(LockInfo* info, int operation) {
+    int saved_errno = errno;
+    int mode = operation & (LOCK_SH | LOCK_EX);
+    lock_guard<mutex> guard(profile_mtx);
+    end_samples([&](const profile_sample_t& sample) {
+        return sample.owner == info && sample.space == PROFILE_FLOCK && sample.mode != mode;
+    });
+    errno = saved_errno;
+}
+
+/*
+ * a fcntl operation is about to unlock the absolute range, which ends the samples overlapping it. POSIX locks are
+ * unlocked by the process, OFD locks by their open file description.
+ */
+void profile_end_range(LockInfo* info, int operation, const struct flock* range) {
+    int saved_errno = errno;
+    LockInfo* owner = operation == F_SETLK || operation == F_SETLKW ? nullptr : info;
+    uint64_t file = info->file_id();
+    int64_t start = range->l_start;
+    int64_t end = range->l_len == 0 ? INT64_MAX : range->l_start + range->l_len - 1;
+    lock_guard<mutex> guard(profile_mtx);
+    end_samples([&](const profile_sample_t& sample) {
+        return sample.owner == owner && sample.file == file && sample.space == PROFILE_RANGE &&
+               sample.start <= end && start <= sample.end;
+    });
+    errno = saved_errno;
+}
+
+/*
+ * the last reference to info is released, which releases its flock and OFD locks.
+ */
+void profile_end_owner(LockInfo* info) {
+    int saved_errno = errno;
+    lock_guard<mutex> guard(profile_mtx);
+    end_samples([&](const profile_sample_t& sample) { return sample.owner == info; });
+    errno = saved_errno;
+}
+
+/*
+ * a fd of the file of info is closed, which releases all POSIX locks of the process on the file.
+ */
+void profile_end_posix(LockInfo* info) {
+    int saved_errno = errno;
+    uint64_t file = info->file_id();
+    lock_guard<mutex> guard(profile_mtx);
+    end_samples([&](const profile_sample_t& sample) { return sample.owner == nullptr && sample.file == file; });
+    errno = saved_errno;
+}
+
+/*
+ * the process exits, the locks still held count until now.
+ */
+void profile_retire() {
+    if (!profile_active) return;
+    lock_guard<mutex> guard(profile_mtx);
+    end_samples([](const profile_sample_t&) { return true; });
+}
@@ -0,0 +1,153 @@
+/*
+ * Sampling profiler of lock hold times, enabled with LOCALFLOCK_PROFILE=<directory>. A fraction of all acquired locks,
+ * LOCALFLOCK_PROFILE_RATE, records the stack of the caller and the time until the lock is released by an unlock, a
+ * close or the end of the process. Every process adds its samples to its own file <pid>-<start time>.profile in the
+ * directory, one entry per stack and lock with the number of samples, the hold time and the time other requests
+ * waited for the lock while it was held. For the latter, every blocking request registers in the shared file
+ * "waiting" of the directory while it waits, whether it is sampled or not, and the holder of a sampled lock adds up
+ * the waiting requests for its lock before it releases it. localflock-profile writes folded stacks for flamegraphs.
+ *
+ * Requests that are not sampled cost a thread-local random number, blocking requests also two atomic operations in
+ * the shared file. Capturing a stack costs a few microseconds.
+ */
+
+#ifndef LOCALFLOCK_PROFILE_H
+#define LOCALFLOCK_PROFILE_H
+
+#include <atomic>
+#include <cstdint>
+#include <fcntl.h>
+
+using namespace std;
+
+// identification of a profile file, it starts with "profile".
+#define PROFILE_MAGIC 0x00656c69666f7270ULL
+#define PROFILE_VERSION 1
+// the entries start after the header, at this offset
+#define PROFILE_HEADER_SIZE 4096
+// entries per process, further stacks are dropped
+#define PROFILE_ENTRIES 4096
+// frames of a stack and the size of the stack and lock names in an entry
+#define PROFILE_MAX_FRAMES 48
+#define PROFILE_STACK_LEN 1944
+#define PROFILE_LOCK_LEN 64
+// fraction of the acquired locks that are sampled if LOCALFLOCK_PROFILE_RATE is not set
+#define PROFILE_DEFAULT_RATE 0.01
+// shared file of the waiting requests in the directory. A request registers in one of PROFILE_WAIT_WINDOW slots
+// starting at the hash of its lock, the holder checks only these.
+#define PROFILE_WAITING "waiting"
+#define PROFILE_WAIT_SLOTS 4096
+#define PROFILE_WAIT_WINDOW 64
+
+// lock spaces, flock locks do not conflict with byte range locks
+enum profile_space_t : uint32_t {
+    PROFILE_FLOCK = 1,
+    PROFILE_RANGE = 2
+};
+
+// one stack and lock of a process
+struct profile_entry_t {
+    // hash of the stack and the lock, 0 for free entries. Set last, when the names are complete.
+    atomic<uint64_t> key;
+    uint32_t space;
+    uint32_t reserved;
+    atomic<uint64_t> samples;
+    atomic<uint64_t> hold_ns;
+    // time requests of any process waited for the lock while a sample held it
+    atomic<uint64_t> caused_ns;
+    // see LockInfo::lock_name
+    char lock[PROFILE_LOCK_LEN];
+    // frames from the outermost to the caller of the lock function, separated by ';' as in folded stacks
+    char stack[PROFILE_STACK_LEN];
+};
+static_assert(sizeof(profile_entry_t) == 2048, "profile entries have to keep their size");
+
+// start of a profile file
+struct profile_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    int32_t pid;
+    uint32_t entries;
+    double rate;
+    atomic<uint64_t> samples;
+    // samples of stacks that did not fit into the entries anymore
+    atomic<uint64_t> dropped;
+};
+
+// a request waiting for a lock, in the shared file PROFILE_WAITING
+struct profile_wait_slot_t {
+    // the waiting process, 0 for free slots
+    atomic<int32_t> pid;
+    uint32_t space;
+    // LockInfo::file_id of the lock, set last
+    atomic<uint64_t> file;
+    uint64_t start_ns;
+    uint64_t reserved;
+};
+
+class LockInfo;
+
+// whether locks are sampled in this process, and the threshold of the random numbers of sampled locks
+extern bool profile_active;
+extern uint64_t profile_threshold;
+// number of samples holding a lock, release operations only look for them if there are any
+extern atomic<int> profile_holding;
+
+void profile_enable();
+void profile_start(LockInfo* info, profile_space_t space, int mode, const struct flock* range);
+void profile_end_flock(LockInfo* info, int operation);
+void profile_end_range(LockInfo* info, int operation, const struct flock* range);
+void profile_end_owner(LockInfo* info);
+void profile_end_posix(LockInfo* info);
+void profile_retire();
+int profile_wait_begin(LockInfo* info, profile_space_t space, uint64_t start);
+void profile_wait_end(int slot);
+
+/*
+ * decide whether an acquired lock is sampled, with a xorshift generator per thread.
+ */
+static inline bool profile_sample() {
+    static thread_local uint64_t state = 0;
+    if (__builtin_expect(state == 0, 0)) state = (uint64_t) (uintptr_t) &state * 0x9e3779b97f4a7c15ULL | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state <= profile_threshold;
+}
+
+/*
+ * a flock lock was acquired with operation
+ */
+static inline void profile_flock_acquired(LockInfo* info, int operation) {
+    if (profile_sample()) profile_start(info, PROFILE_FLOCK, operation, nullptr);
+}
+
+/*
+ * a fcntl lock was set with operation on the absolute range
+ */
+static inline void profile_fcntl_acquired(LockInfo* info, int operation, const struct flock* range) {
+    if (range->l_type != F_UNLCK && profile_sample()) profile_start(info, PROFILE_RANGE, operation, range);
+}
+
+/*
+ * operation may release or convert a sampled flock lock of info, called before it is done
+ */
+static inline void profile_flock_releasing(LockInfo* info, int operation) {
+    if (profile_holding.load(memory_order_relaxed) != 0) profile_end_flock(info, operation);
+}
+
+static inline void profile_fcntl_releasing(LockInfo* info, int operation, const struct flock* range) {
+    if (range->l_type == F_UNLCK && profile_holding.load(memory_order_relaxed) != 0) {
+        profile_end_range(info, operation, range);
+    }
+}
+
+/*
+ * a fd of info is closed, which releases the POSIX locks of the process on the file
+ */
+static inline void profile_closing(LockInfo* info) {
+    if (profile_holding.load(memory_order_relaxed) != 0) profile_end_posix(info);
+}
+
+#endif //LOCALFLOCK_PROFILE_H
@@ -4,102 +4,356 @@
 
 #include "protocol.h"
 #include "support.h"
+#include "stats.h"
 #include <cstdio>
-#include <ext/stdio_filebuf.h>
+#include <cstring>
+#include <unordered_set>
+#include <vector>
+#include <algorithm>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/mman.h>
 
 /*
- * Open and if necessary create the protocol file. The file will be locked directly.
+ * Open and if necessary create the protocol file and map it into memory.
  */
-Protocol::Protocol() {
-    logger->debug("opening protocol file {}", settings->PROTOCOL_FILE);
-    this->fd = open_and_set_perm(settings->PROTOCOL_FILE);
-    int err = originalFlock(this->fd, LOCK_EX);
-    if (err != 0) logger->error("unable to lock protocol file {}", settings->PROTOCOL_FILE);
+Protocol::Protocol() : fd(-1), pid(0), header(nullptr), slots(nullptr), mapped_size(0) {
+    this->open_file();
+    if (!this->map_file()) {
+        logger->error("unable to use protocol file {}", settings->PROTOCOL_FILE);
+        this->close();
+    }
 }
 
 /*
  * make sure, that the file is closed when the object is deleted.
  */
 Protocol::~Protocol() {
-    if (fd > 0) this->close();
+    if (this->fd >= 0) this->close();
 }
 
 /*
- * Close the file again. That will release the lock as well.
+ * Close the file and remove the mapping.
  */
 void Protocol::close() {
-    logger->debug("closing protocol file.");
-    originalClose(this->fd);
-    fd = -1;
+    LOG_DEBUG("closing protocol file.");
+    if (this->header != nullptr) munmap(this->header, this->mapped_size);
+    this->header = nullptr;
+    this->slots = nullptr;
+    if (this->fd >= 0) internal_fd_close(this->fd);
+    this->fd = -1;
+}
+
+/*
+ * open the file. It is not mapped here, as this is also used to get a new open file description after fork.
+ */
+void Protocol::open_file() {
+    LOG_DEBUG("opening protocol file {}", settings->PROTOCOL_FILE);
+    this->fd = open_and_set_perm(PROTOCOL_NAME, true);
+    this->pid = get_own_pid();
+}
+
+/*
+ * map the file into memory. A new file is initialized first, which is done by the one process that gets the
+ * exclusive lock while the file is still empty.
+ */
+bool Protocol::map_file() {
+    if (this->fd < 0) return false;
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) return false;
+    if (st.st_size == 0) {
+        originalFlock(this->fd, LOCK_EX);
+        if (fstat(this->fd, &st) == 0 && st.st_size == 0) {
+            protocol_header_t new_header = {};
+            new_header.magic = PROTOCOL_MAGIC;
+            new_header.version = PROTOCOL_VERSION;
+            new_header.slots = settings->PROTOCOL_SLOTS;
+            new_header.levels = settings->LEVELS + 1;
+            size_t size = sizeof(protocol_header_t) + sizeof(protocol_slot_t) * new_header.slots;
+            LOG_DEBUG("creating protocol with {} slots", new_header.slots);
+            if (ftruncate(this->fd, size) != 0 || pwrite(this->fd, &new_header, sizeof(new_header), 0) < 0) {
+                logger->error("unable to initialize protocol file {}", settings->PROTOCOL_FILE);
+            }
+        }
+        originalFlock(this->fd, LOCK_UN);
+    }
+
+    // check the header before mapping all slots
+    protocol_header_t file_header;
+    if (pread(this->fd, &file_header, sizeof(file_header), 0) != sizeof(file_header)) return false;
+    if (file_header.magic != PROTOCOL_MAGIC || file_header.version != PROTOCOL_VERSION) {
+        logger->error("{} is not a protocol file of this version", settings->PROTOCOL_FILE);
+        return false;
+    }
+    this->mapped_size = sizeof(protocol_header_t) + sizeof(protocol_slot_t) * file_header.slots;
+    void* mapping = mmap(nullptr, this->mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (mapping == MAP_FAILED) return false;
+    this->header = (protocol_header_t*) mapping;
+    this->slots = (protocol_slot_t*) ((char*) mapping + sizeof(protocol_header_t));
+    return true;
+}
+
+/*
+ * get the protocol of this process. It is opened once and kept open.
+ */
+Protocol* Protocol::get() {
+    static Protocol* instance = nullptr;
+    static mutex instance_mtx;
+    lock_guard<mutex> guard(instance_mtx);
+    if (instance == nullptr) instance = new Protocol();
+    return instance;
+}
+
+/*
+ * take the flock on the protocol file. LOCK_SH is used while adding entries and creating files, LOCK_EX while
+ * removing files. With LOCK_NB, false is returned if the lock is not available immediately.
+ */
+bool Protocol::lock(int operation) {
+    if (operation & LOCK_NB) {
+        if (!this->mtx.try_lock()) return false;
+    } else {
+        this->mtx.lock();
+    }
+    if (this->fd < 0) return true;
+    // a child process shares the open file description with its parent, the lock would be shared as well.
+    if (this->pid != get_own_pid()) {
+        internal_fd_close(this->fd);
+        this->open_file();
+    }
+    int err = originalFlock(this->fd, operation);
+    if (err != 0) {
+        if (errno != EWOULDBLOCK) logger->error("unable to lock protocol file {}", settings->PROTOCOL_FILE);
+        this->mtx.unlock();
+        return false;
+    }
+    return true;
+}
+
+/*
+ * release the flock on the protocol file.
+ */
+void Protocol::unlock() {
+    if (this->fd >= 0) originalFlock(this->fd, LOCK_UN);
+    this->mtx.unlock();
+}
+
+/*
+ * hold the mutex while fork copies the process, so that the child does not inherit it locked by another thread.
+ */
+void Protocol::prepare_fork() {
+    this->mtx.lock();
 }
 
 /*
- * store the new file and our own PID in the file
+ * release the mutex taken by prepare_fork, in the parent and in the child.
  */
-void Protocol::add(string& path) {
-    logger->debug("adding {} to protocol for PID {}", path, getpid());
-    // append to the end of the file
-    lseek(this->fd, 0, SEEK_END);
-    dprintf(this->fd, "%d|%s\n", getpid(), path.c_str());
+void Protocol::after_fork() {
+    this->mtx.unlock();
 }
 
 /*
- * Remove old files from the protocol and delete them. This is done when all processes that
- * opened a file before are already closed.
+ * store the name of a new file relative to LOCKDIR and our own PID in a free slot. The shared lock has to be held
+ * by the caller. Returns the index of the slot or -1 if the file could not be recorded.
  */
-void Protocol::cleanup() {
-    logger->debug("checking protocol for old files");
+int Protocol::add(const string& name) {
+    if (this->slots == nullptr) return -1;
+    pid_t own_pid = get_own_pid();
+    LOG_DEBUG("adding {} to protocol for PID {}", name, own_pid);
+    if (name.size() >= PROTOCOL_NAME_LEN) {
+        logger->warn("name of {} is too long for the protocol, it will never be removed", name);
+        return -1;
+    }
+
+    // the slots are kept dense at the beginning of the file, so that the cleanup has to check only few of them.
+    uint32_t count = this->header->slots;
+    uint32_t start = this->header->free_hint.load(memory_order_relaxed) % count;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = (start + i) % count;
+        protocol_slot_t& slot = this->slots[index];
+        int32_t expected = 0;
+        if (slot.pid.load(memory_order_relaxed) != 0) continue;
+        if (!slot.pid.compare_exchange_strong(expected, own_pid, memory_order_acquire)) continue;
+        slot.start_time = get_own_start_time();
+        strncpy(slot.name, name.c_str(), PROTOCOL_NAME_LEN);
+        slot.state.store(SLOT_USED, memory_order_release);
+        this->header->free_hint.store(index + 1, memory_order_relaxed);
+        uint32_t high_water = this->header->high_water.load(memory_order_relaxed);
+        while (index >= high_water && !this->header->high_water.compare_exchange_weak(high_water, index + 1)) {}
+        return (int) index;
+    }
+    logger->warn("protocol is full, {} will never be removed", name);
+    return -1;
+}
 
-    // create a stream from the file descriptor
-    lseek(this->fd, 0, SEEK_SET);
-    __gnu_cxx::stdio_filebuf<char> buf(this->fd, std::ios::in);
-    istream is(&buf);
+/*
+ * mark the file of a slot as no longer used by this process. The slot is freed by the next cleanup.
+ */
+void Protocol::remove(int slot) {
+    if (this->slots == nullptr || slot < 0) return;
+    this->slots[slot].state.store(SLOT_RELEASED, memory_order_release);
+}
 
-    // read the file line by line and store the result in maps
-    string line;
-    pid_t pid;
-    string filename;
-    int pos;
-    map<string, vector<pid_t>> file_pid_map;
-    while (!is.eof()) {
-        getline(is, line);
-        pos = line.find('|');
-        if (pos == string::npos) break;
-        pid = stoi(line.substr(0, pos));
-        filename = line.substr(pos+1, line.size());
-        logger->debug("    -> pid={}, filename={}", pid, filename);
-        if (file_pid_map.count(filename) == 0) {
-            file_pid_map[filename] = vector<pid_t>();
+/*
+ * call the callback for all slots in use, without any lock. Names of slots that are being filled may be incomplete.
+ */
+void Protocol::for_each_used(const function<void(pid_t, const char*)>& callback) {
+    if (this->slots == nullptr) return;
+    uint32_t high_water = min(this->header->high_water.load(memory_order_acquire), this->header->slots);
+    for (uint32_t i = 0; i < high_water; i++) {
+        protocol_slot_t& slot = this->slots[i];
+        if (slot.state.load(memory_order_acquire) != SLOT_USED) continue;
+        // the name is copied, it may change while we look at it
+        char name[PROTOCOL_NAME_LEN];
+        memcpy(name, slot.name, PROTOCOL_NAME_LEN);
+        name[PROTOCOL_NAME_LEN - 1] = 0;
+        callback(slot.pid.load(memory_order_relaxed), name);
+    }
+}
+
+/*
+ * change the names of all entries, e.g., after the lock files were moved. The exclusive lock has to be held by the
+ * caller, so that no slot is being filled.
+ */
+void Protocol::rename_entries(const function<string(const char*)>& rename) {
+    if (this->slots == nullptr) return;
+    uint32_t high_water = min(this->header->high_water.load(memory_order_acquire), this->header->slots);
+    for (uint32_t i = 0; i < high_water; i++) {
+        protocol_slot_t& slot = this->slots[i];
+        if (slot.state.load(memory_order_acquire) == SLOT_FREE) continue;
+        slot.name[PROTOCOL_NAME_LEN - 1] = 0;
+        string name = rename(slot.name);
+        if (name.size() >= PROTOCOL_NAME_LEN) {
+            logger->warn("new name {} is too long for the protocol", name);
+            continue;
         }
-        // store the pid, if the process is still running
-        if (getpgid(pid) > 0) {
-            file_pid_map[filename].push_back(pid);
-        } else {
-            logger->debug("    -> pid={} is dead!", pid);
+        strncpy(slot.name, name.c_str(), PROTOCOL_NAME_LEN);
+    }
+}
+
+/*
+ * whether the protocol file is open and mapped
+ */
+bool Protocol::is_open() const {
+    return this->header != nullptr;
+}
+
+/*
+ * levels of subdirectories of the lock directory. The protocol header is shared by all processes and tells those
+ * that read the format before a migration about the new layout. Callers hold the lock of the protocol.
+ */
+uint32_t Protocol::levels() const {
+    uint32_t levels = this->header != nullptr ? this->header->levels.load(memory_order_acquire) : 0;
+    return levels == 0 ? settings->LEVELS : levels - 1;
+}
+
+/*
+ * announce a new layout of the lock directory, with the exclusive lock held.
+ */
+void Protocol::set_levels(uint32_t levels) {
+    if (this->header != nullptr) this->header->levels.store(levels + 1, memory_order_release);
+}
+
+/*
+ * check whether the process of a slot is still using its file. The start times of processes are cached, as
+ * processes usually have multiple entries.
+ */
+bool Protocol::slot_is_used(protocol_slot_t& slot, unordered_map<pid_t, uint64_t>& start_times) {
+    pid_t slot_pid = slot.pid.load(memory_order_acquire);
+    if (slot_pid == 0) return false;
+    // free slots with a pid are being filled, which only happens while holding the shared lock. Finding one
+    // during cleanup means that the process died while writing.
+    if (slot.state.load(memory_order_acquire) != SLOT_USED) return false;
+    if (slot.start_time == 0) return process_is_running(slot_pid, 0);
+    auto cached = start_times.find(slot_pid);
+    if (cached == start_times.end()) {
+        cached = start_times.emplace(slot_pid, get_process_start_time(slot_pid)).first;
+    }
+    return cached->second == slot.start_time;
+}
+
+/*
+ * Remove old files from the protocol and delete them. This is done when all processes that opened a file before
+ * are not running anymore. At most max_slots entries are checked, starting where the last cleanup of any process
+ * stopped, so that the cost is bounded. With max_slots = 0, all entries are checked. If wait is false, nothing is
+ * done when another process is currently using the protocol.
+ */
+protocol_cleanup_t Protocol::cleanup(uint32_t max_slots, bool wait) {
+    protocol_cleanup_t result = {};
+    if (this->slots == nullptr) return result;
+    uint32_t high_water = this->header->high_water.load(memory_order_acquire);
+    if (high_water == 0) return result;
+    LOG_DEBUG("checking protocol for old files");
+    if (!this->lock(wait ? LOCK_EX : LOCK_EX | LOCK_NB)) {
+        LOG_DEBUG("    -> protocol is in use, skipping cleanup");
+        return result;
+    }
+    high_water = this->header->high_water.load(memory_order_acquire);
+
+    // the range of entries to check in this run
+    uint32_t count = high_water;
+    uint32_t first = 0;
+    if (max_slots > 0 && max_slots < high_water) {
+        count = max_slots;
+        first = this->header->cleanup_cursor.fetch_add(max_slots, memory_order_relaxed) % high_water;
+    }
+
+    // collect all slots of dead processes
+    unordered_map<pid_t, uint64_t> start_times;
+    vector<uint32_t> old_slots;
+    vector<bool> is_old(high_water, false);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = (first + i) % high_water;
+        protocol_slot_t& slot = this->slots[index];
+        if (slot.pid.load(memory_order_relaxed) == 0) continue;
+        result.checked++;
+        if (!this->slot_is_used(slot, start_times)) {
+            LOG_DEBUG("    -> pid={}, filename={} is not used anymore", slot.pid.load(), slot.name);
+            old_slots.push_back(index);
+            is_old[index] = true;
         }
     }
 
-    // iterate over all files and delete those that do not have a running process anymore
-    lseek(this->fd, 0, SEEK_SET);
-    for (const auto& one_files_pids: file_pid_map) {
-        // no pids related anymore, delete the file
-        if (one_files_pids.second.empty()) {
-            int err = remove(one_files_pids.first.c_str());
-            if (err != 0) logger->warn("unable to delete {}", one_files_pids.first);
-            else logger->debug("deleted {}", one_files_pids.first);
+    // a file can only be deleted if no other entry refers to it. Entries outside of the checked range are only
+    // checked if they have the name of an old entry.
+    unordered_set<string_view> unused_files;
+    for (const auto& index: old_slots) unused_files.insert(this->slots[index].name);
+    for (uint32_t index = 0; index < high_water && !unused_files.empty(); index++) {
+        protocol_slot_t& slot = this->slots[index];
+        if (is_old[index] || slot.pid.load(memory_order_relaxed) == 0) continue;
+        auto unused = unused_files.find(slot.name);
+        if (unused == unused_files.end()) continue;
+        if (this->slot_is_used(slot, start_times)) unused_files.erase(unused);
+    }
+
+    // delete files that are not used by any running process anymore
+    for (const auto& name: unused_files) {
+        string path(name);
+        int err = unlinkat(settings->LOCKDIR_FD, path.c_str(), 0);
+        if (err != 0 && errno != ENOENT) {
+            logger->warn("unable to delete {}/{}", settings->LOCKDIR, path);
         } else {
-            // write the filename back to the protocol because it is still in use.
-            for (const auto& one_pid: one_files_pids.second) {
-                dprintf(this->fd, "%d|%s\n", one_pid, one_files_pids.first.c_str());
-            }
+            LOG_DEBUG("deleted {}/{}", settings->LOCKDIR, path);
+            result.removed++;
         }
     }
 
-    // truncate the protocol file to the new length
-    size_t file_pos = lseek(this->fd, 0, SEEK_CUR);
-    size_t file_size = lseek(this->fd, 0, SEEK_END);
-    if (file_pos < file_size) {
-        logger->debug("shrinking protocol size from {} to {}", file_size, file_pos);
-        ftruncate(this->fd, file_pos);
+    // free the slots. This is done last, as the names of unused_files point into the slots.
+    for (const auto& index: old_slots) {
+        protocol_slot_t& slot = this->slots[index];
+        slot.state.store(SLOT_FREE, memory_order_relaxed);
+        slot.pid.store(0, memory_order_release);
+        result.freed++;
+    }
+    if (!old_slots.empty()) {
+        uint32_t lowest = *min_element(old_slots.begin(), old_slots.end());
+        if (lowest < this->header->free_hint.load(memory_order_relaxed)) {
+            this->header->free_hint.store(lowest, memory_order_relaxed);
+        }
     }
+    this->unlock();
+    stats_add_deferred(STAT_CLEANUPS, 1);
+    stats_add_deferred(STAT_CLEANUP_CHECKED, result.checked);
+    stats_add_deferred(STAT_CLEANUP_FREED, result.freed);
+    stats_add_deferred(STAT_CLEANUP_REMOVED, result.removed);
+    return result;
 }
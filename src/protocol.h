@@ -1,23 +1,111 @@
 /*
- * The protocol is used to keep track of all created files. All new files are written to the protocol,
- * on startup, old files not used anymore are removed.
+ * The protocol is used to keep track of all created files. It is a memory mapped file with a fixed number of
+ * slots, each slot records one lock file used by one process. Slots are claimed and released with atomic
+ * operations. Adding entries only requires a shared flock on the protocol file, so processes do not serialize each
+ * other. Only the cleanup, which removes files of processes that are not running anymore, takes the exclusive lock.
  */
 
 #ifndef LOCALFLOCK_PROTOCOL_H
 #define LOCALFLOCK_PROTOCOL_H
 
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <unordered_map>
+#include <functional>
+#include <sys/types.h>
 using namespace std;
 
+// name of the protocol file in LOCKDIR
+#define PROTOCOL_NAME "registry"
+// identification of the file format, the file starts with "lclflock".
+#define PROTOCOL_MAGIC 0x6b636f6c666c636cULL
+#define PROTOCOL_VERSION 1
+// number of slots used when the protocol is created, can be changed with LOCALFLOCK_PROTOCOL_SLOTS.
+#define PROTOCOL_DEFAULT_SLOTS 65536
+// number of entries checked by each process on startup, can be changed with LOCALFLOCK_CLEANUP_SLOTS.
+#define PROTOCOL_DEFAULT_CLEANUP_SLOTS 16
+// maximal length of a lock file name relative to LOCKDIR, including the terminating zero.
+#define PROTOCOL_NAME_LEN 240
+
+// state of one slot
+enum protocol_slot_state_t : uint32_t {
+    // the slot is free or currently being filled by the process in the pid field.
+    SLOT_FREE = 0,
+    // the lock file is in use by the process in the pid field as long as that process is running.
+    SLOT_USED = 1,
+    // the process does not use the lock file anymore.
+    SLOT_RELEASED = 2
+};
+
+// header at the beginning of the protocol file.
+struct protocol_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slots;
+    // all slots above this index have never been used.
+    atomic<uint32_t> high_water;
+    // the search for a free slot starts here, all slots below are probably in use.
+    atomic<uint32_t> free_hint;
+    // the next incremental cleanup starts here.
+    atomic<uint32_t> cleanup_cursor;
+    // levels of subdirectories of the lock directory plus one, changed by a migration. 0 in protocols of older
+    // versions, the format file is used then.
+    atomic<uint32_t> levels;
+    char reserved[224];
+};
+
+// one entry of the protocol. The pid is claimed first, it is zero for free slots.
+struct protocol_slot_t {
+    atomic<int32_t> pid;
+    atomic<uint32_t> state;
+    // start time of the process in clock ticks since boot, to detect reused pids.
+    uint64_t start_time;
+    // name of the lock file relative to LOCKDIR.
+    char name[PROTOCOL_NAME_LEN];
+};
+
+// result of a cleanup
+struct protocol_cleanup_t {
+    // number of entries checked
+    uint32_t checked;
+    // number of entries of processes not running anymore
+    uint32_t freed;
+    // number of deleted lock files
+    uint32_t removed;
+};
+
 class Protocol {
 public:
     Protocol();
     ~Protocol();
     void close();
-    void add(string& path);
-    void cleanup();
+    bool lock(int operation);
+    void unlock();
+    int add(const string& name);
+    void remove(int slot);
+    protocol_cleanup_t cleanup(uint32_t max_slots, bool wait);
+    void for_each_used(const function<void(pid_t, const char*)>& callback);
+    void rename_entries(const function<string(const char*)>& rename);
+    bool is_open() const;
+    uint32_t levels() const;
+    void set_levels(uint32_t levels);
+    void prepare_fork();
+    void after_fork();
+    static Protocol* get();
 private:
+    void open_file();
+    bool map_file();
+    bool slot_is_used(protocol_slot_t& slot, unordered_map<pid_t, uint64_t>& start_times);
     int fd;
+    // the process that opened fd. After fork, the child needs its own open file description for the flock.
+    pid_t pid;
+    protocol_header_t* header;
+    protocol_slot_t* slots;
+    size_t mapped_size;
+    // flock locks of all threads use the same open file description, they have to be serialized.
+    mutex mtx;
 };
 
 
@@ -0,0 +1,307 @@
+/*
+ * Lock backend in shared memory.
+ */
+
+#include "shm_table.h"
+#include "support.h"
+#include <mutex>
+#include <climits>
+#include <cstring>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/*
+ * initialize a mutex shared by all processes that is released by the kernel when its owner dies.
+ */
+void shm_init_mutex(pthread_mutex_t* mtx) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * whether the process of a holder is still running. The own process is never checked.
+ */
+static bool holder_alive(const lock_holder_t& holder) {
+    if (holder.pid == get_own_pid()) return true;
+    return process_is_running(holder.pid, holder.start_time);
+}
+
+/*
+ * lock the mutex of a record. If its last owner died, the record may have been changed halfway: the holders of
+ * processes that are not running anymore are removed and the record is used as it is.
+ */
+static int lock_mutex(shm_record_t* record) {
+    int err = pthread_mutex_lock(&record->mtx);
+    if (err == EOWNERDEAD) {
+        logger->warn("a process died while changing a lock record, removing the locks of dead processes");
+        for (uint32_t i = 0; i < record->holder_count && i < LOCK_HOLDERS_MAX;) {
+            if (!holder_alive(record->holders[i])) holders_remove(record->holders, record->holder_count, i);
+            else i++;
+        }
+        if (record->holder_count > LOCK_HOLDERS_MAX) record->holder_count = LOCK_HOLDERS_MAX;
+        pthread_mutex_consistent(&record->mtx);
+        err = 0;
+    }
+    if (err != 0) logger->error("unable to lock a lock record: {}", strerror(err));
+    return err;
+}
+
+/*
+ * release the mutex of a record and wake all waiting processes if the locks changed.
+ */
+static void unlock_mutex(shm_record_t* record, bool changed) {
+    bool wake = changed && record->contended != 0;
+    if (wake) {
+        record->contended = 0;
+        record->wakeups.fetch_add(1, memory_order_release);
+    }
+    pthread_mutex_unlock(&record->mtx);
+    if (wake) syscall(SYS_futex, (uint32_t*) &record->wakeups, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static bool has_key(shm_record_t* record, const uint64_t key[2]) {
+    return record->key[0].load(memory_order_relaxed) == key[0] && record->key[1].load(memory_order_relaxed) == key[1];
+}
+
+/*
+ * open and if necessary create the segment of the lock directory. Its name is derived from the identity of the
+ * lock directory, so that all processes find the same segment independent of the path they use.
+ */
+ShmTable::ShmTable() : header(nullptr), records(nullptr) {
+    struct stat st;
+    if (fstat(settings->LOCKDIR_FD, &st) != 0) {
+        logger->error("unable to get the identity of {}", settings->LOCKDIR);
+        return;
+    }
+    string name = fmt::format("/localflock-{:x}-{:x}", (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        logger->error("unable to open shared memory {}", name);
+        return;
+    }
+    // the mode given to shm_open is reduced by the umask. Only the creator is allowed to change it.
+    fchmod(fd, 0666);
+
+    // a new segment is initialized by the one process that gets the exclusive lock while it is still empty.
+    originalFlock(fd, LOCK_EX);
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        uint32_t count = settings->SHM_RECORDS;
+        size = sizeof(shm_header_t) + sizeof(shm_record_t) * count;
+        LOG_DEBUG("creating shared memory {} with {} records", name, count);
+        void* mapping = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                                 : MAP_FAILED;
+        if (mapping != MAP_FAILED) {
+            auto* new_header = (shm_header_t*) mapping;
+            shm_init_mutex(&new_header->insert_mtx);
+            new_header->records = count;
+            new_header->version = SHM_VERSION;
+            new_header->magic = SHM_MAGIC;
+            munmap(mapping, size);
+        }
+    }
+    shm_header_t file_header = {};
+    if (pread(fd, &file_header, sizeof(file_header), 0) != sizeof(file_header) || file_header.magic != SHM_MAGIC ||
+        file_header.version != SHM_VERSION) {
+        logger->error("shared memory {} is not a lock table of this version", name);
+    } else {
+        size = sizeof(shm_header_t) + sizeof(shm_record_t) * file_header.records;
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) {
+            this->header = (shm_header_t*) mapping;
+            this->records = (shm_record_t*) ((char*) mapping + sizeof(shm_header_t));
+        }
+    }
+    originalFlock(fd, LOCK_UN);
+    // the mapping stays valid without the fd
+    originalClose(fd);
+}
+
+/*
+ * get the table of this process. It is opened once and kept open.
+ */
+ShmTable* ShmTable::get() {
+    static ShmTable* instance = nullptr;
+    static mutex instance_mtx;
+    lock_guard<mutex> guard(instance_mtx);
+    if (instance == nullptr) instance = new ShmTable();
+    return instance;
+}
+
+bool ShmTable::is_open() const {
+    return this->header != nullptr;
+}
+
+/*
+ * find the record of a file. Lookups do not lock anything, the key is checked again with the record mutex held.
+ * New records are created under the insert mutex, which takes over a record without holders in the probe sequence
+ * or a record that was never used. Returns nullptr if the file has no record and none can be created.
+ */
+shm_record_t* ShmTable::find(const uint64_t key[2], bool create) {
+    if (this->header == nullptr) return nullptr;
+    uint32_t count = this->header->records;
+    uint32_t home = (uint32_t) (key[0] % count);
+    for (uint32_t i = 0; i < count; i++) {
+        shm_record_t* record = &this->records[(home + i) % count];
+        if (record->used.load(memory_order_acquire) == 0) break;
+        if (has_key(record, key)) return record;
+    }
+    if (!create) return nullptr;
+
+    if (pthread_mutex_lock(&this->header->insert_mtx) == EOWNERDEAD) {
+        pthread_mutex_consistent(&this->header->insert_mtx);
+    }
+    shm_record_t* result = nullptr;
+    // a record without holders, its mutex is held until the whole probe sequence was checked for the key
+    shm_record_t* unused = nullptr;
+    for (uint32_t i = 0; i < count; i++) {
+        shm_record_t* record = &this->records[(home + i) % count];
+        if (record->used.load(memory_order_acquire) == 0) {
+            if (unused == nullptr) {
+                shm_init_mutex(&record->mtx);
+                record->key[0].store(key[0], memory_order_relaxed);
+                record->key[1].store(key[1], memory_order_relaxed);
+                record->used.store(1, memory_order_release);
+                result = record;
+            }
+            break;
+        }
+        if (has_key(record, key)) {
+            result = record;
+            break;
+        }
+        if (unused == nullptr && lock_mutex(record) == 0) {
+            if (record->holder_count == 0) unused = record;
+            else pthread_mutex_unlock(&record->mtx);
+        }
+    }
+    if (unused != nullptr) {
+        if (result == nullptr) {
+            unused->key[0].store(key[0], memory_order_relaxed);
+            unused->key[1].store(key[1], memory_order_relaxed);
+            result = unused;
+        }
+        pthread_mutex_unlock(&unused->mtx);
+    }
+    pthread_mutex_unlock(&this->header->insert_mtx);
+    if (result == nullptr) logger->error("the shared memory lock table is full");
+    return result;
+}
+
+/*
+ * find and lock the record of a file. Returns nullptr if there is none.
+ */
+shm_record_t* ShmTable::lock_record(const uint64_t key[2], bool create) {
+    while (true) {
+        shm_record_t* record = this->find(key, create);
+        if (record == nullptr || lock_mutex(record) != 0) return nullptr;
+        // the record may have been taken over by another file in the meantime
+        if (has_key(record, key)) return record;
+        pthread_mutex_unlock(&record->mtx);
+    }
+}
+
+/*
+ * set or remove a lock of the owner on a range, type is one of F_RDLCK, F_WRLCK and F_UNLCK. flock locks cover
+ * the whole file. If wait is set, the process sleeps until conflicting locks are released, otherwise EAGAIN is
+ * returned.
+ */
+int ShmTable::set(const uint64_t key[2], const lock_owner_t& owner, short type, int64_t start, int64_t end,
+                  bool wait) {
+    bool unlock = type == F_UNLCK;
+    bool write = type == F_WRLCK;
+    shm_record_t* record = this->lock_record(key, !unlock);
+    if (record == nullptr) {
+        if (unlock) return 0;
+        errno = ENOLCK;
+        return -1;
+    }
+    while (true) {
+        int conflict = unlock ? -1 : holders_conflict(record->holders, record->holder_count, owner, write, start, end);
+        if (conflict < 0) {
+            if (record->holder_count + holders_needed(record->holders, record->holder_count, owner, type, start, end) >
+                LOCK_HOLDERS_MAX) {
+                unlock_mutex(record, false);
+                errno = ENOLCK;
+                return -1;
+            }
+            unlock_mutex(record, holders_set(record->holders, record->holder_count, owner, type, start, end));
+            return 0;
+        }
+        // the holder may have died without releasing its lock
+        if (!holder_alive(record->holders[conflict])) {
+            LOG_DEBUG("removing lock of pid {}, which is not running anymore", record->holders[conflict].pid);
+            holders_remove(record->holders, record->holder_count, (uint32_t) conflict);
+            continue;
+        }
+        if (!wait) {
+            unlock_mutex(record, false);
+            errno = EAGAIN;
+            return -1;
+        }
+
+        // sleep until the next release, but check the holders from time to time
+        record->contended = 1;
+        uint32_t seen = record->wakeups.load(memory_order_acquire);
+        pthread_mutex_unlock(&record->mtx);
+        struct timespec timeout = {SHM_LIVENESS_CHECK_MS / 1000, (SHM_LIVENESS_CHECK_MS % 1000) * 1000000L};
+        syscall(SYS_futex, (uint32_t*) &record->wakeups, FUTEX_WAIT, seen, &timeout, nullptr, 0);
+        record = this->lock_record(key, true);
+        if (record == nullptr) {
+            errno = ENOLCK;
+            return -1;
+        }
+    }
+}
+
+/*
+ * check whether a lock could be set, like F_GETLK. arg contains the absolute range and is changed to describe a
+ * conflicting lock or gets l_type F_UNLCK.
+ */
+int ShmTable::test(const uint64_t key[2], const lock_owner_t& owner, struct flock* arg) {
+    int64_t start, end;
+    if (!lock_range(arg, start, end)) return -1;
+    shm_record_t* record = this->lock_record(key, false);
+    int conflict = -1;
+    while (record != nullptr) {
+        conflict = holders_conflict(record->holders, record->holder_count, owner, arg->l_type == F_WRLCK, start, end);
+        if (conflict < 0 || holder_alive(record->holders[conflict])) break;
+        holders_remove(record->holders, record->holder_count, (uint32_t) conflict);
+    }
+    if (conflict < 0) arg->l_type = F_UNLCK;
+    else holders_describe(record->holders[conflict], arg);
+    if (record != nullptr) unlock_mutex(record, false);
+    return 0;
+}
+
+/*
+ * remove the locks of processes that are not running anymore from all records. Returns the number of removed
+ * locks.
+ */
+uint32_t ShmTable::sweep() {
+    if (this->header == nullptr) return 0;
+    uint32_t removed = 0;
+    for (uint32_t i = 0; i < this->header->records; i++) {
+        shm_record_t* record = &this->records[i];
+        if (record->used.load(memory_order_acquire) == 0 || lock_mutex(record) != 0) continue;
+        bool changed = false;
+        for (uint32_t j = 0; j < record->holder_count;) {
+            if (!holder_alive(record->holders[j])) {
+                holders_remove(record->holders, record->holder_count, j);
+                changed = true;
+                removed++;
+            } else {
+                j++;
+            }
+        }
+        unlock_mutex(record, changed);
+    }
+    return removed;
+}
@@ -0,0 +1,75 @@
+/*
+ * Lock backend without lock files. All locks of the host are kept in a hash table in a POSIX shared memory segment
+ * that belongs to the lock directory. Each record holds the flock and the byte range locks of one original file,
+ * identified by the hash of its path like the lock files. Records are protected by robust, process-shared mutexes,
+ * so that uncontended locks and unlocks are a few atomic operations without any system call. Waiting processes
+ * sleep on a futex of the record and are woken by the next release.
+ *
+ * Each holder is recorded with its pid and start time. A process that dies while holding a record mutex is noticed
+ * by the next process locking it (EOWNERDEAD), locks of processes that died are removed by the processes waiting
+ * for them and by localflock-gc. There is no cleanup of files and no protocol.
+ */
+
+#ifndef LOCALFLOCK_SHM_TABLE_H
+#define LOCALFLOCK_SHM_TABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+#include "lock_backend.h"
+
+using namespace std;
+
+// identification of the segment, it starts with "lclfshm".
+#define SHM_MAGIC 0x006d6873666c636cULL
+#define SHM_VERSION 1
+// number of records of a new segment, can be changed with LOCALFLOCK_SHM_RECORDS.
+#define SHM_DEFAULT_RECORDS 16384
+// waiting processes check this often whether the holders are still running
+#define SHM_LIVENESS_CHECK_MS 200
+
+// all locks of one original file
+struct shm_record_t {
+    pthread_mutex_t mtx;
+    // 0 for records that were never used. Used records with no holders can be taken over by other files.
+    atomic<uint32_t> used;
+    // futex word, incremented whenever waiting processes are woken.
+    atomic<uint32_t> wakeups;
+    // set by waiting processes, a release wakes them only if set. Protected by mtx.
+    uint32_t contended;
+    // number of entries in holders, protected by mtx.
+    uint32_t holder_count;
+    // hash of the path of the original file
+    atomic<uint64_t> key[2];
+    lock_holder_t holders[LOCK_HOLDERS_MAX];
+};
+
+// start of the segment
+struct shm_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t records;
+    // serializes the creation of records, never taken while a record mutex is held.
+    pthread_mutex_t insert_mtx;
+    char reserved[80];
+};
+
+void shm_init_mutex(pthread_mutex_t* mtx);
+
+class ShmTable : public LockBackend {
+public:
+    static ShmTable* get();
+    bool is_open() const;
+    int set(const uint64_t key[2], const lock_owner_t& owner, short type, int64_t start, int64_t end,
+            bool wait) override;
+    int test(const uint64_t key[2], const lock_owner_t& owner, struct flock* arg) override;
+    uint32_t sweep();
+private:
+    ShmTable();
+    shm_record_t* find(const uint64_t key[2], bool create);
+    shm_record_t* lock_record(const uint64_t key[2], bool create);
+    shm_header_t* header;
+    shm_record_t* records;
+};
+
+#endif //LOCALFLOCK_SHM_TABLE_H
@@ -0,0 +1,237 @@
+/*
+ * Statistics about the locks of each process in shared memory.
+ */
+
+#include "stats.h"
+#include "support.h"
+#include <mutex>
+#include <dirent.h>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+stats_page_t* stats_page = nullptr;
+static bool stats_enabled = false;
+static mutex stats_mtx;
+// name of the file of this process in STATS_DIR. Not a string, the file may be created by the constructor of the
+// library before the constructors of other globals ran.
+static char stats_name[64];
+// events recorded before the file was created
+static uint64_t stats_pending[STAT_COUNTERS];
+
+// names used by localflock-stat, in the order of stats_counter_t
+static const char* counter_names[] = {
+    "flock_sh", "flock_ex", "flock_un", "fcntl_setlk", "fcntl_setlkw", "fcntl_getlk", "ofd_setlk", "ofd_setlkw",
+    "ofd_getlk", "close_tracked", "would_block", "errors", "waits", "wait_ns", "lock_files_created", "cleanups",
+    "cleanup_checked", "cleanup_freed", "cleanup_removed", "passthrough", "wait_deadlines", "wait_reports",
+    "fair_queued"
+};
+static_assert(sizeof(counter_names) / sizeof(counter_names[0]) == STAT_COUNTERS, "a counter has no name");
+
+/*
+ * name of a counter, nullptr for unused counters.
+ */
+const char* stats_counter_name(int counter) {
+    return counter < STAT_COUNTERS ? counter_names[counter] : nullptr;
+}
+
+/*
+ * a child process gets its own file with the first event, the mapping of the parent is removed.
+ */
+static void stats_reset_in_child() {
+    if (stats_page != nullptr) munmap(stats_page, sizeof(stats_page_t));
+    stats_page = nullptr;
+}
+
+/*
+ * record statistics in this process. Only the library does this, not the tools.
+ */
+void stats_enable() {
+    if (!settings->STATS) return;
+    stats_enabled = true;
+    pthread_atfork(nullptr, nullptr, stats_reset_in_child);
+}
+
+/*
+ * map a file in the statistics directory. New files are initialized with a header for this process.
+ */
+stats_page_t* stats_map(const string& name, bool writable) {
+    string path = string(STATS_DIR) + "/" + name;
+    int fd = openat(settings->LOCKDIR_FD, path.c_str(), writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC,
+                    0644);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (st.st_size < (off_t) sizeof(stats_page_t) && !writable)) {
+        originalClose(fd);
+        return nullptr;
+    }
+    // growing the file is harmless if another process did it already, existing counters are kept.
+    if (st.st_size < (off_t) sizeof(stats_page_t) && ftruncate(fd, sizeof(stats_page_t)) != 0) {
+        originalClose(fd);
+        return nullptr;
+    }
+    void* mapping = mmap(nullptr, sizeof(stats_page_t), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                         fd, 0);
+    originalClose(fd);
+    if (mapping == MAP_FAILED) return nullptr;
+    auto* page = (stats_page_t*) mapping;
+    if (writable && page->magic == 0) {
+        page->version = STATS_VERSION;
+        page->magic = STATS_MAGIC;
+    }
+    if (page->magic != STATS_MAGIC || page->version != STATS_VERSION) {
+        munmap(mapping, sizeof(stats_page_t));
+        return nullptr;
+    }
+    return page;
+}
+
+/*
+ * remove a mapping created by stats_map.
+ */
+void stats_unmap(stats_page_t* page) {
+    munmap(page, sizeof(stats_page_t));
+}
+
+/*
+ * create the file of this process on its first event. Returns nullptr if statistics are disabled or the file could
+ * not be created, the events are not counted then. errno is kept, the event may be the failure of a lock.
+ */
+stats_page_t* stats_create() {
+    if (!stats_enabled) return nullptr;
+    lock_guard<mutex> guard(stats_mtx);
+    if (stats_page != nullptr) return stats_page;
+    int saved_errno = errno;
+    // the directory is writable for everyone, the sticky bit protects the files of other users.
+    if (mkdirat(settings->LOCKDIR_FD, STATS_DIR, 01777) == 0) {
+        string path = settings->LOCKDIR + "/" + STATS_DIR;
+        chmod(path.c_str(), 01777);
+    }
+    pid_t pid = get_own_pid();
+    uint64_t start_time = get_own_start_time();
+    snprintf(stats_name, sizeof(stats_name), "%d-%lu", pid, (unsigned long) start_time);
+    stats_page_t* page = stats_map(stats_name, true);
+    if (page == nullptr) {
+        // do not try again for every event
+        logger->warn("unable to create statistics file {}/{}/{}", settings->LOCKDIR, STATS_DIR, stats_name);
+        stats_enabled = false;
+        errno = saved_errno;
+        return nullptr;
+    }
+    page->pid = pid;
+    page->start_time = start_time;
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        if (stats_pending[i] != 0) page->counters[i].fetch_add(stats_pending[i], memory_order_relaxed);
+        stats_pending[i] = 0;
+    }
+    stats_page = page;
+    errno = saved_errno;
+    return page;
+}
+
+/*
+ * count an event without creating the file. Used for the cleanup on startup, processes that never lock a file
+ * should not get a file. The events are added when the file is created.
+ */
+void stats_add_deferred(stats_counter_t counter, uint64_t value) {
+    lock_guard<mutex> guard(stats_mtx);
+    if (stats_page != nullptr) {
+        stats_page->counters[counter].fetch_add(value, memory_order_relaxed);
+    } else {
+        stats_pending[counter] += value;
+    }
+}
+
+/*
+ * add all counters of source to target.
+ */
+void stats_add_page(stats_page_t* target, const stats_page_t* source) {
+    for (int i = 0; i < STATS_MAX_COUNTERS; i++) {
+        uint64_t value = source->counters[i].load(memory_order_relaxed);
+        if (value != 0) target->counters[i].fetch_add(value, memory_order_relaxed);
+    }
+    for (int i = 0; i < STATS_WAIT_BUCKETS; i++) {
+        uint64_t value = source->wait_buckets[i].load(memory_order_relaxed);
+        if (value != 0) target->wait_buckets[i].fetch_add(value, memory_order_relaxed);
+    }
+}
+
+/*
+ * add the counters of a file to the retired counters and remove it. The file is renamed first, so that it is
+ * added only once if several processes retire it at the same time.
+ */
+static bool retire_file(const string& name) {
+    string path = string(STATS_DIR) + "/" + name;
+    string claimed = path + ".retiring";
+    if (renameat(settings->LOCKDIR_FD, path.c_str(), settings->LOCKDIR_FD, claimed.c_str()) != 0) return false;
+    stats_page_t* page = stats_map(name + ".retiring", false);
+    stats_page_t* retired = stats_map(STATS_RETIRED, true);
+    if (page != nullptr && retired != nullptr) stats_add_page(retired, page);
+    if (page != nullptr) stats_unmap(page);
+    if (retired != nullptr) stats_unmap(retired);
+    unlinkat(settings->LOCKDIR_FD, claimed.c_str(), 0);
+    return true;
+}
+
+/*
+ * called when the process exits. The counters are kept in the retired file, the file of the process is removed.
+ */
+void stats_retire() {
+    lock_guard<mutex> guard(stats_mtx);
+    if (stats_page == nullptr) return;
+    if (stats_page->pid == get_own_pid()) retire_file(stats_name);
+    stats_unmap(stats_page);
+    stats_page = nullptr;
+}
+
+/*
+ * parse the pid and the start time from the name of a statistics file. Returns false for other files.
+ */
+static bool parse_stats_name(const char* name, pid_t& pid, uint64_t& start_time) {
+    char* end;
+    long value = strtol(name, &end, 10);
+    if (end == name || *end != '-' || value <= 0) return false;
+    pid = (pid_t) value;
+    start_time = strtoull(end + 1, &end, 10);
+    return *end == 0;
+}
+
+/*
+ * retire the files of processes that are not running anymore. Returns the number of retired files.
+ */
+uint32_t stats_retire_dead() {
+    string path = settings->LOCKDIR + "/" + STATS_DIR;
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) return 0;
+    uint32_t count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        pid_t pid;
+        uint64_t start_time;
+        if (!parse_stats_name(entry->d_name, pid, start_time)) continue;
+        if (process_is_running(pid, start_time)) continue;
+        if (retire_file(entry->d_name)) count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/*
+ * call the callback with the statistics of every running process.
+ */
+void stats_for_each(const function<void(const stats_page_t*)>& callback) {
+    string path = settings->LOCKDIR + "/" + STATS_DIR;
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        pid_t pid;
+        uint64_t start_time;
+        if (!parse_stats_name(entry->d_name, pid, start_time)) continue;
+        stats_page_t* page = stats_map(entry->d_name, false);
+        if (page == nullptr) continue;
+        if (process_is_running(pid, start_time)) callback(page);
+        stats_unmap(page);
+    }
+    closedir(dir);
+}
@@ -0,0 +1,124 @@
+/*
+ * Statistics about the locks of each process. Every process using the library maps a small file in
+ * $LOCKDIR/stats/ and counts its operations there with relaxed atomic additions, so that recording costs only a few
+ * nanoseconds and does not need any lock. When a process exits, its counters are added to $LOCKDIR/stats/retired
+ * and its file is removed. Files of processes that were killed are retired by localflock-stat and localflock-gc.
+ */
+
+#ifndef LOCALFLOCK_STATS_H
+#define LOCALFLOCK_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <functional>
+#include <ctime>
+#include <sys/types.h>
+using namespace std;
+
+// directory for the statistics in LOCKDIR and the file with the sum of all exited processes
+#define STATS_DIR "stats"
+#define STATS_RETIRED "retired"
+// identification of the file format, the file starts with "lfstats".
+#define STATS_MAGIC 0x0073746174736c66ULL
+#define STATS_VERSION 1
+// number of counters and histogram buckets reserved in the file, not all are used yet.
+#define STATS_MAX_COUNTERS 64
+#define STATS_WAIT_BUCKETS 32
+
+// counters of each process
+enum stats_counter_t {
+    STAT_FLOCK_SH,
+    STAT_FLOCK_EX,
+    STAT_FLOCK_UN,
+    STAT_FCNTL_SETLK,
+    STAT_FCNTL_SETLKW,
+    STAT_FCNTL_GETLK,
+    STAT_OFD_SETLK,
+    STAT_OFD_SETLKW,
+    STAT_OFD_GETLK,
+    STAT_CLOSE_TRACKED,
+    // non-blocking requests that failed because of another lock
+    STAT_WOULD_BLOCK,
+    // all other failed requests
+    STAT_ERRORS,
+    // blocking requests and the time spent in them
+    STAT_WAITS,
+    STAT_WAIT_NS,
+    STAT_LOCK_FILES_CREATED,
+    STAT_CLEANUPS,
+    STAT_CLEANUP_CHECKED,
+    STAT_CLEANUP_FREED,
+    STAT_CLEANUP_REMOVED,
+    // lock operations passed through to the original file by the policy
+    STAT_PASSTHROUGH,
+    // blocking requests that failed at their deadline, and messages about requests still waiting
+    STAT_WAIT_DEADLINES,
+    STAT_WAIT_REPORTS,
+    // blocking flock requests that waited in the fair queue
+    STAT_FAIR_QUEUED,
+    STAT_COUNTERS
+};
+
+// content of a statistics file
+struct stats_page_t {
+    uint64_t magic;
+    uint32_t version;
+    int32_t pid;
+    uint64_t start_time;
+    char reserved[40];
+    atomic<uint64_t> counters[STATS_MAX_COUNTERS];
+    // bucket 0 counts waits below 1 µs, bucket i waits of 2^(i-1) to 2^i µs. The last bucket counts all longer waits.
+    atomic<uint64_t> wait_buckets[STATS_WAIT_BUCKETS];
+};
+
+extern stats_page_t* stats_page;
+
+void stats_enable();
+stats_page_t* stats_create();
+void stats_add_deferred(stats_counter_t counter, uint64_t value);
+void stats_retire();
+void stats_add_page(stats_page_t* target, const stats_page_t* source);
+const char* stats_counter_name(int counter);
+uint32_t stats_retire_dead();
+void stats_for_each(const function<void(const stats_page_t*)>& callback);
+stats_page_t* stats_map(const string& name, bool writable);
+void stats_unmap(stats_page_t* page);
+
+/*
+ * count an event. The file is created with the first event of a process.
+ */
+static inline void stats_add(stats_counter_t counter, uint64_t value = 1) {
+    stats_page_t* page = stats_page;
+    if (__builtin_expect(page == nullptr, 0)) {
+        page = stats_create();
+        if (page == nullptr) return;
+    }
+    page->counters[counter].fetch_add(value, memory_order_relaxed);
+}
+
+/*
+ * start time of a blocking request in nanoseconds
+ */
+static inline uint64_t stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * record the time spent in a blocking request.
+ */
+static inline void stats_add_wait(uint64_t start) {
+    uint64_t waited = stats_clock() - start;
+    stats_page_t* page = stats_page;
+    if (page == nullptr) return;
+    uint64_t micros = waited / 1000;
+    int bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+    if (bucket >= STATS_WAIT_BUCKETS) bucket = STATS_WAIT_BUCKETS - 1;
+    page->counters[STAT_WAITS].fetch_add(1, memory_order_relaxed);
+    page->counters[STAT_WAIT_NS].fetch_add(waited, memory_order_relaxed);
+    page->wait_buckets[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+#endif //LOCALFLOCK_STATS_H
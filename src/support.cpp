@@ -2,101 +2,445 @@
  * Implementation of support functions used by the main code.
  */
 #include "support.h"
+#include "protocol.h"
+#include "lock_dir.h"
+#include "shm_table.h"
+#include "async_log.h"
+#include "stats.h"
+#include "policy.h"
+#include "profile.h"
+#include <dlfcn.h>
+#include <fstream>
+#include <unordered_map>
+#include <climits>
+
+// globals shared by the library and the tools
+shared_ptr<spdlog::logger> logger;
+bool debug_enabled = false;
+original_flock_type originalFlock;
+original_fcntl_type originalFcntl;
+original_close_type originalClose;
+original_dup_type originalDup;
+original_dup2_type originalDup2;
+original_dup3_type originalDup3;
+original_close_range_type originalCloseRange;
+original_closefrom_type originalClosefrom;
+
+// settings are read during initialisation. The init priority makes sure that they are initialized before calling
+// the init method.
+shared_ptr<settings_t> settings __attribute__ ((init_priority (101)));
+
+static void reset_own_pid();
+
+/*
+ * get pointers to the original system functions.
+ */
+void init_original_functions() {
+    originalFlock = (original_flock_type)dlsym(RTLD_NEXT, "flock");
+    originalFcntl = (original_fcntl_type)dlsym(RTLD_NEXT, "fcntl");
+    originalClose = (original_close_type)dlsym(RTLD_NEXT, "close");
+    originalDup = (original_dup_type)dlsym(RTLD_NEXT, "dup");
+    originalDup2 = (original_dup2_type)dlsym(RTLD_NEXT, "dup2");
+    originalDup3 = (original_dup3_type)dlsym(RTLD_NEXT, "dup3");
+    originalCloseRange = (original_close_range_type)dlsym(RTLD_NEXT, "close_range");
+    originalClosefrom = (original_closefrom_type)dlsym(RTLD_NEXT, "closefrom");
+    pthread_atfork(nullptr, nullptr, reset_own_pid);
+}
+
+/*
+ * create the logger. Messages go to stderr unless LOCALFLOCK_LOG_FILE is set, then they are written asynchronously
+ * into that file.
+ */
+void create_logger(const string& name) {
+    const char* value = getenv("LOCALFLOCK_LOG_FILE");
+    if (value != nullptr && value[0] != 0) {
+        logger = make_shared<spdlog::logger>(name, make_shared<async_log_sink>(value));
+    } else {
+        logger = spdlog::stderr_logger_st(name);
+    }
+}
+
+/*
+ * read the configuration file. It contains the settings with the names of the environment variables, one
+ * "NAME=value" per line. Empty lines and lines starting with # are ignored.
+ */
+static void read_config_file(const char* path, unordered_map<string, string>& config) {
+    ifstream file(path);
+    if (!file) {
+        logger->warn("unable to read configuration file {}", path);
+        return;
+    }
+    string line;
+    while (getline(file, line)) {
+        size_t first = line.find_first_not_of(" \t");
+        if (first == string::npos || line[first] == '#') continue;
+        size_t pos = line.find('=', first);
+        if (pos == string::npos) {
+            logger->warn("ignoring line without '=' in {}: {}", path, line);
+            continue;
+        }
+        string name = line.substr(first, pos - first);
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) name.pop_back();
+        size_t value_start = line.find_first_not_of(" \t", pos + 1);
+        config[name] = value_start == string::npos ? "" : line.substr(value_start);
+    }
+}
+
+/*
+ * read settings from environment variables and create the lock directory. The logger has to exist already.
+ */
+void read_settings() {
+    settings = make_shared<settings_t>();
+    unordered_map<string, string> config;
+    const char* config_file = getenv("LOCALFLOCK_CONFIG");
+    if (config_file != nullptr) read_config_file(config_file, config);
+    auto get_setting = [&](const char* name) -> const char* {
+        const char* result = getenv(name);
+        if (result != nullptr) return result;
+        auto entry = config.find(name);
+        return entry != config.end() ? entry->second.c_str() : nullptr;
+    };
+    const char* value = get_setting("LOCALFLOCK_DEBUG");
+    if (value == nullptr) {
+        settings->DEBUG = false;
+    } else {
+        settings->DEBUG = true;
+        logger->set_level(spdlog::level::debug);
+    }
+    // tools may have enabled debug messages already
+    debug_enabled = logger->should_log(spdlog::level::debug);
+    LOG_DEBUG("LOCALFLOCK_DEBUG={}", settings->DEBUG);
+    value = get_setting("LOCALFLOCK_LOG_FILE");
+    if (value != nullptr) settings->LOG_FILE = string(value);
+    LOG_DEBUG("LOCALFLOCK_LOG_FILE={}", settings->LOG_FILE);
+    value = get_setting("LOCALFLOCK_LOCKDIR");
+    if (value == nullptr) {
+        settings->LOCKDIR = "/var/lock/localflock";
+    } else {
+        settings->LOCKDIR = string(value);
+    }
+    settings->PROTOCOL_FILE = fmt::format("{}/{}", settings->LOCKDIR, PROTOCOL_NAME);
+    LOG_DEBUG("LOCALFLOCK_LOCKDIR={}", settings->LOCKDIR);
+    value = get_setting("LOCALFLOCK_PROTOCOL_SLOTS");
+    if (value == nullptr || atoi(value) <= 0) {
+        settings->PROTOCOL_SLOTS = PROTOCOL_DEFAULT_SLOTS;
+    } else {
+        settings->PROTOCOL_SLOTS = atoi(value);
+    }
+    value = get_setting("LOCALFLOCK_CLEANUP_SLOTS");
+    if (value == nullptr || atoi(value) < 0) {
+        settings->CLEANUP_SLOTS = PROTOCOL_DEFAULT_CLEANUP_SLOTS;
+    } else {
+        settings->CLEANUP_SLOTS = atoi(value);
+    }
+    LOG_DEBUG("LOCALFLOCK_CLEANUP_SLOTS={}", settings->CLEANUP_SLOTS);
+    value = get_setting("LOCALFLOCK_SHOW_NAMES");
+    if (value == nullptr) {
+        settings->SHOW_NAMES = false;
+    } else {
+        settings->SHOW_NAMES = true;
+    }
+    LOG_DEBUG("LOCALFLOCK_SHOW_NAMES={}", settings->SHOW_NAMES);
+    value = get_setting("LOCALFLOCK_STATS");
+    settings->STATS = value == nullptr || strcmp(value, "0") != 0;
+    value = get_setting("LOCALFLOCK_TRACE");
+    if (value != nullptr) settings->TRACE = string(value);
+    LOG_DEBUG("LOCALFLOCK_TRACE={}", settings->TRACE);
+    value = get_setting("LOCALFLOCK_PROFILE");
+    if (value != nullptr) settings->PROFILE = string(value);
+    value = get_setting("LOCALFLOCK_PROFILE_RATE");
+    settings->PROFILE_RATE = PROFILE_DEFAULT_RATE;
+    if (value != nullptr) {
+        char* end;
+        double rate = strtod(value, &end);
+        if (end == value || *end != 0 || rate < 0 || rate > 1) {
+            logger->warn("LOCALFLOCK_PROFILE_RATE={} is not a fraction between 0 and 1, using {}", value,
+                         PROFILE_DEFAULT_RATE);
+        } else {
+            settings->PROFILE_RATE = rate;
+        }
+    }
+    LOG_DEBUG("LOCALFLOCK_PROFILE={}, LOCALFLOCK_PROFILE_RATE={}", settings->PROFILE, settings->PROFILE_RATE);
+    value = get_setting("LOCALFLOCK_FILESYSTEMS");
+    if (value == nullptr) value = POLICY_DEFAULT_FILESYSTEMS;
+    if (!policy_parse_filesystems(value, settings->FILESYSTEMS, settings->ALL_FILESYSTEMS)) {
+        logger->warn("unknown filesystem in LOCALFLOCK_FILESYSTEMS={}", value);
+    }
+    LOG_DEBUG("LOCALFLOCK_FILESYSTEMS={}", value);
+    value = get_setting("LOCALFLOCK_INCLUDE");
+    if (value != nullptr && !policy_parse_prefixes(value, settings->INCLUDE)) {
+        logger->warn("LOCALFLOCK_INCLUDE={} contains relative paths, they are ignored", value);
+    }
+    value = get_setting("LOCALFLOCK_EXCLUDE");
+    if (value != nullptr && !policy_parse_prefixes(value, settings->EXCLUDE)) {
+        logger->warn("LOCALFLOCK_EXCLUDE={} contains relative paths, they are ignored", value);
+    }
+    value = get_setting("LOCALFLOCK_WAIT_DEADLINE");
+    settings->WAIT_DEADLINE_MS = 0;
+    if (value != nullptr && !parse_seconds(value, settings->WAIT_DEADLINE_MS)) {
+        logger->warn("LOCALFLOCK_WAIT_DEADLINE={} is not a number of seconds, waits have no deadline", value);
+    }
+    value = get_setting("LOCALFLOCK_WAIT_DEADLINES");
+    if (value != nullptr && !policy_parse_deadlines(value, settings->WAIT_DEADLINES)) {
+        logger->warn("LOCALFLOCK_WAIT_DEADLINES={} contains malformed entries, they are ignored", value);
+    }
+    value = get_setting("LOCALFLOCK_WAIT_ERROR");
+    settings->WAIT_ERROR = value != nullptr && strcmp(value, "EAGAIN") == 0 ? EAGAIN : EINTR;
+    if (value != nullptr && strcmp(value, "EAGAIN") != 0 && strcmp(value, "EINTR") != 0) {
+        logger->warn("unknown value LOCALFLOCK_WAIT_ERROR={}, using EINTR", value);
+    }
+    value = get_setting("LOCALFLOCK_WAIT_REPORT");
+    settings->WAIT_REPORT_MS = 0;
+    if (value != nullptr && !parse_seconds(value, settings->WAIT_REPORT_MS)) {
+        logger->warn("LOCALFLOCK_WAIT_REPORT={} is not a number of seconds, long waits are not reported", value);
+    }
+    LOG_DEBUG("LOCALFLOCK_WAIT_DEADLINE={} ms, LOCALFLOCK_WAIT_REPORT={} ms", settings->WAIT_DEADLINE_MS,
+              settings->WAIT_REPORT_MS);
+    value = get_setting("LOCALFLOCK_FAIR");
+    settings->FAIR = value != nullptr && strcmp(value, "1") == 0;
+    LOG_DEBUG("LOCALFLOCK_FAIR={}", settings->FAIR);
+    value = get_setting("LOCALFLOCK_SHM_RECORDS");
+    if (value == nullptr || atoi(value) <= 0) {
+        settings->SHM_RECORDS = SHM_DEFAULT_RECORDS;
+    } else {
+        settings->SHM_RECORDS = atoi(value);
+    }
+    value = get_setting("LOCALFLOCK_SERVER");
+    if (value != nullptr) settings->SERVER = string(value);
+    LOG_DEBUG("LOCALFLOCK_SERVER={}", settings->SERVER);
+    value = get_setting("LOCALFLOCK_DEVICES");
+    if (value != nullptr && !identity_parse_devices(value, settings->DEVICES)) {
+        logger->warn("LOCALFLOCK_DEVICES={} contains malformed entries or missing mount points, they are ignored",
+                     value);
+    }
+    lockdir_format_t requested_format = {HASH_MURMUR3, LOCKDIR_DEFAULT_LEVELS, BACKEND_FILE, NAMING_PATH};
+    value = get_setting("LOCALFLOCK_HASH");
+    if (value != nullptr && !hash_from_name(value, requested_format.hash)) {
+        logger->warn("unknown value LOCALFLOCK_HASH={}, using {}", value, hash_name(requested_format.hash));
+    }
+    value = get_setting("LOCALFLOCK_SHARD_LEVELS");
+    if (value != nullptr) {
+        requested_format.levels = min((uint32_t) strtoul(value, nullptr, 10), (uint32_t) LOCKDIR_MAX_LEVELS);
+    }
+    value = get_setting("LOCALFLOCK_BACKEND");
+    if (value != nullptr && !backend_from_name(value, requested_format.backend)) {
+        logger->warn("unknown value LOCALFLOCK_BACKEND={}, using {}", value, backend_name(requested_format.backend));
+    }
+    value = get_setting("LOCALFLOCK_NAMING");
+    if (value != nullptr && !naming_from_name(value, requested_format.naming)) {
+        logger->warn("unknown value LOCALFLOCK_NAMING={}, using {}", value, naming_name(requested_format.naming));
+    }
+
+    // create the local folder for locks.
+    if (!filesystem::is_directory(settings->LOCKDIR)) {
+        filesystem::create_directory(settings->LOCKDIR);
+        filesystem::permissions(settings->LOCKDIR, filesystem::perms::all);
+    }
+
+    // all lock files are opened relative to this fd, so that the path is resolved only once
+    settings->LOCKDIR_FD = open(settings->LOCKDIR.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (settings->LOCKDIR_FD < 0) logger->error("unable to open lock directory {}", settings->LOCKDIR);
+    else internal_fd_add(settings->LOCKDIR_FD);
+
+    // the format of an existing directory wins over our own settings
+    lockdir_format_t format = get_lockdir_format(settings->LOCKDIR, requested_format);
+    settings->HASH = format.hash;
+    settings->LEVELS = format.levels;
+    settings->BACKEND = format.backend;
+    settings->NAMING = format.naming;
+    LOG_DEBUG("lock file names are {} hashes of the {} in {} levels of subdirectories, backend {}",
+              hash_name(settings->HASH), naming_name(settings->NAMING), settings->LEVELS,
+              backend_name(settings->BACKEND));
+}
 
 /*
  * check /proc/self/fd/ to get the absolute path of the file to lock
  */
 string get_path_for_fd(int fd) {
-    string result;
-    try {
-        result = filesystem::read_symlink(fmt::format("/proc/self/fd/{}", fd));
-    } catch(exception& e){
+    char link[32];
+    char target[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t length = readlink(link, target, sizeof(target));
+    if (length < 0 || length == sizeof(target)) {
         logger->warn("get_path_for_fd: unable to get path for {}, no lock will be created!", fd);
-        logger->warn(e.what());
-        result = "";
+        return "";
     }
-    return result;
+    return string(target, length);
 }
 
 /*
- * construct a local file name in /var/lock/localflock to use for the lock
+ * construct the name of the local lock file relative to the lock directory
  */
-string get_local_lock_path(string &path) {
-    string suffix;
+string get_local_lock_name(string &path) {
+    string result;
     // use human readable file names
     if (settings->SHOW_NAMES) {
-        suffix.assign(path, 1, string::npos);
-        for (int i=0; i < suffix.size(); i++) {
-            if (suffix[i] == '/') suffix[i] = '-';
+        result.assign(path, 1, string::npos);
+        for (int i=0; i < result.size(); i++) {
+            if (result[i] == '/') result[i] = '-';
         }
     // calculate a hash for the file name
     } else {
-        // length of the hash
-        unsigned int digest_len = gcry_md_get_algo_dlen(GCRY_MD_SHA1);
-        unsigned char* digest = (unsigned char *)malloc(digest_len * sizeof(unsigned char));
-        char* digest_encoded = (char *)malloc(digest_len*2+1 * sizeof(char));
-        gcry_md_hash_buffer(GCRY_MD_SHA1, digest, path.c_str(), path.size());
-
-        for (int i=0; i<digest_len; i++) {
-            sprintf(&digest_encoded[i * 2], "%02x", digest[i]);
-        }
-        digest_encoded[digest_len*2] = 0;
-        suffix = string(digest_encoded);
-        free(digest);
-        free(digest_encoded);
+        char digest[HASH_MAX_HEX_LEN];
+        size_t digest_len = hash_hex(settings->HASH, path.data(), path.size(), digest);
+        result.assign(digest, digest_len);
     }
-    string result = fmt::format("{}/{}", settings->LOCKDIR, suffix);
     return result;
 }
 
 /*
- * Create a new file and set permission for everyone
+ * construct the name of the local lock file of a file identity relative to the lock directory. Identity names are
+ * hashes even with LOCALFLOCK_SHOW_NAMES.
+ */
+string get_local_lock_name(const file_identity_t& identity) {
+    char digest[HASH_MAX_HEX_LEN];
+    size_t digest_len = hash_hex(settings->HASH, &identity, sizeof(identity), digest);
+    return string(digest, digest_len);
+}
+
+/*
+ * fds kept open by the library, one bit per fd. close_range and closefrom of the program leave them open.
+ */
+static atomic<uint64_t> internal_fds[INTERNAL_FDS_MAX / 64];
+
+void internal_fd_add(int fd) {
+    if ((unsigned int) fd >= INTERNAL_FDS_MAX) return;
+    internal_fds[fd / 64].fetch_or(uint64_t(1) << (fd % 64), memory_order_relaxed);
+}
+
+/*
+ * close a fd of the library.
  */
-int open_and_set_perm(string &path) {
-    int fd = open(path.c_str(), O_CREAT | O_RDWR);
+int internal_fd_close(int fd) {
+    if ((unsigned int) fd < INTERNAL_FDS_MAX) {
+        internal_fds[fd / 64].fetch_and(~(uint64_t(1) << (fd % 64)), memory_order_relaxed);
+    }
+    return originalClose(fd);
+}
 
-    // the file may already have to correct permissions, but a different owner. In this case, don't try to update
-    // the permissions.
-    filesystem::perms required_perms = filesystem::perms::all
-                                       & ~filesystem::perms::owner_exec
-                                       & ~filesystem::perms::group_exec
-                                       & ~filesystem::perms::others_exec;
-    filesystem::perms actual_perms = filesystem::status(path).permissions();
-    if (actual_perms != required_perms) {
-        logger->debug("updating permissions of {} from {} to {}.", path, perms_to_str(actual_perms), perms_to_str(required_perms));
-        try {
-            filesystem::permissions(path, required_perms);
-        } catch (const std::exception& e) {
-            logger->warn("open_and_set_perm: error during permission update:");
-            logger->warn(e.what());
+/*
+ * find the lowest fd of the library from first to last, including both. Returns -1 if there is none.
+ */
+int next_internal_fd(unsigned int first, unsigned int last) {
+    if (last >= INTERNAL_FDS_MAX) last = INTERNAL_FDS_MAX - 1;
+    for (unsigned int word = first / 64; first <= last && word <= last / 64; word++) {
+        uint64_t bits = internal_fds[word].load(memory_order_relaxed);
+        if (word == first / 64) bits &= ~uint64_t(0) << (first % 64);
+        if (bits == 0) continue;
+        unsigned int fd = word * 64 + __builtin_ctzll(bits);
+        return fd <= last ? (int) fd : -1;
+    }
+    return -1;
+}
+
+/*
+ * Open a file in the lock directory. If create is set, the file is created if necessary and gets read and write
+ * permissions for everyone. The permissions are only set for new files, existing files are opened with a single
+ * system call relative to the cached fd of the lock directory. If given, created tells whether the file is new.
+ * The fd belongs to the library and has to be closed with internal_fd_close.
+ */
+int open_and_set_perm(const string &name, bool create, bool* created) {
+    const mode_t required_perms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+    int fd = openat(settings->LOCKDIR_FD, name.c_str(), O_RDWR | O_CLOEXEC);
+    bool parents_created = false;
+    while (fd < 0 && errno == ENOENT && create) {
+        fd = openat(settings->LOCKDIR_FD, name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, required_perms);
+        // the first file in a subdirectory of the lock directory
+        if (fd < 0 && errno == ENOENT) {
+            if (parents_created || lockdir_create_parents(name) != 0) break;
+            parents_created = true;
+            errno = ENOENT;
+            continue;
+        }
+        if (fd >= 0) {
+            // the mode given to openat is reduced by the umask
+            if (fchmod(fd, required_perms) != 0) logger->warn("open_and_set_perm: unable to set permissions of {}", name);
+            stats_add(STAT_LOCK_FILES_CREATED);
+            if (created != nullptr) *created = true;
+            break;
         }
+        // another process was faster
+        if (errno == EEXIST) fd = openat(settings->LOCKDIR_FD, name.c_str(), O_RDWR | O_CLOEXEC);
+    }
+
+    // files created by older versions or other users may not be writable for us. flock works with read-only fds.
+    if (fd < 0 && errno == EACCES) {
+        logger->warn("open_and_set_perm: {} is not writable, opening it read-only", name);
+        fd = openat(settings->LOCKDIR_FD, name.c_str(), O_RDONLY | O_CLOEXEC);
     }
+    if (fd < 0) logger->error("open_and_set_perm: unable to open {}/{}", settings->LOCKDIR, name);
+    else internal_fd_add(fd);
     return fd;
 }
 
-/**
- * Create a string representation of the permission for usage in an error message
- */
-string perms_to_str(filesystem::perms p)
-{
-    string result = "";
-    if ((p & filesystem::perms::owner_read) != filesystem::perms::none) result += "r";
-    else result += "-";
-    if ((p & filesystem::perms::owner_write) != filesystem::perms::none) result += "w";
-    else result += "-";
-    if ((p & filesystem::perms::owner_exec) != filesystem::perms::none) result += "x";
-    else result += "-";
-    if ((p & filesystem::perms::group_read) != filesystem::perms::none) result += "r";
-    else result += "-";
-    if ((p & filesystem::perms::group_write) != filesystem::perms::none) result += "w";
-    else result += "-";
-    if ((p & filesystem::perms::group_exec) != filesystem::perms::none) result += "x";
-    else result += "-";
-    if ((p & filesystem::perms::others_read) != filesystem::perms::none) result += "r";
-    else result += "-";
-    if ((p & filesystem::perms::others_write) != filesystem::perms::none) result += "w";
-    else result += "-";
-    if ((p & filesystem::perms::others_exec) != filesystem::perms::none) result += "x";
-    else result += "-";
-    return result;
+/*
+ * get the pid of this process. The value is cached and updated in child processes after fork.
+ */
+static pid_t own_pid = 0;
+static uint64_t own_start_time = 0;
+pid_t get_own_pid() {
+    if (own_pid == 0) own_pid = getpid();
+    return own_pid;
+}
+
+/*
+ * get the start time of this process, cached like the pid.
+ */
+uint64_t get_own_start_time() {
+    if (own_start_time == 0) own_start_time = get_process_start_time(get_own_pid());
+    return own_start_time;
+}
+
+/*
+ * forget the cached pid and start time in a new child process.
+ */
+static void reset_own_pid() {
+    own_pid = 0;
+    own_start_time = 0;
+}
+
+/*
+ * get the start time of a process in clock ticks after boot from /proc/<pid>/stat. Returns 0 if the process does
+ * not exist.
+ */
+uint64_t get_process_start_time(pid_t pid) {
+    char path[32];
+    char buffer[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    originalClose(fd);
+    if (length <= 0) return 0;
+    buffer[length] = 0;
+
+    // the name of the command may contain spaces, the fields are counted from the last closing bracket. The start
+    // time is field 22, the field after the bracket is field 3.
+    char* pos = strrchr(buffer, ')');
+    if (pos == nullptr) return 0;
+    for (int field = 2; field < 22 && pos != nullptr; field++) {
+        pos = strchr(pos + 1, ' ');
+    }
+    if (pos == nullptr) return 0;
+    return strtoull(pos + 1, nullptr, 10);
+}
+
+/*
+ * check whether a process is still running. If a start time is given, it has to match as well, otherwise the pid
+ * was reused by another process.
+ */
+bool process_is_running(pid_t pid, uint64_t start_time) {
+    if (start_time == 0) return getpgid(pid) > 0;
+    return get_process_start_time(pid) == start_time;
+}
+
+/*
+ * parse a number of seconds with fractions, e.g., "30" or "0.5". Returns false for malformed and negative values.
+ */
+bool parse_seconds(const char* value, uint32_t& milliseconds) {
+    char* end;
+    double seconds = strtod(value, &end);
+    if (end == value || *end != 0 || !(seconds >= 0) || seconds > UINT32_MAX / 1000.0) return false;
+    milliseconds = (uint32_t) (seconds * 1000 + 0.5);
+    return true;
 }
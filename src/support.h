@@ -6,6 +6,7 @@
 
 // standard functions
 #include <string>
+#include <vector>
 #include <cstdlib>
 #include <filesystem>
 #include <thread>
@@ -18,9 +19,22 @@ using namespace std;
 #include "spdlog/fmt/fmt.h"
 extern shared_ptr<spdlog::logger> logger;
 
+// debug messages are only formatted if enabled. The check is a single load of a global flag, the arguments are not
+// evaluated otherwise. Building with LOCALFLOCK_DEBUG_LOG=OFF removes the messages completely.
+extern bool debug_enabled;
+#ifdef LOCALFLOCK_NO_DEBUG_LOG
+#define LOG_DEBUG(...) do {} while (0)
+#else
+#define LOG_DEBUG(...) do { if (__builtin_expect(debug_enabled, 0)) logger->debug(__VA_ARGS__); } while (0)
+#endif
+
 // calculation of hashes for filenames used to obscure filenames
-#include <gcrypt.h>
-extern gcry_md_hd_t hash_context;
+#include "hash.h"
+#include "lock_dir.h"
+#include "file_identity.h"
+
+// everything is hidden in the library except the overwritten functions and the public API
+#define LOCALFLOCK_EXPORT __attribute__ ((visibility ("default")))
 
 // Type definition for overwritten function
 #include <fcntl.h>
@@ -28,17 +42,40 @@ extern gcry_md_hd_t hash_context;
 typedef int (*original_flock_type)(int, int);
 typedef int (*original_fcntl_type)(int, int, ...);
 typedef int (*original_close_type)(int);
+typedef int (*original_dup_type)(int);
+typedef int (*original_dup2_type)(int, int);
+typedef int (*original_dup3_type)(int, int, int);
+typedef int (*original_close_range_type)(unsigned int, unsigned int, int);
+typedef void (*original_closefrom_type)(int);
 extern original_flock_type originalFlock;
 extern original_fcntl_type originalFcntl;
 extern original_close_type originalClose;
-extern bool init_called;
-extern mutex mtx;
+extern original_dup_type originalDup;
+extern original_dup2_type originalDup2;
+extern original_dup3_type originalDup3;
+// nullptr if the C library is older than glibc 2.34
+extern original_close_range_type originalCloseRange;
+extern original_closefrom_type originalClosefrom;
+
+// fds above this number opened by the library itself are not protected from bulk closes of the program
+#define INTERNAL_FDS_MAX (1 << 20)
 
 // own functions
+void init_original_functions();
+void create_logger(const string& name);
+void read_settings();
 string get_path_for_fd(int fd);
-string get_local_lock_path(string &path);
-int open_and_set_perm(string &path);
-string perms_to_str(filesystem::perms p);
+string get_local_lock_name(string &path);
+string get_local_lock_name(const file_identity_t& identity);
+int open_and_set_perm(const string &name, bool create, bool* created = nullptr);
+void internal_fd_add(int fd);
+int internal_fd_close(int fd);
+int next_internal_fd(unsigned int first, unsigned int last);
+pid_t get_own_pid();
+uint64_t get_own_start_time();
+uint64_t get_process_start_time(pid_t pid);
+bool process_is_running(pid_t pid, uint64_t start_time);
+bool parse_seconds(const char* value, uint32_t& milliseconds);
 
 // struct for settings
 struct settings_t {
@@ -46,10 +83,66 @@ struct settings_t {
     string LOCKDIR;
     // whether or not to show debug messages on stderr. Default: false.
     bool DEBUG;
-    // whether or not to obscure files names. Default: false.
+    // write messages asynchronously into this file instead of stderr. Default: empty, messages go to stderr.
+    string LOG_FILE;
+    // whether or not to obscure files names. With identity naming, the names stay hashes and the path is only
+    // recorded in new lock files. Default: false.
     bool SHOW_NAMES;
-    // name for the protocol file. Default: $LOCKDIR/protocl, not changeable
+    // hash algorithm for the names of lock files, as recorded in $LOCKDIR/format. The value of LOCALFLOCK_HASH is
+    // only used for new lock directories. Default: murmur3 for new directories, sha1 for existing ones.
+    hash_algorithm_t HASH;
+    // levels of subdirectories of LOCKDIR, as recorded in $LOCKDIR/format. The value of LOCALFLOCK_SHARD_LEVELS is
+    // only used for new lock directories. Default: 2 for new directories, 0 for existing ones.
+    uint32_t LEVELS;
+    // where locks are kept, as recorded in $LOCKDIR/format. The value of LOCALFLOCK_BACKEND is only used for new
+    // lock directories. Default: lock files.
+    lock_backend_t BACKEND;
+    // whether locks are named after the path or the identity of the original file, as recorded in $LOCKDIR/format.
+    // The value of LOCALFLOCK_NAMING is only used for new lock directories. Default: path.
+    lock_naming_t NAMING;
+    // stable names of devices for identity naming, from LOCALFLOCK_DEVICES. Default: empty, device numbers are used.
+    vector<device_name_t> DEVICES;
+    // number of records of a new shared memory lock table. Default: 16384.
+    uint32_t SHM_RECORDS;
+    // address of localflock-server, which keeps the locks of all hosts. If it cannot be reached, the locks are kept
+    // in LOCKDIR. Default: empty, no server.
+    string SERVER;
+    // fd of LOCKDIR opened with O_PATH, all files in LOCKDIR are opened relative to it.
+    int LOCKDIR_FD;
+    // name for the protocol file. Default: $LOCKDIR/registry, not changeable
     string PROTOCOL_FILE;
+    // number of slots in a newly created protocol. Default: 65536.
+    uint32_t PROTOCOL_SLOTS;
+    // number of protocol entries checked by each process on startup, 0 disables the cleanup. Default: 16.
+    uint32_t CLEANUP_SLOTS;
+    // filesystem types (f_type of statfs) whose locks are redirected to LOCKDIR, locks on other filesystems are
+    // passed through. Default: network and parallel filesystems, see POLICY_DEFAULT_FILESYSTEMS.
+    vector<long> FILESYSTEMS;
+    // record statistics in $LOCKDIR/stats, disabled by LOCALFLOCK_STATS=0. Default: true.
+    bool STATS;
+    // directory for the traces of all lock operations, from LOCALFLOCK_TRACE. Default: empty, nothing is traced.
+    string TRACE;
+    // directory for the profiles of lock hold times, from LOCALFLOCK_PROFILE. Default: empty, nothing is sampled.
+    string PROFILE;
+    // fraction of the acquired locks that are sampled, from LOCALFLOCK_PROFILE_RATE. Default: PROFILE_DEFAULT_RATE.
+    double PROFILE_RATE;
+    // redirect the locks on all filesystems, set by LOCALFLOCK_FILESYSTEMS=all.
+    bool ALL_FILESYSTEMS;
+    // path prefixes whose locks are always or never redirected, independent of the filesystem. Default: empty.
+    vector<string> INCLUDE;
+    vector<string> EXCLUDE;
+    // deadline of blocking waits for redirected locks in milliseconds, 0 waits forever. Default: 0.
+    uint32_t WAIT_DEADLINE_MS;
+    // deadlines of the files below path prefixes, the longest prefix wins over WAIT_DEADLINE_MS. Default: empty.
+    vector<pair<string, uint32_t>> WAIT_DEADLINES;
+    // errno of a blocking request whose deadline expired, EINTR or EAGAIN. Default: EINTR.
+    int WAIT_ERROR;
+    // interval of the messages about requests still waiting for a redirected lock in milliseconds, 0 disables them.
+    // Default: 0.
+    uint32_t WAIT_REPORT_MS;
+    // queue blocking flock requests of redirected locks in the order they arrived, set by LOCALFLOCK_FAIR=1.
+    // Default: false.
+    bool FAIR;
 };
 extern shared_ptr<settings_t> settings;
 
@@ -0,0 +1,184 @@
+/*
+ * Recording of lock operations into a memory mapped file per process.
+ */
+
+#include "trace.h"
+#include "lock_info.h"
+#include "support.h"
+#include "stats.h"
+#include <mutex>
+#include <ctime>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+bool trace_active = false;
+// the file of this process, created with the first record. Protected by trace_mtx, the chunks are only added.
+static mutex trace_mtx;
+static int trace_fd = -1;
+static atomic<trace_header_t*> trace_header(nullptr);
+static atomic<trace_record_t*> trace_chunks[TRACE_MAX_CHUNKS];
+// thread id of the calling thread, with the process it was read in
+static thread_local pid_t own_tid = 0;
+static thread_local pid_t own_tid_pid = 0;
+
+/*
+ * a child process gets its own file with the first record, the mappings of the parent are removed.
+ */
+static void trace_reset_in_child() {
+    new (&trace_mtx) mutex();
+    for (auto& chunk: trace_chunks) {
+        trace_record_t* records = chunk.exchange(nullptr, memory_order_relaxed);
+        if (records != nullptr) munmap(records, TRACE_CHUNK_RECORDS * sizeof(trace_record_t));
+    }
+    trace_header_t* header = trace_header.exchange(nullptr, memory_order_relaxed);
+    if (header != nullptr) munmap(header, TRACE_HEADER_SIZE);
+    if (trace_fd >= 0) internal_fd_close(trace_fd);
+    trace_fd = -1;
+}
+
+/*
+ * record lock operations in this process if LOCALFLOCK_TRACE is set. Only the library does this, not the tools.
+ */
+void trace_enable() {
+    if (settings->TRACE.empty()) return;
+    trace_active = true;
+    pthread_atfork(nullptr, nullptr, trace_reset_in_child);
+}
+
+/*
+ * create the file of this process. trace_mtx has to be held by the caller.
+ */
+static trace_header_t* trace_create() {
+    mkdir(settings->TRACE.c_str(), 0755);
+    string path = fmt::format("{}/{}-{}.trace", settings->TRACE, get_own_pid(), get_own_start_time());
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, TRACE_HEADER_SIZE) != 0) {
+        logger->error("unable to create the trace file {}, lock operations are not recorded", path);
+        if (fd >= 0) originalClose(fd);
+        trace_active = false;
+        return nullptr;
+    }
+    void* mapping = mmap(nullptr, TRACE_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        logger->error("unable to map the trace file {}, lock operations are not recorded", path);
+        originalClose(fd);
+        trace_active = false;
+        return nullptr;
+    }
+    internal_fd_add(fd);
+    auto* header = (trace_header_t*) mapping;
+    struct timespec realtime, monotonic;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    header->realtime_offset_ns = (realtime.tv_sec - monotonic.tv_sec) * 1000000000LL +
+                                 (realtime.tv_nsec - monotonic.tv_nsec);
+    header->pid = get_own_pid();
+    header->record_size = sizeof(trace_record_t);
+    header->version = TRACE_VERSION;
+    header->magic = TRACE_MAGIC;
+    trace_fd = fd;
+    return header;
+}
+
+/*
+ * the header of the file of this process, which is created if needed. nullptr if it cannot be created.
+ */
+static trace_header_t* get_header() {
+    trace_header_t* header = trace_header.load(memory_order_acquire);
+    if (header != nullptr) return header;
+    lock_guard<mutex> guard(trace_mtx);
+    header = trace_header.load(memory_order_relaxed);
+    if (header == nullptr && trace_active) {
+        header = trace_create();
+        trace_header.store(header, memory_order_release);
+    }
+    return header;
+}
+
+/*
+ * the record at index, the file is extended by a chunk if needed. nullptr if the file is full.
+ */
+static trace_record_t* get_record(uint64_t index) {
+    uint64_t chunk = index / TRACE_CHUNK_RECORDS;
+    if (chunk >= TRACE_MAX_CHUNKS) return nullptr;
+    trace_record_t* records = trace_chunks[chunk].load(memory_order_acquire);
+    if (records == nullptr) {
+        lock_guard<mutex> guard(trace_mtx);
+        records = trace_chunks[chunk].load(memory_order_relaxed);
+        if (records == nullptr) {
+            size_t size = TRACE_CHUNK_RECORDS * sizeof(trace_record_t);
+            off_t offset = TRACE_HEADER_SIZE + chunk * size;
+            struct stat st;
+            if (fstat(trace_fd, &st) != 0 || (st.st_size < offset + (off_t) size &&
+                                             ftruncate(trace_fd, offset + size) != 0)) {
+                return nullptr;
+            }
+            void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, offset);
+            if (mapping == MAP_FAILED) return nullptr;
+            records = (trace_record_t*) mapping;
+            trace_chunks[chunk].store(records, memory_order_release);
+        }
+    }
+    return records + index % TRACE_CHUNK_RECORDS;
+}
+
+/*
+ * append one record. errno is not changed.
+ */
+static void trace_add(trace_op_t operation, int fd, LockInfo* info, int command, int16_t type, int64_t start,
+                      int64_t length, uint64_t time, uint64_t end, int error) {
+    int saved_errno = errno;
+    trace_header_t* header = get_header();
+    if (header != nullptr) {
+        uint64_t index = header->count.fetch_add(1, memory_order_relaxed);
+        trace_record_t* record = get_record(index);
+        if (record == nullptr) {
+            header->dropped.fetch_add(1, memory_order_relaxed);
+        } else {
+            if (own_tid_pid != get_own_pid()) {
+                own_tid = (pid_t) syscall(SYS_gettid);
+                own_tid_pid = get_own_pid();
+            }
+            record->time_ns = time;
+            record->wait_ns = end - time;
+            record->file = info->file_id();
+            record->start = start;
+            record->length = length;
+            record->pid = get_own_pid();
+            record->tid = own_tid;
+            record->fd = fd;
+            record->type = type;
+            record->command = command;
+            record->error = error;
+            record->operation.store(operation, memory_order_release);
+        }
+    }
+    errno = saved_errno;
+}
+
+/*
+ * record a flock operation that started at start and just finished with result.
+ */
+void trace_flock(int fd, LockInfo* info, int operation, uint64_t start, int result) {
+    trace_add(TRACE_FLOCK, fd, info, operation, 0, 0, 0, start, stats_clock(), result == 0 ? 0 : errno);
+}
+
+/*
+ * record a fcntl lock operation on the absolute range.
+ */
+void trace_fcntl(int fd, LockInfo* info, int command, const struct flock* range, uint64_t start, int result) {
+    trace_add(TRACE_FCNTL, fd, info, command, range->l_type, range->l_start, range->l_len, start, stats_clock(),
+              result == 0 ? 0 : errno);
+}
+
+void trace_close(int fd, LockInfo* info) {
+    uint64_t now = stats_clock();
+    trace_add(TRACE_CLOSE, fd, info, 0, 0, 0, 0, now, now, 0);
+}
+
+void trace_dup(int fd, LockInfo* info, int new_fd) {
+    uint64_t now = stats_clock();
+    trace_add(TRACE_DUP, fd, info, new_fd, 0, 0, 0, now, now, 0);
+}
@@ -0,0 +1,89 @@
+/*
+ * Trace of all lock operations, enabled with LOCALFLOCK_TRACE=<directory>. Every process appends fixed-size binary
+ * records to its own file in this directory, <pid>-<start time>.trace, which is mapped into memory: recording an
+ * operation is an atomic increment and a copy, without a system call. The file grows in chunks of
+ * TRACE_CHUNK_RECORDS. A record is complete once its operation is set, the records of a process that was killed
+ * while writing them are skipped. localflock-replay merges the files of all processes and executes them again.
+ */
+
+#ifndef LOCALFLOCK_TRACE_H
+#define LOCALFLOCK_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <fcntl.h>
+
+using namespace std;
+
+// identification of a trace file, it starts with "lclftrc".
+#define TRACE_MAGIC 0x006372747466636cULL
+#define TRACE_VERSION 1
+// the records start after the header, at this offset
+#define TRACE_HEADER_SIZE 4096
+// records mapped at once, 1 MiB
+#define TRACE_CHUNK_RECORDS 16384
+// further records of a process are dropped, 4 GiB
+#define TRACE_MAX_CHUNKS 4096
+
+enum trace_op_t : uint16_t {
+    TRACE_NONE = 0,
+    // flock, command is the operation
+    TRACE_FLOCK = 1,
+    // fcntl lock commands, command is the fcntl command and type, start and length the range
+    TRACE_FCNTL = 2,
+    // close of a fd with lock information
+    TRACE_CLOSE = 3,
+    // duplicate of a fd with lock information, the new fd is in command
+    TRACE_DUP = 4
+};
+
+struct trace_record_t {
+    // start of the operation, CLOCK_MONOTONIC in nanoseconds, which is the same for all processes of a host.
+    uint64_t time_ns;
+    // duration of the operation, including the time spent waiting for the lock.
+    uint64_t wait_ns;
+    // the locked file: hash of the name of its lock, see LockInfo::lock_name.
+    uint64_t file;
+    // absolute start and length of fcntl locks, as after F_GETLK for F_GETLK commands
+    int64_t start;
+    int64_t length;
+    int32_t pid;
+    int32_t tid;
+    int32_t fd;
+    // trace_op_t, written last
+    atomic<uint16_t> operation;
+    // l_type of fcntl locks
+    int16_t type;
+    int32_t command;
+    // 0 or the errno of the operation
+    int32_t error;
+};
+static_assert(sizeof(trace_record_t) == 64, "trace records have to keep their size");
+
+// start of a trace file
+struct trace_header_t {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    int32_t pid;
+    uint32_t reserved;
+    // CLOCK_REALTIME minus CLOCK_MONOTONIC when the file was created, to show the time of the records
+    int64_t realtime_offset_ns;
+    // records reserved by writers, the last ones may not be complete
+    atomic<uint64_t> count;
+    // records dropped as the file reached TRACE_MAX_CHUNKS
+    atomic<uint64_t> dropped;
+};
+
+class LockInfo;
+
+// whether operations are recorded in this process
+extern bool trace_active;
+
+void trace_enable();
+void trace_flock(int fd, LockInfo* info, int operation, uint64_t start, int result);
+void trace_fcntl(int fd, LockInfo* info, int command, const struct flock* range, uint64_t start, int result);
+void trace_close(int fd, LockInfo* info);
+void trace_dup(int fd, LockInfo* info, int new_fd);
+
+#endif //LOCALFLOCK_TRACE_H
@@ -0,0 +1,332 @@
+/*
+ * Test for localflock_lock_async: requests granted at once and after waiting, deadlines, cancellation, the wakeup
+ * by locks released within the process, many pending requests without a thread each and fork. The test is not
+ * linked with the library, it uses the weak declarations of the public header.
+ *
+ * The test runs itself as workload under LD_PRELOAD, once with lock files and once with the shared memory backend.
+ * Each workload process reads commands from stdin and answers with one line, so that the test can interleave the
+ * processes.
+ *
+ * Usage: async_lock <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <sstream>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "localflock.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const string& name, bool ok) {
+    printf("%-60s %s\n", name.c_str(), ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+static string result_name(int result) {
+    if (result == 0) return "ok";
+    if (errno == EINPROGRESS) return "EINPROGRESS";
+    if (errno == ETIMEDOUT) return "ETIMEDOUT";
+    if (errno == ECANCELED) return "ECANCELED";
+    if (errno == EALREADY) return "EALREADY";
+    return to_string(errno);
+}
+
+static bool readable(int handle, int timeout_ms) {
+    struct pollfd request = {handle, POLLIN, 0};
+    return poll(&request, 1, timeout_ms) == 1;
+}
+
+static int thread_count() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 8, "Threads:") == 0) return atoi(line.c_str() + 8);
+    }
+    return -1;
+}
+
+/*
+ * the program running under LD_PRELOAD. Commands:
+ *   "hold <path>": lock a new fd exclusively with flock, it stays locked until release
+ *   "release": unlock and close the fds of hold
+ *   "try <path>": answer whether a new fd could be locked exclusively without waiting
+ *   "async <ex|sh> <timeout> <path>": open a new fd and start a request for it
+ *   "wait <ms>": answer whether the handle of the request becomes readable within ms
+ *   "result", "cancel", "close": the functions of the API for the handle of the request
+ *   "unlock": unlock and close the fd of the request
+ *   "local <path>": wait for a lock held by another fd of this process, which is released later
+ *   "many <count> <path>": start count shared requests on new fds, answer the number of threads
+ *   "waitall <ms>": answer how many handles of many became readable within ms, all are closed
+ *   "fork": answer whether a child process sees the pending request cancelled
+ */
+static int workload() {
+    char line[4096];
+    vector<int> held;
+    int fd = -1, handle = -1;
+    vector<int> many_fds, many_handles;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        line[strcspn(line, "\n")] = 0;
+        istringstream input(line);
+        string command, mode, path;
+        input >> command;
+        string answer = "no";
+        if (command == "hold") {
+            input >> path;
+            held.push_back(open(path.c_str(), O_RDWR));
+            if (flock(held.back(), LOCK_EX) == 0) answer = "ok";
+        } else if (command == "release") {
+            answer = "ok";
+            for (int held_fd: held) {
+                if (flock(held_fd, LOCK_UN) != 0) answer = "no";
+                close(held_fd);
+            }
+            held.clear();
+        } else if (command == "try") {
+            input >> path;
+            int try_fd = open(path.c_str(), O_RDWR);
+            if (try_fd >= 0 && flock(try_fd, LOCK_EX | LOCK_NB) == 0) answer = "ok";
+            close(try_fd);
+        } else if (command == "async") {
+            int timeout;
+            input >> mode >> timeout >> path;
+            fd = open(path.c_str(), O_RDWR);
+            handle = localflock_lock_async(fd, mode == "ex" ? LOCK_EX : LOCK_SH, timeout);
+            answer = handle >= 0 ? "ok" : result_name(-1);
+        } else if (command == "wait") {
+            int timeout;
+            input >> timeout;
+            answer = readable(handle, timeout) ? "ready" : "pending";
+        } else if (command == "result") {
+            answer = result_name(localflock_async_result(handle));
+        } else if (command == "cancel") {
+            answer = result_name(localflock_async_cancel(handle));
+        } else if (command == "close") {
+            answer = result_name(localflock_async_close(handle));
+        } else if (command == "unlock") {
+            answer = result_name(flock(fd, LOCK_UN));
+            close(fd);
+        } else if (command == "local") {
+            input >> path;
+            int holder = open(path.c_str(), O_RDWR);
+            int waiter = open(path.c_str(), O_RDWR);
+            flock(holder, LOCK_EX);
+            int local_handle = localflock_lock_async(waiter, LOCK_EX, -1);
+            // let the retries of the request reach their longest interval
+            bool pending = !readable(local_handle, 200);
+            auto released = chrono::steady_clock::now();
+            flock(holder, LOCK_UN);
+            bool ready = readable(local_handle, 1000);
+            auto waited = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - released);
+            if (pending && ready && localflock_async_result(local_handle) == 0 && waited.count() < 20) answer = "ok";
+            localflock_async_close(local_handle);
+            close(waiter);
+            close(holder);
+        } else if (command == "many") {
+            int count;
+            input >> count >> path;
+            answer = "ok";
+            for (int i = 0; i < count; i++) {
+                many_fds.push_back(open(path.c_str(), O_RDWR));
+                many_handles.push_back(localflock_lock_async(many_fds.back(), LOCK_SH, -1));
+                if (many_handles.back() < 0 || localflock_async_result(many_handles.back()) == 0) answer = "no";
+            }
+            if (answer == "ok") answer = to_string(thread_count());
+        } else if (command == "waitall") {
+            int timeout;
+            input >> timeout;
+            int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            for (int many_handle: many_handles) {
+                struct epoll_event event = {};
+                event.events = EPOLLIN | EPOLLONESHOT;
+                event.data.fd = many_handle;
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, many_handle, &event);
+            }
+            size_t granted = 0;
+            auto end = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+            while (granted < many_handles.size() && chrono::steady_clock::now() < end) {
+                struct epoll_event events[64];
+                int ready = epoll_wait(epoll_fd, events, 64, 100);
+                for (int i = 0; i < ready; i++) {
+                    if (localflock_async_result(events[i].data.fd) == 0) granted++;
+                }
+            }
+            close(epoll_fd);
+            for (int many_handle: many_handles) localflock_async_close(many_handle);
+            for (int many_fd: many_fds) close(many_fd);
+            many_handles.clear();
+            many_fds.clear();
+            answer = to_string(granted);
+        } else if (command == "fork") {
+            pid_t child = fork();
+            if (child == 0) {
+                bool cancelled = localflock_async_result(handle) != 0 && errno == ECANCELED;
+                _exit(cancelled ? 0 : 1);
+            }
+            int status;
+            waitpid(child, &status, 0);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) answer = "ok";
+        }
+        printf("%s\n", answer.c_str());
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// a running workload process
+struct worker_t {
+    pid_t pid;
+    FILE* commands;
+    FILE* answers;
+};
+
+static worker_t start_worker(const char* program, const char* library, const string& lockdir,
+                             const string& backend) {
+    int to_child[2], from_child[2];
+    // other workers must not inherit the pipes, they would not see the end of their input
+    if (pipe2(to_child, O_CLOEXEC) != 0 || pipe2(from_child, O_CLOEXEC) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        setenv("LOCALFLOCK_BACKEND", backend.c_str(), 1);
+        execl("/proc/self/exe", program, "--workload", nullptr);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    return {child, fdopen(to_child[1], "w"), fdopen(from_child[0], "r")};
+}
+
+static string send(worker_t& worker, const string& command) {
+    fprintf(worker.commands, "%s\n", command.c_str());
+    fflush(worker.commands);
+    char line[256];
+    if (fgets(line, sizeof(line), worker.answers) == nullptr) return "";
+    line[strcspn(line, "\n")] = 0;
+    return line;
+}
+
+static void stop_worker(worker_t& worker) {
+    fclose(worker.commands);
+    fclose(worker.answers);
+    int status;
+    waitpid(worker.pid, &status, 0);
+}
+
+static string create_file(const string& directory, const string& name) {
+    string path = directory + "/" + name;
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+/*
+ * all checks with one backend
+ */
+static void run(const char* program, const char* library, const string& directory, const string& backend) {
+    string lockdir = directory + "/locks-" + backend;
+    vector<string> files;
+    for (int i = 0; i < 7; i++) files.push_back(create_file(directory, "file" + to_string(i)));
+    worker_t a = start_worker(program, library, lockdir, backend);
+    worker_t b = start_worker(program, library, lockdir, backend);
+    worker_t c = start_worker(program, library, lockdir, backend);
+    string prefix = backend + ": ";
+
+    check(prefix + "free lock: request started", send(a, "async ex -1 " + files[0]) == "ok");
+    check(prefix + "free lock: granted at once", send(a, "wait 0") == "ready" && send(a, "result") == "ok");
+    check(prefix + "free lock: handle closed", send(a, "close") == "ok" && send(a, "unlock") == "ok");
+
+    check(prefix + "held lock: request started", send(b, "hold " + files[1]) == "ok" &&
+                                                 send(a, "async ex -1 " + files[1]) == "ok");
+    check(prefix + "held lock: pending", send(a, "wait 100") == "pending" && send(a, "result") == "EINPROGRESS");
+    check(prefix + "held lock: granted after the release", send(b, "release") == "ok" &&
+                                                           send(a, "wait 2000") == "ready" &&
+                                                           send(a, "result") == "ok");
+    check(prefix + "held lock: kept after closing the handle", send(a, "close") == "ok" &&
+                                                               send(c, "try " + files[1]) == "no");
+    check(prefix + "held lock: unlocked", send(a, "unlock") == "ok" && send(c, "try " + files[1]) == "ok");
+
+    check(prefix + "deadline: request started", send(b, "hold " + files[2]) == "ok" &&
+                                                 send(a, "async ex 300 " + files[2]) == "ok");
+    check(prefix + "deadline: pending before", send(a, "wait 50") == "pending");
+    check(prefix + "deadline: timed out", send(a, "wait 2000") == "ready" && send(a, "result") == "ETIMEDOUT");
+    send(a, "close");
+    send(a, "unlock");
+    send(b, "release");
+
+    check(prefix + "cancel: request started", send(b, "hold " + files[3]) == "ok" &&
+                                              send(a, "async ex -1 " + files[3]) == "ok");
+    check(prefix + "cancel: cancelled", send(a, "cancel") == "ok" && send(a, "wait 0") == "ready" &&
+                                        send(a, "result") == "ECANCELED");
+    check(prefix + "cancel: finished requests are not cancelled", send(a, "cancel") == "EALREADY");
+    send(b, "release");
+    usleep(100000);
+    check(prefix + "cancel: lock not taken later", send(c, "try " + files[3]) == "ok");
+    send(a, "close");
+    send(a, "unlock");
+
+    check(prefix + "local release: woken at once", send(a, "local " + files[4]) == "ok");
+
+    check(prefix + "many: lock held", send(b, "hold " + files[5]) == "ok");
+    string threads = send(a, "many 300 " + files[5]);
+    check(prefix + "many: one thread for all requests", threads == "2");
+    check(prefix + "many: all granted after the release", send(b, "release") == "ok" &&
+                                                          send(a, "waitall 5000") == "300");
+
+    check(prefix + "fork: request started", send(b, "hold " + files[6]) == "ok" &&
+                                            send(a, "async ex -1 " + files[6]) == "ok");
+    check(prefix + "fork: cancelled in the child", send(a, "fork") == "ok");
+    check(prefix + "fork: still pending in the parent", send(a, "result") == "EINPROGRESS");
+    check(prefix + "fork: granted in the parent", send(b, "release") == "ok" && send(a, "wait 2000") == "ready" &&
+                                                  send(a, "result") == "ok");
+    send(a, "close");
+    send(a, "unlock");
+
+    stop_worker(a);
+    stop_worker(b);
+    stop_worker(c);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--workload") == 0) return workload();
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/async_lock.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+
+    check("api: not available without the library", localflock_lock_async == nullptr);
+    run(argv[0], argv[1], directory, "file");
+    run(argv[0], argv[1], directory, "shm");
+
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
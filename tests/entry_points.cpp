@@ -0,0 +1,171 @@
+/*
+ * Test for the entry points besides flock, fcntl and close: the bulk closes close_range and closefrom, fcntl64 as
+ * used by programs built with 64 bit file offsets, and lockf.
+ *
+ * The test runs itself as workload under LD_PRELOAD. Whether a file is locked is checked by a new process that
+ * opens the file on its own and tries to lock it without waiting.
+ *
+ * Usage: entry_points <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const char* name, bool ok) {
+    printf("%-50s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+/*
+ * check in a new process whether the file can be locked with flock.
+ */
+static bool can_flock(const string& path) {
+    pid_t child = fork();
+    if (child == 0) {
+        int fd = open(path.c_str(), O_RDWR);
+        _exit(flock(fd, LOCK_EX | LOCK_NB) == 0 ? 0 : 1);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * check in a new process whether a range of the file can be locked with a POSIX lock.
+ */
+static bool can_lock_range(const string& path, off_t start, off_t length) {
+    pid_t child = fork();
+    if (child == 0) {
+        int fd = open(path.c_str(), O_RDWR);
+        struct flock arg = {};
+        arg.l_type = F_WRLCK;
+        arg.l_whence = SEEK_SET;
+        arg.l_start = start;
+        arg.l_len = length;
+        _exit(fcntl(fd, F_SETLK, &arg) == 0 ? 0 : 1);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * check in a new process what lockf(F_TEST) reports for the whole file.
+ */
+static bool lockf_test_reports_lock(const string& path) {
+    pid_t child = fork();
+    if (child == 0) {
+        int fd = open(path.c_str(), O_RDWR);
+        _exit(lockf(fd, F_TEST, 0) != 0 && errno == EACCES ? 0 : 1);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static string create_file(const char* directory, const string& name) {
+    string path = string(directory) + "/" + name;
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+/*
+ * lock a few files with fds next to each other, returns the first fd.
+ */
+static int lock_files(const char* directory, const char* prefix, string* paths, int count) {
+    int first = -1;
+    for (int i = 0; i < count; i++) {
+        paths[i] = create_file(directory, prefix + to_string(i));
+        int fd = open(paths[i].c_str(), O_RDWR);
+        flock(fd, LOCK_EX);
+        if (first < 0) first = fd;
+    }
+    return first;
+}
+
+/*
+ * the program running under LD_PRELOAD.
+ */
+static int workload(const char* directory) {
+    string paths[3];
+    int first = lock_files(directory, "close_range", paths, 3);
+    close_range(first, first + 2, CLOSE_RANGE_CLOEXEC);
+    check("close_range: CLOEXEC keeps the locks", !can_flock(paths[1]));
+    close_range(first, ~0U, 0);
+    check("close_range: locks released", can_flock(paths[0]) && can_flock(paths[1]) && can_flock(paths[2]));
+    // the fd numbers are used again, they must not refer to the old lock files
+    string other = create_file(directory, "reused");
+    int fd = open(other.c_str(), O_RDWR);
+    flock(fd, LOCK_EX);
+    check("close_range: reused fd locks the new file", fd == first && !can_flock(other) && can_flock(paths[0]));
+    close(fd);
+
+    first = lock_files(directory, "closefrom", paths, 3);
+    closefrom(first + 1);
+    check("closefrom: locks below the range kept", !can_flock(paths[0]));
+    check("closefrom: locks released", can_flock(paths[1]) && can_flock(paths[2]));
+    close(first);
+
+    // fcntl64 is used instead of fcntl by programs built with _FILE_OFFSET_BITS=64
+    string path = create_file(directory, "fcntl64");
+    fd = open(path.c_str(), O_RDWR);
+    struct flock arg = {};
+    arg.l_type = F_WRLCK;
+    arg.l_whence = SEEK_SET;
+    fcntl64(fd, F_SETLK, &arg);
+    check("fcntl64: lock on the local file", !can_lock_range(path, 0, 0));
+    close(fd);
+
+    // lockf locks relative to the current offset of the file
+    path = create_file(directory, "lockf");
+    fd = open(path.c_str(), O_RDWR);
+    lseek(fd, 100, SEEK_SET);
+    check("lockf: F_TLOCK", lockf(fd, F_TLOCK, 10) == 0);
+    check("lockf: range starts at the offset", can_lock_range(path, 0, 100) && !can_lock_range(path, 105, 1));
+    check("lockf: F_TEST in another process", lockf_test_reports_lock(path));
+    check("lockf: F_ULOCK", lockf(fd, F_ULOCK, 10) == 0 && can_lock_range(path, 100, 10));
+    close(fd);
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && strcmp(argv[1], "--workload") == 0) return workload(argv[2]);
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/entry_points.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string lockdir = directory + "/locks";
+
+    pid_t child = fork();
+    if (child == 0) {
+        setenv("LD_PRELOAD", argv[1], 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        // the scratch directory is on a local filesystem, whose locks are passed through by default
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        execl("/proc/self/exe", argv[0], "--workload", directory.c_str(), nullptr);
+        _exit(127);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    filesystem::remove_all(directory);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,240 @@
+/*
+ * Test for LOCALFLOCK_FAIR: a waiting exclusive flock request holds back later shared requests, which get their
+ * lock once the exclusive one is done, non-blocking requests fail while it waits, and the queue moves on when a
+ * queued process dies. Without the fair mode, the later shared requests pass the exclusive one. Runs with lock files
+ * and with the shm backend.
+ *
+ * The test runs itself as workload under LD_PRELOAD. Each workload process reads commands from stdin and answers
+ * with one line, so that the test can interleave the processes.
+ *
+ * Usage: fair_queue <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <sstream>
+#include <filesystem>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// time a blocked request is given to answer before it is considered waiting
+#define BLOCKED_MS 200
+
+static int failures = 0;
+
+static void check(const string& name, bool ok) {
+    printf("%-60s %s\n", name.c_str(), ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+/*
+ * the program running under LD_PRELOAD. Commands, answered with the result and the milliseconds it took:
+ *   "sh <path>", "ex <path>": open a new fd and take a shared or exclusive flock lock, waiting for it
+ *   "shnb <path>": the same with a shared lock and LOCK_NB
+ *   "unlock <path>": close the fds opened for path
+ */
+static int workload() {
+    char line[4096];
+    multimap<string, int> fds;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        line[strcspn(line, "\n")] = 0;
+        istringstream input(line);
+        string command, path;
+        input >> command >> path;
+        auto start = chrono::steady_clock::now();
+        string answer = "unknown";
+        if (command == "sh" || command == "ex" || command == "shnb") {
+            int fd = open(path.c_str(), O_RDWR);
+            int operation = command == "ex" ? LOCK_EX : command == "sh" ? LOCK_SH : LOCK_SH | LOCK_NB;
+            if (flock(fd, operation) == 0) answer = "ok";
+            else answer = errno == EWOULDBLOCK ? "EWOULDBLOCK" : strerror(errno);
+            fds.emplace(path, fd);
+        } else if (command == "unlock") {
+            auto range = fds.equal_range(path);
+            for (auto entry = range.first; entry != range.second; entry++) close(entry->second);
+            fds.erase(path);
+            answer = "ok";
+        }
+        long elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        printf("%s %ld\n", answer.c_str(), elapsed);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// a running workload process
+struct worker_t {
+    pid_t pid;
+    FILE* commands;
+    FILE* answers;
+};
+
+static worker_t start_worker(const char* program, const char* library, const string& lockdir, const string& backend,
+                             bool fair) {
+    int to_child[2], from_child[2];
+    // other workers must not inherit the pipes, they would not see the end of their input
+    if (pipe2(to_child, O_CLOEXEC) != 0 || pipe2(from_child, O_CLOEXEC) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        setenv("LOCALFLOCK_BACKEND", backend.c_str(), 1);
+        if (fair) setenv("LOCALFLOCK_FAIR", "1", 1);
+        execl("/proc/self/exe", program, "--workload", nullptr);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    return {child, fdopen(to_child[1], "w"), fdopen(from_child[0], "r")};
+}
+
+static void post(worker_t& worker, const string& command) {
+    fprintf(worker.commands, "%s\n", command.c_str());
+    fflush(worker.commands);
+}
+
+/*
+ * whether the worker answered its last command within timeout_ms
+ */
+static bool answered(worker_t& worker, int timeout_ms) {
+    struct pollfd pfd = {fileno(worker.answers), POLLIN, 0};
+    return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+/*
+ * the answer to the last command, with the milliseconds it took in elapsed
+ */
+static string answer(worker_t& worker, long& elapsed) {
+    char line[256];
+    if (fgets(line, sizeof(line), worker.answers) == nullptr) return "";
+    line[strcspn(line, "\n")] = 0;
+    char* separator = strrchr(line, ' ');
+    if (separator == nullptr) return "";
+    elapsed = atol(separator + 1);
+    *separator = 0;
+    return line;
+}
+
+static string answer(worker_t& worker) {
+    long elapsed;
+    return answer(worker, elapsed);
+}
+
+static string send(worker_t& worker, const string& command) {
+    post(worker, command);
+    return answer(worker);
+}
+
+static void stop_worker(worker_t& worker) {
+    fclose(worker.commands);
+    fclose(worker.answers);
+    int status;
+    waitpid(worker.pid, &status, 0);
+}
+
+/*
+ * all checks with one backend
+ */
+static void run(const char* program, const char* library, const string& directory, const string& backend) {
+    string lockdir = directory + "/locks-" + backend;
+    string path = directory + "/data";
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    string prefix = backend + ": ";
+    long elapsed = 0;
+
+    // a shared lock is held while an exclusive request waits, a later shared request waits behind it
+    worker_t holder = start_worker(program, library, lockdir, backend, true);
+    worker_t writer = start_worker(program, library, lockdir, backend, true);
+    worker_t reader = start_worker(program, library, lockdir, backend, true);
+    worker_t other = start_worker(program, library, lockdir, backend, true);
+    check(prefix + "fair: shared lock", send(holder, "sh " + path) == "ok");
+    post(writer, "ex " + path);
+    check(prefix + "fair: exclusive request waits", !answered(writer, BLOCKED_MS));
+    post(reader, "sh " + path);
+    check(prefix + "fair: later shared request waits", !answered(reader, BLOCKED_MS));
+    check(prefix + "fair: LOCK_NB fails while a request waits", send(other, "shnb " + path) == "EWOULDBLOCK");
+    send(holder, "unlock " + path);
+    check(prefix + "fair: exclusive request first", answer(writer) == "ok" && !answered(reader, BLOCKED_MS));
+    send(writer, "unlock " + path);
+    check(prefix + "fair: then the shared request", answer(reader) == "ok");
+    send(reader, "unlock " + path);
+    send(other, "unlock " + path);
+
+    // a queued process that dies does not hold back the requests behind it
+    check(prefix + "dead: shared lock", send(holder, "sh " + path) == "ok");
+    post(writer, "ex " + path);
+    usleep(BLOCKED_MS * 1000);
+    post(reader, "sh " + path);
+    usleep(BLOCKED_MS * 1000);
+    kill(writer.pid, SIGKILL);
+    stop_worker(writer);
+    check(prefix + "dead: shared request proceeds", answer(reader, elapsed) == "ok" && elapsed < 5000);
+    send(reader, "unlock " + path);
+    send(holder, "unlock " + path);
+    stop_worker(reader);
+    stop_worker(other);
+    stop_worker(holder);
+
+    // without the fair mode, the shared request passes the waiting exclusive request
+    holder = start_worker(program, library, lockdir, backend, false);
+    writer = start_worker(program, library, lockdir, backend, false);
+    reader = start_worker(program, library, lockdir, backend, false);
+    check(prefix + "unfair: shared lock", send(holder, "sh " + path) == "ok");
+    post(writer, "ex " + path);
+    check(prefix + "unfair: exclusive request waits", !answered(writer, BLOCKED_MS));
+    check(prefix + "unfair: later shared request passes", send(reader, "sh " + path) == "ok");
+    send(holder, "unlock " + path);
+    send(reader, "unlock " + path);
+    check(prefix + "unfair: exclusive lock at last", answer(writer) == "ok");
+    stop_worker(writer);
+    stop_worker(reader);
+    stop_worker(holder);
+
+    // the segments are named after the lock directory
+    struct stat st;
+    if (stat(lockdir.c_str(), &st) == 0) {
+        char name[64];
+        snprintf(name, sizeof(name), "/localflock-%lx-%lx", (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+        shm_unlink(name);
+        snprintf(name, sizeof(name), "/localflock-fair-%lx-%lx", (unsigned long) st.st_dev,
+                 (unsigned long) st.st_ino);
+        shm_unlink(name);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--workload") == 0) return workload();
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/fair_queue.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    run(argv[0], argv[1], directory, "file");
+    run(argv[0], argv[1], directory, "shm");
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
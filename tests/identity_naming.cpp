@@ -0,0 +1,226 @@
+/*
+ * Test for lock directories with identity naming: hardlinks share their locks, renaming a locked file keeps the
+ * lock, the path is only recorded with LOCALFLOCK_SHOW_NAMES and LOCALFLOCK_DEVICES names the device.
+ *
+ * The test runs itself as workload under LD_PRELOAD. Each workload process reads commands from stdin and answers
+ * with one line, so that the test can interleave the processes.
+ *
+ * Usage: identity_naming <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const char* name, bool ok) {
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+/*
+ * the program running under LD_PRELOAD. Commands:
+ *   "ex <path>": open a new fd and take an exclusive flock lock, waiting for it
+ *   "try <path>": answer whether a new fd could be locked exclusively without waiting
+ *   "unlock": release the locks of the fds opened by ex, which stay open
+ */
+static int workload() {
+    char line[4096];
+    vector<int> fds;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        line[strcspn(line, "\n")] = 0;
+        istringstream input(line);
+        string command, path;
+        input >> command >> path;
+        string answer = "no";
+        if (command == "ex") {
+            int fd = open(path.c_str(), O_RDWR);
+            if (fd >= 0 && flock(fd, LOCK_EX) == 0) answer = "ok";
+            fds.push_back(fd);
+        } else if (command == "try") {
+            int fd = open(path.c_str(), O_RDWR);
+            if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0) answer = "ok";
+            close(fd);
+        } else if (command == "unlock") {
+            answer = "ok";
+            for (int fd: fds) {
+                if (flock(fd, LOCK_UN) != 0) answer = "no";
+            }
+        }
+        printf("%s\n", answer.c_str());
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// a running workload process
+struct worker_t {
+    pid_t pid;
+    FILE* commands;
+    FILE* answers;
+};
+
+/*
+ * start a workload process. settings are additional environment variables "NAME=value".
+ */
+static worker_t start_worker(const char* program, const char* library, const string& lockdir,
+                             const vector<string>& settings) {
+    int to_child[2], from_child[2];
+    // other workers must not inherit the pipes, they would not see the end of their input
+    if (pipe2(to_child, O_CLOEXEC) != 0 || pipe2(from_child, O_CLOEXEC) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        setenv("LOCALFLOCK_SHARD_LEVELS", "0", 1);
+        for (auto& setting: settings) putenv(strdup(setting.c_str()));
+        execl("/proc/self/exe", program, "--workload", nullptr);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    return {child, fdopen(to_child[1], "w"), fdopen(from_child[0], "r")};
+}
+
+static string send(worker_t& worker, const string& command) {
+    fprintf(worker.commands, "%s\n", command.c_str());
+    fflush(worker.commands);
+    char line[256];
+    if (fgets(line, sizeof(line), worker.answers) == nullptr) return "";
+    line[strcspn(line, "\n")] = 0;
+    return line;
+}
+
+static void stop_worker(worker_t& worker) {
+    fclose(worker.commands);
+    fclose(worker.answers);
+    int status;
+    waitpid(worker.pid, &status, 0);
+}
+
+static string create_file(const string& directory, const string& name) {
+    string path = directory + "/" + name;
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+static string read_file(const string& path) {
+    ifstream file(path);
+    stringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+/*
+ * the lock files in the flat lock directory, without the registry, the format and the statistics
+ */
+static vector<string> lock_files(const string& lockdir) {
+    vector<string> result;
+    for (auto& entry: filesystem::directory_iterator(lockdir)) {
+        string name = entry.path().filename();
+        if (entry.is_regular_file() && name != "registry" && name.compare(0, 6, "format") != 0) {
+            result.push_back(entry.path());
+        }
+    }
+    return result;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--workload") == 0) return workload();
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/identity_naming.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    // the recorded paths are absolute
+    directory = filesystem::canonical(directory);
+    string data = directory + "/data";
+    mkdir(data.c_str(), 0755);
+    string file = create_file(data, "file");
+    string link = data + "/link";
+    if (::link(file.c_str(), link.c_str()) != 0) {
+        perror("link");
+        return 2;
+    }
+
+    // names after the path, the default: a hardlink has its own lock
+    string lockdir = directory + "/path-locks";
+    worker_t a = start_worker(argv[0], argv[1], lockdir, {});
+    worker_t b = start_worker(argv[0], argv[1], lockdir, {});
+    check("path: exclusive lock", send(a, "ex " + file) == "ok");
+    check("path: format records the naming", read_file(lockdir + "/format").find("naming=path\n") != string::npos);
+    check("path: hardlink locked separately", send(b, "try " + link) == "ok");
+    stop_worker(a);
+    stop_worker(b);
+
+    // names after the identity
+    lockdir = directory + "/identity-locks";
+    a = start_worker(argv[0], argv[1], lockdir, {"LOCALFLOCK_NAMING=identity"});
+    b = start_worker(argv[0], argv[1], lockdir, {"LOCALFLOCK_NAMING=identity"});
+    check("identity: exclusive lock", send(a, "ex " + file) == "ok");
+    check("identity: format records the naming",
+          read_file(lockdir + "/format").find("naming=identity\n") != string::npos);
+    check("identity: hardlink shares the lock", send(b, "try " + link) == "no");
+    string renamed = data + "/renamed";
+    rename(file.c_str(), renamed.c_str());
+    check("identity: renamed file keeps the lock", send(b, "try " + renamed) == "no");
+    check("identity: one lock file without the path", lock_files(lockdir).size() == 1 &&
+                                                      read_file(lock_files(lockdir)[0]).empty());
+    check("identity: released", send(a, "unlock") == "ok" && send(b, "try " + renamed) == "ok");
+    rename(renamed.c_str(), file.c_str());
+    stop_worker(a);
+    stop_worker(b);
+
+    // the path is resolved only to be shown, the name stays the same
+    a = start_worker(argv[0], argv[1], lockdir, {"LOCALFLOCK_SHOW_NAMES=1"});
+    b = start_worker(argv[0], argv[1], lockdir, {});
+    string other = create_file(data, "other");
+    check("show names: exclusive lock", send(a, "ex " + other) == "ok");
+    check("show names: same lock without showing names", send(b, "try " + other) == "no");
+    bool recorded = false;
+    for (auto& path: lock_files(lockdir)) recorded = recorded || read_file(path) == other;
+    check("show names: path recorded in the lock file", recorded);
+    check("show names: names stay hashes", !filesystem::exists(lockdir + "/" + other.substr(1)));
+    stop_worker(a);
+    stop_worker(b);
+
+    // the device of a mount point gets a stable name. Processes naming it differently do not share locks.
+    a = start_worker(argv[0], argv[1], lockdir, {"LOCALFLOCK_DEVICES=" + data + "=shared"});
+    b = start_worker(argv[0], argv[1], lockdir, {"LOCALFLOCK_DEVICES=" + data + "=shared"});
+    worker_t c = start_worker(argv[0], argv[1], lockdir, {"LOCALFLOCK_DEVICES=" + data + "=elsewhere"});
+    check("devices: exclusive lock", send(a, "ex " + file) == "ok");
+    check("devices: same name shares the lock", send(b, "try " + file) == "no");
+    check("devices: other name has its own lock", send(c, "try " + file) == "ok");
+    stop_worker(a);
+    stop_worker(b);
+    stop_worker(c);
+
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/*
+ * Regression test for the cost of preloading the library into processes that never lock a file, which is most of
+ * them: the additional time to start a process, the additional resident memory, and no access to the lock
+ * directory at all.
+ *
+ * The test starts itself many times with and without LD_PRELOAD, alternating to spread noise of the host evenly,
+ * and compares the medians.
+ *
+ * Usage: load_budget <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ctime>
+
+using namespace std;
+
+// number of processes started with and without the library
+#define RUNS 200
+// allowed additional time to start a process in microseconds, median of all runs
+#define START_BUDGET_US 1000
+// allowed additional resident memory in kB
+#define RSS_BUDGET_KB 1536
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * the program running with or without the library. It uses the intercepted close and fcntl like every program
+ * does, but never locks a file, and reports its resident memory.
+ */
+static int workload(int output_fd) {
+    int fd = open("/proc/self/status", O_RDONLY);
+    char buffer[4096];
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    fcntl(fd, F_GETFD);
+    close(fd);
+    if (length <= 0) return 1;
+    buffer[length] = 0;
+    const char* rss = strstr(buffer, "VmRSS:");
+    long kb = rss != nullptr ? atol(rss + 6) : 0;
+    if (write(output_fd, &kb, sizeof(kb)) != sizeof(kb)) return 1;
+    return 0;
+}
+
+/*
+ * start the workload, return the time until it exited and its resident memory.
+ */
+static int64_t run(const char* library, const string& lockdir, long& rss_kb) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) return -1;
+    int64_t start = now_ns();
+    pid_t child = fork();
+    if (child == 0) {
+        if (library != nullptr) setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        execl("/proc/self/exe", "load_budget", "--workload", to_string(pipe_fds[1]).c_str(), nullptr);
+        _exit(127);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    int64_t elapsed = now_ns() - start;
+    close(pipe_fds[1]);
+    rss_kb = 0;
+    if (read(pipe_fds[0], &rss_kb, sizeof(rss_kb)) != sizeof(rss_kb)) elapsed = -1;
+    close(pipe_fds[0]);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed : -1;
+}
+
+static int64_t median(vector<int64_t>& values) {
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && strcmp(argv[1], "--workload") == 0) return workload(atoi(argv[2]));
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/load_budget.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string lockdir = directory + "/locks";
+
+    vector<int64_t> native_ns, preload_ns, native_kb, preload_kb;
+    for (int i = 0; i < RUNS; i++) {
+        long kb;
+        int64_t elapsed = run(nullptr, lockdir, kb);
+        if (elapsed < 0) {
+            fprintf(stderr, "workload failed\n");
+            return 1;
+        }
+        native_ns.push_back(elapsed);
+        native_kb.push_back(kb);
+        elapsed = run(argv[1], lockdir, kb);
+        if (elapsed < 0) {
+            fprintf(stderr, "workload failed with the library\n");
+            return 1;
+        }
+        preload_ns.push_back(elapsed);
+        preload_kb.push_back(kb);
+    }
+
+    int64_t start_us = (median(preload_ns) - median(native_ns)) / 1000;
+    int64_t rss_kb = median(preload_kb) - median(native_kb);
+    bool lockdir_used = filesystem::exists(lockdir);
+    filesystem::remove_all(directory);
+
+    bool ok = true;
+    printf("%-30s %6ld us (budget %d us) %s\n", "additional start time", start_us, START_BUDGET_US,
+           start_us <= START_BUDGET_US ? "ok" : "FAILED");
+    ok &= start_us <= START_BUDGET_US;
+    printf("%-30s %6ld kB (budget %d kB) %s\n", "additional resident memory", rss_kb, RSS_BUDGET_KB,
+           rss_kb <= RSS_BUDGET_KB ? "ok" : "FAILED");
+    ok &= rss_kb <= RSS_BUDGET_KB;
+    printf("%-30s %s\n", "lock directory untouched", lockdir_used ? "FAILED" : "ok");
+    ok &= !lockdir_used;
+    return ok ? 0 : 1;
+}
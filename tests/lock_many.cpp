@@ -0,0 +1,255 @@
+/*
+ * Test for localflock_lock_many and localflock_unlock_many: all files locked or none, the same order in all
+ * processes, fds of the same open file description and invalid arguments. The test is not linked with the library,
+ * it uses the weak declarations of the public header like a program that does not know whether it is preloaded.
+ *
+ * The test runs itself as workload under LD_PRELOAD. Each workload process reads commands from stdin and answers
+ * with one line, so that the test can interleave the processes.
+ *
+ * Usage: lock_many <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "localflock.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const char* name, bool ok) {
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+static string result_name(int result) {
+    if (result == 0) return "ok";
+    if (errno == EWOULDBLOCK) return "EWOULDBLOCK";
+    if (errno == EDEADLK) return "EDEADLK";
+    if (errno == EINVAL) return "EINVAL";
+    return to_string(errno);
+}
+
+/*
+ * the program running under LD_PRELOAD. Commands:
+ *   "lock <ex|sh> <wait|nb> <path>...": open a new fd per path and lock them all with localflock_lock_many
+ *   "unlock": localflock_unlock_many on the fds of the last lock command
+ *   "try <path>": answer whether a new fd could be locked exclusively without waiting
+ *   "hold <path>": lock a new fd with flock, it stays locked
+ *   "dup <path>": lock a fd and its duplicate together, then unlock them
+ *   "twice <ex|sh> <path>": lock two open file descriptions of the same file together, then unlock them
+ *   "invalid": lock with an invalid mode
+ *   "loop <count> <path>...": lock and unlock all paths count times, waiting for the locks
+ */
+static int workload() {
+    char line[65536];
+    vector<int> fds;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        line[strcspn(line, "\n")] = 0;
+        istringstream input(line);
+        string command, mode, wait, path;
+        input >> command;
+        string answer = "no";
+        if (command == "lock") {
+            input >> mode >> wait;
+            fds.clear();
+            while (input >> path) fds.push_back(open(path.c_str(), O_RDWR));
+            answer = result_name(localflock_lock_many(fds.data(), (int) fds.size(), mode == "ex" ? LOCK_EX : LOCK_SH,
+                                                      wait == "nb" ? LOCK_NB : 0));
+        } else if (command == "unlock") {
+            answer = result_name(localflock_unlock_many(fds.data(), (int) fds.size()));
+        } else if (command == "try") {
+            input >> path;
+            int fd = open(path.c_str(), O_RDWR);
+            if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0) answer = "ok";
+            close(fd);
+        } else if (command == "hold") {
+            input >> path;
+            int fd = open(path.c_str(), O_RDWR);
+            if (fd >= 0 && flock(fd, LOCK_EX) == 0) answer = "ok";
+        } else if (command == "dup" || command == "twice") {
+            if (command == "twice") input >> mode;
+            input >> path;
+            int pair[2];
+            pair[0] = open(path.c_str(), O_RDWR);
+            // a duplicate shares the lock information only if the fd was used for locking before
+            flock(pair[0], LOCK_UN);
+            pair[1] = command == "dup" ? dup(pair[0]) : open(path.c_str(), O_RDWR);
+            answer = result_name(localflock_lock_many(pair, 2, mode == "sh" ? LOCK_SH : LOCK_EX, 0));
+            localflock_unlock_many(pair, 2);
+            close(pair[0]);
+            close(pair[1]);
+        } else if (command == "invalid") {
+            int fd = 0;
+            answer = result_name(localflock_lock_many(&fd, 1, LOCK_UN, 0));
+        } else if (command == "loop") {
+            int count;
+            input >> count;
+            vector<int> loop_fds;
+            while (input >> path) loop_fds.push_back(open(path.c_str(), O_RDWR));
+            answer = "ok";
+            for (int i = 0; i < count; i++) {
+                if (localflock_lock_many(loop_fds.data(), (int) loop_fds.size(), LOCK_EX, 0) != 0 ||
+                    localflock_unlock_many(loop_fds.data(), (int) loop_fds.size()) != 0) {
+                    answer = result_name(-1);
+                    break;
+                }
+            }
+            for (int fd: loop_fds) close(fd);
+        }
+        printf("%s\n", answer.c_str());
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// a running workload process
+struct worker_t {
+    pid_t pid;
+    FILE* commands;
+    FILE* answers;
+};
+
+static worker_t start_worker(const char* program, const char* library, const string& lockdir) {
+    int to_child[2], from_child[2];
+    // other workers must not inherit the pipes, they would not see the end of their input
+    if (pipe2(to_child, O_CLOEXEC) != 0 || pipe2(from_child, O_CLOEXEC) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        execl("/proc/self/exe", program, "--workload", nullptr);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    return {child, fdopen(to_child[1], "w"), fdopen(from_child[0], "r")};
+}
+
+static void post(worker_t& worker, const string& command) {
+    fprintf(worker.commands, "%s\n", command.c_str());
+    fflush(worker.commands);
+}
+
+static string answer(worker_t& worker) {
+    char line[256];
+    if (fgets(line, sizeof(line), worker.answers) == nullptr) return "";
+    line[strcspn(line, "\n")] = 0;
+    return line;
+}
+
+static string send(worker_t& worker, const string& command) {
+    post(worker, command);
+    return answer(worker);
+}
+
+static void stop_worker(worker_t& worker) {
+    fclose(worker.commands);
+    fclose(worker.answers);
+    int status;
+    waitpid(worker.pid, &status, 0);
+}
+
+static string create_file(const string& directory, const string& name) {
+    string path = directory + "/" + name;
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+/*
+ * whether none of the files can be locked by the worker
+ */
+static bool all_locked(worker_t& worker, const vector<string>& files) {
+    for (auto& file: files) {
+        if (send(worker, "try " + file) != "no") return false;
+    }
+    return true;
+}
+
+static bool none_locked(worker_t& worker, const vector<string>& files) {
+    for (auto& file: files) {
+        if (send(worker, "try " + file) != "ok") return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--workload") == 0) return workload();
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/lock_many.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string lockdir = directory + "/locks";
+    vector<string> files;
+    string all, reversed;
+    for (int i = 0; i < 50; i++) {
+        files.push_back(create_file(directory, "file" + to_string(i)));
+        all += " " + files.back();
+        reversed = " " + files.back() + reversed;
+    }
+
+    check("api: not available without the library", localflock_lock_many == nullptr);
+
+    worker_t a = start_worker(argv[0], argv[1], lockdir);
+    worker_t b = start_worker(argv[0], argv[1], lockdir);
+    check("lock: all files", send(a, "lock ex wait" + all) == "ok");
+    check("lock: all files locked", all_locked(b, files));
+    check("unlock: all files", send(a, "unlock") == "ok");
+    check("unlock: all files released", none_locked(b, files));
+    check("shared: all files", send(a, "lock sh wait" + all) == "ok" && send(b, "lock sh nb" + all) == "ok");
+    check("shared: released", send(a, "unlock") == "ok" && send(b, "unlock") == "ok");
+
+    // a failing lock releases the locks acquired before
+    check("rollback: one file held by another process", send(b, "hold " + files[25]) == "ok");
+    check("rollback: nonblocking lock fails", send(a, "lock ex nb" + all) == "EWOULDBLOCK");
+    worker_t c = start_worker(argv[0], argv[1], lockdir);
+    vector<string> others = files;
+    others.erase(others.begin() + 25);
+    check("rollback: no other file stays locked", none_locked(c, others));
+    stop_worker(b);
+    b = start_worker(argv[0], argv[1], lockdir);
+
+    // fds of the same file
+    check("same file: fd and its duplicate", send(a, "dup " + files[0]) == "ok");
+    check("same file: exclusive on two open file descriptions", send(a, "twice ex " + files[0]) == "EDEADLK");
+    check("same file: shared on two open file descriptions", send(a, "twice sh " + files[0]) == "ok");
+    check("same file: nothing left locked", none_locked(c, {files[0]}));
+    check("invalid: mode", send(a, "invalid") == "EINVAL");
+
+    // processes locking the same files in opposite orders do not deadlock
+    post(a, "loop 200" + all);
+    post(b, "loop 200" + reversed);
+    post(c, "loop 200" + all);
+    check("order: no deadlock", answer(a) == "ok" && answer(b) == "ok" && answer(c) == "ok");
+
+    stop_worker(a);
+    stop_worker(b);
+    stop_worker(c);
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
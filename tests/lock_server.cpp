@@ -0,0 +1,310 @@
+/*
+ * Test for localflock-server: processes with different lock directories, like processes on different hosts, lock
+ * the same file through the server over a Unix and a TCP socket. Covers waiting for a release, byte range locks,
+ * the lease of a lost connection, a restart of the server and the fallback to the lock directory.
+ *
+ * The test runs itself as workload under LD_PRELOAD. Each workload process reads commands from stdin and answers
+ * with one line, so that the test can interleave the processes.
+ *
+ * Usage: lock_server <path to liblocalflock.so> <path to localflock-server> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <filesystem>
+#include <sstream>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const char* name, bool ok) {
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+/*
+ * a lock reported by F_GETLK as "<l_type> <l_start> <l_len> <l_pid>"
+ */
+static string fmt_lock(const struct flock& arg) {
+    return to_string(arg.l_type) + " " + to_string(arg.l_start) + " " + to_string(arg.l_len) + " " +
+           to_string(arg.l_pid);
+}
+
+/*
+ * the program running under LD_PRELOAD. Commands:
+ *   "ex <path>", "sh <path>": open a new fd and take a flock lock, waiting for it
+ *   "try <path>": answer whether a new fd could be locked exclusively without waiting
+ *   "unlock <path>": release the flock locks of the fds opened by ex and sh, which stay open
+ *   "set <r|w|u> <start> <length> <path>": F_SETLK on one fd per path
+ *   "get <r|w> <start> <length> <path>": F_GETLK, answers with the type, range and pid of the conflicting lock
+ */
+static int workload() {
+    char line[4096];
+    vector<pair<string, int>> flock_fds;
+    map<string, int> range_fds;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        line[strcspn(line, "\n")] = 0;
+        istringstream input(line);
+        string command, path;
+        input >> command;
+        string answer = "no";
+        if (command == "ex" || command == "sh") {
+            input >> path;
+            int fd = open(path.c_str(), O_RDWR);
+            if (fd >= 0 && flock(fd, command == "ex" ? LOCK_EX : LOCK_SH) == 0) answer = "ok";
+            flock_fds.emplace_back(path, fd);
+        } else if (command == "try") {
+            input >> path;
+            int fd = open(path.c_str(), O_RDWR);
+            if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0) answer = "ok";
+            close(fd);
+        } else if (command == "unlock") {
+            input >> path;
+            answer = "ok";
+            for (auto& entry: flock_fds) {
+                if (entry.first == path && flock(entry.second, LOCK_UN) != 0) answer = "no";
+            }
+        } else if (command == "set" || command == "get") {
+            string type;
+            struct flock arg = {};
+            input >> type >> arg.l_start >> arg.l_len >> path;
+            arg.l_type = type == "w" ? F_WRLCK : type == "r" ? F_RDLCK : F_UNLCK;
+            arg.l_whence = SEEK_SET;
+            if (range_fds.count(path) == 0) range_fds[path] = open(path.c_str(), O_RDWR);
+            int fd = range_fds[path];
+            if (command == "get") {
+                if (fcntl(fd, F_GETLK, &arg) == 0) {
+                    answer = arg.l_type == F_UNLCK ? "none" : fmt_lock(arg);
+                }
+            } else if (fcntl(fd, F_SETLK, &arg) == 0) {
+                answer = "ok";
+            }
+        }
+        printf("%s\n", answer.c_str());
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// a running workload process
+struct worker_t {
+    pid_t pid;
+    FILE* commands;
+    FILE* answers;
+};
+
+static worker_t start_worker(const char* program, const char* library, const string& lockdir, const string& server) {
+    int to_child[2], from_child[2];
+    // other workers must not inherit the pipes, they would not see the end of their input
+    if (pipe2(to_child, O_CLOEXEC) != 0 || pipe2(from_child, O_CLOEXEC) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        setenv("LOCALFLOCK_SERVER", server.c_str(), 1);
+        execl("/proc/self/exe", program, "--workload", nullptr);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    return {child, fdopen(to_child[1], "w"), fdopen(from_child[0], "r")};
+}
+
+static void post(worker_t& worker, const string& command) {
+    fprintf(worker.commands, "%s\n", command.c_str());
+    fflush(worker.commands);
+}
+
+static string answer(worker_t& worker) {
+    char line[256];
+    if (fgets(line, sizeof(line), worker.answers) == nullptr) return "";
+    line[strcspn(line, "\n")] = 0;
+    return line;
+}
+
+static string send(worker_t& worker, const string& command) {
+    post(worker, command);
+    return answer(worker);
+}
+
+static void stop_worker(worker_t& worker) {
+    fclose(worker.commands);
+    fclose(worker.answers);
+    int status;
+    waitpid(worker.pid, &status, 0);
+}
+
+static void kill_worker(worker_t& worker) {
+    kill(worker.pid, SIGKILL);
+    stop_worker(worker);
+}
+
+// a running localflock-server and the addresses it listens on
+struct server_t {
+    pid_t pid;
+    vector<string> addresses;
+};
+
+/*
+ * start the server with a lease of one second, it prints one line "listening on <address>" per listening socket.
+ */
+static server_t start_server(const char* program, const vector<string>& addresses) {
+    int from_child[2];
+    if (pipe2(from_child, O_CLOEXEC) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(from_child[1], STDOUT_FILENO);
+        vector<const char*> args = {program, "-L", "1"};
+        for (auto& address: addresses) {
+            args.push_back("-l");
+            args.push_back(address.c_str());
+        }
+        args.push_back(nullptr);
+        execv(program, (char* const*) args.data());
+        _exit(127);
+    }
+    close(from_child[1]);
+    server_t server = {child, {}};
+    FILE* output = fdopen(from_child[0], "r");
+    char line[256];
+    while (server.addresses.size() < addresses.size() && fgets(line, sizeof(line), output) != nullptr) {
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "listening on ", 13) == 0) server.addresses.emplace_back(line + 13);
+    }
+    fclose(output);
+    return server;
+}
+
+static void stop_server(server_t& server) {
+    kill(server.pid, SIGTERM);
+    int status;
+    waitpid(server.pid, &status, 0);
+}
+
+static string create_file(const string& directory, const string& name) {
+    string path = directory + "/" + name;
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--workload") == 0) return workload();
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <localflock-server> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    const char* library = argv[1];
+    mkdir(argv[3], 0755);
+    string directory = string(argv[3]) + "/lock_server.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    // every worker has its own lock directory, like a process on another host
+    string first_host = directory + "/host1";
+    string second_host = directory + "/host2";
+    string first = create_file(directory, "first");
+    string second = create_file(directory, "second");
+    string socket = "unix:" + directory + "/sock";
+
+    server_t server = start_server(argv[2], {socket, "127.0.0.1:0"});
+    check("server: listening on both addresses", server.addresses.size() == 2);
+    if (server.addresses.size() != 2) {
+        stop_server(server);
+        filesystem::remove_all(directory);
+        return 1;
+    }
+    string tcp = server.addresses[1];
+
+    // flock locks over the Unix socket and over TCP
+    worker_t a = start_worker(argv[0], library, first_host, socket);
+    worker_t b = start_worker(argv[0], library, second_host, tcp);
+    check("flock: exclusive lock", send(a, "ex " + first) == "ok");
+    check("flock: exclusive lock seen by another host", send(b, "try " + first) == "no");
+    check("flock: other file not locked", send(b, "try " + second) == "ok");
+    check("flock: shared locks of two hosts", send(a, "unlock " + first) == "ok" &&
+                                               send(a, "sh " + first) == "ok" && send(b, "sh " + first) == "ok");
+    check("flock: shared locks exclude exclusive ones", send(b, "try " + first) == "no");
+    check("flock: released", send(a, "unlock " + first) == "ok" && send(b, "unlock " + first) == "ok" &&
+                             send(b, "try " + first) == "ok");
+
+    // the waiting request is queued at the server and answered by the release
+    check("wait: exclusive lock", send(a, "ex " + first) == "ok");
+    post(b, "ex " + first);
+    usleep(50000);
+    auto released = chrono::steady_clock::now();
+    send(a, "unlock " + first);
+    check("wait: lock acquired after the release", answer(b) == "ok");
+    check("wait: granted by the server without polling",
+          chrono::steady_clock::now() - released < chrono::milliseconds(100));
+    check("wait: lock held by the waiting host", send(a, "try " + first) == "no");
+    send(b, "unlock " + first);
+
+    // byte range locks
+    check("range: write lock 0-99", send(a, "set w 0 100 " + second) == "ok");
+    check("range: overlapping lock refused", send(b, "set r 50 10 " + second) == "no");
+    check("range: lock behind it", send(b, "set w 100 0 " + second) == "ok");
+    check("range: conflict reported by F_GETLK",
+          send(b, "get r 10 1 " + second) == "1 0 100 " + to_string(a.pid));
+    check("range: part unlocked", send(a, "set u 0 50 " + second) == "ok" && send(b, "set r 0 50 " + second) == "ok");
+    check("range: rest still locked", send(b, "set r 50 1 " + second) == "no");
+
+    // the locks of a lost connection are kept for the lease of one second
+    check("lease: exclusive lock", send(a, "ex " + first) == "ok");
+    kill_worker(a);
+    check("lease: lock kept after the connection is lost", send(b, "try " + first) == "no");
+    sleep(3);
+    check("lease: lock released after the lease", send(b, "try " + first) == "ok");
+    check("lease: range locks released after the lease", send(b, "set w 0 100 " + second) == "ok");
+    stop_worker(b);
+
+    // the clients connect again after a restart of the server, the locks held before are lost
+    a = start_worker(argv[0], library, first_host, socket);
+    b = start_worker(argv[0], library, second_host, socket);
+    check("restart: exclusive lock", send(a, "ex " + first) == "ok");
+    check("restart: first try", send(b, "try " + second) == "ok");
+    stop_server(server);
+    server = start_server(argv[2], {socket});
+    check("restart: server listening again", server.addresses.size() == 1);
+    check("restart: lock after reconnecting", send(b, "ex " + second) == "ok");
+    check("restart: lock seen after reconnecting", send(a, "try " + second) == "no");
+    stop_worker(a);
+    stop_worker(b);
+    stop_server(server);
+
+    // without a server, the processes of one host lock through the lock directory
+    string unreachable = "unix:" + directory + "/missing";
+    a = start_worker(argv[0], library, first_host, unreachable);
+    b = start_worker(argv[0], library, first_host, unreachable);
+    check("fallback: exclusive lock", send(a, "ex " + first) == "ok");
+    check("fallback: lock seen through the lock directory", send(b, "try " + first) == "no");
+    check("fallback: lock files in the lock directory", filesystem::exists(first_host + "/registry"));
+    stop_worker(a);
+    stop_worker(b);
+
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+/*
+ * Test for locks on fds that share an open file description, created by dup, dup2, fcntl(F_DUPFD) or inherited by
+ * fork. The kernel attaches flock locks to the open file description, the library has to do the same with the local
+ * lock files.
+ *
+ * The test runs itself as workload under LD_PRELOAD. Whether a file is locked is checked by a new process that
+ * opens the file on its own and tries to lock it without waiting.
+ *
+ * Usage: lock_sharing <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const char* name, bool ok) {
+    printf("%-50s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+/*
+ * check in a new process whether the file can be locked.
+ */
+static bool can_lock(const string& path, int operation) {
+    pid_t child = fork();
+    if (child == 0) {
+        int fd = open(path.c_str(), O_RDWR);
+        _exit(flock(fd, operation | LOCK_NB) == 0 ? 0 : 1);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static string create_file(const char* directory, const char* name) {
+    string path = string(directory) + "/" + name;
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+/*
+ * the program running under LD_PRELOAD.
+ */
+static int workload(const char* directory) {
+    // the lock stays as long as any fd of the open file description is open
+    string path = create_file(directory, "dup");
+    int fd = open(path.c_str(), O_RDWR);
+    flock(fd, LOCK_EX);
+    int duplicate = dup(fd);
+    close(fd);
+    check("dup: lock kept after closing the original fd", !can_lock(path, LOCK_EX));
+    close(duplicate);
+    check("dup: lock released with the last fd", can_lock(path, LOCK_EX));
+
+    path = create_file(directory, "dupfd");
+    fd = open(path.c_str(), O_RDWR);
+    flock(fd, LOCK_EX);
+    duplicate = fcntl(fd, F_DUPFD_CLOEXEC, 100);
+    close(fd);
+    check("F_DUPFD: lock kept after closing the original fd", !can_lock(path, LOCK_EX));
+    close(duplicate);
+    check("F_DUPFD: lock released with the last fd", can_lock(path, LOCK_EX));
+
+    // both fds are the same lock owner
+    path = create_file(directory, "unlock");
+    fd = open(path.c_str(), O_RDWR);
+    flock(fd, LOCK_EX);
+    duplicate = dup(fd);
+    flock(duplicate, LOCK_UN);
+    check("dup: unlock through the duplicate", can_lock(path, LOCK_EX));
+    close(duplicate);
+    close(fd);
+
+    // dup2 closes the target fd and replaces it
+    string first = create_file(directory, "dup2-first");
+    string second = create_file(directory, "dup2-second");
+    fd = open(first.c_str(), O_RDWR);
+    flock(fd, LOCK_EX);
+    int other = open(second.c_str(), O_RDWR);
+    flock(other, LOCK_EX);
+    dup2(other, fd);
+    check("dup2: lock of the replaced fd released", can_lock(first, LOCK_EX));
+    close(other);
+    check("dup2: lock kept by the new fd", !can_lock(second, LOCK_EX));
+    flock(fd, LOCK_UN);
+    check("dup2: unlock through the new fd", can_lock(second, LOCK_EX));
+    close(fd);
+
+    // a child locking the file on its own must not depend on the shared locks of its parent
+    path = create_file(directory, "fork");
+    fd = open(path.c_str(), O_RDWR);
+    flock(fd, LOCK_SH);
+    int ready[2], done[2];
+    if (pipe(ready) != 0 || pipe(done) != 0) return 2;
+    pid_t child = fork();
+    if (child == 0) {
+        int own_fd = open(path.c_str(), O_RDWR);
+        char c = flock(own_fd, LOCK_SH) == 0 ? 'y' : 'n';
+        if (write(ready[1], &c, 1) != 1 || read(done[0], &c, 1) != 1) _exit(1);
+        _exit(0);
+    }
+    char c = 0;
+    if (read(ready[0], &c, 1) != 1) c = 0;
+    check("fork: shared lock in the child", c == 'y');
+    flock(fd, LOCK_UN);
+    check("fork: lock of the child kept when the parent unlocks", !can_lock(path, LOCK_EX));
+    if (write(done[1], &c, 1) != 1) return 2;
+    waitpid(child, nullptr, 0);
+    check("fork: lock released when the child exits", can_lock(path, LOCK_EX));
+    close(fd);
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && strcmp(argv[1], "--workload") == 0) return workload(argv[2]);
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/lock_sharing.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string lockdir = directory + "/locks";
+
+    pid_t child = fork();
+    if (child == 0) {
+        setenv("LD_PRELOAD", argv[1], 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        // the scratch directory is on a local filesystem, whose locks are passed through by default
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        execl("/proc/self/exe", argv[0], "--workload", directory.c_str(), nullptr);
+        _exit(127);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    filesystem::remove_all(directory);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
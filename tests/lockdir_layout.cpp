@@ -0,0 +1,224 @@
+/*
+ * Test for the layout of the lock directory: new directories use subdirectories, directories of older versions stay
+ * flat and are migrated by localflock-gc -m while processes hold locks in them.
+ *
+ * The test runs itself as workload under LD_PRELOAD. Each workload process reads commands from stdin, e.g.,
+ * "lock <path>", and answers with one line, so that the test can interleave the processes with the migration.
+ *
+ * Usage: lockdir_layout <path to liblocalflock.so> <path to localflock-gc> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const char* name, bool ok) {
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+/*
+ * the program running under LD_PRELOAD. Commands: "lock <path>" opens a new fd and takes an exclusive flock,
+ * "unlock <path>" releases the locks of the fds opened by lock, which stay open, "try <path>" answers whether a new
+ * fd could be locked without waiting.
+ */
+static int workload() {
+    char line[4096];
+    vector<pair<string, int>> fds;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        line[strcspn(line, "\n")] = 0;
+        char* space = strchr(line, ' ');
+        if (space == nullptr) break;
+        *space = 0;
+        string command(line), path(space + 1);
+        bool ok = false;
+        if (command == "lock") {
+            int fd = open(path.c_str(), O_RDWR);
+            ok = fd >= 0 && flock(fd, LOCK_EX) == 0;
+            fds.emplace_back(path, fd);
+        } else if (command == "try") {
+            int fd = open(path.c_str(), O_RDWR);
+            ok = fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0;
+            close(fd);
+        } else if (command == "unlock") {
+            ok = true;
+            for (auto& entry: fds) {
+                if (entry.first == path) ok = flock(entry.second, LOCK_UN) == 0 && ok;
+            }
+        }
+        printf("%s\n", ok ? "ok" : "no");
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// a running workload process
+struct worker_t {
+    pid_t pid;
+    FILE* commands;
+    FILE* answers;
+};
+
+static worker_t start_worker(const char* program, const char* library, const string& lockdir) {
+    int to_child[2], from_child[2];
+    // other workers must not inherit the pipes, they would not see the end of their input
+    if (pipe2(to_child, O_CLOEXEC) != 0 || pipe2(from_child, O_CLOEXEC) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        // the scratch directory is on a local filesystem, whose locks are passed through by default
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        execl("/proc/self/exe", program, "--workload", nullptr);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    return {child, fdopen(to_child[1], "w"), fdopen(from_child[0], "r")};
+}
+
+static bool send(worker_t& worker, const char* command, const string& path) {
+    fprintf(worker.commands, "%s %s\n", command, path.c_str());
+    fflush(worker.commands);
+    char answer[16];
+    return fgets(answer, sizeof(answer), worker.answers) != nullptr && strncmp(answer, "ok", 2) == 0;
+}
+
+static void stop_worker(worker_t& worker) {
+    fclose(worker.commands);
+    fclose(worker.answers);
+    int status;
+    waitpid(worker.pid, &status, 0);
+}
+
+static string create_file(const string& directory, const string& name) {
+    string path = directory + "/" + name;
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+static string read_file(const string& path) {
+    ifstream file(path);
+    stringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+/*
+ * number of lock files in the lock directory at the given depth of subdirectories
+ */
+static int count_lock_files(const string& lockdir, int depth) {
+    int count = 0;
+    for (auto it = filesystem::recursive_directory_iterator(lockdir); it != filesystem::recursive_directory_iterator(); ++it) {
+        string name = it->path().filename();
+        if (it.depth() == 0 && (name == "stats" || name == "registry" || name.compare(0, 6, "format") == 0)) {
+            it.disable_recursion_pending();
+            continue;
+        }
+        if (it->is_regular_file() && it.depth() == depth) count++;
+    }
+    return count;
+}
+
+/*
+ * run localflock-gc on the lock directory
+ */
+static bool run_gc(const char* gc, const string& lockdir, const char* levels) {
+    pid_t child = fork();
+    if (child == 0) {
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        execl(gc, gc, "-m", levels, nullptr);
+        _exit(127);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--workload") == 0) return workload();
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <localflock-gc> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[3], 0755);
+    string directory = string(argv[3]) + "/lockdir_layout.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string first = create_file(directory, "first");
+    string second = create_file(directory, "second");
+    string third = create_file(directory, "third");
+
+    // a new lock directory uses two levels of subdirectories
+    string lockdir = directory + "/new";
+    worker_t a = start_worker(argv[0], argv[1], lockdir);
+    check("new directory: lock", send(a, "lock", first));
+    check("new directory: format records the levels", read_file(lockdir + "/format").find("levels=2\n") != string::npos);
+    check("new directory: lock file in the second level", count_lock_files(lockdir, 2) == 1 &&
+                                                           count_lock_files(lockdir, 0) == 0);
+    worker_t b = start_worker(argv[0], argv[1], lockdir);
+    check("new directory: lock seen by another process", !send(b, "try", first));
+    stop_worker(a);
+    check("new directory: lock released", send(b, "try", first));
+    stop_worker(b);
+
+    // a directory of the first format version stays flat
+    lockdir = directory + "/old";
+    filesystem::create_directory(lockdir);
+    ofstream(lockdir + "/format") << "version=1\nhash=murmur3\n";
+    a = start_worker(argv[0], argv[1], lockdir);
+    check("old directory: lock", send(a, "lock", first));
+    check("old directory: lock file stays flat", count_lock_files(lockdir, 0) == 1);
+
+    // migration while the lock is held. The process that read the old format keeps its lock and uses the new
+    // layout for new lock files.
+    check("migration: localflock-gc -m 2", run_gc(argv[2], lockdir, "2"));
+    check("migration: format records the levels", read_file(lockdir + "/format").find("levels=2\n") != string::npos);
+    check("migration: lock file moved", count_lock_files(lockdir, 0) == 0 && count_lock_files(lockdir, 2) == 1);
+    b = start_worker(argv[0], argv[1], lockdir);
+    check("migration: held lock seen by a new process", !send(b, "try", first));
+    check("migration: old process locks a new file", send(a, "lock", second));
+    check("migration: new file in the second level", count_lock_files(lockdir, 2) == 2);
+    check("migration: new file locked for a new process", !send(b, "try", second));
+    // a new fd of a known file needs a new open file description of the moved lock file
+    check("migration: old process releases the lock", send(a, "unlock", first) && send(b, "try", first));
+    check("migration: old process locks a known file with a new fd", send(a, "lock", first));
+    check("migration: lock seen by the new process", !send(b, "try", first));
+    check("migration: new process locks a new file", send(b, "lock", third) && !send(a, "try", third));
+    stop_worker(a);
+    check("migration: locks released", send(b, "try", first) && send(b, "try", second));
+
+    // back to a flat directory while the lock on the third file is held
+    check("migration back: localflock-gc -m 0", run_gc(argv[2], lockdir, "0"));
+    check("migration back: lock files flat", count_lock_files(lockdir, 0) >= 1 && count_lock_files(lockdir, 2) == 0);
+    a = start_worker(argv[0], argv[1], lockdir);
+    check("migration back: held lock seen by a new process", !send(a, "try", third));
+    stop_worker(a);
+    stop_worker(b);
+
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
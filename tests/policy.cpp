@@ -0,0 +1,190 @@
+/*
+ * Test for the policy deciding which locks are redirected to the lock directory: by filesystem type, by included
+ * and excluded path prefixes and with the settings taken from a configuration file.
+ *
+ * The test runs itself as workload under LD_PRELOAD with different settings. The workload locks the given files
+ * and waits until the test checked them. A lock that is passed through is seen by the test, which does not load
+ * the library, a redirected lock is not.
+ *
+ * Usage: policy <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const string& name, bool ok) {
+    printf("%-60s %s\n", name.c_str(), ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+/*
+ * the program running under LD_PRELOAD: lock all files, report on stdout and wait until stdin is closed.
+ */
+static int workload(int count, char** paths) {
+    for (int i = 0; i < count; i++) {
+        int fd = open(paths[i], O_RDWR);
+        if (fd < 0 || flock(fd, LOCK_EX) != 0) return 1;
+    }
+    char byte = 0;
+    if (write(STDOUT_FILENO, &byte, 1) != 1) return 1;
+    while (read(STDIN_FILENO, &byte, 1) > 0);
+    return 0;
+}
+
+/*
+ * whether the kernel knows a lock on the file, i.e., the lock of the workload was passed through.
+ */
+static bool natively_locked(const string& path) {
+    int fd = open(path.c_str(), O_RDWR);
+    bool locked = flock(fd, LOCK_EX | LOCK_NB) != 0;
+    close(fd);
+    return locked;
+}
+
+struct expectation_t {
+    string path;
+    bool redirected;
+};
+
+/*
+ * run the workload with the given settings and check which of the locks were redirected.
+ */
+static void run(const char* program, const char* library, const string& name, const string& lockdir,
+                const vector<pair<string, string>>& environment, const vector<expectation_t>& expected) {
+    int to_child[2], from_child[2];
+    if (pipe(to_child) != 0 || pipe(from_child) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        for (auto& variable: environment) setenv(variable.first.c_str(), variable.second.c_str(), 1);
+        vector<char*> argv = {(char*) program, (char*) "--workload"};
+        for (auto& file: expected) argv.push_back((char*) file.path.c_str());
+        argv.push_back(nullptr);
+        execv("/proc/self/exe", argv.data());
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    char byte;
+    bool locked = read(from_child[0], &byte, 1) == 1;
+    check(name + ": workload locked the files", locked);
+    if (locked) {
+        for (auto& file: expected) {
+            string relative = file.path.substr(file.path.rfind('/', file.path.rfind('/') - 1) + 1);
+            check(name + ": " + relative + (file.redirected ? " redirected" : " passed through"),
+                  natively_locked(file.path) != file.redirected);
+        }
+    }
+    close(to_child[1]);
+    close(from_child[0]);
+    int status;
+    waitpid(child, &status, 0);
+}
+
+static string create_file(const string& directory, const string& name) {
+    filesystem::create_directories(directory);
+    string path = directory + "/" + name;
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+/*
+ * number of lock files in the lock directory and its subdirectories, without the format, the protocol and the
+ * statistics.
+ */
+static size_t count_lock_files(const string& lockdir) {
+    size_t count = 0;
+    if (!filesystem::exists(lockdir)) return 0;
+    for (auto it = filesystem::recursive_directory_iterator(lockdir); it != filesystem::recursive_directory_iterator(); ++it) {
+        string name = it->path().filename();
+        if (it.depth() == 0 && (name == "stats" || name == "registry" || name.compare(0, 6, "format") == 0)) {
+            it.disable_recursion_pending();
+            continue;
+        }
+        if (it->is_regular_file()) count++;
+    }
+    return count;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "--workload") == 0) return workload(argc - 2, argv + 2);
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/policy.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string lockdir = directory + "/locks";
+    string plain = create_file(directory + "/data", "plain");
+    string included = create_file(directory + "/data/in", "file");
+    string excluded = create_file(directory + "/data/out", "file");
+    string reincluded = create_file(directory + "/data/out/in", "file");
+    string similar = create_file(directory + "/data/outside", "file");
+
+    // the filesystem of the scratch directory, given as number
+    struct statfs fs;
+    statfs(directory.c_str(), &fs);
+    char type[32];
+    snprintf(type, sizeof(type), "0x%lx", (unsigned long) (uint32_t) fs.f_type);
+
+    run(argv[0], argv[1], "empty list", lockdir, {{"LOCALFLOCK_FILESYSTEMS", ""}}, {{plain, false}});
+    check("empty list: no lock files created", count_lock_files(lockdir) == 0);
+    run(argv[0], argv[1], "type as number", lockdir, {{"LOCALFLOCK_FILESYSTEMS", type}}, {{plain, true}});
+    check("type as number: lock file created", count_lock_files(lockdir) == 1);
+    run(argv[0], argv[1], "all", lockdir, {{"LOCALFLOCK_FILESYSTEMS", "all"}}, {{plain, true}});
+
+    // the most specific prefix wins
+    run(argv[0], argv[1], "include", lockdir,
+        {{"LOCALFLOCK_FILESYSTEMS", ""}, {"LOCALFLOCK_INCLUDE", directory + "/data/in/"}},
+        {{plain, false}, {included, true}});
+    run(argv[0], argv[1], "exclude", lockdir,
+        {{"LOCALFLOCK_FILESYSTEMS", "all"}, {"LOCALFLOCK_EXCLUDE", directory + "/data/out"},
+         {"LOCALFLOCK_INCLUDE", "relative:" + directory + "/data/out/in"}},
+        {{plain, true}, {excluded, false}, {reincluded, true}, {similar, true}});
+    run(argv[0], argv[1], "same prefix", lockdir,
+        {{"LOCALFLOCK_FILESYSTEMS", ""}, {"LOCALFLOCK_INCLUDE", directory + "/data"},
+         {"LOCALFLOCK_EXCLUDE", directory + "/data"}},
+        {{plain, false}});
+
+    // settings from a file, the environment takes precedence
+    string config = directory + "/localflock.conf";
+    ofstream(config) << "# redirect everything below data except data/out\n"
+                     << "LOCALFLOCK_FILESYSTEMS=all\n"
+                     << "\n"
+                     << "LOCALFLOCK_EXCLUDE=" << directory << "/data/out\n";
+    run(argv[0], argv[1], "config file", lockdir, {{"LOCALFLOCK_CONFIG", config}},
+        {{plain, true}, {excluded, false}});
+    run(argv[0], argv[1], "config file overridden", lockdir,
+        {{"LOCALFLOCK_CONFIG", config}, {"LOCALFLOCK_EXCLUDE", directory + "/data"}},
+        {{plain, false}, {excluded, false}});
+
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
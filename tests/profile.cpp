@@ -0,0 +1,207 @@
+/*
+ * Test for LOCALFLOCK_PROFILE and localflock-profile: a workload holds locks in three functions, with every lock
+ * sampled, and the folded stacks of the profiles are checked for the hold times, the wait caused by a lock and the
+ * number of samples.
+ *
+ * The test runs itself as workload under LD_PRELOAD. The workload holds an exclusive flock lock on the first file
+ * while a child process waits for it, takes ten short byte range locks on the second file and keeps a flock lock
+ * and a byte range lock on the third file until their fds are closed. The functions are exported, so that the
+ * profiler finds their names.
+ *
+ * Usage: profile <path to liblocalflock.so> <path to localflock-profile> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// time the first lock is held while the child waits for it
+#define HOLD_US 100000
+// short byte range locks and the time each is held
+#define SHORT_LOCKS 10
+#define SHORT_US 1000
+// time the locks on the third file are held until the close
+#define CLOSE_US 20000
+
+static int failures = 0;
+
+static void check(const char* name, bool ok) {
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+__attribute__((noinline)) void hold_long(const char* path) {
+    int fd = open(path, O_RDWR);
+    flock(fd, LOCK_EX);
+    pid_t child = fork();
+    if (child == 0) {
+        int own = open(path, O_RDWR);
+        flock(own, LOCK_EX);
+        _exit(0);
+    }
+    usleep(HOLD_US);
+    flock(fd, LOCK_UN);
+    waitpid(child, nullptr, 0);
+    close(fd);
+}
+
+__attribute__((noinline)) void hold_short(const char* path) {
+    int fd = open(path, O_RDWR);
+    struct flock arg = {};
+    arg.l_whence = SEEK_SET;
+    arg.l_len = 10;
+    for (int i = 0; i < SHORT_LOCKS; i++) {
+        arg.l_type = F_WRLCK;
+        fcntl(fd, F_SETLKW, &arg);
+        usleep(SHORT_US);
+        arg.l_type = F_UNLCK;
+        fcntl(fd, F_SETLK, &arg);
+    }
+    close(fd);
+}
+
+__attribute__((noinline)) void hold_until_close(const char* path) {
+    int fd = open(path, O_RDWR);
+    int range_fd = open(path, O_RDWR);
+    flock(fd, LOCK_EX);
+    struct flock arg = {};
+    arg.l_type = F_WRLCK;
+    arg.l_whence = SEEK_SET;
+    fcntl(range_fd, F_SETLK, &arg);
+    usleep(CLOSE_US);
+    close(fd);
+    close(range_fd);
+}
+
+__attribute__((noinline)) int workload(const char* first, const char* second, const char* third) {
+    hold_long(first);
+    hold_short(second);
+    hold_until_close(third);
+    return 0;
+}
+
+/*
+ * run a program with the library and wait for it, its output goes into output. Returns its exit status.
+ */
+static int run(const vector<string>& args, const char* library, const string& lockdir, const string& profile,
+               const string& output) {
+    pid_t child = fork();
+    if (child == 0) {
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        if (!profile.empty()) {
+            setenv("LOCALFLOCK_PROFILE", profile.c_str(), 1);
+            setenv("LOCALFLOCK_PROFILE_RATE", "1", 1);
+        }
+        if (!output.empty()) {
+            int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            dup2(fd, STDOUT_FILENO);
+        }
+        vector<const char*> argv;
+        for (auto& arg: args) argv.push_back(arg.c_str());
+        argv.push_back(nullptr);
+        execv(args[0] == "--self" ? "/proc/self/exe" : args[0].c_str(), (char* const*) argv.data());
+        _exit(127);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static string read_file(const string& path) {
+    ifstream input(path);
+    stringstream content;
+    content << input.rdbuf();
+    return content.str();
+}
+
+/*
+ * the sum of the values of the folded stacks that contain part
+ */
+static long folded_value(const string& folded, const string& part) {
+    istringstream lines(folded);
+    string line;
+    long result = 0;
+    while (getline(lines, line)) {
+        if (line.find(part) != string::npos) result += atol(line.substr(line.find_last_of(' ') + 1).c_str());
+    }
+    return result;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 5 && strcmp(argv[1], "--workload") == 0) return workload(argv[2], argv[3], argv[4]);
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <localflock-profile> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    const char* library = argv[1];
+    string tool = argv[2];
+    mkdir(argv[3], 0755);
+    string directory = string(argv[3]) + "/profile.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string first = directory + "/first", second = directory + "/second", third = directory + "/third";
+    for (auto& path: {first, second, third}) close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    string profiles = directory + "/profiles", lockdir = directory + "/locks", output = directory + "/output";
+
+    // one profile per process and the shared file of the waiting requests
+    check("profile: workload finished",
+          run({"--self", "--workload", first, second, third}, library, lockdir, profiles, "") == 0);
+    int files = 0;
+    error_code error;
+    for (auto& entry: filesystem::directory_iterator(profiles, error)) files += entry.path().extension() == ".profile";
+    check("profile: one file per process", files == 2);
+    check("profile: file of the waiting requests", filesystem::exists(profiles + "/waiting"));
+
+    // folded stacks of the hold times, in microseconds
+    check("hold: printed", run({tool, profiles}, library, lockdir, "", output) == 0);
+    string folded = read_file(output);
+    check("hold: frames named", folded.find("main;workload;hold_long;[lock ") != string::npos);
+    check("hold: long lock", folded_value(folded, ";hold_long;[lock ") >= HOLD_US * 9 / 10);
+    check("hold: short locks", folded_value(folded, ";hold_short;[lock ") >= SHORT_LOCKS * SHORT_US);
+    check("hold: locks released by close", folded_value(folded, ";hold_until_close;[lock ") >= 2 * CLOSE_US * 9 / 10);
+
+    // the wait of the child, the number of samples and the lock as root frame
+    check("wait: printed", run({tool, "-m", "wait", profiles}, library, lockdir, "", output) == 0);
+    folded = read_file(output);
+    check("wait: caused by the long lock", folded_value(folded, ";hold_long;[lock ") >= HOLD_US / 2);
+    check("wait: none by the short locks", folded_value(folded, ";hold_short;[lock ") == 0);
+    check("samples: printed", run({tool, "-m", "samples", "-r", profiles}, library, lockdir, "", output) == 0);
+    folded = read_file(output);
+    check("samples: one per short lock", folded_value(folded, ";hold_short ") == SHORT_LOCKS);
+    check("samples: lock as root frame", folded.compare(0, 6, "[lock ") == 0);
+
+    // a table of the locks, and the stacks of the first one
+    check("table: printed", run({tool, "-t", profiles}, library, lockdir, "", output) == 0);
+    istringstream table(read_file(output));
+    string line, lock;
+    int locks = 0;
+    getline(table, line);
+    while (getline(table, line)) {
+        if (locks++ == 0) lock = line.substr(0, line.find(' '));
+    }
+    check("table: one line per lock", locks == 3);
+    check("filter: printed", run({tool, "-l", lock, profiles}, library, lockdir, "", output) == 0);
+    folded = read_file(output);
+    check("filter: only the longest lock", folded_value(folded, ";hold_long;[lock " + lock + "] ") > 0 &&
+                                           folded_value(folded, ";hold_short;") == 0);
+    check("filter: not a profile", run({tool, profiles + "/waiting"}, library, lockdir, "", output) == 2);
+
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
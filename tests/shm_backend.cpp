@@ -0,0 +1,254 @@
+/*
+ * Test for the shared memory backend: flock and byte range locks between processes, F_GETLK, waiting for a release
+ * and the recovery of locks held by processes that were killed.
+ *
+ * The test runs itself as workload under LD_PRELOAD. Each workload process reads commands from stdin and answers
+ * with one line, so that the test can interleave the processes.
+ *
+ * Usage: shm_backend <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const char* name, bool ok) {
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+/*
+ * a lock reported by F_GETLK as "<l_type> <l_start> <l_len> <l_pid>"
+ */
+static string fmt_lock(const struct flock& arg) {
+    return to_string(arg.l_type) + " " + to_string(arg.l_start) + " " + to_string(arg.l_len) + " " +
+           to_string(arg.l_pid);
+}
+
+/*
+ * the program running under LD_PRELOAD. Commands:
+ *   "ex <path>", "sh <path>": open a new fd and take a flock lock, waiting for it
+ *   "try <path>": answer whether a new fd could be locked exclusively without waiting
+ *   "unlock <path>": release the flock locks of the fds opened by ex and sh, which stay open
+ *   "set <r|w|u> <start> <length> <path>": F_SETLK on one fd per path
+ *   "get <r|w> <start> <length> <path>": F_GETLK, answers with the type, range and pid of the conflicting lock
+ *   "ofd <r|w|u> <start> <length> <path>": F_OFD_SETLK on the fd of set
+ */
+static int workload() {
+    char line[4096];
+    vector<pair<string, int>> flock_fds;
+    map<string, int> range_fds;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        line[strcspn(line, "\n")] = 0;
+        istringstream input(line);
+        string command, path;
+        input >> command;
+        string answer = "no";
+        if (command == "ex" || command == "sh") {
+            input >> path;
+            int fd = open(path.c_str(), O_RDWR);
+            if (fd >= 0 && flock(fd, command == "ex" ? LOCK_EX : LOCK_SH) == 0) answer = "ok";
+            flock_fds.emplace_back(path, fd);
+        } else if (command == "try") {
+            input >> path;
+            int fd = open(path.c_str(), O_RDWR);
+            if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0) answer = "ok";
+            close(fd);
+        } else if (command == "unlock") {
+            input >> path;
+            answer = "ok";
+            for (auto& entry: flock_fds) {
+                if (entry.first == path && flock(entry.second, LOCK_UN) != 0) answer = "no";
+            }
+        } else if (command == "set" || command == "get" || command == "ofd") {
+            string type;
+            struct flock arg = {};
+            input >> type >> arg.l_start >> arg.l_len >> path;
+            arg.l_type = type == "w" ? F_WRLCK : type == "r" ? F_RDLCK : F_UNLCK;
+            arg.l_whence = SEEK_SET;
+            if (range_fds.count(path) == 0) range_fds[path] = open(path.c_str(), O_RDWR);
+            int fd = range_fds[path];
+            if (command == "get") {
+                if (fcntl(fd, F_GETLK, &arg) == 0) {
+                    answer = arg.l_type == F_UNLCK ? "none" : fmt_lock(arg);
+                }
+            } else if (fcntl(fd, command == "set" ? F_SETLK : F_OFD_SETLK, &arg) == 0) {
+                answer = "ok";
+            }
+        }
+        printf("%s\n", answer.c_str());
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// a running workload process
+struct worker_t {
+    pid_t pid;
+    FILE* commands;
+    FILE* answers;
+};
+
+static worker_t start_worker(const char* program, const char* library, const string& lockdir) {
+    int to_child[2], from_child[2];
+    // other workers must not inherit the pipes, they would not see the end of their input
+    if (pipe2(to_child, O_CLOEXEC) != 0 || pipe2(from_child, O_CLOEXEC) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        setenv("LOCALFLOCK_BACKEND", "shm", 1);
+        setenv("LOCALFLOCK_SHM_RECORDS", "64", 1);
+        execl("/proc/self/exe", program, "--workload", nullptr);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    return {child, fdopen(to_child[1], "w"), fdopen(from_child[0], "r")};
+}
+
+static void post(worker_t& worker, const string& command) {
+    fprintf(worker.commands, "%s\n", command.c_str());
+    fflush(worker.commands);
+}
+
+static string answer(worker_t& worker) {
+    char line[256];
+    if (fgets(line, sizeof(line), worker.answers) == nullptr) return "";
+    line[strcspn(line, "\n")] = 0;
+    return line;
+}
+
+static string send(worker_t& worker, const string& command) {
+    post(worker, command);
+    return answer(worker);
+}
+
+static void stop_worker(worker_t& worker) {
+    fclose(worker.commands);
+    fclose(worker.answers);
+    int status;
+    waitpid(worker.pid, &status, 0);
+}
+
+static void kill_worker(worker_t& worker) {
+    kill(worker.pid, SIGKILL);
+    stop_worker(worker);
+}
+
+static string create_file(const string& directory, const string& name) {
+    string path = directory + "/" + name;
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+static string read_file(const string& path) {
+    ifstream file(path);
+    stringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--workload") == 0) return workload();
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/shm_backend.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string lockdir = directory + "/locks";
+    string first = create_file(directory, "first");
+    string second = create_file(directory, "second");
+
+    // flock locks
+    worker_t a = start_worker(argv[0], argv[1], lockdir);
+    worker_t b = start_worker(argv[0], argv[1], lockdir);
+    check("flock: exclusive lock", send(a, "ex " + first) == "ok");
+    check("flock: format records the backend", read_file(lockdir + "/format").find("backend=shm\n") != string::npos);
+    check("flock: no lock files", !filesystem::exists(lockdir + "/registry"));
+    check("flock: exclusive lock seen by another process", send(b, "try " + first) == "no");
+    check("flock: other file not locked", send(b, "try " + second) == "ok");
+    check("flock: shared locks of two processes", send(a, "unlock " + first) == "ok" &&
+                                                  send(a, "sh " + first) == "ok" && send(b, "sh " + first) == "ok");
+    check("flock: shared locks exclude exclusive ones", send(b, "try " + first) == "no");
+    check("flock: released", send(a, "unlock " + first) == "ok" && send(b, "unlock " + first) == "ok" &&
+                             send(b, "try " + first) == "ok");
+
+    // a waiting process is woken by the release, not by the periodic check of the holders after 200 ms
+    check("wait: exclusive lock", send(a, "ex " + first) == "ok");
+    post(b, "ex " + first);
+    usleep(50000);
+    auto released = chrono::steady_clock::now();
+    send(a, "unlock " + first);
+    check("wait: lock acquired after the release", answer(b) == "ok");
+    check("wait: woken without polling",
+          chrono::steady_clock::now() - released < chrono::milliseconds(100));
+    check("wait: lock held by the waiting process", send(a, "try " + first) == "no");
+    send(b, "unlock " + first);
+
+    // byte range locks
+    check("range: write lock 0-99", send(a, "set w 0 100 " + second) == "ok");
+    check("range: overlapping lock refused", send(b, "set r 50 10 " + second) == "no");
+    check("range: lock behind it", send(b, "set w 100 0 " + second) == "ok");
+    check("range: conflict reported by F_GETLK",
+          send(b, "get r 10 1 " + second) == "1 0 100 " + to_string(a.pid));
+    check("range: lock to the end reported with length 0",
+          send(a, "get r 200 1 " + second) == "1 100 0 " + to_string(b.pid));
+    check("range: flock independent of range locks", send(b, "try " + second) == "ok");
+    check("range: part unlocked", send(a, "set u 0 50 " + second) == "ok" && send(b, "set r 0 50 " + second) == "ok");
+    check("range: rest still locked", send(b, "set r 50 1 " + second) == "no");
+    check("range: OFD lock conflicts with POSIX lock of the same process", send(a, "ofd w 60 10 " + second) == "no");
+
+    // locks of killed processes
+    check("recovery: exclusive lock", send(a, "ex " + first) == "ok");
+    kill_worker(a);
+    check("recovery: lock of the killed process removed", send(b, "try " + first) == "ok");
+    check("recovery: range locks of the killed process removed", send(b, "set w 0 100 " + second) == "ok");
+    a = start_worker(argv[0], argv[1], lockdir);
+    check("recovery: exclusive lock of a new process", send(a, "ex " + first) == "ok");
+    post(b, "ex " + first);
+    usleep(50000);
+    kill_worker(a);
+    check("recovery: waiting process gets the lock", answer(b) == "ok");
+    stop_worker(b);
+
+    struct stat st;
+    if (stat(lockdir.c_str(), &st) == 0) {
+        char name[64];
+        snprintf(name, sizeof(name), "/localflock-%lx-%lx", (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+        shm_unlink(name);
+    }
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,203 @@
+/*
+ * Regression test for the number of system calls done by the library for the first lock on a file, for further
+ * locks, for locks on duplicated fds and for closing untracked fds. The workload runs four times: with all locks
+ * redirected to lock files, with all locks passed through to the kernel by the policy, with all locks redirected
+ * to the shared memory backend and with the shared memory backend naming locks after the identity of the file.
+ *
+ * The test runs itself as workload under LD_PRELOAD and counts the system calls with ptrace. The workload marks
+ * the start and the end of each measured section with a getppid call, which is not used by the library.
+ *
+ * Usage: syscall_count <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <filesystem>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// number of files used in each section
+#define FILES 20
+// system calls allowed once per section, e.g., for opening the protocol on the first lock
+#define SETUP_SYSCALLS 20
+
+// runs of the workload
+enum run_mode_t {
+    MODE_REDIRECTED,
+    MODE_PASSTHROUGH,
+    MODE_SHM,
+    MODE_IDENTITY,
+    MODE_COUNT
+};
+static const char* mode_names[] = {"redirected", "passthrough", "shm", "identity"};
+
+// the measured sections of the workload and the maximal number of system calls per file in each mode
+struct section_t {
+    const char* name;
+    int max[MODE_COUNT];
+};
+static const section_t sections[] = {
+    // redirected: fstat, readlink, shared lock on the protocol, check for an existing lock file, create it and set
+    // permissions, unlock the protocol, open an own open file description, LOCK_EX and LOCK_UN. The lock directory
+    // is new, each file also creates its two levels of subdirectories: a failed create, mkdirat and fchmodat twice.
+    // passed through: fstat, LOCK_EX and LOCK_UN, the filesystem type of the device is known from the setup lock
+    // shm: fstat and readlink, locking and unlocking stay in user space
+    // identity: fstat and the inode generation instead of readlink
+    {"first lock", {15, 3, 2, 2}},
+    // a second fd of the same file: fstat, open an own open file description (redirected only), LOCK_EX and LOCK_UN
+    // (not with shm)
+    {"lock on known file", {4, 3, 1, 1}},
+    // dup shares the lock information of the fd: dup, LOCK_EX, LOCK_UN and closing the duplicate
+    {"lock on duplicated fd", {4, 4, 2, 2}},
+    // the close itself and closing the own open file description (redirected only)
+    {"close of locked fd", {2, 1, 1, 1}},
+    // nothing but the close itself
+    {"close of untracked fd", {1, 1, 1, 1}},
+};
+
+/*
+ * the program running under LD_PRELOAD.
+ */
+static int workload(const char* directory) {
+    vector<int> fds, second_fds, plain_fds;
+    for (int i = 0; i < FILES; i++) {
+        string path = string(directory) + "/file" + to_string(i);
+        fds.push_back(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+        second_fds.push_back(open(path.c_str(), O_RDWR));
+        plain_fds.push_back(open(path.c_str(), O_RDONLY));
+    }
+
+    // the library reads its settings and opens the lock directory on the first lock of the process, which is not
+    // part of the cost per file
+    string setup_path = string(directory) + "/setup";
+    int setup_fd = open(setup_path.c_str(), O_CREAT | O_RDWR, 0644);
+    flock(setup_fd, LOCK_EX);
+    flock(setup_fd, LOCK_UN);
+
+    getppid();
+    for (int fd: fds) {
+        flock(fd, LOCK_EX);
+        flock(fd, LOCK_UN);
+    }
+    getppid();
+    for (int fd: second_fds) {
+        flock(fd, LOCK_EX);
+        flock(fd, LOCK_UN);
+    }
+    getppid();
+    for (int fd: fds) {
+        int duplicate = dup(fd);
+        flock(duplicate, LOCK_EX);
+        flock(duplicate, LOCK_UN);
+        close(duplicate);
+    }
+    getppid();
+    for (int fd: second_fds) close(fd);
+    getppid();
+    for (int fd: plain_fds) close(fd);
+    getppid();
+    return 0;
+}
+
+/*
+ * run the workload under ptrace and count the system calls of each section. Returns the number of failed sections.
+ */
+static int measure(const char* program, const char* library, const string& directory, run_mode_t mode) {
+    filesystem::create_directory(directory);
+    string lockdir = directory + "/locks";
+    pid_t child = fork();
+    if (child == 0) {
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        // an empty list of filesystems passes all locks through
+        setenv("LOCALFLOCK_FILESYSTEMS", mode == MODE_PASSTHROUGH ? "" : "all", 1);
+        setenv("LOCALFLOCK_BACKEND", mode == MODE_SHM || mode == MODE_IDENTITY ? "shm" : "file", 1);
+        setenv("LOCALFLOCK_NAMING", mode == MODE_IDENTITY ? "identity" : "path", 1);
+        ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        execl("/proc/self/exe", program, "--workload", directory.c_str(), nullptr);
+        _exit(127);
+    }
+
+    // count system calls between the markers. Every system call stops twice, on entry and on exit.
+    int status;
+    waitpid(child, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, child, nullptr, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+    int section = -1;
+    int count = 0;
+    bool entry = true;
+    vector<int> counts;
+    while (true) {
+        ptrace(PTRACE_SYSCALL, child, nullptr, nullptr);
+        if (waitpid(child, &status, 0) < 0 || WIFEXITED(status) || WIFSIGNALED(status)) break;
+        if (!WIFSTOPPED(status) || WSTOPSIG(status) != (SIGTRAP | 0x80)) continue;
+        if (entry) {
+            struct user_regs_struct regs;
+            ptrace(PTRACE_GETREGS, child, nullptr, &regs);
+            if (regs.orig_rax == SYS_getppid) {
+                if (section >= 0) counts.push_back(count);
+                section++;
+                count = 0;
+            } else {
+                count++;
+            }
+        }
+        entry = !entry;
+    }
+
+    // the segment of the shared memory backend is named after the lock directory
+    struct stat st;
+    if ((mode == MODE_SHM || mode == MODE_IDENTITY) && stat(lockdir.c_str(), &st) == 0) {
+        char name[64];
+        snprintf(name, sizeof(name), "/localflock-%lx-%lx", (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+        shm_unlink(name);
+    }
+
+    int expected = sizeof(sections) / sizeof(sections[0]);
+    if ((int) counts.size() != expected) {
+        fprintf(stderr, "expected %d sections, got %zu\n", expected, counts.size());
+        return 1;
+    }
+    int failures = 0;
+    for (int i = 0; i < expected; i++) {
+        int max_per_file = sections[i].max[mode];
+        bool ok = counts[i] <= max_per_file * FILES + SETUP_SYSCALLS;
+        printf("%-12s %-24s %6.2f syscalls per file (limit %d) %s\n", mode_names[mode],
+               sections[i].name, (double) counts[i] / FILES, max_per_file, ok ? "ok" : "FAILED");
+        if (!ok) failures++;
+    }
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && strcmp(argv[1], "--workload") == 0) return workload(argv[2]);
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    // a new directory for each run, the lock files should not exist before
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/syscall_count.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+
+    int failures = 0;
+    for (int mode = 0; mode < MODE_COUNT; mode++) {
+        failures += measure(argv[0], argv[1], directory + "/" + mode_names[mode], (run_mode_t) mode);
+    }
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,184 @@
+/*
+ * Test for LOCALFLOCK_TRACE and localflock-replay: a workload with two processes and four threads is traced, the
+ * trace is printed and replayed as fast as possible and with the original timing.
+ *
+ * The test runs itself as workload under LD_PRELOAD. The workload locks the first file in its main thread while a
+ * child process waits for it, two threads lock and unlock it in a loop and the child takes byte range locks on the
+ * second file.
+ *
+ * Usage: trace_replay <path to liblocalflock.so> <path to localflock-replay> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// iterations of each locking thread
+#define THREAD_ITERATIONS 50
+// time the main thread holds the lock the child waits for
+#define HOLD_US 50000
+
+static int failures = 0;
+
+static void check(const char* name, bool ok) {
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+static void lock_loop(const char* path) {
+    int fd = open(path, O_RDWR);
+    for (int i = 0; i < THREAD_ITERATIONS; i++) {
+        flock(fd, LOCK_EX);
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+}
+
+static int workload(const char* first, const char* second) {
+    int fd = open(first, O_RDWR);
+    flock(fd, LOCK_EX);
+    pid_t child = fork();
+    if (child == 0) {
+        int own = open(first, O_RDWR);
+        flock(own, LOCK_EX);
+        flock(own, LOCK_UN);
+        int range_fd = open(second, O_RDWR);
+        struct flock arg = {};
+        arg.l_type = F_WRLCK;
+        arg.l_whence = SEEK_SET;
+        arg.l_len = 10;
+        fcntl(range_fd, F_SETLK, &arg);
+        arg.l_type = F_UNLCK;
+        fcntl(range_fd, F_SETLK, &arg);
+        _exit(0);
+    }
+    usleep(HOLD_US);
+    flock(fd, LOCK_UN);
+    waitpid(child, nullptr, 0);
+    thread a(lock_loop, first), b(lock_loop, first);
+    a.join();
+    b.join();
+    int copy = dup(fd);
+    flock(copy, LOCK_SH);
+    close(copy);
+    close(fd);
+    return 0;
+}
+
+/*
+ * run a program with the library and wait for it. Returns its exit status.
+ */
+static int run(const vector<string>& args, const char* library, const string& lockdir, const string& trace) {
+    pid_t child = fork();
+    if (child == 0) {
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        if (!trace.empty()) setenv("LOCALFLOCK_TRACE", trace.c_str(), 1);
+        vector<const char*> argv;
+        for (auto& arg: args) argv.push_back(arg.c_str());
+        argv.push_back(nullptr);
+        execv(args[0] == "--self" ? "/proc/self/exe" : args[0].c_str(), (char* const*) argv.data());
+        _exit(127);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static string read_file(const string& path) {
+    ifstream input(path);
+    stringstream content;
+    content << input.rdbuf();
+    return content.str();
+}
+
+/*
+ * a number in the JSON output of localflock-replay, -1 if it is missing
+ */
+static long json_number(const string& json, const string& name) {
+    size_t position = json.find("\"" + name + "\": ");
+    if (position == string::npos) return -1;
+    return atol(json.c_str() + position + name.size() + 4);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 4 && strcmp(argv[1], "--workload") == 0) return workload(argv[2], argv[3]);
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <localflock-replay> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    const char* library = argv[1];
+    string replay = argv[2];
+    mkdir(argv[3], 0755);
+    string directory = string(argv[3]) + "/trace_replay.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string first = directory + "/first", second = directory + "/second";
+    close(open(first.c_str(), O_CREAT | O_RDWR, 0644));
+    close(open(second.c_str(), O_CREAT | O_RDWR, 0644));
+    string traces = directory + "/traces", lockdir = directory + "/locks";
+
+    // one trace file per process
+    check("trace: workload finished", run({"--self", "--workload", first, second}, library, lockdir, traces) == 0);
+    int files = 0;
+    error_code error;
+    for (auto& entry: filesystem::directory_iterator(traces, error)) files += entry.path().extension() == ".trace";
+    check("trace: one file per process", files == 2);
+
+    // the merged trace as text
+    string dump = directory + "/dump";
+    check("dump: printed", run({replay, "-D", "-o", dump, traces}, library, lockdir, "") == 0);
+    istringstream lines(read_file(dump));
+    string line;
+    int records = 0, exclusive = 0, ranges = 0, dups = 0, closes = 0;
+    bool waited = false;
+    while (getline(lines, line)) {
+        records++;
+        if (line.find("flock LOCK_EX ") != string::npos) {
+            exclusive++;
+            waited |= atof(line.substr(line.find_last_of(' ') + 1).c_str()) >= HOLD_US / 2 * 1e-6;
+        }
+        ranges += line.find("fcntl F_SETLK ") != string::npos;
+        dups += line.find(" dup -> ") != string::npos;
+        closes += line.find(" close ") != string::npos;
+    }
+    check("dump: all exclusive flock locks", exclusive == 2 + 2 * THREAD_ITERATIONS);
+    check("dump: wait of the child recorded", waited);
+    check("dump: byte range locks", ranges == 2);
+    check("dump: dup and close", dups == 1 && closes == 4);
+
+    // replay as fast as possible and with the original timing, with another lock directory
+    string result = directory + "/result";
+    check("replay: as fast as possible", run({replay, "-s", "0", "-d", directory, "-o", result, traces}, library,
+                                             directory + "/replay-locks", "") == 0);
+    string json = read_file(result);
+    check("replay: all operations", json_number(json, "ops") == records);
+    check("replay: two processes, four threads", json_number(json, "processes") == 2 &&
+                                                  json_number(json, "threads") == 4);
+    check("replay: same results", json_number(json, "differences") == 0 &&
+                                  json.find("\"stalled\": false") != string::npos);
+    check("replay: original timing", run({replay, "-s", "1", "-d", directory, "-o", result, traces}, library,
+                                         directory + "/replay-locks", "") == 0);
+    json = read_file(result);
+    check("replay: wait of the child reproduced", json_number(json, "max_ns") >= HOLD_US / 2 * 1000);
+    check("replay: not a trace", run({replay, "-o", result, dump}, library, lockdir, "") == 2);
+
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+/*
+ * Test for the deadlines of blocking requests: flock, F_SETLKW and F_OFD_SETLKW fail with EINTR or EAGAIN when the
+ * deadline expires, the holder of the lock is logged and long waits are reported. Deadlines can depend on the path.
+ * Runs with lock files and with the shm backend.
+ *
+ * The test runs itself as workload under LD_PRELOAD. Each workload process reads commands from stdin and answers
+ * with one line, so that the test can interleave the processes.
+ *
+ * Usage: wait_deadline <path to liblocalflock.so> <directory for temporary files>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(const string& name, bool ok) {
+    printf("%-60s %s\n", name.c_str(), ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+/*
+ * the result of a request as answered by the workload
+ */
+static string result_name(int result) {
+    if (result == 0) return "ok";
+    if (errno == EINTR) return "EINTR";
+    if (errno == EAGAIN) return "EAGAIN";
+    return strerror(errno);
+}
+
+/*
+ * the program running under LD_PRELOAD. Commands, answered with the result and the milliseconds it took:
+ *   "ex <path>": open a new fd and take an exclusive flock lock, waiting for it
+ *   "unlock <path>": release and close the fds opened by ex
+ *   "set <path>", "setw <path>": write lock on bytes 0-9 with F_SETLK or F_SETLKW, on one fd per path
+ *   "ofd <path>", "ofdw <path>": the same with F_OFD_SETLK and F_OFD_SETLKW
+ */
+static int workload() {
+    char line[4096];
+    multimap<string, int> flock_fds;
+    map<string, int> range_fds;
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        line[strcspn(line, "\n")] = 0;
+        istringstream input(line);
+        string command, path;
+        input >> command >> path;
+        auto start = chrono::steady_clock::now();
+        string answer = "unknown";
+        if (command == "ex") {
+            int fd = open(path.c_str(), O_RDWR);
+            answer = result_name(flock(fd, LOCK_EX));
+            flock_fds.emplace(path, fd);
+        } else if (command == "unlock") {
+            auto range = flock_fds.equal_range(path);
+            for (auto entry = range.first; entry != range.second; entry++) close(entry->second);
+            flock_fds.erase(path);
+            answer = "ok";
+        } else if (command == "set" || command == "setw" || command == "ofd" || command == "ofdw") {
+            if (range_fds.count(path) == 0) range_fds[path] = open(path.c_str(), O_RDWR);
+            struct flock arg = {};
+            arg.l_type = F_WRLCK;
+            arg.l_whence = SEEK_SET;
+            arg.l_len = 10;
+            int operation = command == "set" ? F_SETLK : command == "setw" ? F_SETLKW
+                                                       : command == "ofd" ? F_OFD_SETLK : F_OFD_SETLKW;
+            answer = result_name(fcntl(range_fds[path], operation, &arg));
+        }
+        long elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        printf("%s %ld\n", answer.c_str(), elapsed);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// a running workload process, its messages go into log
+struct worker_t {
+    pid_t pid;
+    FILE* commands;
+    FILE* answers;
+    string log;
+};
+
+static worker_t start_worker(const char* program, const char* library, const string& lockdir, const string& backend,
+                             const string& log, const vector<pair<string, string>>& environment) {
+    int to_child[2], from_child[2];
+    // other workers must not inherit the pipes, they would not see the end of their input
+    if (pipe2(to_child, O_CLOEXEC) != 0 || pipe2(from_child, O_CLOEXEC) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        int log_fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(log_fd, STDERR_FILENO);
+        setenv("LD_PRELOAD", library, 1);
+        setenv("LOCALFLOCK_LOCKDIR", lockdir.c_str(), 1);
+        setenv("LOCALFLOCK_FILESYSTEMS", "all", 1);
+        setenv("LOCALFLOCK_BACKEND", backend.c_str(), 1);
+        for (auto& variable: environment) setenv(variable.first.c_str(), variable.second.c_str(), 1);
+        execl("/proc/self/exe", program, "--workload", nullptr);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    return {child, fdopen(to_child[1], "w"), fdopen(from_child[0], "r"), log};
+}
+
+static void post(worker_t& worker, const string& command) {
+    fprintf(worker.commands, "%s\n", command.c_str());
+    fflush(worker.commands);
+}
+
+/*
+ * the answer to the last command, with the milliseconds it took in elapsed
+ */
+static string answer(worker_t& worker, long& elapsed) {
+    char line[256];
+    if (fgets(line, sizeof(line), worker.answers) == nullptr) return "";
+    line[strcspn(line, "\n")] = 0;
+    char* separator = strrchr(line, ' ');
+    if (separator == nullptr) return "";
+    elapsed = atol(separator + 1);
+    *separator = 0;
+    return line;
+}
+
+static string send(worker_t& worker, const string& command, long& elapsed) {
+    post(worker, command);
+    return answer(worker, elapsed);
+}
+
+static string send(worker_t& worker, const string& command) {
+    long elapsed;
+    return send(worker, command, elapsed);
+}
+
+static void stop_worker(worker_t& worker) {
+    fclose(worker.commands);
+    fclose(worker.answers);
+    int status;
+    waitpid(worker.pid, &status, 0);
+}
+
+static string read_file(const string& path) {
+    ifstream input(path);
+    stringstream content;
+    content << input.rdbuf();
+    return content.str();
+}
+
+static string create_file(const string& path) {
+    close(open(path.c_str(), O_CREAT | O_RDWR, 0644));
+    return path;
+}
+
+/*
+ * all checks with one backend
+ */
+static void run(const char* program, const char* library, const string& directory, const string& backend) {
+    string lockdir = directory + "/locks-" + backend;
+    string first = create_file(directory + "/first"), second = create_file(directory + "/second");
+    string fast = directory + "/fast";
+    mkdir(fast.c_str(), 0755);
+    string third = create_file(fast + "/third");
+    string prefix = backend + ": ";
+    long elapsed = 0;
+
+    // the holder and a process with a deadline of 0.3 s that reports its waits every 0.1 s
+    worker_t holder = start_worker(program, library, lockdir, backend, directory + "/holder.log", {});
+    worker_t bounded = start_worker(program, library, lockdir, backend, directory + "/bounded.log",
+                                    {{"LOCALFLOCK_WAIT_DEADLINE", "0.3"}, {"LOCALFLOCK_WAIT_REPORT", "0.1"}});
+    check(prefix + "flock: exclusive lock", send(holder, "ex " + first) == "ok");
+    check(prefix + "flock: EINTR at the deadline", send(bounded, "ex " + first, elapsed) == "EINTR");
+    check(prefix + "flock: failed after 0.3 s", elapsed >= 250 && elapsed < 3000);
+    post(bounded, "ex " + first);
+    usleep(100000);
+    send(holder, "unlock " + first);
+    check(prefix + "flock: lock released before the deadline", answer(bounded, elapsed) == "ok" && elapsed < 300);
+    send(bounded, "unlock " + first);
+
+    // byte range locks, the kernel reports the pid of POSIX locks and none for OFD locks
+    check(prefix + "range: write lock", send(holder, "set " + second) == "ok");
+    check(prefix + "range: F_SETLKW fails at the deadline", send(bounded, "setw " + second) == "EINTR");
+    check(prefix + "range: OFD lock", send(holder, "ofd " + third) == "ok");
+    check(prefix + "range: F_OFD_SETLKW fails at the deadline", send(bounded, "ofdw " + third) == "EINTR");
+    stop_worker(bounded);
+    string log = read_file(bounded.log);
+    check(prefix + "log: waits reported", log.find("LOCK_EX on " + first + " is waiting for") != string::npos);
+    check(prefix + "log: holder of the flock lock",
+          log.find("LOCK_EX on " + first + " failed after 0.3 s, the lock is held by pid " +
+                   to_string(holder.pid)) != string::npos);
+    check(prefix + "log: holder of the POSIX lock",
+          log.find("F_SETLKW on " + second + " failed after 0.3 s, the lock is held by pid " +
+                   to_string(holder.pid)) != string::npos);
+    check(prefix + "log: holder of the OFD lock",
+          log.find("F_OFD_SETLKW on " + third + " failed after 0.3 s, the lock is held by an open file description") !=
+          string::npos);
+
+    // EAGAIN instead of EINTR
+    worker_t again = start_worker(program, library, lockdir, backend, directory + "/again.log",
+                                  {{"LOCALFLOCK_WAIT_DEADLINE", "0.1"}, {"LOCALFLOCK_WAIT_ERROR", "EAGAIN"}});
+    check(prefix + "error: exclusive lock", send(holder, "ex " + first) == "ok");
+    check(prefix + "error: EAGAIN at the deadline", send(again, "ex " + first) == "EAGAIN");
+    stop_worker(again);
+
+    // a deadline only for the files below the prefix, the others wait as long as needed
+    worker_t by_path = start_worker(program, library, lockdir, backend, directory + "/by_path.log",
+                                    {{"LOCALFLOCK_WAIT_DEADLINES", fast + "=0.2"}});
+    check(prefix + "prefix: exclusive lock", send(holder, "ex " + third) == "ok");
+    check(prefix + "prefix: deadline below the prefix", send(by_path, "ex " + third, elapsed) == "EINTR" &&
+                                                        elapsed >= 150);
+    post(by_path, "ex " + first);
+    usleep(500000);
+    send(holder, "unlock " + first);
+    check(prefix + "prefix: no deadline for other files", answer(by_path, elapsed) == "ok" && elapsed >= 400);
+    stop_worker(by_path);
+    stop_worker(holder);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "--workload") == 0) return workload();
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <liblocalflock.so> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    mkdir(argv[2], 0755);
+    string directory = string(argv[2]) + "/wait_deadline.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    run(argv[0], argv[1], directory, "file");
+    run(argv[0], argv[1], directory, "shm");
+    filesystem::remove_all(directory);
+    return failures == 0 ? 0 : 1;
+}
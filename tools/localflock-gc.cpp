@@ -0,0 +1,79 @@
+/*
+ * Full cleanup of the lock directory. Processes loading localflock only check a few entries of the protocol on
+ * startup. This tool checks all of them and is meant to be run regularly, e.g., from cron or a systemd timer.
+ *
+ * Usage: localflock-gc [-v] [-m levels]
+ *
+ * With -m, the lock files are moved into the given number of levels of subdirectories first, e.g., -m 2 for a flat
+ * directory used by an older version. Programs may keep running, but all programs using the directory must be of a
+ * version that knows the format version 2.
+ *
+ * With the shared memory backend, there are no lock files. The locks of processes that died are removed from the
+ * lock table instead.
+ *
+ * The lock directory is taken from LOCALFLOCK_LOCKDIR as for the library.
+ */
+
+#include "../src/support.h"
+#include "../src/protocol.h"
+#include "../src/stats.h"
+#include "../src/lock_dir.h"
+#include "../src/shm_table.h"
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+    bool verbose = false;
+    long levels = -1;
+    int option;
+    while ((option = getopt(argc, argv, "vm:h")) != -1) {
+        switch (option) {
+            case 'v':
+                verbose = true;
+                break;
+            case 'm':
+                levels = atol(optarg);
+                if (levels < 0 || levels > LOCKDIR_MAX_LEVELS) {
+                    fprintf(stderr, "levels have to be between 0 and %d\n", LOCKDIR_MAX_LEVELS);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-v] [-m levels]\n", argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+
+    init_original_functions();
+    create_logger("localflock-gc");
+    if (verbose) logger->set_level(spdlog::level::debug);
+    read_settings();
+
+    if (levels >= 0) {
+        lockdir_migration_t migration = lockdir_migrate((uint32_t) levels);
+        if (migration.old_levels == (uint32_t) levels && migration.moved == 0 && migration.failed == 0) {
+            logger->info("{} uses {} levels already", settings->LOCKDIR, levels);
+        } else {
+            logger->info("moved {} lock files from {} to {} levels, {} failed", migration.moved, migration.old_levels,
+                         levels, migration.failed);
+        }
+        if (migration.failed > 0) return 1;
+    }
+
+    if (settings->BACKEND == BACKEND_SHM) {
+        ShmTable* table = ShmTable::get();
+        if (!table->is_open()) return 1;
+        logger->info("removed {} locks of dead processes from the shared memory lock table", table->sweep());
+    } else {
+        // check all entries and wait for processes currently adding entries.
+        Protocol* proto = Protocol::get();
+        protocol_cleanup_t result = proto->cleanup(0, true);
+        logger->info("checked {} entries in {}, freed {} entries, removed {} lock files",
+                     result.checked, settings->PROTOCOL_FILE, result.freed, result.removed);
+        proto->close();
+    }
+
+    // statistics of processes that were killed are added to the sum of all exited processes
+    uint32_t retired = stats_retire_dead();
+    if (retired > 0) logger->info("retired statistics of {} processes", retired);
+    return 0;
+}
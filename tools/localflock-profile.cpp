@@ -0,0 +1,178 @@
+/*
+ * Folded stacks of the lock hold times sampled with LOCALFLOCK_PROFILE, the input format of flamegraph.pl and most
+ * other flame graph tools.
+ *
+ * Usage: localflock-profile [-m hold|wait|samples] [-r] [-l lock] [-t] profile...
+ *
+ * The profiles are files or directories with files written by LOCALFLOCK_PROFILE, the entries of all processes with
+ * the same stack and lock are merged. Each line is a stack from the outermost frame to the caller of the lock
+ * function, followed by the frame "[lock <name>]" and the value:
+ *
+ *     main;process_batch;update_index;[lock 1a2b3c] 81234
+ *
+ *   -m hold     estimated time the locks were held in microseconds, the sampled time divided by the rate (default)
+ *   -m wait     estimated time other requests waited for the locks while they were held, in microseconds
+ *   -m samples  number of samples
+ *   -r          the lock as outermost frame instead of the innermost, one tower per lock
+ *   -l lock     only locks whose name contains lock
+ *   -t          a table of the locks with their samples, hold and wait times instead of stacks
+ *
+ * The names of the locks are those of the lock directory, see LOCALFLOCK_SHOW_NAMES, or device:inode for locks
+ * passed through to the kernel.
+ */
+
+#include "../src/profile.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <filesystem>
+#include <unistd.h>
+
+using namespace std;
+
+// the sum of all entries with the same stack and lock
+struct folded_t {
+    uint64_t samples = 0;
+    double hold_ns = 0;
+    double caused_ns = 0;
+};
+
+struct options_t {
+    string metric = "hold";
+    bool lock_root = false;
+    string lock_filter;
+    bool table = false;
+};
+static options_t options;
+
+/*
+ * add the entries of a profile file. Returns false if it is not a profile.
+ */
+static bool read_profile(const string& path, map<pair<string, string>, folded_t>& stacks) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        perror(path.c_str());
+        return false;
+    }
+    profile_header_t header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && header.magic == PROFILE_MAGIC &&
+                 header.version == PROFILE_VERSION && header.entry_size == sizeof(profile_entry_t) &&
+                 header.rate > 0 && fseek(file, PROFILE_HEADER_SIZE, SEEK_SET) == 0;
+    if (valid && header.dropped.load() > 0) {
+        fprintf(stderr, "%s: %lu samples were dropped, the process had more than %u stacks\n", path.c_str(),
+                (unsigned long) header.dropped.load(), header.entries);
+    }
+    // entries are used in order, the first free entry ends the file
+    profile_entry_t entry;
+    for (uint32_t i = 0; valid && i < header.entries && fread(&entry, sizeof(entry), 1, file) == 1; i++) {
+        if (entry.key.load() == 0) break;
+        entry.lock[PROFILE_LOCK_LEN - 1] = 0;
+        entry.stack[PROFILE_STACK_LEN - 1] = 0;
+        if (entry.samples.load() == 0 || strstr(entry.lock, options.lock_filter.c_str()) == nullptr) continue;
+        folded_t& folded = stacks[{entry.stack, entry.lock}];
+        folded.samples += entry.samples.load();
+        folded.hold_ns += entry.hold_ns.load() / header.rate;
+        folded.caused_ns += entry.caused_ns.load() / header.rate;
+    }
+    fclose(file);
+    if (!valid) fprintf(stderr, "%s: not a profile of this version\n", path.c_str());
+    return valid;
+}
+
+static uint64_t metric(const folded_t& folded) {
+    if (options.metric == "samples") return folded.samples;
+    return (uint64_t) ((options.metric == "wait" ? folded.caused_ns : folded.hold_ns) / 1000);
+}
+
+/*
+ * one line per stack and lock, without the stacks whose value is 0
+ */
+static void print_folded(const map<pair<string, string>, folded_t>& stacks) {
+    for (auto& entry: stacks) {
+        uint64_t value = metric(entry.second);
+        if (value == 0) continue;
+        const string& stack = entry.first.first;
+        string lock = "[lock " + entry.first.second + "]";
+        if (options.lock_root) {
+            printf("%s%s%s %lu\n", lock.c_str(), stack.empty() ? "" : ";", stack.c_str(), (unsigned long) value);
+        } else {
+            printf("%s%s%s %lu\n", stack.c_str(), stack.empty() ? "" : ";", lock.c_str(), (unsigned long) value);
+        }
+    }
+}
+
+/*
+ * one line per lock, ordered by the selected metric
+ */
+static void print_table(const map<pair<string, string>, folded_t>& stacks) {
+    map<string, folded_t> locks;
+    for (auto& entry: stacks) {
+        folded_t& lock = locks[entry.first.second];
+        lock.samples += entry.second.samples;
+        lock.hold_ns += entry.second.hold_ns;
+        lock.caused_ns += entry.second.caused_ns;
+    }
+    vector<pair<string, folded_t>> ordered(locks.begin(), locks.end());
+    stable_sort(ordered.begin(), ordered.end(), [](const pair<string, folded_t>& a, const pair<string, folded_t>& b) {
+        return metric(a.second) > metric(b.second);
+    });
+    printf("%-40s %10s %14s %14s\n", "lock", "samples", "hold ms", "wait ms");
+    for (auto& lock: ordered) {
+        printf("%-40s %10lu %14.1f %14.1f\n", lock.first.c_str(), (unsigned long) lock.second.samples,
+               lock.second.hold_ns / 1e6, lock.second.caused_ns / 1e6);
+    }
+}
+
+int main(int argc, char** argv) {
+    int option;
+    while ((option = getopt(argc, argv, "m:rl:th")) != -1) {
+        switch (option) {
+            case 'm':
+                options.metric = optarg;
+                if (options.metric != "hold" && options.metric != "wait" && options.metric != "samples") {
+                    fprintf(stderr, "%s: unknown metric %s\n", argv[0], optarg);
+                    return 2;
+                }
+                break;
+            case 'r':
+                options.lock_root = true;
+                break;
+            case 'l':
+                options.lock_filter = optarg;
+                break;
+            case 't':
+                options.table = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-m hold|wait|samples] [-r] [-l lock] [-t] profile...\n", argv[0]);
+                return option == 'h' ? 0 : 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "%s: no profile given\n", argv[0]);
+        return 2;
+    }
+
+    // merge all profiles, the shared file of the waiting requests is skipped
+    map<pair<string, string>, folded_t> stacks;
+    for (int i = optind; i < argc; i++) {
+        error_code error;
+        if (filesystem::is_directory(argv[i], error)) {
+            for (auto& entry: filesystem::directory_iterator(argv[i])) {
+                if (entry.path().extension() == ".profile") read_profile(entry.path(), stacks);
+            }
+        } else if (!read_profile(argv[i], stacks)) {
+            return 2;
+        }
+    }
+    if (options.table) {
+        print_table(stacks);
+    } else {
+        print_folded(stacks);
+    }
+    return 0;
+}
@@ -0,0 +1,502 @@
+/*
+ * Execute the lock operations recorded with LOCALFLOCK_TRACE again, to measure how a change of the library, its
+ * build or its settings affects the throughput and the latency of a real workload.
+ *
+ * Usage: localflock-replay [-s speed] [-d scratch directory] [-f json|csv] [-o output file] [-D] trace...
+ *
+ * The traces are files or directories with files written by LOCALFLOCK_TRACE, the files of all processes are merged.
+ * Each traced process is replayed by its own process and each traced thread by its own thread, so that POSIX locks
+ * belong to the same owners as in the trace. Every thread executes its operations in their order, at the original
+ * time relative to the start of the trace divided by speed, with -s 0 without any pause and without any order
+ * between the threads. An operation waiting for a lock delays the later operations of its thread. The locked files are replaced by empty files in a new scratch
+ * directory, one per file of the trace. Requests of localflock_lock_async are replayed as blocking flock, fds
+ * inherited from a parent process get their own open file description.
+ *
+ * The library and its settings are taken from the environment, e.g.:
+ *
+ *     LD_PRELOAD=/path/to/liblocalflock.so LOCALFLOCK_FILESYSTEMS=all localflock-replay -s 0 traces/
+ *
+ * The result is one JSON object (or CSV row) like those of localflock_bench, with the latency of the lock
+ * operations in the replay and in the trace. Operations whose result differs from the trace are counted. With -D,
+ * the merged trace is printed as text instead. The exit status is 1 if an operation waited for much longer than in
+ * the trace, which happens if the order of the locks in the traced program depended on something else than locks.
+ */
+
+#include "../src/trace.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <filesystem>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// latencies are counted in buckets with 8 steps per power of two, as by localflock_stress
+#define HISTOGRAM_BUCKETS 496
+// an operation may wait this much longer than in the trace before the replay is considered stuck
+#define STALL_SECONDS 10
+
+// one operation of the trace
+struct replay_op_t {
+    uint64_t time_ns;
+    uint64_t wait_ns;
+    uint64_t file;
+    int64_t start;
+    int64_t length;
+    int32_t pid;
+    int32_t tid;
+    int32_t fd;
+    uint16_t operation;
+    int16_t type;
+    int32_t command;
+    int32_t error;
+    // the traced fd and for TRACE_DUP the new fd, see assign_handles
+    uint64_t handle;
+    uint64_t new_handle;
+};
+
+// state of one replaying thread, shared with the parent
+struct replay_thread_slot_t {
+    // start of the current operation and how long it may take, 0 between operations
+    atomic<int64_t> busy_since;
+    atomic<int64_t> allowed_ns;
+};
+
+// results of all replaying processes, shared memory
+struct replay_shared_t {
+    atomic<int64_t> start_ns;
+    atomic<uint64_t> ops;
+    atomic<uint64_t> differences;
+    atomic<uint64_t> max_lag_ns;
+    atomic<uint64_t> histogram[HISTOGRAM_BUCKETS];
+};
+
+struct options_t {
+    double speed = 1;
+    string directory = "/tmp";
+    bool csv = false;
+    bool dump = false;
+    FILE* output = stdout;
+};
+static options_t options;
+
+static inline int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t ns) {
+    if (ns < 16) return (int) ns;
+    int power = 63 - __builtin_clzll(ns);
+    return 16 + (power - 4) * 8 + (int) ((ns >> (power - 3)) & 7);
+}
+
+static uint64_t bucket_value(int bucket) {
+    if (bucket < 16) return bucket;
+    int power = (bucket - 16) / 8 + 4;
+    return (uint64_t) (8 + (bucket - 16) % 8) << (power - 3);
+}
+
+/*
+ * the value at rank p of a histogram
+ */
+static uint64_t percentile(const vector<uint64_t>& histogram, double p) {
+    uint64_t total = 0;
+    for (uint64_t count: histogram) total += count;
+    uint64_t rank = (uint64_t) (p * (total > 0 ? total - 1 : 0)), seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen > rank) return bucket_value(b);
+    }
+    return 0;
+}
+
+static uint64_t histogram_max(const vector<uint64_t>& histogram) {
+    uint64_t result = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) if (histogram[b] > 0) result = bucket_value(b);
+    return result;
+}
+
+/*
+ * whether an operation acquires, releases or tests a lock, only those are measured
+ */
+static bool is_lock(const replay_op_t& op) {
+    return op.operation == TRACE_FLOCK || op.operation == TRACE_FCNTL;
+}
+
+/*
+ * append the complete records of a trace file. Returns false if it is not a trace.
+ */
+static bool read_trace(const string& path, vector<replay_op_t>& ops) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        perror(path.c_str());
+        return false;
+    }
+    trace_header_t header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && header.magic == TRACE_MAGIC &&
+                 header.version == TRACE_VERSION && header.record_size == sizeof(trace_record_t) &&
+                 fseek(file, TRACE_HEADER_SIZE, SEEK_SET) == 0;
+    uint64_t count = valid ? header.count.load() : 0;
+    if (valid && header.dropped.load() > 0) {
+        fprintf(stderr, "%s: %lu records were dropped\n", path.c_str(), (unsigned long) header.dropped.load());
+    }
+    trace_record_t record;
+    for (uint64_t i = 0; i < count && fread(&record, sizeof(record), 1, file) == 1; i++) {
+        uint16_t operation = record.operation.load();
+        if (operation == TRACE_NONE) continue;
+        ops.push_back({record.time_ns, record.wait_ns, record.file, record.start, record.length, record.pid,
+                       record.tid, record.fd, operation, record.type, record.command, record.error, 0, 0});
+    }
+    fclose(file);
+    if (!valid) fprintf(stderr, "%s: not a trace of this version\n", path.c_str());
+    return valid;
+}
+
+static string flock_name(int operation) {
+    string result = operation & LOCK_EX ? "LOCK_EX" : operation & LOCK_SH ? "LOCK_SH" : "LOCK_UN";
+    if (operation & LOCK_NB) result += "|LOCK_NB";
+    return result;
+}
+
+static string fcntl_name(int command) {
+    switch (command) {
+        case F_SETLK: return "F_SETLK";
+        case F_SETLKW: return "F_SETLKW";
+        case F_GETLK: return "F_GETLK";
+        case F_OFD_SETLK: return "F_OFD_SETLK";
+        case F_OFD_SETLKW: return "F_OFD_SETLKW";
+        case F_OFD_GETLK: return "F_OFD_GETLK";
+        default: return to_string(command);
+    }
+}
+
+/*
+ * print the merged trace, one line per operation
+ */
+static void dump(const vector<replay_op_t>& ops) {
+    uint64_t first = ops.empty() ? 0 : ops[0].time_ns;
+    for (auto& op: ops) {
+        string arguments;
+        switch (op.operation) {
+            case TRACE_FLOCK:
+                arguments = "flock " + flock_name(op.command);
+                break;
+            case TRACE_FCNTL:
+                arguments = "fcntl " + fcntl_name(op.command) + " " +
+                            (op.type == F_WRLCK ? "F_WRLCK" : op.type == F_RDLCK ? "F_RDLCK" : "F_UNLCK") + " " +
+                            to_string(op.start) + "+" + to_string(op.length);
+                break;
+            case TRACE_CLOSE:
+                arguments = "close";
+                break;
+            default:
+                arguments = "dup -> " + to_string(op.command);
+                break;
+        }
+        fprintf(options.output, "%14.6f %7d %7d %5d %016lx %-40s %-12s %12.6f\n", (op.time_ns - first) / 1e9, op.pid,
+                op.tid, op.fd, (unsigned long) op.file, arguments.c_str(), op.error == 0 ? "ok" : strerror(op.error),
+                op.wait_ns / 1e9);
+    }
+}
+
+// the fds of one replaying process, by the handle of the traced fd
+class fd_map_t {
+public:
+    explicit fd_map_t(const string& directory) : directory(directory) {}
+
+    /*
+     * the fd for a handle, the file is opened with the first use of the handle
+     */
+    int get(uint64_t handle, uint64_t file) {
+        lock_guard<mutex> guard(this->mtx);
+        auto existing = this->fds.find(handle);
+        if (existing != this->fds.end()) return existing->second;
+        char path[32];
+        snprintf(path, sizeof(path), "/%016lx", (unsigned long) file);
+        int fd = open((this->directory + path).c_str(), O_RDWR | O_CLOEXEC);
+        this->fds[handle] = fd;
+        return fd;
+    }
+
+    void close_fd(uint64_t handle) {
+        lock_guard<mutex> guard(this->mtx);
+        auto existing = this->fds.find(handle);
+        if (existing == this->fds.end()) return;
+        close(existing->second);
+        this->fds.erase(existing);
+    }
+
+    void dup_fd(uint64_t handle, uint64_t file, uint64_t new_handle) {
+        int fd = this->get(handle, file);
+        lock_guard<mutex> guard(this->mtx);
+        this->fds[new_handle] = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    }
+
+private:
+    string directory;
+    mutex mtx;
+    unordered_map<uint64_t, int> fds;
+};
+
+/*
+ * give every traced fd a handle that is unique for the whole trace, from its first use, open or dup to its close.
+ * The threads of a process reuse the numbers of closed fds, which must not mix up their files if the threads are not
+ * replayed in the exact order of the trace. ops have to be sorted by time.
+ */
+static void assign_handles(vector<replay_op_t>& ops) {
+    map<pair<int32_t, int32_t>, uint64_t> current;
+    uint64_t next = 1;
+    for (auto& op: ops) {
+        auto existing = current.find({op.pid, op.fd});
+        if (existing == current.end()) existing = current.emplace(make_pair(op.pid, op.fd), next++).first;
+        op.handle = existing->second;
+        if (op.operation == TRACE_CLOSE) current.erase(existing);
+        if (op.operation == TRACE_DUP) {
+            op.new_handle = next++;
+            current[{op.pid, op.command}] = op.new_handle;
+        }
+    }
+}
+
+/*
+ * execute one operation. Returns 0 or the errno of the operation.
+ */
+static int execute(const replay_op_t& op, fd_map_t& fds) {
+    int result = 0;
+    switch (op.operation) {
+        case TRACE_FLOCK:
+            result = flock(fds.get(op.handle, op.file), op.command);
+            break;
+        case TRACE_FCNTL: {
+            struct flock range = {};
+            range.l_type = op.type;
+            range.l_whence = SEEK_SET;
+            range.l_start = op.start;
+            range.l_len = op.length;
+            result = fcntl(fds.get(op.handle, op.file), op.command, &range);
+            break;
+        }
+        case TRACE_CLOSE:
+            fds.close_fd(op.handle);
+            break;
+        default:
+            fds.dup_fd(op.handle, op.file, op.new_handle);
+            break;
+    }
+    return result == 0 ? 0 : errno;
+}
+
+/*
+ * replay the operations of one thread
+ */
+static void replay_thread(const vector<replay_op_t>& ops, uint64_t first, replay_shared_t* shared,
+                          replay_thread_slot_t* slot, fd_map_t& fds) {
+    int64_t start = shared->start_ns.load();
+    for (auto& op: ops) {
+        int64_t target = start;
+        if (options.speed > 0) {
+            target += (int64_t) ((op.time_ns - first) / options.speed);
+            struct timespec until = {(time_t) (target / 1000000000), (long) (target % 1000000000)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, nullptr) == EINTR) {}
+        }
+        int64_t begin = now_ns();
+        uint64_t lag = options.speed > 0 && begin > target ? begin - target : 0;
+        uint64_t max_lag = shared->max_lag_ns.load();
+        while (lag > max_lag && !shared->max_lag_ns.compare_exchange_weak(max_lag, lag)) {}
+        slot->allowed_ns.store((int64_t) STALL_SECONDS * 1000000000 +
+                               (int64_t) (options.speed > 0 ? op.wait_ns / options.speed : op.wait_ns));
+        slot->busy_since.store(begin);
+        int error = execute(op, fds);
+        int64_t latency = now_ns() - begin;
+        slot->busy_since.store(0);
+        shared->ops.fetch_add(1);
+        if (!is_lock(op)) continue;
+        shared->histogram[histogram_bucket(latency)].fetch_add(1, memory_order_relaxed);
+        if (error != op.error) shared->differences.fetch_add(1);
+    }
+}
+
+int main(int argc, char** argv) {
+    int option;
+    string output;
+    while ((option = getopt(argc, argv, "s:d:f:o:Dh")) != -1) {
+        switch (option) {
+            case 's':
+                options.speed = max(atof(optarg), 0.0);
+                break;
+            case 'd':
+                options.directory = optarg;
+                break;
+            case 'f':
+                options.csv = strcmp(optarg, "csv") == 0;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'D':
+                options.dump = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s speed] [-d scratch directory] [-f json|csv] [-o output file] [-D] "
+                                "trace...\n", argv[0]);
+                return option == 'h' ? 0 : 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "%s: no trace given\n", argv[0]);
+        return 2;
+    }
+    if (!output.empty()) {
+        options.output = fopen(output.c_str(), "w");
+        if (options.output == nullptr) {
+            perror(output.c_str());
+            return 2;
+        }
+    }
+
+    // merge all traces
+    vector<replay_op_t> ops;
+    for (int i = optind; i < argc; i++) {
+        error_code error;
+        if (filesystem::is_directory(argv[i], error)) {
+            for (auto& entry: filesystem::directory_iterator(argv[i])) {
+                if (entry.path().extension() == ".trace") read_trace(entry.path(), ops);
+            }
+        } else if (!read_trace(argv[i], ops)) {
+            return 2;
+        }
+    }
+    stable_sort(ops.begin(), ops.end(), [](const replay_op_t& a, const replay_op_t& b) {
+        return a.time_ns < b.time_ns;
+    });
+    if (options.dump) {
+        dump(ops);
+        return 0;
+    }
+    assign_handles(ops);
+
+    // the operations of each thread of each process, and an empty file for each traced file
+    map<int32_t, map<int32_t, vector<replay_op_t>>> processes;
+    vector<uint64_t> traced_histogram(HISTOGRAM_BUCKETS);
+    filesystem::create_directories(options.directory);
+    string directory = options.directory + "/localflock-replay.XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    unordered_map<uint64_t, bool> files;
+    for (auto& op: ops) {
+        processes[op.pid][op.tid].push_back(op);
+        if (is_lock(op)) traced_histogram[histogram_bucket(op.wait_ns)]++;
+        if (files.emplace(op.file, true).second) {
+            char path[32];
+            snprintf(path, sizeof(path), "/%016lx", (unsigned long) op.file);
+            close(open((directory + path).c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644));
+        }
+    }
+    int thread_count = 0;
+    for (auto& process: processes) thread_count += (int) process.second.size();
+
+    size_t shared_size = sizeof(replay_shared_t) + thread_count * sizeof(replay_thread_slot_t);
+    void* memory = mmap(nullptr, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+    auto* shared = (replay_shared_t*) memory;
+    auto* slots = (replay_thread_slot_t*) (shared + 1);
+    uint64_t first = ops.empty() ? 0 : ops[0].time_ns;
+
+    // one process per traced process, they start together
+    vector<pid_t> workers;
+    int slot = 0;
+    for (auto& process: processes) {
+        pid_t child = fork();
+        if (child == 0) {
+            while (shared->start_ns.load() == 0) usleep(100);
+            fd_map_t fds(directory);
+            vector<thread> threads;
+            int thread_slot = slot;
+            for (auto& traced_thread: process.second) {
+                threads.emplace_back(replay_thread, cref(traced_thread.second), first, shared, &slots[thread_slot++],
+                                     ref(fds));
+            }
+            for (auto& running: threads) running.join();
+            _exit(0);
+        }
+        if (child < 0) {
+            perror("fork");
+            break;
+        }
+        workers.push_back(child);
+        slot += (int) process.second.size();
+    }
+    int64_t start = now_ns() + 10000000;
+    shared->start_ns.store(start);
+
+    // wait for all processes, operations taking much longer than in the trace stop the replay
+    bool stalled = false;
+    size_t running = workers.size();
+    while (running > 0) {
+        while (running > 0 && waitpid(-1, nullptr, WNOHANG) > 0) running--;
+        if (running == 0) break;
+        int64_t now = now_ns();
+        for (int i = 0; i < thread_count && !stalled; i++) {
+            int64_t since = slots[i].busy_since.load();
+            stalled = since != 0 && now - since > slots[i].allowed_ns.load();
+        }
+        if (stalled) {
+            fprintf(stderr, "an operation waits much longer than in the trace, the replay is stopped\n");
+            for (pid_t worker: workers) kill(worker, SIGKILL);
+        }
+        usleep(10000);
+    }
+    int64_t elapsed = now_ns() - start;
+    filesystem::remove_all(directory);
+
+    vector<uint64_t> histogram(HISTOGRAM_BUCKETS);
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) histogram[b] = shared->histogram[b].load();
+    uint64_t replayed = shared->ops.load();
+    double ops_per_sec = elapsed > 0 ? replayed * 1e9 / elapsed : 0;
+    if (options.csv) {
+        fprintf(options.output, "benchmark,speed,processes,threads,files,ops,ops_per_sec,p50_ns,p90_ns,p99_ns,"
+                                "p999_ns,max_ns,traced_p50_ns,traced_p99_ns,traced_max_ns,max_lag_ns,differences,"
+                                "stalled\n");
+        fprintf(options.output, "replay,%g,%zu,%d,%zu,%lu,%.0f,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%d\n",
+                options.speed, processes.size(), thread_count, files.size(), (unsigned long) replayed, ops_per_sec,
+                (unsigned long) percentile(histogram, 0.5), (unsigned long) percentile(histogram, 0.9),
+                (unsigned long) percentile(histogram, 0.99), (unsigned long) percentile(histogram, 0.999),
+                (unsigned long) histogram_max(histogram), (unsigned long) percentile(traced_histogram, 0.5),
+                (unsigned long) percentile(traced_histogram, 0.99), (unsigned long) histogram_max(traced_histogram),
+                (unsigned long) shared->max_lag_ns.load(), (unsigned long) shared->differences.load(), stalled);
+    } else {
+        fprintf(options.output, "{\"benchmark\": \"replay\", \"speed\": %g, \"processes\": %zu, \"threads\": %d, "
+                "\"files\": %zu, \"ops\": %lu, \"ops_per_sec\": %.0f, \"p50_ns\": %lu, \"p90_ns\": %lu, "
+                "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu, \"traced_p50_ns\": %lu, \"traced_p99_ns\": %lu, "
+                "\"traced_max_ns\": %lu, \"max_lag_ns\": %lu, \"differences\": %lu, \"stalled\": %s}\n",
+                options.speed, processes.size(), thread_count, files.size(), (unsigned long) replayed, ops_per_sec,
+                (unsigned long) percentile(histogram, 0.5), (unsigned long) percentile(histogram, 0.9),
+                (unsigned long) percentile(histogram, 0.99), (unsigned long) percentile(histogram, 0.999),
+                (unsigned long) histogram_max(histogram), (unsigned long) percentile(traced_histogram, 0.5),
+                (unsigned long) percentile(traced_histogram, 0.99), (unsigned long) histogram_max(traced_histogram),
+                (unsigned long) shared->max_lag_ns.load(), (unsigned long) shared->differences.load(),
+                stalled ? "true" : "false");
+    }
+    if (options.output != stdout) fclose(options.output);
+    return stalled ? 1 : 0;
+}
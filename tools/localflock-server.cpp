@@ -0,0 +1,370 @@
+/*
+ * Lock server for processes on many hosts sharing a filesystem without working locks. Programs using the library
+ * with LOCALFLOCK_SERVER set to one of the addresses of the server send their lock requests here instead of using
+ * the lock directory of their host.
+ *
+ * Usage: localflock-server [-v] [-L lease seconds] -l address [-l address ...]
+ *
+ * Addresses are Unix sockets (unix:/run/localflock.sock) or TCP ports (host:port, *:port for all interfaces, port 0
+ * for any free port). The bound addresses are printed on stdout.
+ *
+ * The server is a single thread. All requests that arrived are handled before the replies are sent, each client
+ * gets all its replies with one write. Requests that have to wait are queued per file and answered in their order
+ * when the conflicting locks are released. Each client process has a session, which keeps its locks for the lease
+ * time after its connection was lost. A client connecting again within that time resumes its session, otherwise
+ * the locks are released. TCP keepalive notices hosts that disappeared without closing their connections.
+ */
+
+#include "../src/support.h"
+#include "../src/lock_client.h"
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <random>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// a blocking request waiting for its lock
+struct waiter_t {
+    uint32_t session;
+    server_message_t request;
+};
+
+// all locks on one file
+struct record_t {
+    uint32_t holder_count = 0;
+    lock_holder_t holders[LOCK_HOLDERS_MAX];
+    deque<waiter_t> waiters;
+};
+
+// a client process
+struct session_t {
+    uint64_t token;
+    // the connection, -1 while the client is not connected
+    int fd;
+    // end of the lease while the client is not connected
+    time_t expires;
+};
+
+// a connection of a client
+struct connection_t {
+    // 0 until the client sent REQUEST_HELLO
+    uint32_t session = 0;
+    string input;
+    string output;
+};
+
+typedef pair<uint64_t, uint64_t> record_key_t;
+
+static map<record_key_t, record_t> records;
+static map<uint32_t, session_t> sessions;
+static map<int, connection_t> connections;
+static uint32_t last_session = 0;
+static time_t lease = SERVER_DEFAULT_LEASE;
+static volatile sig_atomic_t stopping = 0;
+
+static void send_reply(uint32_t session, const server_message_t& reply) {
+    auto found = sessions.find(session);
+    if (found == sessions.end()) return;
+    auto connection = connections.find(found->second.fd);
+    if (connection != connections.end()) connection->second.output.append((const char*) &reply, sizeof(reply));
+}
+
+/*
+ * try to set a lock. Returns 0 if it was set or removed, an errno value otherwise.
+ */
+static int try_set(record_t& record, const server_message_t& request, uint32_t session, bool& changed) {
+    lock_owner_t owner = {request.pid, request.id, request.kind, session};
+    bool unlock = request.lock_type == F_UNLCK;
+    if (!unlock && holders_conflict(record.holders, record.holder_count, owner, request.lock_type == F_WRLCK,
+                                    request.start, request.end) >= 0) {
+        return EAGAIN;
+    }
+    if (record.holder_count + holders_needed(record.holders, record.holder_count, owner, request.lock_type,
+                                             request.start, request.end) > LOCK_HOLDERS_MAX) {
+        return ENOLCK;
+    }
+    changed = holders_set(record.holders, record.holder_count, owner, request.lock_type, request.start, request.end);
+    return 0;
+}
+
+/*
+ * answer the waiting requests that can be granted now, in the order they arrived.
+ */
+static void grant_waiters(record_t& record) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto waiter = record.waiters.begin(); waiter != record.waiters.end();) {
+            bool set_changed = false;
+            int result = try_set(record, waiter->request, waiter->session, set_changed);
+            if (result == EAGAIN) {
+                ++waiter;
+                continue;
+            }
+            server_message_t reply = waiter->request;
+            reply.result = result;
+            send_reply(waiter->session, reply);
+            waiter = record.waiters.erase(waiter);
+            // an upgrade of a lock can release parts of it
+            changed = changed || set_changed;
+        }
+    }
+}
+
+static void forget_record_if_unused(map<record_key_t, record_t>::iterator record) {
+    if (record->second.holder_count == 0 && record->second.waiters.empty()) records.erase(record);
+}
+
+/*
+ * remove the waiting requests of a session, and its locks if the lease ended.
+ */
+static void drop_session(uint32_t session, bool locks) {
+    for (auto record = records.begin(); record != records.end();) {
+        auto& waiters = record->second.waiters;
+        for (auto waiter = waiters.begin(); waiter != waiters.end();) {
+            if (waiter->session == session) waiter = waiters.erase(waiter);
+            else ++waiter;
+        }
+        bool changed = false;
+        for (uint32_t i = 0; locks && i < record->second.holder_count;) {
+            if (record->second.holders[i].session == session) {
+                holders_remove(record->second.holders, record->second.holder_count, i);
+                changed = true;
+            } else {
+                i++;
+            }
+        }
+        if (changed) grant_waiters(record->second);
+        auto next = std::next(record);
+        forget_record_if_unused(record);
+        record = next;
+    }
+}
+
+/*
+ * handle one request of a connection. Replies are collected in the output of the connections.
+ */
+static void handle(int fd, connection_t& connection, server_message_t& request) {
+    server_message_t reply = request;
+    reply.result = 0;
+    if (request.type == REQUEST_HELLO) {
+        if (request.version != SERVER_PROTOCOL_VERSION) {
+            reply.result = EPROTO;
+        } else {
+            // resume the session if it still exists
+            uint32_t number = (uint32_t) request.id;
+            auto found = sessions.find(number);
+            if (request.id != 0 && found != sessions.end() && found->second.token == request.id) {
+                // the old connection may not be closed yet
+                auto old = connections.find(found->second.fd);
+                if (old != connections.end() && old->first != fd) old->second.session = 0;
+                found->second.fd = fd;
+                // the client sends its unanswered requests again
+                drop_session(number, false);
+                LOG_DEBUG("session {} resumed by pid {}", number, request.pid);
+            } else {
+                if (request.id != 0) reply.result = ESTALE;
+                number = ++last_session;
+                if (number == 0) number = ++last_session;
+                static mt19937_64 random(random_device{}());
+                uint64_t token = (random() << 32) | number;
+                sessions[number] = {token, fd, 0};
+                reply.id = token;
+                LOG_DEBUG("session {} started by pid {}", number, request.pid);
+            }
+            connection.session = number;
+        }
+        connection.output.append((const char*) &reply, sizeof(reply));
+        return;
+    }
+    if (connection.session == 0 || (request.type != REQUEST_SET && request.type != REQUEST_TEST)) {
+        reply.result = EPROTO;
+        connection.output.append((const char*) &reply, sizeof(reply));
+        return;
+    }
+
+    record_key_t key(request.key[0], request.key[1]);
+    auto record = records.find(key);
+    if (request.type == REQUEST_TEST) {
+        lock_owner_t owner = {request.pid, request.id, request.kind, connection.session};
+        int conflict = record == records.end() ? -1
+                       : holders_conflict(record->second.holders, record->second.holder_count, owner,
+                                          request.lock_type == F_WRLCK, request.start, request.end);
+        if (conflict < 0) {
+            reply.lock_type = F_UNLCK;
+        } else {
+            lock_holder_t& holder = record->second.holders[conflict];
+            reply.lock_type = holder.write ? F_WRLCK : F_RDLCK;
+            reply.kind = holder.kind;
+            reply.pid = holder.pid;
+            reply.start = holder.start;
+            reply.end = holder.end;
+        }
+        connection.output.append((const char*) &reply, sizeof(reply));
+        return;
+    }
+
+    if (record == records.end()) {
+        if (request.lock_type == F_UNLCK) {
+            connection.output.append((const char*) &reply, sizeof(reply));
+            return;
+        }
+        record = records.emplace(key, record_t()).first;
+    }
+    bool changed = false;
+    reply.result = try_set(record->second, request, connection.session, changed);
+    if (reply.result == EAGAIN && request.wait) {
+        record->second.waiters.push_back({connection.session, request});
+        return;
+    }
+    connection.output.append((const char*) &reply, sizeof(reply));
+    if (changed) grant_waiters(record->second);
+    forget_record_if_unused(record);
+}
+
+static void close_connection(int fd) {
+    uint32_t session = connections[fd].session;
+    connections.erase(fd);
+    close(fd);
+    auto found = sessions.find(session);
+    if (found == sessions.end() || found->second.fd != fd) return;
+    // the locks stay until the end of the lease, blocking requests are sent again after a reconnect
+    LOG_DEBUG("session {} lost its connection, locks kept for {} seconds", session, lease);
+    found->second.fd = -1;
+    found->second.expires = time(nullptr) + lease;
+    drop_session(session, false);
+}
+
+static void expire_sessions() {
+    time_t now = time(nullptr);
+    for (auto session = sessions.begin(); session != sessions.end();) {
+        if (session->second.fd >= 0 || session->second.expires > now) {
+            ++session;
+            continue;
+        }
+        LOG_DEBUG("lease of session {} ended, releasing its locks", session->first);
+        uint32_t number = session->first;
+        session = sessions.erase(session);
+        drop_session(number, true);
+    }
+}
+
+static void stop(int) {
+    stopping = 1;
+}
+
+int main(int argc, char** argv) {
+    bool verbose = false;
+    vector<string> addresses;
+    int option;
+    while ((option = getopt(argc, argv, "vL:l:h")) != -1) {
+        switch (option) {
+            case 'v':
+                verbose = true;
+                break;
+            case 'L':
+                lease = atol(optarg);
+                break;
+            case 'l':
+                addresses.emplace_back(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-v] [-L lease seconds] -l address [-l address ...]\n", argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+    if (addresses.empty()) {
+        fprintf(stderr, "%s: at least one address is required\n", argv[0]);
+        return 1;
+    }
+
+    init_original_functions();
+    create_logger("localflock-server");
+    if (verbose) {
+        logger->set_level(spdlog::level::debug);
+        debug_enabled = true;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, stop);
+    signal(SIGINT, stop);
+
+    vector<int> listeners;
+    for (auto& address: addresses) {
+        string bound;
+        int fd = server_listen(address, bound);
+        if (fd < 0) {
+            logger->error("unable to listen on {}: {}", address, strerror(errno));
+            return 1;
+        }
+        listeners.push_back(fd);
+        printf("listening on %s\n", bound.c_str());
+    }
+    fflush(stdout);
+
+    vector<struct pollfd> fds;
+    while (!stopping) {
+        fds.clear();
+        for (int fd: listeners) fds.push_back({fd, POLLIN, 0});
+        for (auto& connection: connections) {
+            fds.push_back({connection.first, (short) (POLLIN | (connection.second.output.empty() ? 0 : POLLOUT)), 0});
+        }
+        if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) break;
+
+        for (auto& entry: fds) {
+            if (entry.revents == 0) continue;
+            if (find(listeners.begin(), listeners.end(), entry.fd) != listeners.end()) {
+                int fd = accept4(entry.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) continue;
+                int enabled = 1;
+                setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof(enabled));
+                connections[fd];
+                continue;
+            }
+            auto connection = connections.find(entry.fd);
+            if (connection == connections.end()) continue;
+            if (entry.revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buffer[sizeof(server_message_t) * 256];
+                ssize_t length = read(entry.fd, buffer, sizeof(buffer));
+                if (length <= 0 && !(length < 0 && (errno == EAGAIN || errno == EINTR))) {
+                    close_connection(entry.fd);
+                    continue;
+                }
+                if (length > 0) connection->second.input.append(buffer, length);
+                size_t offset = 0;
+                for (; offset + sizeof(server_message_t) <= connection->second.input.size();
+                       offset += sizeof(server_message_t)) {
+                    server_message_t request;
+                    memcpy(&request, connection->second.input.data() + offset, sizeof(request));
+                    handle(entry.fd, connection->second, request);
+                }
+                connection->second.input.erase(0, offset);
+            }
+        }
+
+        // all replies collected in this round are written at once
+        for (auto connection = connections.begin(); connection != connections.end();) {
+            string& output = connection->second.output;
+            int fd = connection->first;
+            ++connection;
+            if (output.empty()) continue;
+            ssize_t length = write(fd, output.data(), output.size());
+            if (length < 0 && errno != EAGAIN && errno != EINTR) {
+                close_connection(fd);
+                continue;
+            }
+            if (length > 0) output.erase(0, length);
+        }
+        expire_sessions();
+    }
+
+    for (auto& address: addresses) {
+        if (address.compare(0, 5, "unix:") == 0) unlink(address.substr(5).c_str());
+        else if (address.compare(0, 1, "/") == 0) unlink(address.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Show the lock statistics of all processes using the library, similar to vmstat.
+ *
+ * Usage: localflock-stat [-l] [-p pid] [interval [count]]
+ *
+ * Without interval, all counters are shown once, for the running processes and in total including all exited
+ * processes. With -l, one line per running process is shown instead. With an interval, one line with the rates of
+ * the most important counters is printed every interval seconds. The lock directory is taken from
+ * LOCALFLOCK_LOCKDIR as for the library.
+ */
+
+#include "../src/support.h"
+#include "../src/stats.h"
+#include <unistd.h>
+#include <memory>
+
+// sum of the counters of the selected processes
+struct stats_sum_t {
+    unique_ptr<stats_page_t> running = make_unique<stats_page_t>();
+    unique_ptr<stats_page_t> total = make_unique<stats_page_t>();
+    uint32_t processes = 0;
+};
+
+/*
+ * collect the counters of all running processes, or of one process if pid is not zero.
+ */
+static stats_sum_t collect(pid_t pid) {
+    stats_sum_t sum;
+    // processes that were killed did not retire their counters themselves
+    stats_retire_dead();
+    stats_for_each([&](const stats_page_t* page) {
+        if (pid != 0 && page->pid != pid) return;
+        stats_add_page(sum.running.get(), page);
+        stats_add_page(sum.total.get(), page);
+        sum.processes++;
+    });
+    if (pid == 0) {
+        stats_page_t* retired = stats_map(STATS_RETIRED, false);
+        if (retired != nullptr) {
+            stats_add_page(sum.total.get(), retired);
+            stats_unmap(retired);
+        }
+    }
+    return sum;
+}
+
+static uint64_t get(const stats_page_t* page, stats_counter_t counter) {
+    return page->counters[counter].load(memory_order_relaxed);
+}
+
+static uint64_t flock_ops(const stats_page_t* page) {
+    return get(page, STAT_FLOCK_SH) + get(page, STAT_FLOCK_EX) + get(page, STAT_FLOCK_UN);
+}
+
+static uint64_t fcntl_ops(const stats_page_t* page) {
+    uint64_t result = 0;
+    for (int i = STAT_FCNTL_SETLK; i <= STAT_OFD_GETLK; i++) result += page->counters[i].load(memory_order_relaxed);
+    return result;
+}
+
+/*
+ * all counters and the histogram of wait times.
+ */
+static void show_summary(const stats_sum_t& sum) {
+    printf("%u running processes\n\n", sum.processes);
+    printf("%-20s %16s %16s\n", "counter", "running", "total");
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        printf("%-20s %16lu %16lu\n", stats_counter_name(i), sum.running->counters[i].load(),
+               sum.total->counters[i].load());
+    }
+    printf("\n%-20s %16s %16s\n", "wait time", "running", "total");
+    for (int i = 0; i < STATS_WAIT_BUCKETS; i++) {
+        uint64_t running = sum.running->wait_buckets[i].load();
+        uint64_t total = sum.total->wait_buckets[i].load();
+        if (total == 0) continue;
+        char label[32];
+        if (i == 0) snprintf(label, sizeof(label), "< 1 us");
+        else if (i == STATS_WAIT_BUCKETS - 1) snprintf(label, sizeof(label), ">= %lu us", 1UL << (i - 1));
+        else snprintf(label, sizeof(label), "< %lu us", 1UL << i);
+        printf("%-20s %16lu %16lu\n", label, running, total);
+    }
+}
+
+/*
+ * one line per running process.
+ */
+static void show_processes(pid_t pid) {
+    stats_retire_dead();
+    printf("%8s %12s %12s %10s %12s %10s %8s %8s\n", "pid", "flock", "fcntl", "waits", "avg_wait_us", "wouldblock",
+           "errors", "created");
+    stats_for_each([&](const stats_page_t* page) {
+        if (pid != 0 && page->pid != pid) return;
+        uint64_t waits = get(page, STAT_WAITS);
+        printf("%8d %12lu %12lu %10lu %12.1f %10lu %8lu %8lu\n", page->pid, flock_ops(page), fcntl_ops(page), waits,
+               waits > 0 ? get(page, STAT_WAIT_NS) / 1000.0 / waits : 0.0, get(page, STAT_WOULD_BLOCK),
+               get(page, STAT_ERRORS), get(page, STAT_LOCK_FILES_CREATED));
+    });
+}
+
+/*
+ * rates of the total counters, exited processes are included, so that the differences are never negative.
+ */
+static void show_rates(pid_t pid, double interval, long count) {
+    stats_sum_t last = collect(pid);
+    for (long line = 0; count == 0 || line < count; line++) {
+        if (line % 20 == 0) {
+            printf("%6s %10s %10s %10s %10s %12s %10s %8s %8s\n", "procs", "flock/s", "fcntl/s", "close/s", "waits/s",
+                   "avg_wait_us", "wblock/s", "err/s", "new/s");
+        }
+        usleep((useconds_t) (interval * 1e6));
+        stats_sum_t now = collect(pid);
+        const stats_page_t* a = pid != 0 ? last.running.get() : last.total.get();
+        const stats_page_t* b = pid != 0 ? now.running.get() : now.total.get();
+        auto rate = [&](uint64_t before, uint64_t after) { return after >= before ? (after - before) / interval : 0; };
+        uint64_t waits = get(b, STAT_WAITS) - get(a, STAT_WAITS);
+        uint64_t wait_ns = get(b, STAT_WAIT_NS) - get(a, STAT_WAIT_NS);
+        printf("%6u %10.0f %10.0f %10.0f %10.0f %12.1f %10.0f %8.0f %8.0f\n", now.processes,
+               rate(flock_ops(a), flock_ops(b)), rate(fcntl_ops(a), fcntl_ops(b)),
+               rate(get(a, STAT_CLOSE_TRACKED), get(b, STAT_CLOSE_TRACKED)), rate(get(a, STAT_WAITS), get(b, STAT_WAITS)),
+               waits > 0 ? wait_ns / 1000.0 / waits : 0.0, rate(get(a, STAT_WOULD_BLOCK), get(b, STAT_WOULD_BLOCK)),
+               rate(get(a, STAT_ERRORS), get(b, STAT_ERRORS)),
+               rate(get(a, STAT_LOCK_FILES_CREATED), get(b, STAT_LOCK_FILES_CREATED)));
+        fflush(stdout);
+        last = move(now);
+    }
+}
+
+int main(int argc, char** argv) {
+    bool list = false;
+    pid_t pid = 0;
+    int option;
+    while ((option = getopt(argc, argv, "lp:h")) != -1) {
+        switch (option) {
+            case 'l':
+                list = true;
+                break;
+            case 'p':
+                pid = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-l] [-p pid] [interval [count]]\n", argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+
+    init_original_functions();
+    create_logger("localflock-stat");
+    read_settings();
+
+    if (optind < argc) {
+        double interval = atof(argv[optind]);
+        long count = optind + 1 < argc ? atol(argv[optind + 1]) : 0;
+        if (interval <= 0) {
+            fprintf(stderr, "invalid interval %s\n", argv[optind]);
+            return 1;
+        }
+        show_rates(pid, interval, count);
+    } else if (list) {
+        show_processes(pid);
+    } else {
+        show_summary(collect(pid));
+    }
+    return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * Show the locks on local lock files with the processes holding and waiting for them, refreshed every second.
+ *
+ * Usage: localflock-top [-b] [-d delay] [-n iterations] [-r rows]
+ *
+ * The inodes of the locks in /proc/locks are joined with the files in LOCKDIR and with the protocol, which lists
+ * the processes using each lock file. Files with waiting processes are shown first. The kernel does not tell how
+ * long a process waits already, the times shown are measured from the first refresh that saw the lock or request.
+ * The original path is shown if the process that created the lock file used LOCALFLOCK_SHOW_NAMES, which records
+ * the path in the lock file. The lock directory is taken from LOCALFLOCK_LOCKDIR as for the library.
+ */
+
+#include "../src/support.h"
+#include "../src/protocol.h"
+#include "../src/proc_locks.h"
+#include "../src/lock_dir.h"
+#include <unistd.h>
+#include <ctime>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <tuple>
+#include <climits>
+#include <cstring>
+#include <sys/stat.h>
+
+// one process holding or waiting for a lock
+struct lock_user_t {
+    pid_t pid;
+    proc_lock_kind_t kind;
+    bool write;
+    // seconds since the first refresh that saw this lock or request
+    double seconds;
+};
+
+// all locks on one lock file
+struct lock_row_t {
+    ino_t ino;
+    string name;
+    vector<lock_user_t> holders;
+    vector<lock_user_t> waiters;
+    // number of processes with an entry for the file in the protocol
+    int registered = 0;
+};
+
+// identity of a lock or request across refreshes
+struct seen_key_t {
+    ino_t ino;
+    pid_t pid;
+    int kind;
+    bool write;
+    bool waiting;
+    bool operator<(const seen_key_t& other) const {
+        return tie(ino, pid, kind, write, waiting) < tie(other.ino, other.pid, other.kind, other.write, other.waiting);
+    }
+};
+
+// names of the files in LOCKDIR by inode, read again if the directory changed or if an unknown lock was seen, which
+// may be a new file in a subdirectory.
+static unordered_map<ino_t, string> names;
+static struct timespec names_mtime = {0, 0};
+static double names_time = 0;
+// minimal time between two reads of the names caused by unknown locks
+#define NAMES_RESCAN_SECONDS 10
+// time at which each lock or request was seen first
+static map<seen_key_t, double> first_seen;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * read the names of all lock files. The inode is part of the directory entry, no file has to be opened.
+ */
+static void update_names(const struct stat& lockdir_stat, bool unknown_seen) {
+    bool changed = lockdir_stat.st_mtim.tv_sec != names_mtime.tv_sec ||
+                   lockdir_stat.st_mtim.tv_nsec != names_mtime.tv_nsec;
+    if (!changed && !(unknown_seen && now_seconds() - names_time >= NAMES_RESCAN_SECONDS)) return;
+    names_mtime = lockdir_stat.st_mtim;
+    names_time = now_seconds();
+    names.clear();
+    lockdir_for_each_file([](const string& name, ino_t ino) { names[ino] = name; });
+}
+
+/*
+ * the original path recorded in a lock file, empty if it was not recorded.
+ */
+static string recorded_path(const string& name) {
+    int fd = openat(settings->LOCKDIR_FD, name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return "";
+    char buffer[PATH_MAX];
+    ssize_t length = pread(fd, buffer, sizeof(buffer), 0);
+    originalClose(fd);
+    return length > 0 ? string(buffer, length) : "";
+}
+
+/*
+ * name of the command of a process
+ */
+static string command_name(pid_t pid) {
+    char path[32];
+    char buffer[64];
+    snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return "?";
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    originalClose(fd);
+    if (length <= 0) return "?";
+    if (buffer[length - 1] == '\n') length--;
+    return string(buffer, length);
+}
+
+/*
+ * format the processes of one column, e.g., "1234/make W 3.0s".
+ */
+static string format_users(const vector<lock_user_t>& users, unordered_map<pid_t, string>& commands) {
+    string result;
+    for (auto& user: users) {
+        if (!result.empty()) result += ", ";
+        if (user.pid > 0) {
+            auto command = commands.find(user.pid);
+            if (command == commands.end()) command = commands.emplace(user.pid, command_name(user.pid)).first;
+            result += fmt::format("{}/{}", user.pid, command->second);
+        } else {
+            result += "ofd";
+        }
+        result += fmt::format(" {}{} {:.0f}s", user.kind == PROC_LOCK_POSIX ? "P" : user.kind == PROC_LOCK_OFD ? "O" : "",
+                              user.write ? "W" : "R", user.seconds);
+    }
+    return result.empty() ? "-" : result;
+}
+
+/*
+ * collect the current locks and print one line for each lock file.
+ */
+static void refresh(bool batch, int rows) {
+    struct stat lockdir_stat;
+    if (fstat(settings->LOCKDIR_FD, &lockdir_stat) != 0) return;
+    vector<proc_lock_t> locks;
+    if (!read_proc_locks(locks, lockdir_stat.st_dev, true)) {
+        logger->error("unable to read /proc/locks");
+        return;
+    }
+    bool unknown_seen = false;
+    for (auto& lock: locks) unknown_seen = unknown_seen || names.find(lock.ino) == names.end();
+    update_names(lockdir_stat, unknown_seen);
+
+    // group by lock file and remember when each lock was seen first
+    double now = now_seconds();
+    unordered_map<ino_t, lock_row_t> by_inode;
+    map<seen_key_t, double> seen;
+    for (auto& lock: locks) {
+        auto name = names.find(lock.ino);
+        if (name == names.end()) continue;
+        seen_key_t key = {lock.ino, lock.pid, lock.kind, lock.write, lock.waiting};
+        auto first = first_seen.find(key);
+        double since = first != first_seen.end() ? first->second : now;
+        seen[key] = since;
+        lock_row_t& row = by_inode[lock.ino];
+        row.ino = lock.ino;
+        row.name = name->second;
+        (lock.waiting ? row.waiters : row.holders).push_back({lock.pid, lock.kind, lock.write, now - since});
+    }
+    first_seen = move(seen);
+
+    // processes with entries in the protocol
+    unordered_map<string, lock_row_t*> by_name;
+    for (auto& entry: by_inode) by_name[entry.second.name] = &entry.second;
+    if (!by_name.empty()) {
+        Protocol::get()->for_each_used([&](pid_t pid, const char* name) {
+            auto row = by_name.find(name);
+            if (row != by_name.end()) row->second->registered++;
+        });
+    }
+
+    // files with waiting processes first, then the longest waits
+    vector<lock_row_t*> sorted;
+    size_t holders = 0, waiters = 0;
+    for (auto& entry: by_inode) {
+        sorted.push_back(&entry.second);
+        holders += entry.second.holders.size();
+        waiters += entry.second.waiters.size();
+    }
+    auto longest_wait = [](const lock_row_t* row) {
+        double result = 0;
+        for (auto& waiter: row->waiters) result = max(result, waiter.seconds);
+        return result;
+    };
+    sort(sorted.begin(), sorted.end(), [&](const lock_row_t* a, const lock_row_t* b) {
+        if (a->waiters.size() != b->waiters.size()) return a->waiters.size() > b->waiters.size();
+        return longest_wait(a) > longest_wait(b);
+    });
+
+    if (!batch) printf("\033[H\033[2J");
+    time_t wall = time(nullptr);
+    char time_text[32];
+    strftime(time_text, sizeof(time_text), "%H:%M:%S", localtime(&wall));
+    printf("localflock-top %s  %s  %zu lock files, %zu locks, %zu waiting\n\n", time_text, settings->LOCKDIR.c_str(),
+           names.size(), holders, waiters);
+    printf("%-34s %5s %-36s %-36s %s\n", "FILE", "USERS", "HOLDERS", "WAITERS", "PATH");
+    unordered_map<pid_t, string> commands;
+    int shown = 0;
+    for (lock_row_t* row: sorted) {
+        if (rows > 0 && shown++ >= rows) break;
+        string path = recorded_path(row->name);
+        printf("%-34.34s %5d %-36s %-36s %s\n", lockdir_flat_name(row->name).c_str(), row->registered,
+               format_users(row->holders, commands).c_str(), format_users(row->waiters, commands).c_str(),
+               path.c_str());
+    }
+    if (batch) printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    bool batch = false;
+    double delay = 1;
+    long iterations = 0;
+    int rows = 40;
+    int option;
+    while ((option = getopt(argc, argv, "bd:n:r:h")) != -1) {
+        switch (option) {
+            case 'b':
+                batch = true;
+                break;
+            case 'd':
+                delay = atof(optarg);
+                break;
+            case 'n':
+                iterations = atol(optarg);
+                break;
+            case 'r':
+                rows = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b] [-d delay] [-n iterations] [-r rows]\n", argv[0]);
+                return option == 'h' ? 0 : 1;
+        }
+    }
+    if (delay <= 0) delay = 1;
+
+    init_original_functions();
+    create_logger("localflock-top");
+    read_settings();
+
+    for (long i = 0; iterations == 0 || i < iterations; i++) {
+        if (i > 0) usleep((useconds_t) (delay * 1e6));
+        refresh(batch, rows);
+    }
+    return 0;
+}